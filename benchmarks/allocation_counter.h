@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+// Heap allocations made by this process so far. Linking allocation_counter.cpp
+// replaces the global operator new and delete so that every allocation is
+// counted, which lets the benchmarks report allocations per operation
+size_t allocation_count();
@@ -0,0 +1,251 @@
+//
+// Compares the two ways of serving a connection from start to end: a thread
+// blocked in handle_client() per connection, as in --mode=threadpool, and a
+// coroutine running serve_connection() per connection on one Scheduler, as in
+// --mode=coroutine. Each session opens a number of keep-alive connections
+// over socketpairs and reports
+//  - bytes_per_idle_connection: growth of the resident set once every
+//    connection answered a request and waits for the next one. The kernel
+//    stack of each thread (16 KiB on x86-64) isn't part of it
+//  - ctx_switches_per_request: voluntary and involuntary context switches of
+//    the process while the client writes a request on every connection and
+//    reads the responses back
+//
+
+#include <benchmark/benchmark.h>
+#include <async_task.h>
+#include <config.h>
+#include <coroutine_server.h>
+#include <scheduler.h>
+#include <server.h>
+#include <logging/Logging.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+int PORT = 8080;
+const char* SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 20;
+
+static const std::string GET_SMALL =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "User-Agent: benchmark\r\n\r\n";
+
+static sockaddr_in loopback_address() {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(40000);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+static size_t resident_bytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr) {
+        return 0;
+    }
+    size_t size = 0;
+    size_t resident = 0;
+    if (fscanf(statm, "%zu %zu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static long context_switches() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static bool write_all(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = write(fd, data.data() + offset, data.size() - offset);
+        if (sent <= 0) {
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+// Reads one response of a known size, false if the connection ended first
+static bool read_response(int fd, char* buffer, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t got = read(fd, buffer + received, size - received);
+        if (got <= 0) {
+            return false;
+        }
+        received += got;
+    }
+    return true;
+}
+
+// The size of the response to GET_SMALL, read up to the end of its body
+static size_t response_size(int fd) {
+    std::string response;
+    char chunk[4096];
+    size_t head_end = std::string::npos;
+    size_t content_length = 0;
+    while (head_end == std::string::npos ||
+           response.size() < head_end + content_length) {
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return 0;
+        }
+        response.append(chunk, got);
+        if (head_end == std::string::npos) {
+            head_end = response.find("\r\n\r\n");
+            if (head_end != std::string::npos) {
+                head_end += 4;
+                const char* header = "\r\nContent-Length: ";
+                size_t at = response.find(header);
+                if (at != std::string::npos && at < head_end) {
+                    content_length = std::strtoul(
+                        response.c_str() + at + std::strlen(header), nullptr, 10);
+                }
+            }
+        }
+    }
+    return response.size();
+}
+
+// Connections served by a thread each, in handle_client()
+class ThreadModel {
+public:
+    void serve(int fd) {
+        threads.emplace_back([fd] {
+            handle_client(loopback_address(), fd, std::chrono::steady_clock::now());
+        });
+    }
+
+    // Called once the client ends every connection
+    void wait() {
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    std::vector<std::thread> threads;
+};
+
+// Connections served by a coroutine each, in serve_connection(), all on the
+// thread running the scheduler
+class CoroutineModel {
+public:
+    CoroutineModel() : runner([this] { scheduler.run(); }) {}
+
+    void serve(int fd) {
+        open.fetch_add(1);
+        scheduler.spawn(serve_and_count(fd));
+    }
+
+    void wait() {
+        while (open.load() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        scheduler.stop();
+        runner.join();
+    }
+
+private:
+    Scheduler scheduler;
+    std::atomic<int> open{0};
+    std::thread runner;
+
+    AsyncTask<void> serve_and_count(int fd) {
+        co_await serve_connection(loopback_address(), fd,
+                                  std::chrono::steady_clock::now());
+        open.fetch_sub(1);
+    }
+};
+
+template <typename Model>
+static void BM_IdleConnections(benchmark::State& state) {
+    Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+    MAX_REQUESTS_PER_CONNECTION = 0;
+    signal(SIGPIPE, SIG_IGN);
+    size_t connections = state.range(0);
+
+    // Memory freed by earlier sessions is given back first, or the
+    // connections would reuse it without growing the resident set
+    malloc_trim(0);
+    size_t resident_before = resident_bytes();
+    std::vector<int> client_fds;
+    Model model;
+    for (size_t i = 0; i < connections; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            state.SkipWithError("socketpair failed");
+            break;
+        }
+        client_fds.push_back(sv[0]);
+        model.serve(sv[1]);
+    }
+
+    // One request per connection, so that each has its buffers and is idle
+    // waiting for the next request, the state the memory is measured in
+    size_t size = 0;
+    for (int fd : client_fds) {
+        if (!write_all(fd, GET_SMALL) || (size = response_size(fd)) == 0) {
+            state.SkipWithError("unexpected response");
+            break;
+        }
+    }
+    size_t resident_idle = resident_bytes();
+
+    std::vector<char> buffer(size);
+    long switches_before = context_switches();
+    for (auto _ : state) {
+        for (int fd : client_fds) {
+            write_all(fd, GET_SMALL);
+        }
+        for (int fd : client_fds) {
+            if (!read_response(fd, buffer.data(), size)) {
+                state.SkipWithError("connection ended");
+                break;
+            }
+        }
+    }
+    long switches = context_switches() - switches_before;
+
+    // The servers return, and close their end, once they read EOF
+    for (int fd : client_fds) {
+        shutdown(fd, SHUT_WR);
+    }
+    model.wait();
+    for (int fd : client_fds) {
+        close(fd);
+    }
+
+    state.SetItemsProcessed(state.iterations() * connections);
+    state.counters["bytes_per_idle_connection"] = benchmark::Counter(
+        static_cast<double>(resident_idle > resident_before
+                                ? resident_idle - resident_before
+                                : 0) /
+        connections);
+    state.counters["ctx_switches_per_request"] = benchmark::Counter(
+        static_cast<double>(switches) / (state.iterations() * connections));
+    Logging::setMinimumLevel(LoggingLevel::LogLevelInfo);
+}
+BENCHMARK_TEMPLATE(BM_IdleConnections, ThreadModel)
+    ->Arg(100)->Arg(1000)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_IdleConnections, CoroutineModel)
+    ->Arg(100)->Arg(1000)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,69 @@
+//
+// Benchmarks recording into the metrics, which stays on under full load, and
+// rendering them for a scrape
+//
+
+#include <benchmark/benchmark.h>
+#include <latency_histogram.h>
+#include <logging/Logging.h>
+#include <metrics.h>
+#include <chrono>
+#include <cstdint>
+
+int PORT = 8080;
+const char* SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 20;
+
+// One counter increment, as done for every request and connection
+static void BM_CountRequest(benchmark::State& state) {
+    for (auto _ : state) {
+        Metrics::count(MetricCounter::REQUESTS_GET);
+    }
+}
+BENCHMARK(BM_CountRequest)->Threads(1)->Threads(4);
+
+// One latency recorded into the histogram of a stage
+static void BM_RecordStage(benchmark::State& state) {
+    auto duration = std::chrono::nanoseconds(1);
+    for (auto _ : state) {
+        Metrics::record(MetricStage::PARSE, duration);
+        duration += std::chrono::nanoseconds(37);
+        benchmark::DoNotOptimize(duration);
+    }
+}
+BENCHMARK(BM_RecordStage)->Threads(1)->Threads(4);
+
+// What a request pays in total: reading the clock for a stage boundary and
+// recording it
+static void BM_TimeAndRecordStage(benchmark::State& state) {
+    auto started = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        auto now = std::chrono::steady_clock::now();
+        Metrics::record(MetricStage::BUILD, started, now);
+        started = now;
+    }
+}
+BENCHMARK(BM_TimeAndRecordStage);
+
+// Percentile of a histogram holding a million values
+static void BM_Percentile(benchmark::State& state) {
+    LatencySnapshot snapshot;
+    for (uint64_t value = 1; value <= 1000000; value++) {
+        snapshot.record(value * 97 % 100000000);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(snapshot.percentile(0.999));
+    }
+}
+BENCHMARK(BM_Percentile);
+
+// Merging every shard and rendering the exposition, once per scrape
+static void BM_RenderPrometheus(benchmark::State& state) {
+    Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Metrics::render_prometheus());
+    }
+}
+BENCHMARK(BM_RenderPrometheus);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,176 @@
+//
+// Benchmarks the incremental request parser against the split() based
+// parsing it replaced, and counts heap allocations per parsed request and
+// per sanitized path
+//
+
+#include <benchmark/benchmark.h>
+#include <allocation_counter.h>
+#include <http_request_parser.h>
+#include <http_scanner.h>
+#include <util.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+int PORT = 8080;
+const char* SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 20;
+
+static const std::string GET_REQUEST =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// A browser-like request with 32 headers and a 4 KB cookie
+static std::string header_heavy_request() {
+    std::string request = GET_REQUEST.substr(0, GET_REQUEST.size() - 2);
+    for (int i = 0; i < 25; i++) {
+        request += "X-Custom-Header-" + std::to_string(i) +
+                   ": some-moderately-long-header-value-" + std::to_string(i) + "\r\n";
+    }
+    request += "Cookie: ";
+    for (int i = 0; i < 64; i++) {
+        request += "session_token_" + std::to_string(i) + "=0123456789abcdef0123456789abcdef; ";
+    }
+    request += "last=1\r\n\r\n";
+    return request;
+}
+static const std::string HEADER_HEAVY_REQUEST = header_heavy_request();
+
+// The parsing done by HTTPParser::parse() before the incremental parser
+static bool split_parse(const std::string& request,
+                        std::unordered_map<std::string, std::string>& headers) {
+    auto parts = split(request, "\r\n\r\n");
+    if (parts.size() != 2) {
+        return false;
+    }
+    auto lines = split(parts[0], "\r\n");
+    auto request_line = split(lines[0], " ");
+    if (request_line.size() != 3) {
+        return false;
+    }
+    for (size_t i = 1; i < lines.size(); i++) {
+        auto data = split(lines[i], ": ");
+        if (data.size() != 2) {
+            return false;
+        }
+        headers[data[0]] = data[1];
+    }
+    return true;
+}
+
+static void BM_SplitParser_GET(benchmark::State& state) {
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        std::unordered_map<std::string, std::string> headers;
+        benchmark::DoNotOptimize(split_parse(GET_REQUEST, headers));
+    }
+    state.counters["allocs_per_request"] = benchmark::Counter(
+        allocation_count() - allocations_before,
+        benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_SplitParser_GET);
+
+static void BM_IncrementalParser_GET(benchmark::State& state) {
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        HTTPRequestParser parser;
+        HTTPRequest request;
+        benchmark::DoNotOptimize(parser.parse(GET_REQUEST, request));
+        benchmark::DoNotOptimize(request.header("Host"));
+    }
+    state.counters["allocs_per_request"] = benchmark::Counter(
+        allocation_count() - allocations_before,
+        benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_IncrementalParser_GET);
+
+// The request arrives in pieces of state.range(0) bytes, as it would over a
+// slow connection, and the parser resumes after every piece
+static void BM_IncrementalParser_Chunked(benchmark::State& state) {
+    const size_t chunk_size = state.range(0);
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        HTTPRequestParser parser;
+        HTTPRequest request;
+        ParseResult result = ParseResult::NEED_MORE;
+        for (size_t received = chunk_size; result == ParseResult::NEED_MORE;
+             received += chunk_size) {
+            std::string_view buffer(GET_REQUEST.data(),
+                                    std::min(received, GET_REQUEST.size()));
+            result = parser.parse(buffer, request);
+        }
+        benchmark::DoNotOptimize(result);
+    }
+    state.counters["allocs_per_request"] = benchmark::Counter(
+        allocation_count() - allocations_before,
+        benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_IncrementalParser_Chunked)->Arg(1)->Arg(16)->Arg(128);
+
+static void BM_SplitParser_HeaderHeavy(benchmark::State& state) {
+    for (auto _ : state) {
+        std::unordered_map<std::string, std::string> headers;
+        benchmark::DoNotOptimize(split_parse(HEADER_HEAVY_REQUEST, headers));
+    }
+    state.SetBytesProcessed(state.iterations() * HEADER_HEAVY_REQUEST.size());
+}
+BENCHMARK(BM_SplitParser_HeaderHeavy);
+
+static void BM_IncrementalParser_HeaderHeavy(benchmark::State& state) {
+    for (auto _ : state) {
+        HTTPRequestParser parser;
+        HTTPRequest request;
+        benchmark::DoNotOptimize(parser.parse(HEADER_HEAVY_REQUEST, request));
+    }
+    state.SetBytesProcessed(state.iterations() * HEADER_HEAVY_REQUEST.size());
+    state.SetLabel(scanner_implementation());
+}
+BENCHMARK(BM_IncrementalParser_HeaderHeavy);
+
+// Scans every line of the header heavy request with one scan_line() kernel
+static void BM_ScanLines(benchmark::State& state,
+                         LineScan (*scan_line_impl)(const char*, size_t),
+                         bool supported) {
+    if (!supported) {
+        state.SkipWithError("instruction set not supported by this CPU");
+        return;
+    }
+    const char* data = HEADER_HEAVY_REQUEST.data();
+    const size_t length = HEADER_HEAVY_REQUEST.size();
+    for (auto _ : state) {
+        size_t position = 0;
+        while (position < length) {
+            LineScan scan = scan_line_impl(data + position, length - position);
+            benchmark::DoNotOptimize(scan);
+            position += scan.newline + 1;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK_CAPTURE(BM_ScanLines, scalar, scan_line_scalar, true);
+BENCHMARK_CAPTURE(BM_ScanLines, sse2, scan_line_sse2, cpu_supports_sse2());
+BENCHMARK_CAPTURE(BM_ScanLines, avx2, scan_line_avx2, cpu_supports_avx2());
+
+// sanitize_path() runs on the route of every GET. Normal routes take the fast
+// path, the others are normalized with std::filesystem
+static void BM_SanitizePath(benchmark::State& state, const std::string& path) {
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sanitize_path(path));
+    }
+    state.counters["allocs_per_path"] = benchmark::Counter(
+        allocation_count() - allocations_before,
+        benchmark::Counter::kAvgIterations);
+}
+BENCHMARK_CAPTURE(BM_SanitizePath, normal, std::string("/images/photos/2024/summer/beach.jpg"));
+BENCHMARK_CAPTURE(BM_SanitizePath, dot_segments, std::string("/images/./photos//2024/../2024/beach.jpg"));
+BENCHMARK_CAPTURE(BM_SanitizePath, traversal, std::string("/images/../../../etc/passwd"));
+
+BENCHMARK_MAIN();
@@ -0,0 +1,150 @@
+//
+// Benchmarks building responses with HTTPResponseBuilder and queueing them
+// on an OutputQueue, and counts the heap allocations each one makes
+//
+
+#include <benchmark/benchmark.h>
+#include <allocation_counter.h>
+#include <file_cache.h>
+#include <http_request_parser.h>
+#include <http_response.h>
+#include <http_response_builder.h>
+#include <logging/Logging.h>
+#include <cstring>
+#include <fcntl.h>
+#include <optional>
+#include <string>
+#include <unistd.h>
+
+int PORT = 8080;
+const char* SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 20;
+
+static const std::string REQUEST_TEXT =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "User-Agent: benchmark\r\nAccept: */*\r\n\r\n";
+
+struct Fixture {
+    HTTPRequest request;
+    std::shared_ptr<const CachedFile> file;
+    std::string body;
+    std::optional<std::string> filename;
+
+    // Skips the benchmark, leaving file null, when the sample resources
+    // weren't copied next to the binary
+    explicit Fixture(benchmark::State& state) {
+        Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+        HTTPRequestParser parser;
+        parser.parse(REQUEST_TEXT, request);
+        file = load_file("res/index.html", 1 << 20);
+        if (!file) {
+            state.SkipWithError("res/index.html not found");
+        }
+    }
+};
+
+static void report_allocations(benchmark::State& state, size_t before) {
+    state.counters["allocs_per_response"] = benchmark::Counter(
+        static_cast<double>(allocation_count() - before) /
+        state.iterations());
+}
+
+// A 200 for a cached file: the head plus one chunk borrowing the content
+static void BM_Build200(benchmark::State& state) {
+    Fixture fixture(state);
+    if (!fixture.file) {
+        return;
+    }
+    size_t before = allocation_count();
+    for (auto _ : state) {
+        HTTPResponseBuilder builder("HTTP/1.1", HTTPStatus::OK, fixture.body,
+                                    fixture.file->content_type,
+                                    fixture.request, fixture.filename,
+                                    fixture.file);
+        HTTPResponse response = builder.build_response();
+        benchmark::DoNotOptimize(response);
+    }
+    report_allocations(state, before);
+}
+BENCHMARK(BM_Build200);
+
+// A 304 has headers only, so this is the cost of the head alone
+static void BM_Build304(benchmark::State& state) {
+    Fixture fixture(state);
+    if (!fixture.file) {
+        return;
+    }
+    size_t before = allocation_count();
+    for (auto _ : state) {
+        HTTPResponseBuilder builder("HTTP/1.1", HTTPStatus::NOT_MODIFIED,
+                                    fixture.body, fixture.file->content_type,
+                                    fixture.request, fixture.filename,
+                                    fixture.file);
+        HTTPResponse response = builder.build_response();
+        benchmark::DoNotOptimize(response);
+    }
+    report_allocations(state, before);
+}
+BENCHMARK(BM_Build304);
+
+// Builds a 200 and writes it through the connection's OutputQueue, as the
+// event loop does, with /dev/null standing in for the socket
+static void BM_BuildAndWrite200(benchmark::State& state) {
+    Fixture fixture(state);
+    if (!fixture.file) {
+        return;
+    }
+    int fd = open("/dev/null", O_WRONLY);
+    OutputQueue output;
+    size_t before = allocation_count();
+    for (auto _ : state) {
+        HTTPResponseBuilder builder("HTTP/1.1", HTTPStatus::OK, fixture.body,
+                                    fixture.file->content_type,
+                                    fixture.request, fixture.filename,
+                                    fixture.file);
+        output.push(builder.build_response());
+        output.write_to(fd);
+    }
+    report_allocations(state, before);
+    close(fd);
+}
+BENCHMARK(BM_BuildAndWrite200);
+
+// A 404 comes from its prebuilt response with only the Date patched in
+static void BM_Build404(benchmark::State& state) {
+    Fixture fixture(state);
+    if (!fixture.file) {
+        return;
+    }
+    size_t before = allocation_count();
+    for (auto _ : state) {
+        HTTPResponseBuilder builder("HTTP/1.1", HTTPStatus::NOT_FOUND,
+                                    fixture.body, HTTPContentType::HTML,
+                                    fixture.request, fixture.filename);
+        HTTPResponse response = builder.build_response();
+        benchmark::DoNotOptimize(response);
+    }
+    report_allocations(state, before);
+}
+BENCHMARK(BM_Build404);
+
+// The floor for BM_Build404: copying the bytes of the same 404 into memory
+static void BM_Copy404Bytes(benchmark::State& state) {
+    Fixture fixture(state);
+    if (!fixture.file) {
+        return;
+    }
+    HTTPResponseBuilder builder("HTTP/1.1", HTTPStatus::NOT_FOUND,
+                                fixture.body, HTTPContentType::HTML,
+                                fixture.request, fixture.filename);
+    std::string bytes = builder.build();
+    char buffer[1024];
+    for (auto _ : state) {
+        std::memcpy(buffer, bytes.data(), bytes.size());
+        benchmark::DoNotOptimize(buffer);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_Copy404Bytes);
+
+BENCHMARK_MAIN();
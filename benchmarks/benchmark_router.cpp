@@ -0,0 +1,145 @@
+//
+// Benchmarks route lookups in a table of 1,000 routes against matching the
+// same patterns one after the other, and counts heap allocations per lookup
+//
+
+#include <benchmark/benchmark.h>
+#include <allocation_counter.h>
+#include <router.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+int PORT = 8080;
+const char* SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 20;
+
+static const size_t RESOURCES = 250;
+
+// Four routes per resource, 1,000 in all, and the static files behind them
+static std::vector<std::pair<HTTPMethod, std::string>> route_table() {
+    std::vector<std::pair<HTTPMethod, std::string>> routes;
+    for (size_t i = 0; i < RESOURCES; i++) {
+        std::string resource = "/api/v1/resource" + std::to_string(i);
+        routes.emplace_back(HTTPMethod::GET, resource);
+        routes.emplace_back(HTTPMethod::GET, resource + "/:id");
+        routes.emplace_back(HTTPMethod::POST, resource + "/:id/items");
+        routes.emplace_back(HTTPMethod::GET, resource + "/:id/items/:item");
+    }
+    routes.emplace_back(HTTPMethod::GET, "/*path");
+    return routes;
+}
+
+static bool ignore(HTTPParser&, const RouteMatch&) { return true; }
+
+static const Router& router() {
+    static Router router;
+    static bool built = [] {
+        for (const auto& [method, pattern] : route_table()) {
+            router.add(method, pattern, ignore);
+        }
+        return true;
+    }();
+    (void)built;
+    return router;
+}
+
+static void BM_RouterLookup(benchmark::State& state, HTTPMethod method,
+                            std::string path) {
+    const Router& routes = router();
+    RouteMatch match;
+    if (!routes.find(method, path, match)) {
+        state.SkipWithError("no route");
+        return;
+    }
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(routes.find(method, path, match));
+        benchmark::DoNotOptimize(match);
+    }
+    state.counters["allocs_per_lookup"] = benchmark::Counter(
+        allocation_count() - allocations_before,
+        benchmark::Counter::kAvgIterations);
+    state.counters["routes"] = routes.size();
+}
+BENCHMARK_CAPTURE(BM_RouterLookup, static, HTTPMethod::GET,
+                  std::string("/api/v1/resource200"));
+BENCHMARK_CAPTURE(BM_RouterLookup, one_param, HTTPMethod::GET,
+                  std::string("/api/v1/resource200/12345"));
+BENCHMARK_CAPTURE(BM_RouterLookup, two_params, HTTPMethod::GET,
+                  std::string("/api/v1/resource200/12345/items/67"));
+BENCHMARK_CAPTURE(BM_RouterLookup, post, HTTPMethod::POST,
+                  std::string("/api/v1/resource200/12345/items"));
+BENCHMARK_CAPTURE(BM_RouterLookup, static_file, HTTPMethod::GET,
+                  std::string("/assets/css/site.css"));
+// The API doesn't match below /api/v1/resource2, the static files do
+BENCHMARK_CAPTURE(BM_RouterLookup, api_fallback, HTTPMethod::GET,
+                  std::string("/api/v1/resource2/1/2/3"));
+
+// Whether path matches pattern segment by segment, ':' and '*' segments
+// matching like in the Router
+static bool matches(std::string_view pattern, std::string_view path) {
+    while (!pattern.empty()) {
+        if (path.empty() || path.front() != '/') {
+            return false;
+        }
+        pattern.remove_prefix(1);
+        path.remove_prefix(1);
+        size_t pattern_end = std::min(pattern.find('/'), pattern.size());
+        size_t path_end = std::min(path.find('/'), path.size());
+        std::string_view segment = pattern.substr(0, pattern_end);
+        if (!segment.empty() && segment.front() == '*') {
+            return true;
+        }
+        if (!segment.empty() && segment.front() == ':') {
+            if (path_end == 0) {
+                return false;
+            }
+        } else if (segment != path.substr(0, path_end)) {
+            return false;
+        }
+        pattern.remove_prefix(pattern_end);
+        path.remove_prefix(path_end);
+    }
+    return path.empty();
+}
+
+// The same table matched one pattern after the other, what a list of
+// routes checked in order costs
+static void BM_LinearScan(benchmark::State& state, HTTPMethod method,
+                          std::string path) {
+    auto routes = route_table();
+    for (auto _ : state) {
+        size_t found = routes.size();
+        for (size_t i = 0; i < routes.size(); i++) {
+            if (routes[i].first == method && matches(routes[i].second, path)) {
+                found = i;
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(found);
+    }
+}
+BENCHMARK_CAPTURE(BM_LinearScan, static, HTTPMethod::GET,
+                  std::string("/api/v1/resource200"));
+BENCHMARK_CAPTURE(BM_LinearScan, two_params, HTTPMethod::GET,
+                  std::string("/api/v1/resource200/12345/items/67"));
+BENCHMARK_CAPTURE(BM_LinearScan, static_file, HTTPMethod::GET,
+                  std::string("/assets/css/site.css"));
+
+// Adding all the routes, done once at startup
+static void BM_BuildRouter(benchmark::State& state) {
+    auto routes = route_table();
+    for (auto _ : state) {
+        Router router;
+        for (const auto& [method, pattern] : routes) {
+            router.add(method, pattern, ignore);
+        }
+        benchmark::DoNotOptimize(router.size());
+    }
+}
+BENCHMARK(BM_BuildRouter);
+
+BENCHMARK_MAIN();
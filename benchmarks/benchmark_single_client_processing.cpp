@@ -1,64 +1,291 @@
 //
 // Created by epicman on 31/10/25.
 //
+// Benchmarks a request from its bytes arriving on a socket to the whole
+// response being read back by the client, through handle_client(), and the
+// processing of one request on its own with the heap allocations it makes
+//
 
 #include <benchmark/benchmark.h>
+#include <allocation_counter.h>
 #include <server.h>
+#include <config.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <string>
 #include <logging/Logging.h>
-#include <iostream>
 #include <http_parser.h>
 #include <util.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <thread>
 
 int PORT = 8080;
 const char* SERVER_ADDRESS = "127.0.0.1";
 int THREAD_POOL_SIZE = 20;
 
-// Fake function to simulate read/write to sockets
-std::string fake_http_request() {
-    return "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n\r\n";
+// Served by the large file benchmarks, created in res the first time. Big
+// enough to be sent with sendfile() rather than from the file cache
+static const char* LARGE_FILE = "res/bench_large.bin";
+static const size_t LARGE_FILE_SIZE = 1024 * 1024;
+
+static const std::string GET_SMALL =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "User-Agent: benchmark\r\n\r\n";
+static const std::string GET_LARGE =
+    "GET /bench_large.bin HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "User-Agent: benchmark\r\n\r\n";
+static const std::string GET_MISSING =
+    "GET /missing/file.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "User-Agent: benchmark\r\n\r\n";
+static const std::string UPLOAD_BODY =
+    "{\"benchmark\": \"upload\", \"values\": [1, 2, 3]}";
+static const std::string POST_UPLOAD =
+    "POST /upload HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "Content-Type: application/json\r\nContent-Length: " +
+    std::to_string(UPLOAD_BODY.size()) + "\r\n\r\n" + UPLOAD_BODY;
+static const std::string GET_SMALL_CLOSE =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "Connection: close\r\n\r\n";
+static const std::string GET_MISSING_CLOSE =
+    "GET /missing/file.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+    "Connection: close\r\n\r\n";
+
+static sockaddr_in loopback_address() {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(40000);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+static void make_large_file() {
+    if (std::filesystem::exists(LARGE_FILE)) {
+        return;
+    }
+    std::ofstream file(LARGE_FILE, std::ios::binary);
+    std::string block(64 * 1024, 'x');
+    for (size_t written = 0; written < LARGE_FILE_SIZE; written += block.size()) {
+        file.write(block.data(), block.size());
+    }
+}
+
+static bool write_all(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = write(fd, data.data() + offset, data.size() - offset);
+        if (sent <= 0) {
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
 }
 
-void process_request(const int client_socket_fd, const std::string &client_ip_addr, Logging &logger, const int client_port, const std::string &request) {
-    HTTPParser parser(request);
-    if (!parser.parse()) {
-        std::cout << "[!] FAILED TO PARSE REQUEST\n";
+// Reads one response: its head, then as many bytes of body as its
+// Content-Length. Returns the status code, 0 if the connection ended first
+static int read_response(int fd, std::string& buffer, size_t& response_bytes) {
+    buffer.clear();
+    size_t head_end = std::string::npos;
+    char chunk[64 * 1024];
+    while (head_end == std::string::npos) {
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return 0;
+        }
+        buffer.append(chunk, got);
+        head_end = buffer.find("\r\n\r\n");
+    }
+    head_end += 4;
+
+    size_t content_length = 0;
+    const char* header = "\r\nContent-Length: ";
+    size_t at = buffer.find(header);
+    if (at != std::string::npos && at < head_end) {
+        content_length = std::strtoul(buffer.c_str() + at + std::strlen(header),
+                                      nullptr, 10);
     }
 
-    std::string response = parser.getResponse();
-    const char *response_buffer = response.c_str();
+    // The body is counted rather than kept
+    size_t body_read = buffer.size() - head_end;
+    while (body_read < content_length) {
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return 0;
+        }
+        body_read += got;
+    }
+    response_bytes = head_end + body_read;
+    return std::atoi(buffer.c_str() + 9);
 }
 
-// This function benchmarks handle_client() directly, using a pipe() to simulate a client socket
-static void BM_FromRequestToResponse(benchmark::State& state) {
-    int sv[2]; // socketpair
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
-        perror("socketpair");
-        exit(1);
+// A keep-alive client of handle_client() over a socketpair. The server side
+// runs on a thread of its own for the whole session, the way a pool thread
+// serves a connection in --mode=threadpool
+class ClientSession {
+public:
+    ClientSession() {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        client_fd = sv[0];
+        server = std::thread([fd = sv[1]] {
+            handle_client(loopback_address(), fd, std::chrono::steady_clock::now());
+        });
     }
 
-    sockaddr_in dummy_addr{};
-    dummy_addr.sin_family = AF_INET;
-    dummy_addr.sin_port = htons(8080);
-    dummy_addr.sin_addr.s_addr = INADDR_ANY;
+    ~ClientSession() {
+        // handle_client() returns, and closes its end, once it reads EOF
+        shutdown(client_fd, SHUT_WR);
+        server.join();
+        close(client_fd);
+    }
 
-    // Write a fake HTTP request into one side of the socket
-    std::string req = fake_http_request();
+    int round_trip(const std::string& request, size_t& response_bytes) {
+        if (!write_all(client_fd, request)) {
+            return 0;
+        }
+        return read_response(client_fd, buffer, response_bytes);
+    }
+
+private:
+    int client_fd;
+    std::thread server;
+    std::string buffer;
+};
 
-    Logging logger;
-    logger.setClassName("Benchmark");
+// Server settings for the request to response benchmarks: quiet, and a
+// session is never closed for the number of requests it made
+static void quiet_server() {
+    Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+    MAX_REQUESTS_PER_CONNECTION = 0;
+}
 
-    const std::string client_ip = "127.0.0.1";
-    const int client_port = 8080;
+// One request after the other on a keep-alive connection, each timed from
+// writing it to reading the last byte of its response
+static void BM_FromRequestToResponse(benchmark::State& state,
+                                     const std::string& request,
+                                     int expected_status) {
+    quiet_server();
+    make_large_file();
 
+    // A fresh checkout has no res/uploads, the server only creates it at startup
+    std::error_code error;
+    std::filesystem::create_directories("res/uploads", error);
+    if (error) {
+        state.SkipWithError("res/uploads could not be created");
+        return;
+    }
+    std::set<std::filesystem::path> uploads_before;
+    for (const auto& entry :
+         std::filesystem::directory_iterator("res/uploads", error)) {
+        uploads_before.insert(entry.path());
+    }
+
+    size_t total_bytes = 0;
+    {
+        ClientSession session;
+        for (auto _ : state) {
+            size_t response_bytes = 0;
+            int status = session.round_trip(request, response_bytes);
+            if (status != expected_status) {
+                state.SkipWithError("unexpected response");
+                break;
+            }
+            total_bytes += response_bytes;
+        }
+    }
+    state.SetBytesProcessed(total_bytes);
+
+    // Uploads made by the benchmark aren't kept
+    for (const auto& entry :
+         std::filesystem::directory_iterator("res/uploads", error)) {
+        if (!uploads_before.count(entry.path())) {
+            std::filesystem::remove(entry.path(), error);
+        }
+    }
+    Logging::setMinimumLevel(LoggingLevel::LogLevelInfo);
+}
+BENCHMARK_CAPTURE(BM_FromRequestToResponse, keep_alive_small, GET_SMALL, 200);
+BENCHMARK_CAPTURE(BM_FromRequestToResponse, keep_alive_large, GET_LARGE, 200);
+BENCHMARK_CAPTURE(BM_FromRequestToResponse, keep_alive_404, GET_MISSING, 404);
+BENCHMARK_CAPTURE(BM_FromRequestToResponse, keep_alive_upload, POST_UPLOAD, 201);
+
+// A connection per request, closed by the server after answering. The
+// request is written before handle_client() runs on this thread, and the
+// response fits in the socket buffer, so no thread is started per request
+static void BM_FromRequestToResponseClose(benchmark::State& state,
+                                          const std::string& request,
+                                          int expected_status) {
+    quiet_server();
+    std::string buffer;
     for (auto _ : state) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            state.SkipWithError("socketpair failed");
+            break;
+        }
+        write_all(sv[0], request);
+        handle_client(loopback_address(), sv[1], std::chrono::steady_clock::now());
+        size_t response_bytes = 0;
+        int status = read_response(sv[0], buffer, response_bytes);
+        close(sv[0]);
+        if (status != expected_status) {
+            state.SkipWithError("unexpected response");
+            break;
+        }
+    }
+    Logging::setMinimumLevel(LoggingLevel::LogLevelInfo);
+}
+BENCHMARK_CAPTURE(BM_FromRequestToResponseClose, small, GET_SMALL_CLOSE, 200);
+BENCHMARK_CAPTURE(BM_FromRequestToResponseClose, 404, GET_MISSING_CLOSE, 404);
 
-        // Benchmark the processing of a request
-        // Add arguments here
-        process_request(sv[1], client_ip, logger, client_port, "GET /server HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nConnection: close\r\n\r\n");
+// Processes one request the way a worker does, with process_http_request(),
+// and reports the heap allocations it makes. Logging is off, so this is the
+// cost of parsing, the file lookup and building the response
+static void process_with_allocation_count(benchmark::State& state,
+                                          const std::string& request) {
+    Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+    benchmark::DoNotOptimize(process_http_request(request));
+    size_t before = allocation_count();
+    for (auto _ : state) {
+        HTTPResponse response = process_http_request(request);
+        benchmark::DoNotOptimize(response);
     }
+    state.counters["allocs_per_request"] = benchmark::Counter(
+        static_cast<double>(allocation_count() - before) /
+        state.iterations());
+    Logging::setMinimumLevel(LoggingLevel::LogLevelInfo);
+}
+
+// A cached file, negotiated to its gzip variant if there is one
+static void BM_ProcessGET200(benchmark::State& state) {
+    process_with_allocation_count(
+        state, "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+               "Accept-Encoding: gzip, br\r\nUser-Agent: benchmark\r\n\r\n");
+}
+BENCHMARK(BM_ProcessGET200);
+
+static void BM_ProcessGET404(benchmark::State& state) {
+    process_with_allocation_count(
+        state, "GET /missing/file.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+               "User-Agent: benchmark\r\n\r\n");
+}
+BENCHMARK(BM_ProcessGET404);
+
+// Two ranges, sent as multipart/byteranges
+static void BM_ProcessGETRanges(benchmark::State& state) {
+    process_with_allocation_count(
+        state, "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n"
+               "Range: bytes=0-10,20-30\r\n\r\n");
 }
-BENCHMARK(BM_FromRequestToResponse);
+BENCHMARK(BM_ProcessGETRanges);
+
 BENCHMARK_MAIN();
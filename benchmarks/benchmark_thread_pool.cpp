@@ -0,0 +1,182 @@
+//
+// Benchmarks the work-stealing ThreadPool against the single mutex +
+// condition variable queue it replaced: throughput of small tasks and the
+// latency from enqueue() to a worker starting the task, at 1-64 threads
+//
+
+#include <benchmark/benchmark.h>
+#include <allocation_counter.h>
+#include <thread_pool.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// The ThreadPool before work stealing: one std::queue<std::function> behind
+// one mutex, notify_one() on every enqueue
+class MutexThreadPool {
+public:
+    explicit MutexThreadPool(size_t num_threads) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            threads_.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex_);
+                        cv_.wait(lock, [this] { return !tasks_.empty() || stop_; });
+                        if (stop_ && tasks_.empty()) {
+                            return;
+                        }
+                        task = std::move(tasks_.front());
+                        tasks_.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void enqueue(std::function<void()> task) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            tasks_.emplace(std::move(task));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    std::vector<std::thread> threads_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex queue_mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+// About what the event loop captures for a batch: too big for the inline
+// buffer of std::function, small enough for Task
+using Payload = std::array<char, 64>;
+
+static const size_t TASKS_PER_PRODUCER = 10000;
+
+static void wait_for(const std::atomic<size_t>& done, size_t count) {
+    while (done.load(std::memory_order_acquire) < count) {
+        std::this_thread::yield();
+    }
+}
+
+// state.range(0) pool threads, state.range(1) threads enqueueing concurrently
+template <typename Pool>
+static void BM_Throughput(benchmark::State& state) {
+    const size_t producer_count = state.range(1);
+    const size_t total_tasks = TASKS_PER_PRODUCER * producer_count;
+    Pool pool(state.range(0));
+
+    size_t allocations_before = allocation_count();
+    for (auto _ : state) {
+        std::atomic<size_t> done{0};
+        std::vector<std::thread> producers;
+        for (size_t p = 0; p < producer_count; p++) {
+            producers.emplace_back([&pool, &done] {
+                Payload payload{};
+                for (size_t i = 0; i < TASKS_PER_PRODUCER; i++) {
+                    pool.enqueue([&done, payload]() {
+                        benchmark::DoNotOptimize(payload);
+                        done.fetch_add(1, std::memory_order_release);
+                    });
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        wait_for(done, total_tasks);
+    }
+
+    state.SetItemsProcessed(state.iterations() * total_tasks);
+    // Includes the std::thread of every producer, a handful per iteration
+    state.counters["allocs_per_task"] = benchmark::Counter(
+        static_cast<double>(allocation_count() - allocations_before) /
+        total_tasks, benchmark::Counter::kAvgIterations);
+}
+
+// Bursts of tasks the size of a pipelined batch, each recording how long it
+// waited between enqueue() and a worker picking it up
+template <typename Pool>
+static void BM_Latency(benchmark::State& state) {
+    using Clock = std::chrono::steady_clock;
+    const size_t burst = 32;
+    Pool pool(state.range(0));
+
+    std::vector<double> latencies;
+    latencies.reserve(1 << 20);
+    std::vector<double> burst_latencies(burst);
+    for (auto _ : state) {
+        std::atomic<size_t> done{0};
+        for (size_t i = 0; i < burst; i++) {
+            Clock::time_point enqueued = Clock::now();
+            pool.enqueue([&done, &burst_latencies, enqueued, i]() {
+                burst_latencies[i] =
+                    std::chrono::duration<double, std::micro>(Clock::now() - enqueued)
+                        .count();
+                done.fetch_add(1, std::memory_order_release);
+            });
+        }
+        wait_for(done, burst);
+        if (latencies.size() + burst <= latencies.capacity()) {
+            latencies.insert(latencies.end(), burst_latencies.begin(),
+                             burst_latencies.end());
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0
+                                 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    state.counters["p50_us"] = percentile(0.50);
+    state.counters["p99_us"] = percentile(0.99);
+    state.counters["p999_us"] = percentile(0.999);
+    state.SetItemsProcessed(state.iterations() * burst);
+}
+
+static void PoolSizes(benchmark::internal::Benchmark* benchmark) {
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        benchmark->Arg(threads);
+    }
+}
+
+static void PoolAndProducerSizes(benchmark::internal::Benchmark* benchmark) {
+    for (int producers : {1, 4}) {
+        for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+            benchmark->Args({threads, producers});
+        }
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_Throughput, MutexThreadPool)
+    ->Apply(PoolAndProducerSizes)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Throughput, ThreadPool)
+    ->Apply(PoolAndProducerSizes)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Latency, MutexThreadPool)
+    ->Apply(PoolSizes)->UseRealTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Latency, ThreadPool)
+    ->Apply(PoolSizes)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,766 @@
+//
+// Drives a running server over the network with a mix of requests and
+// writes the throughput and latency percentiles of the run as JSON, to be
+// compared between commits
+//
+//      load_generator <host> <port> [--key=value]...
+//
+// Load is offered in one of two ways:
+//      --mode=closed   every connection sends its next request as soon as the
+//                      response to the last one arrived. The server sets the
+//                      pace, which finds the highest throughput
+//      --mode=open     requests fall due at a constant --rate whether the
+//                      server keeps up or not. Latency is counted from when a
+//                      request was due, not from when a connection was free
+//                      to send it, so a stall shows in the percentiles of
+//                      every request that waited on it instead of only the
+//                      one that was in flight (coordinated omission)
+//
+// Options:
+//      --connections=N     connections kept open (default 16)
+//      --threads=N         client threads, each with an epoll loop and a
+//                          share of the connections and rate (default 1)
+//      --duration=S        seconds measured (default 10)
+//      --warmup=S          seconds run before measuring (default 1)
+//      --rate=R            requests per second of --mode=open (default 1000)
+//      --mix=KIND:W,...    weights of the kinds of request below (default
+//                          small:70,large:5,missing:10,close:5,upload:10)
+//      --small-path=P      a small static file (default /index.html)
+//      --large-path=P      a large static file (default /large.bin)
+//      --upload-bytes=N    size of the JSON body of an upload (default 1024)
+//      --label=S           name of the run, e.g. the commit it measures
+//      --output=F          write the JSON to F instead of stdout
+//      --baseline=F        compare with the results of an earlier run
+//      --max-regression=P  with --baseline, exit with 1 if the req/s dropped
+//                          or the p99 grew by more than P percent
+//
+// Kinds of request:
+//      small    GET of the small file on a keep-alive connection
+//      large    GET of the large file on a keep-alive connection
+//      missing  GET of a path that doesn't exist, answered with a 404
+//      close    GET of the small file with Connection: close, on a new
+//               connection every time
+//      upload   POST of a JSON body to /upload. The server keeps every
+//               upload in res/uploads
+//
+
+#include <latency_histogram.h>
+#include <nlohmann/json.hpp>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class Kind { SMALL = 0, LARGE, MISSING, CLOSE, UPLOAD, COUNT };
+
+static const size_t KIND_COUNT = static_cast<size_t>(Kind::COUNT);
+static const char* KIND_NAMES[KIND_COUNT] = {"small", "large", "missing",
+                                             "close", "upload"};
+
+struct Options {
+    std::string host;
+    std::string port;
+    bool open_loop = false;
+    int connections = 16;
+    int threads = 1;
+    double duration = 10;
+    double warmup = 1;
+    double rate = 1000;
+    std::array<double, KIND_COUNT> weights = {70, 5, 10, 5, 10};
+    std::string small_path = "/index.html";
+    std::string large_path = "/large.bin";
+    size_t upload_bytes = 1024;
+    std::string label;
+    std::string output;
+    std::string baseline;
+    double max_regression = -1;
+};
+
+// What was measured of one kind of request
+struct KindResults {
+    LatencySnapshot latency;       // from when the request was due
+    LatencySnapshot service_time;  // from when it was sent
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    std::map<int, uint64_t> statuses;
+
+    void merge(const KindResults& other) {
+        latency.merge(other.latency);
+        service_time.merge(other.service_time);
+        errors += other.errors;
+        bytes += other.bytes;
+        for (const auto& [status, count] : other.statuses) {
+            statuses[status] += count;
+        }
+    }
+};
+
+using Results = std::array<KindResults, KIND_COUNT>;
+
+// The bytes of one request of every kind, sent as they are
+static std::array<std::string, KIND_COUNT> build_requests(const Options& options) {
+    std::string host = "Host: " + options.host + ":" + options.port + "\r\n";
+    std::string agent = "User-Agent: load_generator\r\n";
+
+    std::string body = "{\"data\": \"";
+    size_t padding = options.upload_bytes > body.size() + 2
+                         ? options.upload_bytes - body.size() - 2
+                         : 0;
+    body.append(padding, 'x');
+    body += "\"}";
+
+    std::array<std::string, KIND_COUNT> requests;
+    requests[size_t(Kind::SMALL)] =
+        "GET " + options.small_path + " HTTP/1.1\r\n" + host + agent + "\r\n";
+    requests[size_t(Kind::LARGE)] =
+        "GET " + options.large_path + " HTTP/1.1\r\n" + host + agent + "\r\n";
+    requests[size_t(Kind::MISSING)] =
+        "GET /load_generator/missing.html HTTP/1.1\r\n" + host + agent + "\r\n";
+    requests[size_t(Kind::CLOSE)] = "GET " + options.small_path +
+                                    " HTTP/1.1\r\n" + host + agent +
+                                    "Connection: close\r\n\r\n";
+    requests[size_t(Kind::UPLOAD)] =
+        "POST /upload HTTP/1.1\r\n" + host + agent +
+        "Content-Type: application/json\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    return requests;
+}
+
+// A client connection and the request in flight on it, if any
+struct Connection {
+    int fd = -1;
+    bool busy = false;
+    Kind kind = Kind::SMALL;
+    Clock::time_point due;
+    Clock::time_point sent;
+    const std::string* request = nullptr;
+    size_t request_offset = 0;
+
+    // The response, parsed as it arrives. The body is only counted
+    std::string head;
+    bool head_done = false;
+    size_t body_remaining = 0;
+    size_t response_bytes = 0;
+    int status = 0;
+    bool server_closes = false;
+};
+
+static bool equals_ignore_case(const char* a, const char* b, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) !=
+            std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the status, Content-Length and Connection of a complete head
+static bool parse_head(Connection& connection, size_t head_length) {
+    const std::string& head = connection.head;
+    if (head.compare(0, 7, "HTTP/1.") != 0 || head.size() < 12) {
+        return false;
+    }
+    connection.status = std::atoi(head.c_str() + 9);
+
+    size_t line = head.find("\r\n") + 2;
+    while (line < head_length - 2) {
+        size_t end = head.find("\r\n", line);
+        const char* text = head.c_str() + line;
+        size_t length = end - line;
+        if (length > 15 && equals_ignore_case(text, "content-length:", 15)) {
+            connection.body_remaining = std::strtoul(text + 15, nullptr, 10);
+        } else if (length > 11 && equals_ignore_case(text, "connection:", 11)) {
+            std::string value(text + 11, length - 11);
+            connection.server_closes = value.find("close") != std::string::npos;
+        }
+        line = end + 2;
+    }
+    return true;
+}
+
+// One client thread: an epoll loop over its connections
+class Worker {
+public:
+    Worker(const Options& options,
+           const std::array<std::string, KIND_COUNT>& requests,
+           const addrinfo* address, int connection_count, double rate,
+           uint64_t seed)
+        : options(options), requests(requests), address(address),
+          connections(connection_count), random(seed) {
+        if (options.open_loop) {
+            interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(1.0 / rate));
+        }
+        double sum = 0;
+        for (size_t i = 0; i < KIND_COUNT; i++) {
+            sum += options.weights[i];
+            cumulative_weights[i] = sum;
+        }
+    }
+
+    // Offers load from start to end, recording requests due from
+    // measure_from on. first_due staggers the schedules of the threads
+    void run(Clock::time_point start, Clock::time_point measure_from,
+             Clock::time_point end, Clock::duration first_due) {
+        this->measure_from = measure_from;
+        epoll_fd = epoll_create1(0);
+        if (options.open_loop) {
+            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+        }
+        for (auto& connection : connections) {
+            idle.push_back(&connection);
+        }
+
+        Clock::time_point next_due = start + first_due;
+        std::deque<Clock::time_point> waiting;
+        epoll_event events[256];
+        for (Clock::time_point now = Clock::now(); now < end; now = Clock::now()) {
+            if (options.open_loop) {
+                // Requests that fell due while every connection was busy
+                // wait in order, their latency already running
+                for (; next_due <= now; next_due += interval) {
+                    waiting.push_back(next_due);
+                }
+                while (!waiting.empty() && !idle.empty()) {
+                    Connection* connection = idle.back();
+                    idle.pop_back();
+                    start_request(*connection, waiting.front());
+                    waiting.pop_front();
+                }
+                arm_timer(next_due);
+            } else {
+                // A request that fails at once makes its connection idle
+                // again, it is retried on the next round
+                std::vector<Connection*> ready;
+                ready.swap(idle);
+                for (Connection* connection : ready) {
+                    start_request(*connection, Clock::now());
+                }
+            }
+
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
+            int timeout = static_cast<int>(std::min<int64_t>(left.count() + 1, 100));
+            int count = epoll_wait(epoll_fd, events, 256, timeout);
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    uint64_t expirations;
+                    while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    }
+                    continue;
+                }
+                handle_event(*static_cast<Connection*>(events[i].data.ptr),
+                             events[i].events);
+            }
+        }
+
+        unsent = waiting.size();
+        for (auto& connection : connections) {
+            disconnect(connection);
+        }
+        if (timer_fd != -1) {
+            close(timer_fd);
+        }
+        close(epoll_fd);
+    }
+
+    Results results;
+    uint64_t unsent = 0;  // Due in --mode=open but never sent
+
+private:
+    const Options& options;
+    const std::array<std::string, KIND_COUNT>& requests;
+    const addrinfo* address;
+    std::vector<Connection> connections;
+    std::vector<Connection*> idle;
+    std::mt19937_64 random;
+    std::array<double, KIND_COUNT> cumulative_weights;
+    Clock::duration interval{};
+    Clock::time_point measure_from;
+    int epoll_fd = -1;
+    int timer_fd = -1;
+    char buffer[64 * 1024];
+
+    Kind pick_kind() {
+        std::uniform_real_distribution<double> uniform(0, cumulative_weights.back());
+        double value = uniform(random);
+        for (size_t i = 0; i < KIND_COUNT; i++) {
+            if (value < cumulative_weights[i]) {
+                return static_cast<Kind>(i);
+            }
+        }
+        return Kind::SMALL;
+    }
+
+    void arm_timer(Clock::time_point due) {
+        auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            due.time_since_epoch());
+        itimerspec spec{};
+        spec.it_value.tv_sec = since_epoch.count() / 1000000000;
+        spec.it_value.tv_nsec = since_epoch.count() % 1000000000;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    bool connect(Connection& connection) {
+        int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) == -1 &&
+            errno != EINPROGRESS) {
+            close(fd);
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &connection;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        connection.fd = fd;
+        return true;
+    }
+
+    void disconnect(Connection& connection) {
+        if (connection.fd != -1) {
+            close(connection.fd);
+            connection.fd = -1;
+        }
+    }
+
+    bool measured(const Connection& connection) const {
+        return connection.due >= measure_from;
+    }
+
+    void start_request(Connection& connection, Clock::time_point due) {
+        connection.kind = pick_kind();
+        connection.due = due;
+        connection.sent = Clock::now();
+        connection.request = &requests[size_t(connection.kind)];
+        connection.request_offset = 0;
+        connection.head.clear();
+        connection.head_done = false;
+        connection.body_remaining = 0;
+        connection.response_bytes = 0;
+        connection.status = 0;
+        connection.server_closes = false;
+        connection.busy = true;
+
+        // A Connection: close request always goes out on a new connection,
+        // paying for the handshake like a real client would
+        if (connection.kind == Kind::CLOSE) {
+            disconnect(connection);
+        }
+        if (connection.fd == -1 && !connect(connection)) {
+            fail(connection);
+            return;
+        }
+        send_request(connection);
+    }
+
+    void send_request(Connection& connection) {
+        const std::string& request = *connection.request;
+        while (connection.request_offset < request.size()) {
+            ssize_t sent = send(connection.fd, request.data() + connection.request_offset,
+                                request.size() - connection.request_offset, MSG_NOSIGNAL);
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                fail(connection);
+                return;
+            }
+            connection.request_offset += sent;
+        }
+    }
+
+    void handle_event(Connection& connection, uint32_t events) {
+        if (!connection.busy) {
+            // An idle keep-alive connection the server closed
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ssize_t got = recv(connection.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (got == 0 || (got == -1 && errno != EAGAIN)) {
+                    disconnect(connection);
+                }
+            }
+            return;
+        }
+        if ((events & EPOLLOUT) && connection.request_offset < connection.request->size()) {
+            send_request(connection);
+        }
+        if (connection.busy && connection.fd != -1) {
+            receive_response(connection);
+        }
+    }
+
+    void receive_response(Connection& connection) {
+        while (connection.busy) {
+            ssize_t got = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                // Closed or reset before the response was complete
+                fail(connection);
+                return;
+            }
+            connection.response_bytes += got;
+
+            size_t body_bytes = got;
+            if (!connection.head_done) {
+                size_t searched_from = connection.head.size() >= 3 ? connection.head.size() - 3 : 0;
+                connection.head.append(buffer, got);
+                size_t head_end = connection.head.find("\r\n\r\n", searched_from);
+                if (head_end == std::string::npos) {
+                    if (connection.head.size() > 64 * 1024) {
+                        fail(connection);
+                    }
+                    continue;
+                }
+                head_end += 4;
+                if (!parse_head(connection, head_end)) {
+                    fail(connection);
+                    return;
+                }
+                connection.head_done = true;
+                body_bytes = connection.head.size() - head_end;
+            }
+            connection.body_remaining -= std::min(connection.body_remaining, body_bytes);
+            if (connection.body_remaining == 0) {
+                complete(connection);
+            }
+        }
+    }
+
+    void complete(Connection& connection) {
+        Clock::time_point now = Clock::now();
+        if (measured(connection)) {
+            KindResults& kind = results[size_t(connection.kind)];
+            kind.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    now - connection.due).count());
+            kind.service_time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         now - connection.sent).count());
+            kind.bytes += connection.response_bytes;
+            kind.statuses[connection.status]++;
+        }
+        connection.busy = false;
+        if (connection.kind == Kind::CLOSE || connection.server_closes) {
+            disconnect(connection);
+        }
+        idle.push_back(&connection);
+    }
+
+    void fail(Connection& connection) {
+        if (measured(connection)) {
+            results[size_t(connection.kind)].errors++;
+        }
+        connection.busy = false;
+        disconnect(connection);
+        idle.push_back(&connection);
+    }
+};
+
+static double microseconds(uint64_t nanoseconds) { return nanoseconds / 1000.0; }
+
+static nlohmann::json percentiles(const LatencySnapshot& snapshot) {
+    return {
+        {"mean", snapshot.count ? microseconds(snapshot.sum) / snapshot.count : 0.0},
+        {"p50", microseconds(snapshot.percentile(0.5))},
+        {"p90", microseconds(snapshot.percentile(0.9))},
+        {"p99", microseconds(snapshot.percentile(0.99))},
+        {"p99.9", microseconds(snapshot.percentile(0.999))},
+        {"max", microseconds(snapshot.max())},
+    };
+}
+
+static nlohmann::json summary(const KindResults& results, double seconds) {
+    nlohmann::json statuses = nlohmann::json::object();
+    for (const auto& [status, count] : results.statuses) {
+        statuses[std::to_string(status)] = count;
+    }
+    return {
+        {"requests", results.latency.count},
+        {"errors", results.errors},
+        {"requests_per_second", results.latency.count / seconds},
+        {"bytes_per_second", results.bytes / seconds},
+        {"latency_us", percentiles(results.latency)},
+        {"service_time_us", percentiles(results.service_time)},
+        {"statuses", statuses},
+    };
+}
+
+// Prints how a figure changed from the baseline, returns the change in
+// percent
+static double print_change(const char* scope, const char* name, double before,
+                           double after) {
+    double change = before > 0 ? (after - before) / before * 100 : 0;
+    std::fprintf(stderr, "  %-8s %-20s %12.1f -> %12.1f  (%+.1f%%)\n", scope, name,
+                 before, after, change);
+    return change;
+}
+
+// Compares with an earlier run, returns false if a regression is over the
+// allowed percentage
+static bool compare(const nlohmann::json& baseline, const nlohmann::json& current,
+                    double max_regression) {
+    std::fprintf(stderr, "Compared with %s:\n",
+                 baseline.value("label", std::string("baseline")).c_str());
+    bool within = true;
+    auto compare_scope = [&](const char* scope, const nlohmann::json& before,
+                             const nlohmann::json& after, bool checked) {
+        double rps = print_change(scope, "req/s", before["requests_per_second"],
+                                  after["requests_per_second"]);
+        print_change(scope, "p50 (us)", before["latency_us"]["p50"], after["latency_us"]["p50"]);
+        double p99 = print_change(scope, "p99 (us)", before["latency_us"]["p99"],
+                                  after["latency_us"]["p99"]);
+        print_change(scope, "p99.9 (us)", before["latency_us"]["p99.9"],
+                     after["latency_us"]["p99.9"]);
+        if (checked && max_regression >= 0 && (-rps > max_regression || p99 > max_regression)) {
+            within = false;
+        }
+    };
+    compare_scope("all", baseline["all"], current["all"], true);
+    for (const auto& [kind, after] : current["kinds"].items()) {
+        if (baseline.contains("kinds") && baseline["kinds"].contains(kind)) {
+            compare_scope(kind.c_str(), baseline["kinds"][kind], after, false);
+        }
+    }
+    return within;
+}
+
+static void usage() {
+    std::cerr << "Usage: load_generator <host> <port> [--mode=closed|open] "
+                 "[--connections=N] [--threads=N] [--duration=S] [--warmup=S] "
+                 "[--rate=R] [--mix=KIND:W,...] [--small-path=P] "
+                 "[--large-path=P] [--upload-bytes=N] [--label=S] "
+                 "[--output=F] [--baseline=F] [--max-regression=P]\n";
+}
+
+static bool parse_mix(const std::string& mix, std::array<double, KIND_COUNT>& weights) {
+    weights.fill(0);
+    size_t start = 0;
+    while (start < mix.size()) {
+        size_t end = mix.find(',', start);
+        if (end == std::string::npos) {
+            end = mix.size();
+        }
+        std::string entry = mix.substr(start, end - start);
+        size_t colon = entry.find(':');
+        std::string name = entry.substr(0, colon);
+        double weight = colon == std::string::npos ? 1 : std::atof(entry.c_str() + colon + 1);
+        size_t kind = 0;
+        while (kind < KIND_COUNT && name != KIND_NAMES[kind]) {
+            kind++;
+        }
+        if (kind == KIND_COUNT || weight < 0) {
+            std::cerr << "Unknown kind of request in --mix: " << name << "\n";
+            return false;
+        }
+        weights[kind] = weight;
+        start = end + 1;
+    }
+    double total = 0;
+    for (double weight : weights) {
+        total += weight;
+    }
+    return total > 0;
+}
+
+static bool parse_options(int argc, char* argv[], Options& options) {
+    if (argc < 3) {
+        return false;
+    }
+    options.host = argv[1];
+    options.port = argv[2];
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        size_t equals = option.find('=');
+        if (option.rfind("--", 0) != 0 || equals == std::string::npos) {
+            std::cerr << "Invalid option: " << option << "\n";
+            return false;
+        }
+        std::string key = option.substr(2, equals - 2);
+        std::string value = option.substr(equals + 1);
+        if (key == "mode" && (value == "closed" || value == "open")) {
+            options.open_loop = value == "open";
+        } else if (key == "connections") {
+            options.connections = std::max(1, std::atoi(value.c_str()));
+        } else if (key == "threads") {
+            options.threads = std::max(1, std::atoi(value.c_str()));
+        } else if (key == "duration") {
+            options.duration = std::max(0.1, std::atof(value.c_str()));
+        } else if (key == "warmup") {
+            options.warmup = std::max(0.0, std::atof(value.c_str()));
+        } else if (key == "rate") {
+            options.rate = std::max(1.0, std::atof(value.c_str()));
+        } else if (key == "mix") {
+            if (!parse_mix(value, options.weights)) {
+                return false;
+            }
+        } else if (key == "small-path") {
+            options.small_path = value;
+        } else if (key == "large-path") {
+            options.large_path = value;
+        } else if (key == "upload-bytes") {
+            options.upload_bytes = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "label") {
+            options.label = value;
+        } else if (key == "output") {
+            options.output = value;
+        } else if (key == "baseline") {
+            options.baseline = value;
+        } else if (key == "max-regression") {
+            options.max_regression = std::atof(value.c_str());
+        } else {
+            std::cerr << "Invalid option: " << option << "\n";
+            return false;
+        }
+    }
+    options.threads = std::min(options.threads, options.connections);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* address = nullptr;
+    if (getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &address) != 0) {
+        std::cerr << "Cannot resolve " << options.host << ":" << options.port << "\n";
+        return 1;
+    }
+
+    auto requests = build_requests(options);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; i++) {
+        int connections = options.connections / options.threads +
+                          (i < options.connections % options.threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(
+            options, requests, address, connections, options.rate / options.threads, i + 1));
+    }
+
+    std::fprintf(stderr, "%s load on %s:%s, %d connections, %d threads, %.1f s%s\n",
+                 options.open_loop ? "Open loop" : "Closed loop", options.host.c_str(),
+                 options.port.c_str(), options.connections, options.threads,
+                 options.duration, options.warmup > 0 ? " after a warmup" : "");
+
+    auto seconds = [](double value) {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(value));
+    };
+    Clock::time_point start = Clock::now();
+    Clock::time_point measure_from = start + seconds(options.warmup);
+    Clock::time_point end = measure_from + seconds(options.duration);
+
+    // The schedules of the threads are offset by a fraction of their
+    // interval, so together they send at an even pace
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.threads; i++) {
+        auto first_due = seconds(1.0 / options.rate * i);
+        threads.emplace_back([&, i, first_due] {
+            workers[i]->run(start, measure_from, end, first_due);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    freeaddrinfo(address);
+
+    KindResults all;
+    Results kinds;
+    uint64_t unsent = 0;
+    for (const auto& worker : workers) {
+        for (size_t i = 0; i < KIND_COUNT; i++) {
+            kinds[i].merge(worker->results[i]);
+            all.merge(worker->results[i]);
+        }
+        unsent += worker->unsent;
+    }
+
+    nlohmann::json result = {
+        {"label", options.label},
+        {"mode", options.open_loop ? "open" : "closed"},
+        {"connections", options.connections},
+        {"threads", options.threads},
+        {"duration_s", options.duration},
+        {"all", summary(all, options.duration)},
+        {"kinds", nlohmann::json::object()},
+    };
+    if (options.open_loop) {
+        result["target_rate"] = options.rate;
+        result["unsent"] = unsent;
+    }
+    for (size_t i = 0; i < KIND_COUNT; i++) {
+        if (options.weights[i] > 0) {
+            result["kinds"][KIND_NAMES[i]] = summary(kinds[i], options.duration);
+        }
+    }
+
+    std::fprintf(stderr, "%llu requests, %llu errors, %.0f req/s, p50 %.1f us, "
+                         "p99 %.1f us, p99.9 %.1f us\n",
+                 static_cast<unsigned long long>(all.latency.count),
+                 static_cast<unsigned long long>(all.errors),
+                 all.latency.count / options.duration,
+                 microseconds(all.latency.percentile(0.5)),
+                 microseconds(all.latency.percentile(0.99)),
+                 microseconds(all.latency.percentile(0.999)));
+
+    if (options.output.empty()) {
+        std::cout << result.dump(2) << "\n";
+    } else {
+        std::ofstream(options.output) << result.dump(2) << "\n";
+    }
+
+    if (!options.baseline.empty()) {
+        std::ifstream file(options.baseline);
+        nlohmann::json baseline = nlohmann::json::parse(file, nullptr, false);
+        if (baseline.is_discarded() || !baseline.contains("all")) {
+            std::cerr << "Cannot read the baseline " << options.baseline << "\n";
+            return 1;
+        }
+        if (!compare(baseline, result, options.max_regression)) {
+            std::cerr << "Regression above " << options.max_regression << "%\n";
+            return 1;
+        }
+    }
+    return 0;
+}
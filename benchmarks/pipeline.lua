@@ -0,0 +1,22 @@
+-- wrk script that pipelines requests on every connection
+-- Usage: wrk -t4 -c64 -d10s -s pipeline.lua http://127.0.0.1:8080 -- 16
+-- The number after "--" is the pipeline depth (default 16)
+
+local depth = 16
+local pipelined
+
+function init(args)
+  if args[1] ~= nil then
+    depth = tonumber(args[1])
+  end
+
+  local requests = {}
+  for i = 1, depth do
+    requests[i] = wrk.format("GET", "/index.html")
+  end
+  pipelined = table.concat(requests)
+end
+
+function request()
+  return pipelined
+end
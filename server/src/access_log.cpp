@@ -0,0 +1,235 @@
+#include <access_log.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <limits>
+#include <unistd.h>
+
+// The buffer is written out once it holds this much
+static const size_t BUFFER_SIZE = 64 * 1024;
+
+// ... or on the first record this long after the last write
+static const auto FLUSH_INTERVAL = std::chrono::seconds(1);
+
+// Fixed-size part of a record after its length prefix
+static const size_t FIXED_FIELDS_SIZE = 8 + 2 + 8 + 4 + 4 + 4;
+
+template <typename T> static void put(std::string &out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+template <typename T> static T get(const char *data) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<T>(static_cast<unsigned char>(data[i])) << (8 * i);
+  }
+  return value;
+}
+
+void encode_access_log_header(std::string &out) {
+  out.append(ACCESS_LOG_MAGIC);
+  put<uint32_t>(out, ACCESS_LOG_VERSION);
+}
+
+void encode_access_record(const AccessRecord &record, std::string &out) {
+  size_t method_length = std::min<size_t>(record.method.size(), 255);
+  size_t route_length = std::min(record.route.size(), ACCESS_LOG_MAX_ROUTE);
+
+  put<uint16_t>(out, FIXED_FIELDS_SIZE + 1 + method_length + 2 + route_length);
+  put<uint64_t>(out, record.timestamp_us);
+  put<uint16_t>(out, record.status);
+  put<uint64_t>(out, record.bytes);
+  put<uint32_t>(out, record.parse_us);
+  put<uint32_t>(out, record.process_us);
+  put<uint32_t>(out, record.write_us);
+  put<uint8_t>(out, method_length);
+  out.append(record.method, 0, method_length);
+  put<uint16_t>(out, route_length);
+  out.append(record.route, 0, route_length);
+}
+
+bool decode_access_log_header(std::string_view data) {
+  return data.size() >= ACCESS_LOG_HEADER_SIZE &&
+         data.substr(0, 4) == ACCESS_LOG_MAGIC &&
+         get<uint32_t>(data.data() + 4) <= ACCESS_LOG_VERSION;
+}
+
+bool decode_access_record(std::string_view data, AccessRecord &record,
+                          size_t &consumed) {
+  if (data.size() < 2) {
+    return false;
+  }
+  size_t length = get<uint16_t>(data.data());
+  if (data.size() < 2 + length || length < FIXED_FIELDS_SIZE + 1) {
+    return false;
+  }
+
+  const char *field = data.data() + 2;
+  const char *end = field + length;
+  record.timestamp_us = get<uint64_t>(field);
+  record.status = get<uint16_t>(field + 8);
+  record.bytes = get<uint64_t>(field + 10);
+  record.parse_us = get<uint32_t>(field + 18);
+  record.process_us = get<uint32_t>(field + 22);
+  record.write_us = get<uint32_t>(field + 26);
+  field += FIXED_FIELDS_SIZE;
+
+  size_t method_length = get<uint8_t>(field++);
+  if (end - field < static_cast<ptrdiff_t>(method_length + 2)) {
+    return false;
+  }
+  record.method.assign(field, method_length);
+  field += method_length;
+
+  size_t route_length = get<uint16_t>(field);
+  field += 2;
+  if (end - field < static_cast<ptrdiff_t>(route_length)) {
+    return false;
+  }
+  record.route.assign(field, route_length);
+
+  consumed = 2 + length;
+  return true;
+}
+
+uint32_t elapsed_us(std::chrono::steady_clock::time_point from,
+                    std::chrono::steady_clock::time_point to) {
+  auto us =
+      std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+  return static_cast<uint32_t>(
+      std::clamp<int64_t>(us, 0, std::numeric_limits<uint32_t>::max()));
+}
+
+void record_timings(AccessRecord &record,
+                    std::chrono::steady_clock::time_point started,
+                    std::chrono::steady_clock::time_point parsed) {
+  auto finished = std::chrono::steady_clock::now();
+  parsed = std::clamp(parsed, started, finished);
+  record.parse_us = elapsed_us(started, parsed);
+  record.process_us = elapsed_us(parsed, finished);
+}
+
+AccessLog &AccessLog::instance() {
+  // Never destroyed, threads may still finish requests while the process
+  // exits. What is buffered is written by the exit handlers
+  static AccessLog *log = [] {
+    AccessLog *created = new AccessLog();
+    std::atexit([] { AccessLog::instance().flush(); });
+    std::at_quick_exit([] { AccessLog::instance().flush(); });
+    return created;
+  }();
+  return *log;
+}
+
+bool AccessLog::open(const std::string &log_path, size_t max_bytes,
+                     int files) {
+  std::lock_guard<std::mutex> lock(mutex);
+  path = log_path;
+  max_file_bytes = max_bytes;
+  max_files = files;
+  if (!open_file()) {
+    return false;
+  }
+
+  last_write = std::chrono::steady_clock::now();
+  is_enabled.store(true, std::memory_order_release);
+  return true;
+}
+
+bool AccessLog::enabled() const {
+  return is_enabled.load(std::memory_order_relaxed);
+}
+
+void AccessLog::write(const AccessRecord &record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (fd == -1) {
+    return;
+  }
+
+  encode_access_record(record, buffer);
+  auto now = std::chrono::steady_clock::now();
+  if (buffer.size() >= BUFFER_SIZE || now - last_write >= FLUSH_INTERVAL) {
+    write_buffer();
+    last_write = now;
+  }
+}
+
+void AccessLog::flush() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (fd != -1) {
+    write_buffer();
+  }
+}
+
+bool AccessLog::open_file() {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  // A new or empty file starts with the header, an existing log is appended
+  // to
+  off_t size = lseek(fd, 0, SEEK_END);
+  file_bytes = size > 0 ? size : 0;
+  if (file_bytes == 0) {
+    std::string header;
+    encode_access_log_header(header);
+    buffer.insert(0, header);
+  }
+  return true;
+}
+
+void AccessLog::rotate() {
+  close(fd);
+  fd = -1;
+
+  for (int i = max_files - 1; i >= 1; i--) {
+    std::string from = path + "." + std::to_string(i);
+    std::string to = path + "." + std::to_string(i + 1);
+    std::rename(from.c_str(), to.c_str());
+  }
+  if (max_files > 0) {
+    std::rename(path.c_str(), (path + ".1").c_str());
+  } else {
+    unlink(path.c_str());
+  }
+
+  open_file();
+}
+
+void AccessLog::write_buffer() {
+  // Rotate before a write that would take the file past its limit. The
+  // buffer only ever holds whole records, so files end on a record boundary
+  if (max_file_bytes > 0 && file_bytes > ACCESS_LOG_HEADER_SIZE &&
+      file_bytes + buffer.size() > max_file_bytes) {
+    std::string records = std::move(buffer);
+    buffer.clear();
+    rotate();
+    buffer += records;
+    if (fd == -1) {
+      buffer.clear();
+      return;
+    }
+  }
+
+  size_t offset = 0;
+  while (offset < buffer.size()) {
+    ssize_t written = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      break;
+    }
+    offset += written;
+  }
+
+  // Whatever could not be written is dropped, the log must never hold up
+  // requests
+  file_bytes += offset;
+  buffer.clear();
+}
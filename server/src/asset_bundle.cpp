@@ -0,0 +1,345 @@
+#include <asset_bundle.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+template <typename T> static void put(std::string &out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+template <typename T> static T get(const char *data) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<T>(static_cast<unsigned char>(data[i])) << (8 * i);
+  }
+  return value;
+}
+
+// The bundle's bytes, unmapped when the last file borrowing them is gone
+struct AssetBundle::Mapping {
+  const char *data = nullptr;
+  size_t size = 0;
+
+  Mapping(const char *data, size_t size) : data(data), size(size) {}
+  ~Mapping() { munmap(const_cast<char *>(data), size); }
+  Mapping(const Mapping &) = delete;
+  Mapping &operator=(const Mapping &) = delete;
+};
+
+// Reads the index of a bundle, every read checked against the index end
+class IndexReader {
+public:
+  IndexReader(const char *position, const char *end)
+      : position(position), end(end) {}
+
+  template <typename T> bool read(T &value) {
+    if (static_cast<size_t>(end - position) < sizeof(T)) {
+      return false;
+    }
+    value = get<T>(position);
+    position += sizeof(T);
+    return true;
+  }
+
+  template <typename Length> bool read_string(std::string_view &value) {
+    Length length;
+    if (!read(length) || static_cast<size_t>(end - position) < length) {
+      return false;
+    }
+    value = std::string_view(position, length);
+    position += length;
+    return true;
+  }
+
+  bool done() const { return position == end; }
+
+private:
+  const char *position;
+  const char *end;
+};
+
+static std::shared_ptr<const AssetBundle> served_bundle;
+
+std::shared_ptr<const AssetBundle>
+AssetBundle::open(const std::filesystem::path &path, std::string &error) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    error = std::strerror(errno);
+    return nullptr;
+  }
+  struct stat bundle_stat;
+  if (fstat(fd, &bundle_stat) == -1 || !S_ISREG(bundle_stat.st_mode) ||
+      static_cast<size_t>(bundle_stat.st_size) < ASSET_BUNDLE_HEADER_SIZE) {
+    close(fd);
+    error = "not an asset bundle";
+    return nullptr;
+  }
+
+  // The only read of the startup: the whole bundle is mapped, shared and
+  // read-only, and pages come in as the files are first sent
+  size_t size = bundle_stat.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = std::strerror(errno);
+    return nullptr;
+  }
+
+  auto bundle = std::make_shared<AssetBundle>();
+  bundle->mapping =
+      std::make_shared<const Mapping>(static_cast<const char *>(data), size);
+  const char *bytes = bundle->mapping->data;
+
+  uint32_t asset_count = get<uint32_t>(bytes + 8);
+  uint64_t index_offset = get<uint64_t>(bytes + 12);
+  if (std::string_view(bytes, 4) != ASSET_BUNDLE_MAGIC ||
+      get<uint32_t>(bytes + 4) != ASSET_BUNDLE_VERSION) {
+    error = "not an asset bundle of version " +
+            std::to_string(ASSET_BUNDLE_VERSION);
+    return nullptr;
+  }
+  if (index_offset < ASSET_BUNDLE_HEADER_SIZE || index_offset > size) {
+    error = "truncated bundle";
+    return nullptr;
+  }
+
+  // Every variant becomes a CachedFile borrowing its contents from the
+  // mapping, built once here so that serving one is a lookup
+  IndexReader index(bytes + index_offset, bytes + size);
+  bundle->assets.reserve(asset_count);
+  for (uint32_t i = 0; i < asset_count; i++) {
+    Asset asset;
+    uint8_t content_type;
+    uint8_t variant_count;
+    if (!index.read_string<uint16_t>(asset.path) || !index.read(content_type) ||
+        !index.read(variant_count) || content_type > HTTPContentType::CSS ||
+        (!bundle->assets.empty() && bundle->assets.back().path >= asset.path)) {
+      error = "corrupt index";
+      return nullptr;
+    }
+
+    for (uint8_t v = 0; v < variant_count; v++) {
+      uint8_t encoding;
+      uint64_t offset, length;
+      int64_t mtime_seconds;
+      uint32_t mtime_nanoseconds;
+      std::string_view last_modified, etag;
+      if (!index.read(encoding) || !index.read(offset) ||
+          !index.read(length) || !index.read(mtime_seconds) ||
+          !index.read(mtime_nanoseconds) ||
+          !index.read_string<uint8_t>(last_modified) ||
+          !index.read_string<uint8_t>(etag) || encoding >= ENCODING_COUNT ||
+          offset > index_offset || length > index_offset - offset) {
+        error = "corrupt index";
+        return nullptr;
+      }
+
+      auto file = std::make_shared<CachedFile>();
+      file->mapped = std::string_view(bytes + offset, length);
+      file->mapping = bundle->mapping;
+      file->content_type = static_cast<HTTPContentType>(content_type);
+      file->encoding = static_cast<ContentEncoding>(encoding);
+      file->content_length = std::to_string(length);
+      file->etag = etag;
+      file->last_modified = last_modified;
+      file->size = length;
+      file->mtime.tv_sec = mtime_seconds;
+      file->mtime.tv_nsec = mtime_nanoseconds;
+      asset.variants[encoding] = std::move(file);
+    }
+    bundle->assets.push_back(std::move(asset));
+  }
+  if (!index.done()) {
+    error = "corrupt index";
+    return nullptr;
+  }
+
+  return bundle;
+}
+
+std::shared_ptr<const CachedFile>
+AssetBundle::find(std::string_view path, ContentEncoding encoding) const {
+  auto it = std::lower_bound(assets.begin(), assets.end(), path,
+                             [](const Asset &asset, std::string_view key) {
+                               return asset.path < key;
+                             });
+  if (it == assets.end() || it->path != path) {
+    return nullptr;
+  }
+  return it->variants[static_cast<size_t>(encoding)];
+}
+
+size_t AssetBundle::asset_count() const { return assets.size(); }
+
+size_t AssetBundle::size() const { return mapping->size; }
+
+const AssetBundle *AssetBundle::served() { return served_bundle.get(); }
+
+void AssetBundle::serve(std::shared_ptr<const AssetBundle> bundle) {
+  served_bundle = std::move(bundle);
+}
+
+static bool write_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+// The variant of file packed for encoding: its precompressed sibling unless
+// that is older than the file, as the CompressionCache would serve it,
+// otherwise the file compressed now if that saves anything
+static std::shared_ptr<CachedFile>
+encoded_variant(const std::filesystem::path &path, const CachedFile &file,
+                ContentEncoding encoding) {
+  auto sibling = load_file(path.string() + content_encoding_extension(encoding),
+                           std::numeric_limits<size_t>::max());
+  if (sibling) {
+    bool outdated = sibling->mtime.tv_sec < file.mtime.tv_sec ||
+                    (sibling->mtime.tv_sec == file.mtime.tv_sec &&
+                     sibling->mtime.tv_nsec < file.mtime.tv_nsec);
+    if (!outdated) {
+      return sibling;
+    }
+  }
+
+  if (!can_compress(encoding) || !is_compressible(file.content_type)) {
+    return nullptr;
+  }
+  auto compressed = compress(file.content, encoding);
+  if (!compressed || compressed->size() >= file.content.size()) {
+    return nullptr;
+  }
+  auto variant = std::make_shared<CachedFile>();
+  variant->content = std::move(*compressed);
+  variant->etag = encoded_etag(file.etag, encoding);
+  variant->last_modified = file.last_modified;
+  variant->mtime = file.mtime;
+  return variant;
+}
+
+std::optional<size_t> pack_asset_bundle(const std::filesystem::path &directory,
+                                        const std::filesystem::path &bundle_path,
+                                        std::string &error) {
+  // STEP 1
+  // Collect the files, sorted by their path relative to the directory since
+  // that is the order of the index
+  std::vector<std::string> paths;
+  std::error_code ec;
+  std::filesystem::recursive_directory_iterator it(directory, ec), end;
+  for (; !ec && it != end; it.increment(ec)) {
+    if (it->path() == directory / "uploads") {
+      it.disable_recursion_pending();
+      continue;
+    }
+    if (it->is_regular_file(ec)) {
+      paths.push_back(it->path().lexically_relative(directory).generic_string());
+    }
+  }
+  if (ec) {
+    error = directory.string() + ": " + ec.message();
+    return std::nullopt;
+  }
+  std::sort(paths.begin(), paths.end());
+
+  // STEP 2
+  // Write the contents of every variant right after the header, in a temp
+  // file renamed into place at the end, while the index is built up. It
+  // goes last, once every offset is known
+  std::string temp_path = bundle_path.string() + ".tmp";
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd == -1) {
+    error = temp_path + ": " + std::strerror(errno);
+    return std::nullopt;
+  }
+  auto fail = [&](const std::string &message) {
+    error = message;
+    close(fd);
+    unlink(temp_path.c_str());
+    return std::nullopt;
+  };
+
+  uint64_t offset = ASSET_BUNDLE_ALIGNMENT;
+  if (!write_all(fd, std::string(ASSET_BUNDLE_ALIGNMENT, '\0'))) {
+    return fail(temp_path + ": " + std::strerror(errno));
+  }
+
+  std::string index;
+  uint32_t asset_count = 0;
+  for (const auto &path : paths) {
+    std::filesystem::path full_path = directory / path;
+    auto file = load_file(full_path, std::numeric_limits<size_t>::max());
+    if (!file || path.size() > std::numeric_limits<uint16_t>::max()) {
+      continue;
+    }
+
+    std::vector<std::pair<ContentEncoding, std::shared_ptr<CachedFile>>>
+        variants = {{ContentEncoding::IDENTITY, file}};
+    for (auto encoding : {ContentEncoding::BROTLI, ContentEncoding::ZSTD,
+                          ContentEncoding::GZIP}) {
+      if (auto variant = encoded_variant(full_path, *file, encoding)) {
+        variants.emplace_back(encoding, std::move(variant));
+      }
+    }
+
+    put<uint16_t>(index, path.size());
+    index += path;
+    put<uint8_t>(index, file->content_type);
+    put<uint8_t>(index, variants.size());
+    for (const auto &[encoding, variant] : variants) {
+      size_t padding = (ASSET_BUNDLE_ALIGNMENT -
+                        variant->content.size() % ASSET_BUNDLE_ALIGNMENT) %
+                       ASSET_BUNDLE_ALIGNMENT;
+      if (!write_all(fd, variant->content) ||
+          !write_all(fd, std::string(padding, '\0'))) {
+        return fail(temp_path + ": " + std::strerror(errno));
+      }
+
+      put<uint8_t>(index, static_cast<uint8_t>(encoding));
+      put<uint64_t>(index, offset);
+      put<uint64_t>(index, variant->content.size());
+      put<int64_t>(index, variant->mtime.tv_sec);
+      put<uint32_t>(index, variant->mtime.tv_nsec);
+      put<uint8_t>(index, variant->last_modified.size());
+      index += variant->last_modified;
+      put<uint8_t>(index, variant->etag.size());
+      index += variant->etag;
+      offset += variant->content.size() + padding;
+    }
+    asset_count++;
+  }
+
+  // STEP 3
+  // Index at the end, header at the start
+  std::string header;
+  header += ASSET_BUNDLE_MAGIC;
+  put<uint32_t>(header, ASSET_BUNDLE_VERSION);
+  put<uint32_t>(header, asset_count);
+  put<uint64_t>(header, offset);
+  if (!write_all(fd, index) || pwrite(fd, header.data(), header.size(), 0) !=
+                                   static_cast<ssize_t>(header.size())) {
+    return fail(temp_path + ": " + std::strerror(errno));
+  }
+  if (close(fd) == -1 ||
+      rename(temp_path.c_str(), bundle_path.c_str()) == -1) {
+    error = bundle_path.string() + ": " + std::strerror(errno);
+    unlink(temp_path.c_str());
+    return std::nullopt;
+  }
+  return asset_count;
+}
@@ -0,0 +1,212 @@
+#include <compression_cache.h>
+#include <config.h>
+#include <functional>
+#include <sys/stat.h>
+
+// Whether the stat() of a sibling file matches what an entry recorded
+static bool same_sibling(bool exists, const struct stat &file_stat,
+                         bool had_sibling, off_t size, const timespec &mtime) {
+  if (exists != had_sibling) {
+    return false;
+  }
+  return !exists || (file_stat.st_size == size &&
+                     file_stat.st_mtim.tv_sec == mtime.tv_sec &&
+                     file_stat.st_mtim.tv_nsec == mtime.tv_nsec);
+}
+
+CompressionCache::CompressionCache(size_t byte_budget,
+                                   std::chrono::milliseconds ttl,
+                                   size_t shard_count)
+    : shard_budget(byte_budget / shard_count),
+      max_entry_size(byte_budget / shard_count / 4), ttl(ttl) {
+  for (size_t i = 0; i < shard_count; i++) {
+    shards.push_back(std::make_unique<Shard>());
+  }
+}
+
+CompressionCache &CompressionCache::instance() {
+  static CompressionCache cache(COMPRESSION_CACHE_BYTES,
+                                std::chrono::milliseconds(FILE_CACHE_TTL_MS));
+  return cache;
+}
+
+CompressionCache::Shard &CompressionCache::shard_for(const std::string &key) {
+  return *shards[std::hash<std::string>{}(key) % shards.size()];
+}
+
+std::shared_ptr<const CachedFile>
+CompressionCache::get(std::string_view path,
+                      const std::shared_ptr<const CachedFile> &file,
+                      ContentEncoding encoding) {
+  // The key is built in a buffer the thread reuses, a hit doesn't allocate
+  thread_local std::string key;
+  key.assign(path);
+  key += content_encoding_extension(encoding);
+  Shard &shard = shard_for(key);
+  auto now = std::chrono::steady_clock::now();
+
+  // STEP 1
+  // Look the variant up. It is only valid for the version of the file it was
+  // made from, and within the TTL it is served without looking at the disk
+  std::shared_ptr<const CachedFile> cached;
+  bool stale = false;
+  bool had_sibling = false;
+  off_t sibling_size = 0;
+  timespec sibling_mtime{};
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && it->second->source_etag == file->etag) {
+      auto entry = it->second;
+      shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+      if (now - entry->validated_at < ttl) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return entry->variant;
+      }
+      cached = entry->variant;
+      stale = true;
+      had_sibling = entry->has_sibling;
+      sibling_size = entry->sibling_size;
+      sibling_mtime = entry->sibling_mtime;
+    }
+  }
+
+  // STEP 2
+  // The entry is older than the TTL. The file itself was already revalidated
+  // by the file cache, so only check whether a sibling appeared, changed or
+  // went away
+  if (stale) {
+    struct stat file_stat;
+    bool exists = stat(key.c_str(), &file_stat) == 0 &&
+                  S_ISREG(file_stat.st_mode);
+    if (same_sibling(exists, file_stat, had_sibling, sibling_size,
+                     sibling_mtime)) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.index.find(key);
+      if (it != shard.index.end() && it->second->variant == cached &&
+          it->second->source_etag == file->etag) {
+        it->second->validated_at = now;
+      }
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return cached;
+    }
+  }
+
+  // STEP 3
+  // Miss: find or make the variant. Two threads missing on the same file may
+  // both compress it, the second insert simply replaces the first
+  misses.fetch_add(1, std::memory_order_relaxed);
+  Entry entry = make_entry(key, file, encoding);
+  std::shared_ptr<const CachedFile> variant = entry.variant;
+
+  // Like the file cache, large siblings sent with sendfile() are not kept so
+  // the cache holds no descriptors
+  bool cacheable = shard_budget > 0 && entry.bytes <= max_entry_size &&
+                   !(variant && variant->file);
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      erase(shard, it->second);
+    }
+    insert(shard, std::move(entry));
+  }
+
+  return variant;
+}
+
+CompressionCache::Entry
+CompressionCache::make_entry(const std::string &key,
+                             const std::shared_ptr<const CachedFile> &file,
+                             ContentEncoding encoding) {
+  Entry entry;
+  entry.key = key;
+  entry.source_etag = file->etag;
+  entry.validated_at = std::chrono::steady_clock::now();
+
+  // STEP 1
+  // A precompressed sibling wins, unless it is older than the file and so
+  // was made from a previous version of it
+  auto sibling = load_file(key, SENDFILE_THRESHOLD);
+  if (sibling) {
+    entry.has_sibling = true;
+    entry.sibling_size = sibling->size;
+    entry.sibling_mtime = sibling->mtime;
+
+    bool outdated = sibling->mtime.tv_sec < file->mtime.tv_sec ||
+                    (sibling->mtime.tv_sec == file->mtime.tv_sec &&
+                     sibling->mtime.tv_nsec < file->mtime.tv_nsec);
+    if (!outdated) {
+      sibling->content_type = file->content_type;
+      sibling->encoding = encoding;
+      entry.variant = std::move(sibling);
+    }
+  }
+
+  // STEP 2
+  // Otherwise compress text files that are in memory and whose variant will
+  // fit in the cache, anything else would be compressed on every request
+  bool compress_now = !entry.variant && can_compress(encoding) &&
+                      is_compressible(file->content_type) && !file->file &&
+                      file->content.size() <= max_entry_size;
+  if (compress_now) {
+    compressions.fetch_add(1, std::memory_order_relaxed);
+    auto compressed = compress(file->content, encoding);
+
+    // Not worth it if nothing is saved, e.g. for tiny files
+    if (compressed && compressed->size() < file->content.size()) {
+      auto variant = std::make_shared<CachedFile>();
+      variant->content = std::move(*compressed);
+      variant->content_type = file->content_type;
+      variant->encoding = encoding;
+      variant->content_length = std::to_string(variant->content.size());
+
+      variant->etag = encoded_etag(file->etag, encoding);
+      variant->last_modified = file->last_modified;
+      variant->size = variant->content.size();
+      variant->mtime = file->mtime;
+      entry.variant = std::move(variant);
+    }
+  }
+
+  entry.bytes = sizeof(Entry) + key.size();
+  if (entry.variant && !entry.variant->file) {
+    entry.bytes += entry.variant->content.size();
+  }
+  return entry;
+}
+
+void CompressionCache::insert(Shard &shard, Entry entry) {
+  std::string key = entry.key;
+  shard.bytes += entry.bytes;
+  shard.lru.push_front(std::move(entry));
+  shard.index[key] = shard.lru.begin();
+
+  // Evict the least recently used variants until the shard fits its budget
+  while (shard.bytes > shard_budget && shard.lru.size() > 1) {
+    erase(shard, std::prev(shard.lru.end()));
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void CompressionCache::erase(Shard &shard, std::list<Entry>::iterator entry) {
+  shard.bytes -= entry->bytes;
+  shard.index.erase(entry->key);
+  shard.lru.erase(entry);
+}
+
+CompressionCacheStats CompressionCache::stats() const {
+  CompressionCacheStats stats;
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.compressions = compressions.load(std::memory_order_relaxed);
+  stats.evictions = evictions.load(std::memory_order_relaxed);
+
+  for (const auto &shard : shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    stats.entries += shard->lru.size();
+    stats.bytes += shard->bytes;
+  }
+
+  return stats;
+}
@@ -0,0 +1,272 @@
+#include <config.h>
+#include <logging/Logging.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+
+ServerMode SERVER_MODE = ServerMode::EPOLL;
+int LISTEN_BACKLOG = SOMAXCONN;
+int EVENT_LOOP_COUNT = std::max(1u, std::thread::hardware_concurrency());
+bool PIN_POOL_THREADS = false;
+bool USE_IO_URING = false;
+size_t FILE_CACHE_BYTES = 64 * 1024 * 1024;
+int FILE_CACHE_TTL_MS = 1000;
+size_t FILE_CACHE_MAX_FDS = 256;
+size_t FILE_CACHE_MAX_MISSING = 4096;
+size_t SENDFILE_THRESHOLD = 256 * 1024;
+size_t COMPRESSION_CACHE_BYTES = 32 * 1024 * 1024;
+size_t MAX_HEADER_SIZE = 8 * 1024;
+size_t MAX_BODY_SIZE = 64 * 1024 * 1024;
+size_t BODY_CHUNK_SIZE = 64 * 1024;
+int HEADER_TIMEOUT_MS = 10 * 1000;
+int BODY_TIMEOUT_MS = 30 * 1000;
+int IDLE_TIMEOUT_MS = 60 * 1000;
+int WRITE_TIMEOUT_MS = 30 * 1000;
+size_t MAX_CONNECTIONS = 10000;
+size_t MAX_CONNECTIONS_PER_IP = 0;
+size_t MAX_REQUESTS_PER_CONNECTION = 1000;
+std::string METRICS_PATH = "/metrics";
+std::string ACCESS_LOG_PATH;
+size_t ACCESS_LOG_MAX_BYTES = 64 * 1024 * 1024;
+int ACCESS_LOG_FILES = 5;
+const std::filesystem::path SERVER_ROOT =
+    std::filesystem::current_path() / "res";
+std::string ERROR_PAGES_DIR;
+std::string ASSET_BUNDLE_PATH;
+std::string PACK_ASSET_BUNDLE_PATH;
+
+// Parses an integer option value that must be at least min_value
+static bool parse_int(const std::string &value, int &out, int min_value) {
+  try {
+    size_t parsed_chars = 0;
+    int parsed = std::stoi(value, &parsed_chars);
+    if (parsed_chars != value.size() || parsed < min_value) {
+      return false;
+    }
+    out = parsed;
+    return true;
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+bool parse_server_option(const std::string &option) {
+  if (option.rfind("--", 0) != 0) {
+    return false;
+  }
+
+  auto equals_pos = option.find('=');
+  if (equals_pos == std::string::npos) {
+    return false;
+  }
+
+  std::string key = option.substr(2, equals_pos - 2);
+  std::string value = option.substr(equals_pos + 1);
+
+  if (key == "mode") {
+    if (value == "threadpool") {
+      SERVER_MODE = ServerMode::THREAD_POOL;
+    } else if (value == "epoll") {
+      SERVER_MODE = ServerMode::EPOLL;
+    } else if (value == "reuseport") {
+      SERVER_MODE = ServerMode::REUSEPORT;
+    } else if (value == "coroutine") {
+      SERVER_MODE = ServerMode::COROUTINE;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (key == "log-level") {
+    if (value == "info") {
+      Logging::setMinimumLevel(LoggingLevel::LogLevelInfo);
+    } else if (value == "warn") {
+      Logging::setMinimumLevel(LoggingLevel::LogLevelWarning);
+    } else if (value == "error") {
+      Logging::setMinimumLevel(LoggingLevel::LogLevelError);
+    } else if (value == "none") {
+      Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (key == "backlog") {
+    return parse_int(value, LISTEN_BACKLOG, 1);
+  }
+  if (key == "loops") {
+    return parse_int(value, EVENT_LOOP_COUNT, 1);
+  }
+  if (key == "pin-threads") {
+    int pin;
+    if (!parse_int(value, pin, 0) || pin > 1) {
+      return false;
+    }
+    PIN_POOL_THREADS = pin == 1;
+    return true;
+  }
+  if (key == "io-uring") {
+    int enabled;
+    if (!parse_int(value, enabled, 0) || enabled > 1) {
+      return false;
+    }
+    USE_IO_URING = enabled == 1;
+    return true;
+  }
+  if (key == "file-cache-mb") {
+    int megabytes;
+    if (!parse_int(value, megabytes, 0)) {
+      return false;
+    }
+    FILE_CACHE_BYTES = static_cast<size_t>(megabytes) * 1024 * 1024;
+    return true;
+  }
+  if (key == "file-cache-ttl-ms") {
+    return parse_int(value, FILE_CACHE_TTL_MS, 0);
+  }
+  if (key == "file-cache-fds") {
+    int count;
+    if (!parse_int(value, count, 0)) {
+      return false;
+    }
+    FILE_CACHE_MAX_FDS = count;
+    return true;
+  }
+  if (key == "file-cache-missing") {
+    int count;
+    if (!parse_int(value, count, 0)) {
+      return false;
+    }
+    FILE_CACHE_MAX_MISSING = count;
+    return true;
+  }
+  if (key == "sendfile-threshold-kb") {
+    int kilobytes;
+    if (!parse_int(value, kilobytes, 0)) {
+      return false;
+    }
+    SENDFILE_THRESHOLD = static_cast<size_t>(kilobytes) * 1024;
+    return true;
+  }
+  if (key == "compression-cache-mb") {
+    int megabytes;
+    if (!parse_int(value, megabytes, 0)) {
+      return false;
+    }
+    COMPRESSION_CACHE_BYTES = static_cast<size_t>(megabytes) * 1024 * 1024;
+    return true;
+  }
+  if (key == "max-header-kb") {
+    int kilobytes;
+    if (!parse_int(value, kilobytes, 1)) {
+      return false;
+    }
+    MAX_HEADER_SIZE = static_cast<size_t>(kilobytes) * 1024;
+    return true;
+  }
+  if (key == "max-body-kb") {
+    int kilobytes;
+    if (!parse_int(value, kilobytes, 0)) {
+      return false;
+    }
+    MAX_BODY_SIZE = static_cast<size_t>(kilobytes) * 1024;
+    return true;
+  }
+  if (key == "body-chunk-kb") {
+    int kilobytes;
+    if (!parse_int(value, kilobytes, 1)) {
+      return false;
+    }
+    BODY_CHUNK_SIZE = static_cast<size_t>(kilobytes) * 1024;
+    return true;
+  }
+  if (key == "header-timeout-ms") {
+    return parse_int(value, HEADER_TIMEOUT_MS, 0);
+  }
+  if (key == "body-timeout-ms") {
+    return parse_int(value, BODY_TIMEOUT_MS, 0);
+  }
+  if (key == "idle-timeout-ms") {
+    return parse_int(value, IDLE_TIMEOUT_MS, 0);
+  }
+  if (key == "write-timeout-ms") {
+    return parse_int(value, WRITE_TIMEOUT_MS, 0);
+  }
+  if (key == "max-connections") {
+    int count;
+    if (!parse_int(value, count, 0)) {
+      return false;
+    }
+    MAX_CONNECTIONS = count;
+    return true;
+  }
+  if (key == "max-connections-per-ip") {
+    int count;
+    if (!parse_int(value, count, 0)) {
+      return false;
+    }
+    MAX_CONNECTIONS_PER_IP = count;
+    return true;
+  }
+  if (key == "max-requests-per-connection") {
+    int count;
+    if (!parse_int(value, count, 0)) {
+      return false;
+    }
+    MAX_REQUESTS_PER_CONNECTION = count;
+    return true;
+  }
+  if (key == "metrics-path") {
+    // Has to be a route, or nothing at all
+    if (!value.empty() && value.front() != '/') {
+      return false;
+    }
+    METRICS_PATH = value;
+    return true;
+  }
+  if (key == "access-log") {
+    ACCESS_LOG_PATH = value;
+    return true;
+  }
+  if (key == "access-log-max-mb") {
+    int megabytes;
+    if (!parse_int(value, megabytes, 1)) {
+      return false;
+    }
+    ACCESS_LOG_MAX_BYTES = static_cast<size_t>(megabytes) * 1024 * 1024;
+    return true;
+  }
+  if (key == "access-log-files") {
+    return parse_int(value, ACCESS_LOG_FILES, 0);
+  }
+  if (key == "error-pages") {
+    ERROR_PAGES_DIR = value;
+    return true;
+  }
+  if (key == "asset-bundle") {
+    ASSET_BUNDLE_PATH = value;
+    return !value.empty();
+  }
+  if (key == "pack-asset-bundle") {
+    PACK_ASSET_BUNDLE_PATH = value;
+    return !value.empty();
+  }
+
+  return false;
+}
+
+const char *server_mode_name(ServerMode mode) {
+  switch (mode) {
+  case ServerMode::THREAD_POOL:
+    return "threadpool";
+  case ServerMode::EPOLL:
+    return "epoll";
+  case ServerMode::REUSEPORT:
+    return "reuseport";
+  case ServerMode::COROUTINE:
+    return "coroutine";
+  }
+  return "unknown";
+}
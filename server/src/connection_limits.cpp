@@ -0,0 +1,52 @@
+#include <connection_limits.h>
+#include <config.h>
+
+ConnectionLimits &ConnectionLimits::instance() {
+  static ConnectionLimits limits;
+  return limits;
+}
+
+bool ConnectionLimits::admit(const in_addr &address) {
+  // Without a per address limit there is nothing to look up
+  if (MAX_CONNECTIONS_PER_IP == 0) {
+    total.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t &count = per_address[address.s_addr];
+  if (count >= MAX_CONNECTIONS_PER_IP) {
+    return false;
+  }
+  count++;
+  total.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ConnectionLimits::release(const in_addr &address) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (MAX_CONNECTIONS_PER_IP != 0) {
+      auto it = per_address.find(address.s_addr);
+      if (it != per_address.end() && --it->second == 0) {
+        per_address.erase(it);
+      }
+    }
+    total.fetch_sub(1, std::memory_order_relaxed);
+  }
+  released.notify_one();
+}
+
+bool ConnectionLimits::full() const {
+  return MAX_CONNECTIONS != 0 &&
+         total.load(std::memory_order_relaxed) >= MAX_CONNECTIONS;
+}
+
+void ConnectionLimits::wait_until_not_full() {
+  std::unique_lock<std::mutex> lock(mutex);
+  released.wait(lock, [this] { return !full(); });
+}
+
+size_t ConnectionLimits::open() const {
+  return total.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,279 @@
+#include <content_encoding.h>
+#include <util.h>
+#include <array>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Compression levels. Every file version is compressed once and then served
+// from the cache, so these lean towards ratio over speed, short of the
+// slowest levels which would stall a worker for too long on a big file
+static const int GZIP_LEVEL = 9;
+static const int BROTLI_QUALITY = 9;
+static const int ZSTD_LEVEL = 15;
+
+const char *content_encoding_name(ContentEncoding encoding) {
+  switch (encoding) {
+  case ContentEncoding::BROTLI:
+    return "br";
+  case ContentEncoding::ZSTD:
+    return "zstd";
+  case ContentEncoding::GZIP:
+    return "gzip";
+  case ContentEncoding::IDENTITY:
+    break;
+  }
+  return "identity";
+}
+
+const char *content_encoding_extension(ContentEncoding encoding) {
+  switch (encoding) {
+  case ContentEncoding::BROTLI:
+    return ".br";
+  case ContentEncoding::ZSTD:
+    return ".zst";
+  case ContentEncoding::GZIP:
+    return ".gz";
+  case ContentEncoding::IDENTITY:
+    break;
+  }
+  return "";
+}
+
+std::string encoded_etag(std::string_view etag, ContentEncoding encoding) {
+  std::string tagged(etag.substr(0, etag.size() - 1));
+  tagged += '-';
+  tagged += content_encoding_name(encoding);
+  tagged += '"';
+  return tagged;
+}
+
+bool can_compress(ContentEncoding encoding) {
+  switch (encoding) {
+#ifdef HAVE_BROTLI
+  case ContentEncoding::BROTLI:
+    return true;
+#endif
+#ifdef HAVE_ZSTD
+  case ContentEncoding::ZSTD:
+    return true;
+#endif
+#ifdef HAVE_ZLIB
+  case ContentEncoding::GZIP:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+bool is_compressible(HTTPContentType content_type) {
+  switch (content_type) {
+  case HTTPContentType::HTML:
+  case HTTPContentType::TEXT:
+  case HTTPContentType::JSON:
+  case HTTPContentType::JS:
+  case HTTPContentType::CSS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+// Parses a qvalue ("0", "0.5", "1.000") into thousandths
+// Returns -1 if it is malformed
+static int parse_qvalue(std::string_view text) {
+  if (text.empty() || (text[0] != '0' && text[0] != '1')) {
+    return -1;
+  }
+  int value = (text[0] - '0') * 1000;
+  if (text.size() == 1) {
+    return value;
+  }
+  if (text[1] != '.' || text.size() > 5) {
+    return -1;
+  }
+
+  int scale = 100;
+  for (char c : text.substr(2)) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    value += (c - '0') * scale;
+    scale /= 10;
+  }
+  return value > 1000 ? -1 : value;
+}
+
+std::pmr::vector<ContentEncoding>
+parse_accept_encoding(std::string_view value,
+                      std::pmr::memory_resource *memory) {
+  // Codings in server preference order with the qvalue the client gave them
+  // -1 means the client didn't mention the coding
+  static constexpr std::array<ContentEncoding, 3> codings = {
+      ContentEncoding::BROTLI, ContentEncoding::ZSTD, ContentEncoding::GZIP};
+  std::array<int, 3> qvalues = {-1, -1, -1};
+  int wildcard = -1;
+
+  // STEP 1
+  // Each element is "<coding>" or "<coding>;q=<qvalue>"
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    std::string_view element = value.substr(0, comma);
+    value = comma == std::string_view::npos ? std::string_view()
+                                            : value.substr(comma + 1);
+
+    size_t semicolon = element.find(';');
+    std::string_view coding = trim(element.substr(0, semicolon));
+    int qvalue = 1000;
+    if (semicolon != std::string_view::npos) {
+      std::string_view parameter = trim(element.substr(semicolon + 1));
+      if (parameter.size() < 2 || !iequals(parameter.substr(0, 2), "q=")) {
+        continue;
+      }
+      qvalue = parse_qvalue(parameter.substr(2));
+      if (qvalue < 0) {
+        continue;
+      }
+    }
+
+    if (coding == "*") {
+      wildcard = qvalue;
+      continue;
+    }
+    for (size_t i = 0; i < codings.size(); i++) {
+      if (iequals(coding, content_encoding_name(codings[i])) ||
+          (codings[i] == ContentEncoding::GZIP && iequals(coding, "x-gzip"))) {
+        qvalues[i] = qvalue;
+      }
+    }
+  }
+
+  // STEP 2
+  // Order the acceptable codings by qvalue, ties go to the server preference
+  // which is the order of the enum. With at most three codings an insertion
+  // sort does it in place
+  std::array<std::pair<int, ContentEncoding>, 3> acceptable;
+  size_t acceptable_count = 0;
+  for (size_t i = 0; i < codings.size(); i++) {
+    int qvalue = qvalues[i] >= 0 ? qvalues[i] : wildcard;
+    if (qvalue <= 0) {
+      continue;
+    }
+    std::pair<int, ContentEncoding> entry{qvalue, codings[i]};
+    size_t j = acceptable_count++;
+    for (; j > 0 && (acceptable[j - 1].first < entry.first ||
+                     (acceptable[j - 1].first == entry.first &&
+                      entry.second < acceptable[j - 1].second));
+         j--) {
+      acceptable[j] = acceptable[j - 1];
+    }
+    acceptable[j] = entry;
+  }
+
+  std::pmr::vector<ContentEncoding> accepted(memory);
+  accepted.reserve(acceptable_count);
+  for (size_t i = 0; i < acceptable_count; i++) {
+    accepted.push_back(acceptable[i].second);
+  }
+  return accepted;
+}
+
+#ifdef HAVE_ZLIB
+static std::optional<std::string> compress_gzip(std::string_view data) {
+  z_stream stream{};
+  // 15 window bits + 16 selects the gzip wrapper instead of zlib
+  if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return std::nullopt;
+  }
+
+  std::string output(deflateBound(&stream, data.size()), '\0');
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef *>(output.data());
+  stream.avail_out = output.size();
+
+  int result = deflate(&stream, Z_FINISH);
+  size_t compressed_size = stream.total_out;
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    return std::nullopt;
+  }
+
+  output.resize(compressed_size);
+  return output;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+static std::optional<std::string> compress_brotli(std::string_view data) {
+  size_t compressed_size = BrotliEncoderMaxCompressedSize(data.size());
+  if (compressed_size == 0) {
+    return std::nullopt;
+  }
+
+  std::string output(compressed_size, '\0');
+  if (!BrotliEncoderCompress(
+          BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+          reinterpret_cast<const uint8_t *>(data.data()), &compressed_size,
+          reinterpret_cast<uint8_t *>(output.data()))) {
+    return std::nullopt;
+  }
+
+  output.resize(compressed_size);
+  return output;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static std::optional<std::string> compress_zstd(std::string_view data) {
+  std::string output(ZSTD_compressBound(data.size()), '\0');
+  size_t compressed_size = ZSTD_compress(output.data(), output.size(),
+                                         data.data(), data.size(), ZSTD_LEVEL);
+  if (ZSTD_isError(compressed_size)) {
+    return std::nullopt;
+  }
+
+  output.resize(compressed_size);
+  return output;
+}
+#endif
+
+std::optional<std::string> compress(std::string_view data,
+                                    ContentEncoding encoding) {
+  switch (encoding) {
+#ifdef HAVE_BROTLI
+  case ContentEncoding::BROTLI:
+    return compress_brotli(data);
+#endif
+#ifdef HAVE_ZSTD
+  case ContentEncoding::ZSTD:
+    return compress_zstd(data);
+#endif
+#ifdef HAVE_ZLIB
+  case ContentEncoding::GZIP:
+    return compress_gzip(data);
+#endif
+  default:
+    return std::nullopt;
+  }
+}
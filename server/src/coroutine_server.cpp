@@ -0,0 +1,144 @@
+#include <coroutine_server.h>
+#include <config.h>
+#include <connection_limits.h>
+#include <http_connection.h>
+#include <metrics.h>
+#include <scheduler.h>
+#include <logging/Logging.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+// Size of the buffer each read() of a client socket goes into. It is shared
+// by the connections of a scheduler thread, the bytes are appended to the
+// connection's own buffer before any other coroutine runs, so an idle
+// connection holds no read buffer
+static const size_t READ_CHUNK_SIZE = 16 * 1024;
+static thread_local char read_chunk[READ_CHUNK_SIZE];
+
+AsyncTask<void>
+serve_connection(sockaddr_in client_address, int client_socket_fd,
+                 std::chrono::steady_clock::time_point accepted) {
+  Logging logger;
+  logger.setClassName("serve_connection");
+
+  HTTPConnection connection(client_address, accepted);
+  logger.info("Connection from: {}", connection.client());
+
+  {
+    AsyncSocket socket(client_socket_fd);
+    OutputQueue &output = connection.output();
+
+    while (true) {
+      // STEP 1
+      // Answer every complete request already buffered, in order, and send
+      // their responses together
+      connection.process();
+
+      // A body that has to be streamed is read right here. One that stops
+      // arriving ends the request, it is then answered as one that wasn't
+      // read to its end
+      if (connection.streaming()) {
+        if (!co_await socket.send(output, WRITE_TIMEOUT_MS)) {
+          break;
+        }
+        if (connection.start_body() &&
+            !co_await socket.send(output, WRITE_TIMEOUT_MS)) {
+          break;
+        }
+        while (!connection.body_complete()) {
+          ssize_t bytes_read = co_await socket.read(
+              read_chunk, READ_CHUNK_SIZE, BODY_TIMEOUT_MS);
+          if (bytes_read <= 0) {
+            break;
+          }
+          connection.receive_body(read_chunk, bytes_read);
+        }
+        connection.finish_body();
+        continue;
+      }
+
+      bool sent = co_await socket.send(output, WRITE_TIMEOUT_MS);
+      connection.record_first_byte();
+      if (!sent || !connection.keep_alive()) {
+        break;
+      }
+
+      // STEP 2
+      // Wait for more of the next request
+      int timeout_ms = connection.read_timeout_ms();
+      ssize_t bytes_read = -ETIMEDOUT;
+      if (timeout_ms >= 0) {
+        bytes_read =
+            co_await socket.read(read_chunk, READ_CHUNK_SIZE, timeout_ms);
+      }
+      if (bytes_read == -ETIMEDOUT) {
+        if (connection.timed_out()) {
+          co_await socket.send(output, WRITE_TIMEOUT_MS);
+        }
+        break;
+      }
+      if (bytes_read <= 0) {
+        break;
+      }
+      connection.received(read_chunk, bytes_read);
+    }
+  }
+
+  // Closing a socket with unread bytes makes the kernel reset the
+  // connection, which can destroy a 431/413 the client hasn't read yet.
+  // Discard whatever already arrived first
+  while (recv(client_socket_fd, read_chunk, READ_CHUNK_SIZE, MSG_DONTWAIT) >
+         0) {
+  }
+
+  logger.info("Client {} closed connection", connection.client());
+  close(client_socket_fd);
+}
+
+// A connection admitted by the connection limits, released once served
+static AsyncTask<void>
+serve_admitted_connection(sockaddr_in client_address, int client_socket_fd,
+                          std::chrono::steady_clock::time_point accepted) {
+  co_await serve_connection(client_address, client_socket_fd, accepted);
+  ConnectionLimits::instance().release(client_address.sin_addr);
+}
+
+AsyncTask<void> accept_connections(int listen_fd) {
+  Logging logger;
+  logger.setClassName("accept_connections");
+
+  Scheduler &scheduler = *Scheduler::current();
+  ConnectionLimits &limits = ConnectionLimits::instance();
+  AsyncSocket listener(listen_fd);
+  while (true) {
+    // At the connection limit new connections wait in the kernel accept
+    // queue until one closes, here or on another scheduler
+    if (limits.full()) {
+      co_await scheduler.sleep(TimerWheel::TICK);
+      continue;
+    }
+
+    sockaddr_in client_address{};
+    int client_socket_fd = co_await listener.accept(client_address);
+    if (client_socket_fd < 0) {
+      // Running out of file descriptors is retried after a pause instead of
+      // spinning
+      logger.warn(std::string("accept() failed: ") +
+                  strerror(-client_socket_fd));
+      co_await scheduler.sleep(TimerWheel::TICK);
+      continue;
+    }
+
+    if (!limits.admit(client_address.sin_addr)) {
+      Metrics::count(MetricCounter::CONNECTIONS_REFUSED);
+      close(client_socket_fd);
+      continue;
+    }
+    Metrics::count(MetricCounter::CONNECTIONS_ACCEPTED);
+    scheduler.spawn(serve_admitted_connection(
+        client_address, client_socket_fd, std::chrono::steady_clock::now()));
+  }
+}
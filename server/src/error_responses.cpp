@@ -0,0 +1,169 @@
+#include <error_responses.h>
+#include <http_response_builder.h>
+#include <util.h>
+#include <string>
+
+// Built-in page of every error status
+static std::string_view default_page(HTTPStatus status) {
+  switch (status) {
+  case HTTPStatus::BAD_REQUEST:
+    return "<!DOCTYPE html><html><head><title>400 Bad "
+           "Request</title></head><body><h1>400 Bad Request</h1><p>Your "
+           "browser sent a request that this server could not "
+           "understand.</p></body></html>";
+  case HTTPStatus::FORBIDDEN:
+    return "<!DOCTYPE html><html><head><title>403 "
+           "Forbidden</title></head><body><h1>403 Forbidden</h1><p>You don't "
+           "have permission to access this resource.</p></body></html>";
+  case HTTPStatus::NOT_FOUND:
+    return "<!DOCTYPE html><html><head><title>404 Not "
+           "Found</title></head><body><h1>404 Not Found</h1><p>The requested "
+           "resource could not be found on this server.</p></body></html>";
+  case HTTPStatus::UNSUPPORTED_METHOD:
+    return "<!DOCTYPE html><html><head><title>405 Method Not "
+           "Allowed</title></head><body><h1>405 Method Not Allowed</h1><p>The "
+           "request method is not supported for this resource.</p></body>"
+           "</html>";
+  case HTTPStatus::PAYLOAD_TOO_LARGE:
+    return "<!DOCTYPE html><html><head><title>413 Content Too "
+           "Large</title></head><body><h1>413 Content Too Large</h1><p>The "
+           "request body is larger than the server accepts.</p></body></html>";
+  case HTTPStatus::UNSUPPORTED_MEDIA_TYPE:
+    return "<!DOCTYPE html><html><head><title>415 Unsupported Media "
+           "Type</title></head><body><h1>415 Unsupported Media Type</h1><p>"
+           "The request body is not in a format this resource accepts.</p>"
+           "</body></html>";
+  case HTTPStatus::REQUEST_TIMEOUT:
+    return "<!DOCTYPE html><html><head><title>408 Request "
+           "Timeout</title></head><body><h1>408 Request Timeout</h1><p>The "
+           "request was not received in time.</p></body></html>";
+  case HTTPStatus::RANGE_NOT_SATISFIABLE:
+    return "<!DOCTYPE html><html><head><title>416 Range Not "
+           "Satisfiable</title></head><body><h1>416 Range Not Satisfiable</h1>"
+           "<p>None of the requested ranges lie within the resource.</p>"
+           "</body></html>";
+  case HTTPStatus::REQUEST_HEADER_FIELDS_TOO_LARGE:
+    return "<!DOCTYPE html><html><head><title>431 Request Header Fields Too "
+           "Large</title></head><body><h1>431 Request Header Fields Too "
+           "Large</h1><p>The request headers are larger than the server "
+           "accepts.</p></body></html>";
+  case HTTPStatus::INTERNAL_SERVER_ERROR:
+    return "<!DOCTYPE html><html><head><title>500 Internal Server "
+           "Error</title></head><body><h1>500 Internal Server Error</h1><p>"
+           "The server could not complete your request.</p></body></html>";
+  case HTTPStatus::NOT_IMPLEMENTED:
+    return "<!DOCTYPE html><html><head><title>501 Not "
+           "Implemented</title></head><body><h1>501 Not Implemented</h1><p>"
+           "The server does not support the functionality required to "
+           "fulfil the request.</p></body></html>";
+  default:
+    return "";
+  }
+}
+
+ErrorResponses &ErrorResponses::instance() {
+  static ErrorResponses responses;
+  return responses;
+}
+
+ErrorResponses::ErrorResponses() {
+  for (size_t status = 0; status < STATUS_COUNT; status++) {
+    pages[status] = default_page(static_cast<HTTPStatus>(status));
+  }
+  rebuild();
+}
+
+int ErrorResponses::load_pages(const std::filesystem::path &directory) {
+  int loaded = 0;
+  for (size_t status = 0; status < STATUS_COUNT; status++) {
+    if (pages[status].empty()) {
+      continue;
+    }
+    std::string name =
+        std::to_string(http_status_code(static_cast<HTTPStatus>(status))) +
+        ".html";
+    auto content = read_file((directory / name).string());
+    if (content.has_value() && !content->empty()) {
+      pages[status] = std::move(*content);
+      loaded++;
+    }
+  }
+  rebuild();
+  return loaded;
+}
+
+std::string_view ErrorResponses::page(HTTPStatus status) const {
+  if (static_cast<size_t>(status) >= STATUS_COUNT) {
+    return "";
+  }
+  return pages[status];
+}
+
+// The headers are the ones HTTPResponseBuilder sends for an error page, in
+// the same order
+void ErrorResponses::rebuild() {
+  static const std::string_view versions[2] = {"HTTP/1.0", "HTTP/1.1"};
+
+  for (size_t status = 0; status < STATUS_COUNT; status++) {
+    for (int http11 = 0; http11 < 2; http11++) {
+      for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        Prebuilt &entry = prebuilt[status][http11][keep_alive];
+        const std::string &body = pages[status];
+        if (body.empty()) {
+          entry = Prebuilt();
+          continue;
+        }
+
+        std::string bytes;
+        bytes += versions[http11];
+        bytes += " ";
+        bytes += http_status_line(static_cast<HTTPStatus>(status));
+        bytes += "\r\nConnection: ";
+        bytes += keep_alive ? "keep-alive" : "close";
+        bytes += "\r\nContent-Length: " + std::to_string(body.size());
+        bytes += "\r\nContent-Type: ";
+        bytes += content_type_name(HTTPContentType::HTML);
+        bytes += "\r\nDate: ";
+        entry.date_offset = bytes.size();
+        bytes.append(HTTP_DATE_LENGTH, ' ');
+        bytes += "\r\nServer: ";
+        bytes += SERVER_NAME;
+        bytes += "\r\n\r\n";
+        entry.head_length = bytes.size();
+        bytes += body;
+        entry.bytes = std::make_shared<const std::string>(std::move(bytes));
+      }
+    }
+  }
+}
+
+bool ErrorResponses::build(HTTPStatus status, std::string_view version,
+                           bool keep_alive, HTTPResponse &response) const {
+  if (static_cast<size_t>(status) >= STATUS_COUNT ||
+      (version != "HTTP/1.0" && version != "HTTP/1.1")) {
+    return false;
+  }
+  const Prebuilt &entry = prebuilt[status][version == "HTTP/1.1"][keep_alive];
+  if (!entry.bytes) {
+    return false;
+  }
+
+  std::string_view bytes = *entry.bytes;
+  char date[HTTP_DATE_LENGTH];
+  current_http_date(date);
+
+  // A page that fits goes out with the head, copied like it. A bigger one is
+  // borrowed from the prebuilt response
+  size_t copied = bytes.size() <= ResponseHead::INLINE_CAPACITY
+                      ? bytes.size()
+                      : entry.head_length;
+  size_t date_end = entry.date_offset + HTTP_DATE_LENGTH;
+  response.head.append(bytes.substr(0, entry.date_offset));
+  response.head.append(std::string_view(date, HTTP_DATE_LENGTH));
+  response.head.append(bytes.substr(date_end, copied - date_end));
+  if (copied < bytes.size()) {
+    response.append(bytes.substr(copied), entry.bytes);
+  }
+  response.keep_alive = keep_alive;
+  return true;
+}
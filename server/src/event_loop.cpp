@@ -0,0 +1,647 @@
+#include <event_loop.h>
+#include <config.h>
+#include <connection_limits.h>
+#include <metrics.h>
+#include <server.h>
+#include <streamed_request.h>
+#include <thread_pool.h>
+#include <util.h>
+#include <logging/Logging.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <io_uring_loop.h>
+#endif
+
+// Maximum number of events handled per epoll_wait() call
+static const int MAX_EVENTS = 1024;
+
+// Size of the stack buffer used to drain a readable socket
+static const size_t READ_CHUNK_SIZE = 16 * 1024;
+
+// Maximum number of pipelined requests processed as one batch
+static const size_t MAX_PIPELINED_REQUESTS = 32;
+
+// Defined here, where StreamedRequest is a complete type
+EventLoop::Connection::~Connection() = default;
+
+EventLoop::EventLoop(int listen_fd, ThreadPool *pool)
+    : listen_fd_(listen_fd), pool_(pool) {
+  // Pool threads signal finished responses through this eventfd so that the
+  // loop thread wakes up and writes them out
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_fd_ == -1) {
+    perror("eventfd() failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+EventLoop::~EventLoop() {
+  for (auto &[fd, connection] : connections_) {
+    close(fd);
+    ConnectionLimits::instance().release(connection->address.sin_addr);
+  }
+  close(wakeup_fd_);
+  if (epoll_fd_ != -1) {
+    close(epoll_fd_);
+  }
+}
+
+std::unique_ptr<EventLoop> EventLoop::create(int listen_fd, ThreadPool *pool) {
+#ifdef HAVE_IO_URING
+  if (USE_IO_URING && IoUringLoop::supported()) {
+    return std::make_unique<IoUringLoop>(listen_fd, pool);
+  }
+#endif
+  if (USE_IO_URING) {
+    Logging logger;
+    logger.setClassName("EventLoop::create");
+    logger.warn("io_uring is not available, falling back to epoll");
+  }
+  return std::make_unique<EventLoop>(listen_fd, pool);
+}
+
+void EventLoop::run() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    perror("epoll_create1() failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // The listening socket has to be non-blocking as well, otherwise draining
+  // the accept queue in edge-triggered mode would block on the last accept()
+  if (!set_nonblocking(listen_fd_)) {
+    perror("Failed to make the listening socket non-blocking");
+    exit(EXIT_FAILURE);
+  }
+
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = listen_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) == -1) {
+    perror("epoll_ctl() failed to register the listening socket");
+    exit(EXIT_FAILURE);
+  }
+
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = wakeup_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event) == -1) {
+    perror("epoll_ctl() failed to register the wakeup eventfd");
+    exit(EXIT_FAILURE);
+  }
+
+  epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    // Only deadlines and a paused listener need the loop to wake up without
+    // an event, once per tick of the timer wheel
+    int timeout = timers_.empty() && !accept_paused_
+                      ? -1
+                      : timers_.until_next_tick();
+    int ready = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait() failed");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == listen_fd_) {
+        accept_connections();
+      } else if (fd == wakeup_fd_) {
+        uint64_t counter;
+        while (read(wakeup_fd_, &counter, sizeof(counter)) > 0) {
+        }
+        drain_completions();
+      } else {
+        auto it = connections_.find(fd);
+        if (it != connections_.end()) {
+          handle_event(*it->second, events[i].events);
+        }
+      }
+    }
+
+    timers_.expire([this](TimerWheel::Timer &timer) {
+      handle_timeout(static_cast<Connection &>(timer));
+    });
+
+    // Connections closed since, here or by another loop, make room for the
+    // ones waiting in the accept queue
+    if (accept_paused_ && !ConnectionLimits::instance().full()) {
+      resume_accepting();
+    }
+  }
+}
+
+void EventLoop::accept_connections() {
+  Logging logger;
+  logger.setClassName("EventLoop::accept_connections");
+
+  ConnectionLimits &limits = ConnectionLimits::instance();
+
+  // Edge-triggered: keep accepting until the backlog is empty
+  while (true) {
+    // At the limit the rest waits in the accept queue
+    if (limits.full()) {
+      pause_accepting();
+      return;
+    }
+
+    sockaddr_in client_address;
+    socklen_t client_address_len = sizeof(client_address);
+    int client_socket_fd =
+        accept4(listen_fd_, (sockaddr *)(&client_address), &client_address_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Running out of file descriptors must not take the server down,
+        // the pending connections are retried on the next accept event
+        logger.warn(std::string("accept() failed: ") + strerror(errno));
+      }
+      return;
+    }
+
+    Connection *connection = add_connection(client_socket_fd, client_address);
+    if (connection == nullptr) {
+      continue;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = client_socket_fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket_fd, &event) == -1) {
+      logger.warn(std::string("epoll_ctl() failed to register client: ") +
+                  strerror(errno));
+      close_connection(*connection);
+    }
+  }
+}
+
+EventLoop::Connection *EventLoop::add_connection(int fd,
+                                                 const sockaddr_in &address) {
+  Logging logger;
+  logger.setClassName("EventLoop::add_connection");
+
+  char client_ip_addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address.sin_addr, client_ip_addr,
+            sizeof(client_ip_addr));
+
+  if (!ConnectionLimits::instance().admit(address.sin_addr)) {
+    logger.info("Refused connection from {}, too many from this address",
+                client_ip_addr);
+    Metrics::count(MetricCounter::CONNECTIONS_REFUSED);
+    close(fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<Connection> connection = new_connection();
+  connection->fd = fd;
+  connection->address = address;
+  connection->accepted = std::chrono::steady_clock::now();
+  connection->client = std::string(client_ip_addr) + ":" +
+                       std::to_string(ntohs(address.sin_port));
+
+  logger.info("Connection from: {}", connection->client);
+  Metrics::count(MetricCounter::CONNECTIONS_ACCEPTED);
+  update_deadline(*connection);
+
+  Connection *added = connection.get();
+  connections_[fd] = std::move(connection);
+  return added;
+}
+
+std::unique_ptr<EventLoop::Connection> EventLoop::new_connection() {
+  return std::make_unique<Connection>();
+}
+
+// The listener is taken off epoll rather than left unread, so the loop
+// doesn't wake up for connections it can't take
+void EventLoop::pause_accepting() {
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr) == -1) {
+    return;
+  }
+  accept_paused_ = true;
+
+  Logging logger;
+  logger.setClassName("EventLoop::pause_accepting");
+  logger.warn("Connection limit reached, accepting paused");
+}
+
+void EventLoop::resume_accepting() {
+  // Registering a listener with connections queued reports it readable
+  // right away, even edge-triggered, so they are accepted on the next wait
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = listen_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) == -1) {
+    return;
+  }
+  accept_paused_ = false;
+}
+
+void EventLoop::handle_event(Connection &connection, uint32_t events) {
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    read_available(connection);
+  }
+  if (events & EPOLLOUT) {
+    // The client made room in the socket buffer, it is reading
+    connection.progressed = true;
+    flush(connection);
+  }
+
+  process_connection(connection);
+}
+
+void EventLoop::read_available(Connection &connection) {
+  char buffer[READ_CHUNK_SIZE];
+
+  // A client pipelining faster than we answer could make the buffer grow
+  // without bounds. Past the size of the largest buffered request we stop
+  // reading, process_connection() resumes once the buffer has been drained.
+  // Larger bodies are streamed out of the buffer as they arrive
+  const size_t read_limit = MAX_HEADER_SIZE + BODY_CHUNK_SIZE;
+
+  while (!connection.peer_closed) {
+    if (connection.keep_alive && connection.read_buffer.size() >= read_limit) {
+      connection.read_paused = true;
+      return;
+    }
+
+    ssize_t bytes_read = read(connection.fd, buffer, sizeof(buffer));
+    if (bytes_read > 0) {
+      // Once the connection is going to close, whatever else the client
+      // sends is never processed, so it isn't kept either
+      if (connection.keep_alive) {
+        connection.read_buffer.append(buffer, bytes_read);
+      }
+      connection.progressed = true;
+    } else if (bytes_read == 0) {
+      connection.peer_closed = true;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      connection.peer_closed = true;
+      connection.keep_alive = false;
+    }
+  }
+}
+
+void EventLoop::process_connection(Connection &connection) {
+  while (true) {
+    dispatch_requests(connection);
+
+    // Reading was paused on a full buffer. With edge-triggered epoll no new
+    // event arrives for the bytes still waiting in the socket, so resume
+    // here as soon as the buffer has room again
+    if (!connection.read_paused ||
+        connection.read_buffer.size() >= MAX_HEADER_SIZE + BODY_CHUNK_SIZE) {
+      break;
+    }
+    connection.read_paused = false;
+    resume_reading(connection);
+  }
+
+  update_deadline(connection);
+  maybe_close(connection);
+}
+
+void EventLoop::dispatch_requests(Connection &connection) {
+  // Requests on one connection are processed a batch at a time so that the
+  // responses go out in the order the requests came in. We also wait for the
+  // previous batch to be written, which stops a client that never reads
+  // from making us buffer unbounded amounts of responses
+  while (!connection.busy && connection.keep_alive &&
+         connection.output.empty()) {
+    // A request whose body is being streamed takes every byte until its body
+    // is complete
+    if (connection.streamed) {
+      if (!feed_streamed_request(connection)) {
+        return;
+      }
+      continue;
+    }
+
+    // STEP 1
+    // Frame every complete request in the buffer, up to a batch limit. A
+    // pipelining client gets all of them answered with one write. The batch
+    // ends early at the last request the connection is allowed
+    size_t batch_limit = MAX_PIPELINED_REQUESTS;
+    if (MAX_REQUESTS_PER_CONNECTION > 0) {
+      batch_limit = std::min(batch_limit,
+                             MAX_REQUESTS_PER_CONNECTION - connection.requests);
+    }
+    std::vector<size_t> lengths;
+    size_t total_length = 0;
+    size_t length = 0;
+    FrameResult result = FrameResult::INCOMPLETE;
+    while (lengths.size() < batch_limit) {
+      result = frame_http_request(
+          std::string_view(connection.read_buffer).substr(total_length),
+          MAX_HEADER_SIZE, MAX_BODY_SIZE, BODY_CHUNK_SIZE, length);
+      if (result != FrameResult::COMPLETE) {
+        break;
+      }
+      lengths.push_back(length);
+      total_length += length;
+    }
+
+    // STEP 2
+    // A request with a streamed body starts once the requests in front of it
+    // have been answered. Its body is handled on this thread as it arrives,
+    // which only costs a write() to the upload file per read
+    if (lengths.empty() && result == FrameResult::BODY_FOLLOWS) {
+      connection.streamed = std::make_unique<StreamedRequest>(
+          connection.read_buffer.substr(0, length));
+      connection.read_buffer.erase(0, length);
+      if (++connection.requests == MAX_REQUESTS_PER_CONNECTION) {
+        connection.streamed->setConnectionClose();
+      }
+
+      if (connection.streamed->expectsContinue()) {
+        HTTPResponse interim;
+        interim.keep_alive = true;
+        interim.append(std::string(CONTINUE_RESPONSE));
+        connection.output.push(std::move(interim));
+        flush(connection);
+      }
+      continue;
+    }
+
+    // A request that can never be framed gets its 431/413/400/501 once the
+    // requests in front of it have been answered
+    if (lengths.empty()) {
+      if (result != FrameResult::INCOMPLETE) {
+        connection.read_buffer.clear();
+        std::vector<HTTPResponse> responses;
+        responses.push_back(frame_error_response(result));
+        apply_responses(connection, std::move(responses));
+      }
+      return;
+    }
+
+    std::string batch = connection.read_buffer.substr(0, total_length);
+    connection.read_buffer.erase(0, total_length);
+    connection.requests += lengths.size();
+    bool close_after = connection.requests == MAX_REQUESTS_PER_CONNECTION;
+
+    // Whatever follows in the buffer is a new request, with a header timeout
+    // of its own. With the timer cancelled none can fire, and close the
+    // connection, while a pool thread holds on to it
+    clear_deadline(connection);
+
+    // STEP 3
+    // Process the batch, on this thread without a pool
+    if (pool_ == nullptr) {
+      apply_responses(connection, process_batch(batch, lengths, close_after));
+      continue;
+    }
+
+    connection.busy = true;
+
+    Connection *target = &connection;
+    pool_->enqueue([this, target, batch = std::move(batch),
+                    lengths = std::move(lengths), close_after]() {
+      std::vector<HTTPResponse> responses =
+          process_batch(batch, lengths, close_after);
+
+      {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        completions_.push_back({target, std::move(responses)});
+      }
+
+      uint64_t one = 1;
+      write(wakeup_fd_, &one, sizeof(one));
+    });
+  }
+}
+
+bool EventLoop::feed_streamed_request(Connection &connection) {
+  size_t consumed = connection.streamed->feed(connection.read_buffer);
+  connection.read_buffer.erase(0, consumed);
+  if (!connection.streamed->complete()) {
+    return false;
+  }
+
+  std::vector<HTTPResponse> responses;
+  responses.push_back(connection.streamed->respond());
+  connection.streamed.reset();
+  apply_responses(connection, std::move(responses));
+  return true;
+}
+
+std::vector<HTTPResponse>
+EventLoop::process_batch(std::string_view batch,
+                         const std::vector<size_t> &lengths, bool close_after) {
+  std::vector<HTTPResponse> responses;
+  responses.reserve(lengths.size());
+
+  size_t offset = 0;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    bool last = close_after && i + 1 == lengths.size();
+    responses.push_back(
+        process_http_request(batch.substr(offset, lengths[i]), last));
+    offset += lengths[i];
+
+    // Requests after one that closes the connection are never answered
+    if (!responses.back().keep_alive) {
+      break;
+    }
+  }
+
+  return responses;
+}
+
+void EventLoop::drain_completions() {
+  std::vector<Completion> completions;
+  {
+    std::lock_guard<std::mutex> lock(completions_mutex_);
+    completions.swap(completions_);
+  }
+
+  // A connection is never closed while it is busy, so the pointers handed
+  // to the pool threads are still valid here
+  for (auto &completion : completions) {
+    Connection &connection = *completion.connection;
+    connection.busy = false;
+    apply_responses(connection, std::move(completion.responses));
+
+    process_connection(connection);
+  }
+}
+
+void EventLoop::apply_responses(Connection &connection,
+                                std::vector<HTTPResponse> &&responses) {
+  // The whole batch is queued before writing, so consecutive responses are
+  // gathered into the same sendmsg() calls
+  for (auto &response : responses) {
+    if (!connection.keep_alive) {
+      break;
+    }
+    connection.keep_alive = response.keep_alive;
+    connection.output.push(std::move(response));
+  }
+  flush(connection);
+}
+
+void EventLoop::resume_reading(Connection &connection) {
+  read_available(connection);
+}
+
+void EventLoop::record_first_byte(Connection &connection) {
+  if (!connection.first_byte_written && connection.output.written() > 0) {
+    Metrics::record(MetricStage::FIRST_BYTE, connection.accepted,
+                    std::chrono::steady_clock::now());
+    connection.first_byte_written = true;
+  }
+}
+
+bool EventLoop::flush(Connection &connection) {
+  // On EAGAIN the rest stays queued and EPOLLOUT tells us when to continue
+  WriteResult result = connection.output.write_to(connection.fd);
+  record_first_byte(connection);
+  if (result == WriteResult::ERROR) {
+    connection.peer_closed = true;
+    connection.keep_alive = false;
+    connection.output.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void EventLoop::update_deadline(Connection &connection) {
+  Deadline next;
+  if (connection.busy) {
+    next = Deadline::NONE;
+  } else if (!connection.output.empty()) {
+    next = Deadline::WRITE;
+  } else if (connection.streamed) {
+    next = Deadline::BODY;
+  } else if (connection.peer_closed || !connection.keep_alive) {
+    next = Deadline::NONE;
+  } else if (connection.read_buffer.empty()) {
+    next = Deadline::IDLE;
+  } else {
+    next = Deadline::HEADER;
+  }
+
+  // The header timeout runs from the first byte of the request, however
+  // slowly the rest trickles in. The body and write timeouts only measure
+  // how long the client has been stalled, so they restart on progress
+  bool restart = connection.progressed &&
+                 (next == Deadline::BODY || next == Deadline::WRITE);
+  connection.progressed = false;
+  if (next == connection.deadline && !restart) {
+    return;
+  }
+  connection.deadline = next;
+
+  int timeout_ms = 0;
+  switch (next) {
+  case Deadline::NONE:
+    break;
+  case Deadline::HEADER:
+    timeout_ms = HEADER_TIMEOUT_MS;
+    break;
+  case Deadline::BODY:
+    timeout_ms = BODY_TIMEOUT_MS;
+    break;
+  case Deadline::IDLE:
+    timeout_ms = IDLE_TIMEOUT_MS;
+    break;
+  case Deadline::WRITE:
+    timeout_ms = WRITE_TIMEOUT_MS;
+    break;
+  }
+
+  if (timeout_ms == 0) {
+    timers_.cancel(connection);
+  } else {
+    timers_.schedule(connection, std::chrono::milliseconds(timeout_ms));
+  }
+}
+
+void EventLoop::clear_deadline(Connection &connection) {
+  timers_.cancel(connection);
+  connection.deadline = Deadline::NONE;
+}
+
+void EventLoop::handle_timeout(Connection &connection) {
+  // A busy connection has no timer, but it must never be closed under the
+  // pool thread that holds it
+  if (connection.busy) {
+    return;
+  }
+
+  Logging logger;
+  logger.setClassName("EventLoop::handle_timeout");
+  logger.info("Client {} timed out", connection.client);
+  Metrics::count(MetricCounter::TIMEOUTS);
+
+  // A client in the middle of sending a request is told why it is cut off.
+  // Everything else is simply closed
+  if (connection.deadline == Deadline::HEADER) {
+    connection.read_buffer.clear();
+    std::vector<HTTPResponse> responses;
+    responses.push_back(timeout_response());
+    apply_responses(connection, std::move(responses));
+    process_connection(connection);
+    return;
+  }
+
+  close_connection(connection);
+}
+
+void EventLoop::maybe_close(Connection &connection) {
+  if (connection.busy) {
+    return;
+  }
+
+  if (!connection.output.empty()) {
+    return;
+  }
+
+  // Close once the client went away or the last response asked for it.
+  // Complete requests that arrived before EOF have been dispatched already
+  if (connection.peer_closed || !connection.keep_alive) {
+    close_connection(connection);
+  }
+}
+
+void EventLoop::close_connection(Connection &connection) {
+  Logging logger;
+  logger.setClassName("EventLoop::close_connection");
+  logger.info("Client {} closed connection", connection.client);
+
+  ConnectionLimits::instance().release(connection.address.sin_addr);
+  timers_.cancel(connection);
+
+  // The connection leaves the loop, it must not be used after this line
+  auto it = connections_.find(connection.fd);
+  std::unique_ptr<Connection> closed = std::move(it->second);
+  connections_.erase(it);
+  retire(std::move(closed));
+}
+
+void EventLoop::retire(std::unique_ptr<Connection> connection) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd, nullptr);
+  close(connection->fd);
+}
@@ -0,0 +1,262 @@
+#include <file_cache.h>
+#include <config.h>
+#include <util.h>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<CachedFile> load_file(const std::filesystem::path &path,
+                                      size_t max_content_size) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto file = std::make_shared<CachedFile>();
+  file->size = file_stat.st_size;
+  file->mtime = file_stat.st_mtim;
+  file->device = file_stat.st_dev;
+  file->inode = file_stat.st_ino;
+  file->content_type = content_type_for_path(path);
+  file->content_length = std::to_string(file_stat.st_size);
+  file->last_modified = format_rfc7231_date(file_stat.st_mtim.tv_sec);
+
+  // Strong validator derived from the file version, the same scheme nginx
+  // uses: "<mtime>-<size>" in hex
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%llx%09lx-%llx\"",
+           static_cast<unsigned long long>(file_stat.st_mtim.tv_sec),
+           static_cast<long>(file_stat.st_mtim.tv_nsec),
+           static_cast<unsigned long long>(file_stat.st_size));
+  file->etag = etag;
+
+  // Large files are never materialized in memory, the descriptor stays open
+  // for sendfile()
+  if (static_cast<size_t>(file_stat.st_size) > max_content_size) {
+    file->file = std::make_shared<FileHandle>(fd);
+    return file;
+  }
+
+  // Read straight into the final string, its size is known from fstat()
+  file->content.resize(file_stat.st_size);
+  size_t total_read = 0;
+  while (total_read < file->content.size()) {
+    ssize_t bytes_read = pread(fd, file->content.data() + total_read,
+                               file->content.size() - total_read, total_read);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      // The file shrank while we were reading it
+      file->content.resize(total_read);
+      file->size = total_read;
+      file->content_length = std::to_string(total_read);
+      break;
+    }
+    total_read += bytes_read;
+  }
+  close(fd);
+
+  return file;
+}
+
+// Share of a total bound for each of shard_count shards, at least one if
+// the total isn't 0
+static size_t per_shard(size_t total, size_t shard_count) {
+  return (total + shard_count - 1) / shard_count;
+}
+
+FileCache::FileCache(size_t byte_budget, size_t max_open_files,
+                     size_t max_missing, std::chrono::milliseconds ttl,
+                     size_t shard_count)
+    : shard_budget(byte_budget / shard_count),
+      shard_open_files(per_shard(max_open_files, shard_count)),
+      shard_missing(per_shard(max_missing, shard_count)),
+      max_file_size(byte_budget / shard_count / 4), ttl(ttl) {
+  for (size_t i = 0; i < shard_count; i++) {
+    shards.push_back(std::make_unique<Shard>());
+  }
+}
+
+FileCache &FileCache::instance() {
+  static FileCache cache(FILE_CACHE_BYTES, FILE_CACHE_MAX_FDS,
+                         FILE_CACHE_MAX_MISSING,
+                         std::chrono::milliseconds(FILE_CACHE_TTL_MS));
+  return cache;
+}
+
+FileCache::Shard &FileCache::shard_for(std::string_view key) {
+  return *shards[PathHash{}(key) % shards.size()];
+}
+
+std::shared_ptr<const CachedFile>
+FileCache::get(std::string_view key) {
+  Shard &shard = shard_for(key);
+  auto now = std::chrono::steady_clock::now();
+
+  // STEP 1
+  // Look the path up. An entry checked within the TTL is served as is, be
+  // it a file or the knowledge that there is none
+  std::shared_ptr<const CachedFile> cached;
+  bool was_missing = false;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      auto entry = it->second;
+      auto &list = list_for(shard, entry->file.get());
+      list.splice(list.begin(), list, entry);
+      bool fresh = now - entry->validated_at < ttl;
+      if (fresh && !entry->file) {
+        missing_hits.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      if (fresh) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return entry->file;
+      }
+      cached = entry->file;
+      was_missing = !cached;
+    }
+  }
+
+  // STEP 2
+  // The entry is older than the TTL, revalidate it against the file on disk.
+  // The stat() happens outside the lock so other lookups are not blocked
+  const std::string path(key);
+  if (cached) {
+    struct stat file_stat;
+    bool unchanged = stat(path.c_str(), &file_stat) == 0 &&
+                     S_ISREG(file_stat.st_mode) &&
+                     file_stat.st_dev == cached->device &&
+                     file_stat.st_ino == cached->inode &&
+                     file_stat.st_size == cached->size &&
+                     file_stat.st_mtim.tv_sec == cached->mtime.tv_sec &&
+                     file_stat.st_mtim.tv_nsec == cached->mtime.tv_nsec;
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    bool still_cached = it != shard.index.end() && it->second->file == cached;
+    if (unchanged) {
+      if (still_cached) {
+        it->second->validated_at = now;
+      }
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return cached;
+    }
+
+    invalidations.fetch_add(1, std::memory_order_relaxed);
+    if (still_cached) {
+      erase(shard, it->second);
+    }
+  }
+
+  // STEP 3
+  // Miss: open the file and keep it, or remember that there is none
+  misses.fetch_add(1, std::memory_order_relaxed);
+  std::shared_ptr<const CachedFile> file = load_file(path, SENDFILE_THRESHOLD);
+
+  // Nothing at all is cached with a 0 byte budget
+  bool cacheable = shard_budget > 0;
+  if (!file) {
+    cacheable = cacheable && shard_missing > 0;
+  } else if (file->file) {
+    cacheable = cacheable && shard_open_files > 0;
+  } else {
+    cacheable = cacheable && file->content.size() <= max_file_size;
+  }
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      erase(shard, it->second);
+    }
+    insert(shard, path, file);
+  } else if (was_missing) {
+    // Drop the stale "not found", it would be checked again on every lookup
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && !it->second->file) {
+      erase(shard, it->second);
+    }
+  }
+
+  return file;
+}
+
+std::list<FileCache::Entry> &FileCache::list_for(Shard &shard,
+                                                 const CachedFile *file) {
+  if (file == nullptr) {
+    return shard.missing;
+  }
+  if (file->file) {
+    return shard.descriptors;
+  }
+  return shard.contents;
+}
+
+bool FileCache::over_budget(const Shard &shard,
+                            const std::list<Entry> &list) const {
+  if (&list == &shard.missing) {
+    return list.size() > shard_missing;
+  }
+  if (&list == &shard.descriptors) {
+    return list.size() > shard_open_files;
+  }
+  return shard.bytes > shard_budget;
+}
+
+void FileCache::insert(Shard &shard, const std::string &key,
+                       std::shared_ptr<const CachedFile> file) {
+  auto &list = list_for(shard, file.get());
+  if (file && !file->file) {
+    shard.bytes += file->content.size();
+  }
+  list.push_front({key, std::move(file), std::chrono::steady_clock::now()});
+  shard.index[key] = list.begin();
+
+  // Evict the least recently used entries of the same kind until the shard
+  // fits its bound for them
+  while (over_budget(shard, list) && list.size() > 1) {
+    erase(shard, std::prev(list.end()));
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void FileCache::erase(Shard &shard, std::list<Entry>::iterator entry) {
+  auto &list = list_for(shard, entry->file.get());
+  if (entry->file && !entry->file->file) {
+    shard.bytes -= entry->file->content.size();
+  }
+  shard.index.erase(entry->key);
+  list.erase(entry);
+}
+
+FileCacheStats FileCache::stats() const {
+  FileCacheStats stats;
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.missing_hits = missing_hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.evictions = evictions.load(std::memory_order_relaxed);
+  stats.invalidations = invalidations.load(std::memory_order_relaxed);
+
+  for (const auto &shard : shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    stats.entries += shard->contents.size() + shard->descriptors.size() +
+                     shard->missing.size();
+    stats.bytes += shard->bytes;
+    stats.open_files += shard->descriptors.size();
+    stats.missing += shard->missing.size();
+  }
+
+  return stats;
+}
@@ -0,0 +1,67 @@
+#include <frame_pool.h>
+#include <array>
+#include <new>
+
+namespace {
+
+// A free frame holds the link to the next one
+struct FreeFrame {
+  FreeFrame *next;
+};
+
+struct FreeLists {
+  std::array<FreeFrame *, FramePool::CLASS_COUNT> heads{};
+  size_t cached_bytes = 0;
+
+  ~FreeLists() {
+    for (FreeFrame *head : heads) {
+      while (head != nullptr) {
+        FreeFrame *next = head->next;
+        ::operator delete(head);
+        head = next;
+      }
+    }
+  }
+};
+
+FreeLists &free_lists() {
+  thread_local FreeLists lists;
+  return lists;
+}
+
+size_t size_class(size_t size) { return (size - 1) / FramePool::GRANULE; }
+
+} // namespace
+
+void *FramePool::allocate(size_t size) {
+  size_t index = size_class(size);
+  if (index >= CLASS_COUNT) {
+    return ::operator new(size);
+  }
+
+  FreeLists &lists = free_lists();
+  FreeFrame *frame = lists.heads[index];
+  if (frame == nullptr) {
+    return ::operator new((index + 1) * GRANULE);
+  }
+  lists.heads[index] = frame->next;
+  lists.cached_bytes -= (index + 1) * GRANULE;
+  return frame;
+}
+
+void FramePool::deallocate(void *frame, size_t size) {
+  size_t index = size_class(size);
+  FreeLists &lists = free_lists();
+  if (index >= CLASS_COUNT ||
+      lists.cached_bytes + (index + 1) * GRANULE > MAX_CACHED_BYTES) {
+    ::operator delete(frame);
+    return;
+  }
+
+  auto *free_frame = static_cast<FreeFrame *>(frame);
+  free_frame->next = lists.heads[index];
+  lists.heads[index] = free_frame;
+  lists.cached_bytes += (index + 1) * GRANULE;
+}
+
+size_t FramePool::cached_bytes() { return free_lists().cached_bytes; }
@@ -0,0 +1,145 @@
+#include <http_connection.h>
+#include <config.h>
+#include <metrics.h>
+#include <server.h>
+#include <util.h>
+#include <logging/Logging.h>
+#include <arpa/inet.h>
+
+HTTPConnection::HTTPConnection(const sockaddr_in &address,
+                               std::chrono::steady_clock::time_point accepted)
+    : accepted_(accepted), request_started_(accepted) {
+  char ip[INET_ADDRSTRLEN] = "?";
+  inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+  client_ = std::string(ip) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+const std::string &HTTPConnection::client() const { return client_; }
+
+OutputQueue &HTTPConnection::output() { return output_; }
+
+bool HTTPConnection::keep_alive() const { return keep_alive_; }
+
+bool HTTPConnection::streaming() const { return streamed_ != nullptr; }
+
+// Frame the requests in the read buffer by their header terminator and
+// Content-Length. One read may carry several pipelined requests, or only part
+// of one. A request whose body has to be streamed ends the batch: the
+// responses before it go out first, the client may be waiting for them
+// before it sends the body
+void HTTPConnection::process() {
+  size_t consumed = 0;
+  while (keep_alive_ && !streamed_) {
+    size_t length = 0;
+    FrameResult result = frame_http_request(
+        std::string_view(read_buffer_).substr(consumed), MAX_HEADER_SIZE,
+        MAX_BODY_SIZE, BODY_CHUNK_SIZE, length);
+    if (result == FrameResult::INCOMPLETE) {
+      break;
+    }
+
+    bool last_request = ++requests_ == MAX_REQUESTS_PER_CONNECTION;
+    if (result == FrameResult::COMPLETE) {
+      respond(process_http_request(
+          std::string_view(read_buffer_).substr(consumed, length),
+          last_request));
+      consumed += length;
+    } else if (result == FrameResult::BODY_FOLLOWS) {
+      streamed_ = std::make_unique<StreamedRequest>(
+          read_buffer_.substr(consumed, length));
+      consumed += length;
+      if (last_request) {
+        streamed_->setConnectionClose();
+      }
+    } else {
+      respond(frame_error_response(result));
+      consumed = read_buffer_.size();
+    }
+  }
+
+  read_buffer_.erase(0, consumed);
+  if (consumed > 0 && !read_buffer_.empty()) {
+    request_started_ = std::chrono::steady_clock::now();
+  }
+}
+
+bool HTTPConnection::start_body() {
+  bool expects_continue = streamed_->expectsContinue();
+  if (expects_continue) {
+    HTTPResponse interim;
+    interim.keep_alive = true;
+    interim.append(std::string(CONTINUE_RESPONSE));
+    output_.push(std::move(interim));
+  }
+  read_buffer_.erase(0, streamed_->feed(read_buffer_));
+  return expects_continue;
+}
+
+void HTTPConnection::receive_body(const char *data, size_t size) {
+  size_t used = streamed_->feed(std::string_view(data, size));
+  read_buffer_.append(data + used, size - used);
+}
+
+bool HTTPConnection::body_complete() const { return streamed_->complete(); }
+
+void HTTPConnection::finish_body() {
+  HTTPResponse response = streamed_->respond();
+  streamed_.reset();
+  respond(std::move(response));
+  if (!read_buffer_.empty()) {
+    request_started_ = std::chrono::steady_clock::now();
+  }
+}
+
+void HTTPConnection::record_first_byte() {
+  if (!first_byte_recorded_ && output_.written() > 0) {
+    Metrics::record(MetricStage::FIRST_BYTE, accepted_,
+                    std::chrono::steady_clock::now());
+    first_byte_recorded_ = true;
+  }
+}
+
+int HTTPConnection::read_timeout_ms() const {
+  if (read_buffer_.empty()) {
+    return IDLE_TIMEOUT_MS;
+  }
+  if (HEADER_TIMEOUT_MS <= 0) {
+    return 0;
+  }
+
+  // The header timeout runs from the first byte of the request
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - request_started_);
+  if (elapsed.count() >= HEADER_TIMEOUT_MS) {
+    return -1;
+  }
+  return HEADER_TIMEOUT_MS - elapsed.count();
+}
+
+void HTTPConnection::received(const char *data, size_t size) {
+  if (read_buffer_.empty()) {
+    request_started_ = std::chrono::steady_clock::now();
+  }
+  read_buffer_.append(data, size);
+}
+
+bool HTTPConnection::timed_out() {
+  // A client that started a request is told why it is cut off, an idle one
+  // is simply closed
+  keep_alive_ = false;
+  if (read_buffer_.empty()) {
+    return false;
+  }
+
+  Logging logger;
+  logger.setClassName("HTTPConnection::timed_out");
+  logger.info("Client {} timed out", client_);
+  Metrics::count(MetricCounter::TIMEOUTS);
+  output_.push(timeout_response());
+  return true;
+}
+
+void HTTPConnection::respond(HTTPResponse response) {
+  keep_alive_ = response.keep_alive;
+  output_.push(std::move(response));
+}
@@ -1,108 +1,89 @@
 #include <http_parser.h>
 #include <http_response_builder.h>
+#include <asset_bundle.h>
+#include <compression_cache.h>
+#include <config.h>
+#include <content_encoding.h>
+#include <file_cache.h>
+#include <metrics.h>
 #include <util.h>
+#include <upload.h>
 #include <logging/Logging.h>
-#include <nlohmann/json.hpp>
-#include <chrono>
+#include <charconv>
 #include <filesystem>
 #include <set>
 #include <string>
 
-using json = nlohmann::json;
+HTTPParser::HTTPParser(std::string_view request,
+                       std::pmr::memory_resource *memory)
+    : request(request), memory(memory), normalized_route(memory),
+      byte_ranges(memory) {}
 
-HTTPParser::HTTPParser(const std::string &request)
-    : request(request), SERVER_ROOT(std::filesystem::current_path() / "res") {}
+bool HTTPParser::parse() { return parse_request(false); }
 
-bool HTTPParser::parse() {
+bool HTTPParser::parse_head() { return parse_request(true); }
+
+bool HTTPParser::parse_request(bool head_only) {
   Logging logger;
   logger.setClassName("HTTPParser::parse()");
 
-  // Plan: Parse the request string into an object
-  //         The object should contain the following:-
-  //              i) Request line - String
-  //              ii) Headers - Array of string
-  //              iii) Body - String (Optional datatype, present if request
-  //              method is POST)
-
-  // STEP 1
-  // Split the body part from the request metadata
-  auto parts = split(request, "\r\n\r\n");
-  if (parts.size() != 2) {
-    // Even in a GET request, this split should have been successfull
-    // The request is malformed if this split is not successfull
-    status = HTTPStatus::BAD_REQUEST;
-    logger.warn("Malformed HTTP Request. An split on \\r\\n was attempted to "
-                "separate request metadata from body and the split wasn't "
-                "successfull. The error occured on the below request");
-    logger.warn(request);
-    return false;
-  }
-  std::string request_metadata = parts[0];
-  http_body = parts[1];
-
-  // STEP 2
-  // Parse the request_metadata to extract the request line and the headers
-  // array
-  std::string request_line;
-  std::vector<std::string> headers_str;
-
-  auto request_metadata_lines = split(request_metadata, "\r\n");
-  if (request_metadata_lines.size() == 0) {
+  // Plan: Parse the request buffer into http_request
+  //         The request contains the following:-
+  //              i) Request line - method, route and version
+  //              ii) Headers - Array of name/value pairs
+  //              iii) Body - Content-Length bytes after the headers
+  //       All of them are views into the request buffer
+  auto result = head_only ? request_parser.parse_head(request, http_request)
+                          : request_parser.parse(request, http_request);
+  if (result != ParseResult::COMPLETE) {
+    // We are always handed a whole request, so running out of bytes means
+    // the request is as malformed as a syntax error
     status = HTTPStatus::BAD_REQUEST;
-    logger.warn("Malformed HTTP Request. Tried to split request_metadata on "
-                "\\r\\n but no lines were returned.");
-    return false;
-  }
-  request_line = request_metadata_lines[0];
-  for (int i = 1; i < request_metadata_lines.size(); i++) {
-    headers_str.push_back(request_metadata_lines[i]);
-  }
-
-  // STEP 3
-  // Parse the request line to extract the following:-
-  //      i) Request method
-  //      ii) Route
-  //      iii) HTTP Version
-  auto request_line_data = split(request_line, " ");
-  if (request_line_data.size() != 3) {
-    status = HTTPStatus::BAD_REQUEST;
-    logger.warn("Malformed HTTP Request. Tried to split the request line on "
-                "space but failed.");
+    switch (request_parser.error()) {
+    case ParseError::MALFORMED_REQUEST_LINE:
+      logger.warn("Malformed HTTP Request. The request line is not of the "
+                  "form '<method> <route> <version>'.");
+      break;
+    case ParseError::MALFORMED_HEADER:
+      logger.warn("Malformed Header. A header line is not of the form "
+                  "'<name>: <value>'.");
+      break;
+    case ParseError::TOO_MANY_HEADERS:
+      logger.warn("Malformed HTTP Request. Too many headers.");
+      break;
+    case ParseError::INVALID_CONTENT_LENGTH:
+      logger.warn("Malformed HTTP Request. Invalid Content-Length header.");
+      break;
+    case ParseError::NONE:
+      logger.warn("Malformed HTTP Request. The request ended before the "
+                  "headers and body were complete.");
+      break;
+    }
+    logger.warn(std::string(request));
+    parsed_at = std::chrono::steady_clock::now();
     return false;
   }
-  http_method = request_line_data[0];
-  http_route = request_line_data[1];
-  http_version = request_line_data[2];
-
-  // STEP 4
-  // Parse the headers.
-  // Currently they are strings, so split them and store them in key-value pairs
-  for (const auto &header_str : headers_str) {
-    auto data = split(header_str, ": ");
-    if (data.size() != 2) {
-      status = HTTPStatus::BAD_REQUEST;
-      logger.warn("Malformed Header. Tried to split header on ': ' but failed. "
-                  "Check the header string below.");
-      logger.warn(header_str);
-      return false;
-    }
 
-    http_headers[data[0]] = data[1];
-  }
+  http_method = parse_http_method(http_request.method);
+  http_route = http_request.route;
+  http_version = http_request.version;
+  http_body = http_request.body;
 
-  // STEP 5
+  // STEP 2
   bool is_valid_request = validate_fields();
+  parsed_at = std::chrono::steady_clock::now();
   if (!is_valid_request) {
     return false;
   }
-  bool is_processing_successfull = process_request();
+
+  bool is_processing_successfull = process_request(head_only);
 
   return is_processing_successfull;
 }
 
 // Validate data
 // Following are the things that need to be validated:-
-//      i) Request method - Must be GET or POST
+//      i) Request method - Must be one that some route takes
 //      ii) HTTP Version - Must be HTTP/1.1 or HTTP/1.0
 //      iii) Host header must be present with value = localhost:<PORT> or
 //      <SERVER_ADDRESS>:<PORT>
@@ -110,200 +91,397 @@ bool HTTPParser::validate_fields() {
   Logging logger;
   logger.setClassName("HTTPParser::validate_fields()");
 
-  std::set<std::string> allowed_methods = {"GET", "POST"};
-  std::set<std::string> allowed_http_versions = {"HTTP/1.1", "HTTP/1.0"};
+  static const std::set<std::string, std::less<>> allowed_http_versions = {
+      "HTTP/1.1", "HTTP/1.0"};
 
-  if (allowed_methods.count(http_method) == 0) {
+  if (!Router::instance().handles(http_method)) {
     status = HTTPStatus::UNSUPPORTED_METHOD;
     logger.warn("Unknown HTTP method. The below given method was provided");
-    logger.warn(http_method);
+    logger.warn(std::string(http_request.method));
     return false;
   }
   if (allowed_http_versions.count(http_version) == 0) {
     status = HTTPStatus::BAD_REQUEST;
     logger.warn(
         "Unknown HTTP version. The below given HTTP version was provided");
-    logger.warn(http_version);
+    logger.warn(std::string(http_version));
     return false;
   }
-  if (http_headers.count("Host") == 0) {
+  auto host_header = http_request.header("Host");
+  if (!host_header) {
     status = HTTPStatus::BAD_REQUEST;
     logger.warn("Host header not found.");
     return false;
   }
-  const auto host = http_headers["Host"];
-  std::string correct_host_value =
-      std::string(SERVER_ADDRESS) + ":" + std::to_string(PORT);
+  std::string_view host = *host_header;
+  char port[16];
+  auto port_end = std::to_chars(port, port + sizeof(port), PORT).ptr;
+  std::pmr::string correct_host_value(SERVER_ADDRESS, memory);
+  correct_host_value += ':';
+  correct_host_value.append(port, port_end);
   if (host != correct_host_value) {
     status = HTTPStatus::FORBIDDEN;
     logger.warn("Host mismatch. The below given host was provided");
-    logger.warn("Got host: " + host + " Expected host: " + correct_host_value);
+    logger.warn("Got host: {} Expected host: {}", host,
+                std::string_view(correct_host_value));
     return false;
   }
 
-  std::string request_log_lines[] = {
-    http_method + " " + http_route + " " + http_version,
-    "Host validation: " + host + " ✅"
-  };
-  for (const auto& line : request_log_lines) {
-    logger.info(line);
-  }
+  logger.info("{} {} {}", http_request.method, http_route, http_version);
+  logger.info("Host validation: {} ✅", host);
 
   return true;
 }
 
-bool HTTPParser::process_GET_request() {
+// GET requests are used for fetching of files
+// relative_path is the normalized route without its leading '/', so it can't
+// escape the SERVER_ROOT
+bool HTTPParser::process_GET_request(std::string_view relative_path) {
   Logging logger;
   logger.setClassName("HTTPParser::process_GET_request");
 
-  // GET requests are used for fetching of files
-  // First of all we need to sanitize the route we recieved in order to protect
-  // against path traversals
-  auto sanitized_route = sanitize_path(http_route);
-  if (!sanitized_route) {
-    status = HTTPStatus::FORBIDDEN;
-    logger.warn("Path traversal attempt blocked. Route tried to escape the "
-                "SERVER ROOT");
-    return false;
-  }
-
-  std::string route = sanitized_route.value();
-
   // Check if the route is '/'
   // Because in that case we need to check the presence of an index.html file
   // and serve it
-  std::filesystem::path fullpath;
-  if (route == "/") {
-    fullpath = SERVER_ROOT / "index.html";
+  // Both the path on disk and the one in a bundle are built in the request's
+  // memory, they are only needed for the lookups
+  if (relative_path.empty()) {
+    relative_path = "index.html";
     content_type = HTTPContentType::HTML;
-  } else {
-    fullpath = SERVER_ROOT / route.substr(1);
   }
-
-  auto file = read_file(fullpath);
+  std::pmr::string fullpath(SERVER_ROOT.native(), memory);
+  fullpath += '/';
+  fullpath += relative_path;
+
+  // Hot files come out of the in-memory cache together with their
+  // precomputed content type and length. With an asset bundle the files on
+  // disk are never looked at
+  const AssetBundle *bundle = AssetBundle::served();
+  auto file = bundle ? bundle->find(relative_path, ContentEncoding::IDENTITY)
+                     : FileCache::instance().get(fullpath);
   if (!file) {
     status = HTTPStatus::NOT_FOUND;
-    logger.warn("Requested file not found - " + fullpath.string());
+    logger.warn("Requested file not found - {}", std::string_view(fullpath));
     return false;
   }
 
-  std::string file_content = file.value();
+  content_type = file->content_type;
+
+  // Content negotiation: send the first encoded variant of the file the
+  // client accepts, a precompressed sibling or one compressed once and
+  // cached, or the one packed in the bundle. This happens before the
+  // conditional headers are looked at because every variant has its own ETag
+  auto accept_encoding = http_request.header("Accept-Encoding");
+  if (accept_encoding) {
+    for (auto encoding : parse_accept_encoding(*accept_encoding, memory)) {
+      auto variant =
+          bundle ? bundle->find(relative_path, encoding)
+                 : CompressionCache::instance().get(fullpath, file, encoding);
+      if (variant) {
+        file = std::move(variant);
+        break;
+      }
+    }
+  }
+
+  // If user requested an actual file then set http_requested_filename
+  std::string_view filename =
+      relative_path.substr(relative_path.find_last_of('/') + 1);
+  if (!filename.empty()) {
+    http_requested_filename = std::string(filename);
+  }
+  cached_file = std::move(file);
+
+  // A client that already has this version of the file gets a 304 without
+  // a body. This takes precedence over any Range header
+  if (is_not_modified()) {
+    status = HTTPStatus::NOT_MODIFIED;
+    logger.info("Not modified - {}", std::string_view(fullpath));
+    return true;
+  }
+
+  process_range_request();
+
+  return true;
+}
+
+// Whether entity_tag is in the comma separated list of an If-None-Match
+// header. If-None-Match uses the weak comparison, so W/ prefixes are ignored
+static bool etag_list_contains(std::string_view list,
+                               std::string_view entity_tag) {
+  if (entity_tag.substr(0, 2) == "W/") {
+    entity_tag.remove_prefix(2);
+  }
+
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    std::string_view candidate = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view()
+                                           : list.substr(comma + 1);
+
+    while (!candidate.empty() && candidate.front() == ' ') {
+      candidate.remove_prefix(1);
+    }
+    while (!candidate.empty() && candidate.back() == ' ') {
+      candidate.remove_suffix(1);
+    }
+    if (candidate == "*") {
+      return true;
+    }
+    if (candidate.substr(0, 2) == "W/") {
+      candidate.remove_prefix(2);
+    }
+    if (candidate == entity_tag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Evaluate the conditional headers against the cached validators
+// Following are the cases:-
+//      i) If-None-Match is present - not modified if any of its tags
+//         matches the ETag of the file
+//      ii) Otherwise If-Modified-Since is present - not modified if the file
+//          is no newer than the given date
+// Only the metadata of the cache entry is looked at, the file is not read
+bool HTTPParser::is_not_modified() {
+  auto if_none_match = http_request.header("If-None-Match");
+  if (if_none_match) {
+    return etag_list_contains(*if_none_match, cached_file->etag);
+  }
+
+  auto if_modified_since = http_request.header("If-Modified-Since");
+  if (if_modified_since) {
+    auto since = parse_rfc7231_date(*if_modified_since);
+    return since && cached_file->mtime.tv_sec <= *since;
+  }
+
+  return false;
+}
+
+// Handle a Range header on a GET for a file
+// Following are the cases:-
+//      i) No Range header, or one we can't parse - serve the whole file
+//      ii) An If-Range that doesn't match the current version of the file -
+//          the client's partial copy is stale, serve the whole file
+//      iii) At least one range within the file - 206 with those ranges
+//      iv) No range within the file - 416
+void HTTPParser::process_range_request() {
+  Logging logger;
+  logger.setClassName("HTTPParser::process_range_request");
+
+  auto range_header = http_request.header("Range");
+  if (!range_header) {
+    return;
+  }
+
+  // If-Range carries either the ETag or the Last-Modified date the client
+  // got with its partial copy. Both are compared exactly
+  auto if_range_header = http_request.header("If-Range");
+  if (if_range_header && *if_range_header != cached_file->etag &&
+      *if_range_header != cached_file->last_modified) {
+    logger.info("If-Range does not match, serving the whole file");
+    return;
+  }
+
+  auto result = parse_range_header(*range_header, cached_file->size,
+                                   byte_ranges);
+  if (result == RangeResult::SATISFIABLE) {
+    status = HTTPStatus::PARTIAL_CONTENT;
+  } else if (result == RangeResult::UNSATISFIABLE) {
+    status = HTTPStatus::RANGE_NOT_SATISFIABLE;
+    logger.warn("Unsatisfiable range - " + std::string(*range_header));
+  }
+}
 
-  // Add hints based on file extension
-  // It would be much better to do it by scanning the file content
-  // But doing this for simplicity and PoC
-  auto extension = fullpath.extension();
+// Add hints based on file extension
+// It would be much better to do it by scanning the file content
+// But doing this for simplicity and PoC
+HTTPContentType content_type_for_path(const std::filesystem::path &path) {
+  auto extension = path.extension();
   if (extension == ".html") {
-    content_type = HTTPContentType::HTML;
+    return HTTPContentType::HTML;
   } else if (extension == ".png") {
-    content_type = HTTPContentType::PNG;
+    return HTTPContentType::PNG;
   } else if (extension == ".jpg") {
-    content_type = HTTPContentType::JPG;
+    return HTTPContentType::JPG;
   } else if (extension == ".jpeg") {
-    content_type = HTTPContentType::JPEG;
+    return HTTPContentType::JPEG;
   } else if (extension == ".gif") {
-    content_type = HTTPContentType::GIF;
+    return HTTPContentType::GIF;
   } else if (extension == ".json") {
-    content_type = HTTPContentType::JSON;
+    return HTTPContentType::JSON;
   } else if (extension == ".js") {
-    content_type = HTTPContentType::JS;
+    return HTTPContentType::JS;
   } else if (extension == ".css") {
-    content_type = HTTPContentType::CSS;
+    return HTTPContentType::CSS;
   } else {
-    content_type = HTTPContentType::OCTET_STREAM;
+    return HTTPContentType::OCTET_STREAM;
   }
-
-  // If user requested an actual file then set http_requested_filename
-  if (fullpath.has_filename()) {
-    http_requested_filename = fullpath.filename();
-  }
-  response_body = file_content;
-
-  return true;
 }
 
-bool HTTPParser::process_POST_request() {
+// Checks done on an upload before its body is looked at
+//      i) Only JSON is accepted, with Content-Type: application/json
+bool HTTPParser::accept_upload() {
   Logging logger;
-  logger.setClassName("HTTPParser::process_POST_request");
-
-  // We only process the /upload endpoint for now
-  // For all other requests, return a 404
-  auto route = sanitize_path(http_route);
-  if (!route.has_value() || (route.has_value() && route.value() != "/upload")) {
-    status = HTTPStatus::NOT_FOUND;
-    logger.warn(std::string("POST request on endpoint ") + route.value() + " is not found");
-    return false;
-  }
-
-  // We only process JSON data in POST requests
-  // First of all, check whether the Content-Type of the incoming request is
-  // application/json
+  logger.setClassName("HTTPParser::accept_upload");
 
-  if (http_headers.count("Content-Type") == 0) {
+  auto request_content_type = http_request.header("Content-Type");
+  if (!request_content_type) {
     status = HTTPStatus::BAD_REQUEST;
     logger.warn("POST request does not contain the Content-Type header");
     return false;
   }
 
-  if (http_headers["Content-Type"] != "application/json") {
+  if (*request_content_type != "application/json") {
     status = HTTPStatus::UNSUPPORTED_MEDIA_TYPE;
     logger.warn(
         "Content-Type header of incoming POST request is not application/json");
     return false;
   }
 
-  auto parsedJson = json::parse(http_body, nullptr, false);
-  if (parsedJson.is_discarded()) {
-    status = HTTPStatus::BAD_REQUEST;
-    logger.warn("POST request contains invalid JSON");
-    return false;
-  }
+  upload_accepted = true;
+  return true;
+}
 
-  // Now that the JSON is valid
-  // We can simply write the JSON content to res/uploads
-  auto current_ts =
-      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  auto uid = generate_random_id(10);
-  std::string filename =
-      "upload_" + std::to_string(current_ts) + "_" + uid + ".json";
-  std::filesystem::path path_to_write = SERVER_ROOT / "uploads" / filename;
-
-  bool written = write_file(http_body, path_to_write);
-  if (!written) {
-    status = HTTPStatus::INTERNAL_SERVER_ERROR;
-    logger.warn("Failed to write to file in POST request");
+bool HTTPParser::process_POST_request() {
+  // We only process JSON uploads
+  if (!accept_upload()) {
     return false;
   }
 
-  status = HTTPStatus::CREATED;
+  // The whole body is already here, write it out the same way a streamed
+  // body is: validated and written to a temp file, then renamed into place
+  UploadWriter upload(uploadsPath());
+  upload.write(http_body);
+  upload.commit();
+  finishUpload(upload.status(), upload.filename());
+
+  return status == HTTPStatus::CREATED;
+}
+
+bool HTTPParser::acceptsBody() const { return upload_accepted; }
+
+void HTTPParser::finishUpload(HTTPStatus upload_status,
+                              const std::string &filename) {
+  status = upload_status;
+  if (status != HTTPStatus::CREATED) {
+    return;
+  }
 
   std::string json_response =
       std::string("{ \"status\" : \"success\", \"message\" : \"File created "
                   "successfully\", \"filepath\" : \"uploads/") +
       filename + "\" }";
   response_body = json_response;
+}
 
-  return true;
+void HTTPParser::setConnectionClose() { force_close = true; }
+
+std::chrono::steady_clock::time_point HTTPParser::parsedAt() const {
+  return parsed_at;
+}
+
+HTTPStatus HTTPParser::httpStatus() const { return status; }
+
+HTTPMethod HTTPParser::httpMethod() const { return http_method; }
+
+const HTTPRequest &HTTPParser::httpRequest() const { return http_request; }
+
+std::filesystem::path HTTPParser::uploadsPath() const {
+  return SERVER_ROOT / "uploads";
 }
 
-bool HTTPParser::process_request() {
+// Find the route of the request
+// Following are the steps:-
+//      i) Normalize the route, so that every handler sees one that can't
+//         escape the SERVER_ROOT. A route that is normal already, nearly
+//         every one, is left as it is
+//      ii) Look it up with the method, 404 if no route takes both
+bool HTTPParser::match_route(RouteMatch &match) {
   Logging logger;
-  logger.setClassName("HTTPParser::process_request");
+  logger.setClassName("HTTPParser::match_route");
 
-  if (http_method == "GET") {
-    return process_GET_request();
-  } else if (http_method == "POST") {
-    return process_POST_request();
-  } else {
-    status = HTTPStatus::BAD_REQUEST;
-    logger.warn("Unknown request method used - " + http_method);
+  if (!sanitize_route(http_route, normalized_route)) {
+    status = HTTPStatus::FORBIDDEN;
+    logger.warn("Path traversal attempt blocked. Route tried to escape the "
+                "SERVER ROOT");
+    return false;
+  }
+
+  if (!Router::instance().find(http_method, http_route, match)) {
+    status = HTTPStatus::NOT_FOUND;
+    logger.warn("{} request on endpoint {} is not found", http_request.method,
+                http_route);
+    return false;
+  }
+  return true;
+}
+
+bool HTTPParser::process_request(bool head_only) {
+  RouteMatch match;
+  if (!match_route(match)) {
     return false;
   }
+
+  // The body of a streamed request has not arrived yet, a route that takes
+  // it only checks whether we want it
+  if (head_only && match.route->accept_body) {
+    return match.route->accept_body(*this, match);
+  }
+  return match.route->handler(*this, match);
+}
+
+void HTTPParser::setResponse(HTTPStatus response_status, std::string body,
+                             HTTPContentType response_content_type) {
+  status = response_status;
+  response_body = std::move(body);
+  content_type = response_content_type;
 }
 
 const std::string HTTPParser::getResponse() {
+  return buildResponse().to_string();
+}
+
+HTTPResponse HTTPParser::buildResponse() {
   HTTPResponseBuilder builder(http_version, status, response_body, content_type,
-                              http_headers, http_requested_filename);
-  auto response = builder.build();
+                              http_request, http_requested_filename,
+                              cached_file, memory);
+  builder.setByteRanges(byte_ranges);
+  if (force_close) {
+    builder.setConnectionClose();
+  }
+  auto response = builder.build_response();
+  keep_alive = builder.isKeepAlive();
   return response;
-}
\ No newline at end of file
+}
+
+bool HTTPParser::keepAlive() const { return keep_alive; }
+
+void add_builtin_routes(Router &router) {
+  // The metrics have a route of their own, which shadows any file
+  if (!METRICS_PATH.empty()) {
+    router.add(HTTPMethod::GET, METRICS_PATH,
+               [](HTTPParser &parser, const RouteMatch &) {
+                 parser.setResponse(HTTPStatus::OK,
+                                    Metrics::render_prometheus(),
+                                    HTTPContentType::TEXT);
+                 return true;
+               });
+  }
+
+  router.add(
+      HTTPMethod::POST, "/upload",
+      [](HTTPParser &parser, const RouteMatch &) {
+        return parser.process_POST_request();
+      },
+      [](HTTPParser &parser, const RouteMatch &) {
+        return parser.accept_upload();
+      });
+
+  router.add(HTTPMethod::GET, "/*path",
+             [](HTTPParser &parser, const RouteMatch &match) {
+               return parser.process_GET_request(match.param("path"));
+             });
+}
@@ -0,0 +1,96 @@
+#include <http_range.h>
+#include <util.h>
+#include <optional>
+
+// Parses a non-empty run of digits
+static std::optional<size_t> parse_offset(std::string_view digits) {
+  if (digits.empty() || digits.size() > 18) {
+    return std::nullopt;
+  }
+
+  size_t value = 0;
+  for (char c : digits) {
+    if (c < '0' || c > '9') {
+      return std::nullopt;
+    }
+    value = value * 10 + (c - '0');
+  }
+  return value;
+}
+
+static std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+RangeResult parse_range_header(std::string_view value, size_t file_size,
+                               std::pmr::vector<ByteRange> &ranges) {
+  ranges.clear();
+
+  static constexpr std::string_view unit = "bytes=";
+  if (value.size() < unit.size() ||
+      !iequals(value.substr(0, unit.size()), unit)) {
+    return RangeResult::IGNORE;
+  }
+  value.remove_prefix(unit.size());
+
+  size_t spec_count = 0;
+  while (!value.empty()) {
+    size_t comma = value.find(',');
+    std::string_view spec = trim(value.substr(0, comma));
+    value = comma == std::string_view::npos ? std::string_view()
+                                            : value.substr(comma + 1);
+    if (spec.empty()) {
+      continue;
+    }
+    if (++spec_count > MAX_BYTE_RANGES) {
+      return RangeResult::IGNORE;
+    }
+
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      return RangeResult::IGNORE;
+    }
+
+    if (dash == 0) {
+      // Suffix range: the last n bytes of the file
+      auto suffix_length = parse_offset(spec.substr(1));
+      if (!suffix_length) {
+        return RangeResult::IGNORE;
+      }
+      if (*suffix_length > 0 && file_size > 0) {
+        size_t length = std::min(*suffix_length, file_size);
+        ranges.push_back({file_size - length, file_size - 1});
+      }
+      continue;
+    }
+
+    auto first = parse_offset(spec.substr(0, dash));
+    if (!first) {
+      return RangeResult::IGNORE;
+    }
+    size_t last = file_size - 1;
+    if (dash + 1 < spec.size()) {
+      auto parsed_last = parse_offset(spec.substr(dash + 1));
+      if (!parsed_last || *parsed_last < *first) {
+        return RangeResult::IGNORE;
+      }
+      last = std::min(*parsed_last, file_size - 1);
+    }
+
+    if (*first < file_size) {
+      ranges.push_back({*first, last});
+    }
+  }
+
+  if (spec_count == 0) {
+    return RangeResult::IGNORE;
+  }
+  return ranges.empty() ? RangeResult::UNSATISFIABLE
+                        : RangeResult::SATISFIABLE;
+}
@@ -0,0 +1,203 @@
+#include <http_request_parser.h>
+#include <http_scanner.h>
+#include <util.h>
+#include <algorithm>
+
+static constexpr size_t NPOS = std::string_view::npos;
+
+std::optional<std::string_view>
+HTTPRequest::header(std::string_view name) const {
+  for (size_t i = 0; i < header_count; i++) {
+    if (iequals(headers[i].name, name)) {
+      return headers[i].value;
+    }
+  }
+  return std::nullopt;
+}
+
+static bool is_whitespace(char c) { return c == ' ' || c == '\t'; }
+
+ParseResult HTTPRequestParser::parse(std::string_view buffer,
+                                     HTTPRequest &request) {
+  if (state == State::FAILED) {
+    return ParseResult::ERROR;
+  }
+
+  // STEP 1
+  // Consume complete lines: the request line first, then one header per line
+  // until the empty line that ends the request metadata
+  while (state == State::REQUEST_LINE || state == State::HEADERS) {
+    // Find the end of the line, the header colon and any control character
+    // in one pass. Bytes of a partial line that were already scanned by a
+    // previous call are skipped, their findings are kept in line_colon and
+    // line_invalid
+    const char *line_start = buffer.data() + position;
+    size_t scan_from = std::max(position, scan_position);
+    LineScan scan =
+        scan_line(buffer.data() + scan_from, buffer.size() - scan_from);
+    if (line_colon == NPOS && scan.colon != NPOS) {
+      line_colon = scan_from + scan.colon;
+    }
+    if (line_invalid == NPOS && scan.invalid != NPOS) {
+      line_invalid = scan_from + scan.invalid;
+    }
+    if (scan_from + scan.newline == buffer.size()) {
+      scan_position = buffer.size();
+      return ParseResult::NEED_MORE;
+    }
+    size_t newline = scan_from + scan.newline;
+
+    // Lines have to end with \r\n, a bare \n is malformed. The \r is the
+    // only control character allowed in a line
+    ParseError line_error = state == State::REQUEST_LINE
+                                ? ParseError::MALFORMED_REQUEST_LINE
+                                : ParseError::MALFORMED_HEADER;
+    size_t line_length = newline - position;
+    if (line_length == 0 || line_start[line_length - 1] != '\r' ||
+        (line_invalid != NPOS && line_invalid != newline - 1)) {
+      return fail(line_error);
+    }
+    std::string_view line(line_start, line_length - 1);
+    size_t line_offset = position;
+    size_t colon = line_colon == NPOS ? NPOS : line_colon - line_offset;
+    position = newline + 1;
+    scan_position = position;
+    line_colon = NPOS;
+    line_invalid = NPOS;
+
+    if (state == State::REQUEST_LINE) {
+      if (!parse_request_line(line, line_offset)) {
+        return fail(ParseError::MALFORMED_REQUEST_LINE);
+      }
+      state = State::HEADERS;
+    } else if (line.empty()) {
+      body_offset = position;
+      state = State::BODY;
+    } else if (!parse_header_line(line, line_offset, colon)) {
+      return fail(parse_error == ParseError::NONE ? ParseError::MALFORMED_HEADER
+                                                  : parse_error);
+    }
+  }
+
+  // STEP 2
+  // The body is exactly Content-Length bytes long, unless it is not
+  // wanted here at all
+  if (state == State::BODY && head_only) {
+    content_length = 0;
+  }
+  if (state == State::BODY) {
+    if (buffer.size() - body_offset < content_length) {
+      return ParseResult::NEED_MORE;
+    }
+    position = body_offset + content_length;
+    state = State::DONE;
+  }
+
+  // STEP 3
+  // Hand out views into the buffer now that it holds the whole request
+  auto view = [&buffer](Span span) {
+    return buffer.substr(span.offset, span.length);
+  };
+  request.method = view(method);
+  request.route = view(route);
+  request.version = view(version);
+  request.header_count = header_count;
+  for (size_t i = 0; i < header_count; i++) {
+    request.headers[i].name = view(header_names[i]);
+    request.headers[i].value = view(header_values[i]);
+  }
+  request.body = buffer.substr(body_offset, content_length);
+
+  return ParseResult::COMPLETE;
+}
+
+ParseResult HTTPRequestParser::parse_head(std::string_view buffer,
+                                          HTTPRequest &request) {
+  head_only = true;
+  return parse(buffer, request);
+}
+
+// Request line: <method> SP <route> SP <version>
+bool HTTPRequestParser::parse_request_line(std::string_view line,
+                                           size_t line_offset) {
+  size_t first_space = line.find(' ');
+  if (first_space == std::string_view::npos ||
+      !is_token(line.substr(0, first_space))) {
+    return false;
+  }
+  size_t second_space = line.find(' ', first_space + 1);
+  if (second_space == std::string_view::npos ||
+      second_space == first_space + 1 || second_space + 1 == line.size() ||
+      line.find(' ', second_space + 1) != std::string_view::npos) {
+    return false;
+  }
+
+  method = {static_cast<uint32_t>(line_offset),
+            static_cast<uint32_t>(first_space)};
+  route = {static_cast<uint32_t>(line_offset + first_space + 1),
+           static_cast<uint32_t>(second_space - first_space - 1)};
+  version = {static_cast<uint32_t>(line_offset + second_space + 1),
+             static_cast<uint32_t>(line.size() - second_space - 1)};
+  return true;
+}
+
+// Header line: <name> ":" OWS <value> OWS
+bool HTTPRequestParser::parse_header_line(std::string_view line,
+                                          size_t line_offset, size_t colon) {
+  if (colon == NPOS || !is_token(line.substr(0, colon))) {
+    return false;
+  }
+
+  if (header_count == HTTPRequest::MAX_HEADERS) {
+    parse_error = ParseError::TOO_MANY_HEADERS;
+    return false;
+  }
+
+  size_t value_start = colon + 1;
+  size_t value_end = line.size();
+  while (value_start < value_end && is_whitespace(line[value_start])) {
+    value_start++;
+  }
+  while (value_end > value_start && is_whitespace(line[value_end - 1])) {
+    value_end--;
+  }
+
+  std::string_view name = line.substr(0, colon);
+  std::string_view value = line.substr(value_start, value_end - value_start);
+
+  if (iequals(name, "Content-Length")) {
+    if (value.empty() || value.size() > 18) {
+      parse_error = ParseError::INVALID_CONTENT_LENGTH;
+      return false;
+    }
+    size_t length = 0;
+    for (char c : value) {
+      if (c < '0' || c > '9') {
+        parse_error = ParseError::INVALID_CONTENT_LENGTH;
+        return false;
+      }
+      length = length * 10 + (c - '0');
+    }
+    content_length = length;
+  }
+
+  header_names[header_count] = {static_cast<uint32_t>(line_offset),
+                                static_cast<uint32_t>(colon)};
+  header_values[header_count] = {
+      static_cast<uint32_t>(line_offset + value_start),
+      static_cast<uint32_t>(value.size())};
+  header_count++;
+  return true;
+}
+
+ParseResult HTTPRequestParser::fail(ParseError error) {
+  parse_error = error;
+  state = State::FAILED;
+  return ParseResult::ERROR;
+}
+
+void HTTPRequestParser::reset() { *this = HTTPRequestParser(); }
+
+size_t HTTPRequestParser::consumed() const { return position; }
+
+ParseError HTTPRequestParser::error() const { return parse_error; }
@@ -0,0 +1,358 @@
+#include <http_response.h>
+#include <metrics.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Maximum number of memory chunks gathered into one sendmsg() call
+static const size_t MAX_IOVECS = 64;
+
+// Largest region handed to a single sendfile() call
+static const size_t MAX_SENDFILE_LENGTH = 1 << 30;
+
+FileHandle::~FileHandle() { close(fd); }
+
+std::string_view ResponseChunk::bytes() const {
+  if (owner) {
+    return borrowed;
+  }
+  return owned;
+}
+
+size_t ResponseChunk::size() const {
+  if (is_file()) {
+    return file_length;
+  }
+  if (staged) {
+    return staged_length;
+  }
+  return bytes().size();
+}
+
+ResponseHead::ResponseHead(const ResponseHead &other)
+    : inline_size(other.inline_size), overflow(other.overflow) {
+  std::memcpy(inline_bytes.data(), other.inline_bytes.data(), inline_size);
+}
+
+ResponseHead &ResponseHead::operator=(const ResponseHead &other) {
+  if (this != &other) {
+    inline_size = other.inline_size;
+    overflow = other.overflow;
+    std::memcpy(inline_bytes.data(), other.inline_bytes.data(), inline_size);
+  }
+  return *this;
+}
+
+ResponseHead::ResponseHead(ResponseHead &&other) noexcept
+    : inline_size(other.inline_size), overflow(std::move(other.overflow)) {
+  std::memcpy(inline_bytes.data(), other.inline_bytes.data(), inline_size);
+}
+
+ResponseHead &ResponseHead::operator=(ResponseHead &&other) noexcept {
+  if (this != &other) {
+    inline_size = other.inline_size;
+    overflow = std::move(other.overflow);
+    std::memcpy(inline_bytes.data(), other.inline_bytes.data(), inline_size);
+  }
+  return *this;
+}
+
+void ResponseHead::append(std::string_view bytes) {
+  if (overflow.empty() && inline_size + bytes.size() <= INLINE_CAPACITY) {
+    bytes.copy(inline_bytes.data() + inline_size, bytes.size());
+    inline_size += bytes.size();
+    return;
+  }
+  if (overflow.empty()) {
+    overflow.reserve(2 * INLINE_CAPACITY);
+    overflow.assign(inline_bytes.data(), inline_size);
+  }
+  overflow += bytes;
+}
+
+void ResponseHead::append_number(uint64_t value) {
+  char digits[20];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  append(std::string_view(digits, result.ptr - digits));
+}
+
+std::string_view ResponseHead::bytes() const {
+  if (!overflow.empty()) {
+    return overflow;
+  }
+  return std::string_view(inline_bytes.data(), inline_size);
+}
+
+size_t ResponseHead::size() const { return bytes().size(); }
+
+bool ResponseHead::empty() const { return size() == 0; }
+
+void HTTPResponse::append(std::string bytes) {
+  ResponseChunk chunk;
+  chunk.owned = std::move(bytes);
+  chunks.push_back(std::move(chunk));
+}
+
+void HTTPResponse::append(std::string_view bytes,
+                          std::shared_ptr<const void> owner) {
+  ResponseChunk chunk;
+  chunk.borrowed = bytes;
+  chunk.owner = std::move(owner);
+  chunks.push_back(std::move(chunk));
+}
+
+void HTTPResponse::append_file(std::shared_ptr<const FileHandle> file,
+                               off_t offset, size_t length) {
+  ResponseChunk chunk;
+  chunk.file = std::move(file);
+  chunk.file_offset = offset;
+  chunk.file_length = length;
+  chunks.push_back(std::move(chunk));
+}
+
+size_t HTTPResponse::size() const {
+  size_t total = head.size();
+  for (const auto &chunk : chunks) {
+    total += chunk.size();
+  }
+  return total;
+}
+
+std::string HTTPResponse::to_string() const {
+  std::string result;
+  result.reserve(size());
+  result += head.bytes();
+
+  for (const auto &chunk : chunks) {
+    if (!chunk.is_file()) {
+      result += chunk.bytes();
+      continue;
+    }
+
+    size_t start = result.size();
+    result.resize(start + chunk.file_length);
+    size_t total_read = 0;
+    while (total_read < chunk.file_length) {
+      ssize_t bytes_read =
+          pread(chunk.file->fd, result.data() + start + total_read,
+                chunk.file_length - total_read, chunk.file_offset + total_read);
+      if (bytes_read <= 0) {
+        break;
+      }
+      total_read += bytes_read;
+    }
+    result.resize(start + total_read);
+  }
+
+  return result;
+}
+
+void OutputQueue::push(HTTPResponse &&response) {
+  if (chunks.empty()) {
+    write_started = std::chrono::steady_clock::now();
+  }
+
+  size_t size = 0;
+  if (!response.head.empty()) {
+    std::string_view head = response.head.bytes();
+    ResponseChunk chunk;
+    chunk.staged = true;
+    chunk.staged_offset = staged.size();
+    chunk.staged_length = head.size();
+    staged += head;
+    size += head.size();
+    chunks.push_back(std::move(chunk));
+  }
+  for (auto &chunk : response.chunks) {
+    size += chunk.size();
+    chunks.push_back(std::move(chunk));
+  }
+  response.chunks.clear();
+
+  bytes_pushed += size;
+  if (response.access) {
+    response.access->bytes = size;
+    records.push_back({bytes_pushed, std::chrono::steady_clock::now(),
+                       std::move(response.access)});
+  }
+}
+
+bool OutputQueue::empty() const { return chunks.empty(); }
+
+uint64_t OutputQueue::written() const { return bytes_written; }
+
+void OutputQueue::clear() {
+  // The responses that never made it out are still logged
+  log_written_records(true);
+  chunks.clear();
+  front_offset = 0;
+  staged.clear();
+}
+
+std::string_view OutputQueue::bytes_of(const ResponseChunk &chunk) const {
+  if (chunk.staged) {
+    return std::string_view(staged).substr(chunk.staged_offset,
+                                           chunk.staged_length);
+  }
+  return chunk.bytes();
+}
+
+WriteResult OutputQueue::write_to(int socket_fd) {
+  while (!chunks.empty()) {
+    if (chunks.front().size() == 0) {
+      consume(0);
+      continue;
+    }
+
+    WriteResult result = chunks.front().is_file()
+                             ? write_file_chunk(socket_fd)
+                             : write_memory_chunks(socket_fd);
+    if (result != WriteResult::DONE) {
+      return result;
+    }
+  }
+  return WriteResult::DONE;
+}
+
+size_t OutputQueue::gather(size_t &index, iovec *iovecs, size_t max) const {
+  size_t count = 0;
+  for (; index < chunks.size() && count < max; index++) {
+    const ResponseChunk &chunk = chunks[index];
+    if (chunk.is_file()) {
+      break;
+    }
+    std::string_view bytes =
+        bytes_of(chunk).substr(index == 0 ? front_offset : 0);
+    iovecs[count].iov_base = const_cast<char *>(bytes.data());
+    iovecs[count].iov_len = bytes.size();
+    count++;
+  }
+  return count;
+}
+
+bool OutputQueue::file_at(size_t index, int &fd, off_t &offset,
+                          size_t &length) const {
+  if (index >= chunks.size() || !chunks[index].is_file()) {
+    return false;
+  }
+  const ResponseChunk &chunk = chunks[index];
+  size_t skip = index == 0 ? front_offset : 0;
+  fd = chunk.file->fd;
+  offset = chunk.file_offset + skip;
+  length = chunk.file_length - skip;
+  return true;
+}
+
+size_t OutputQueue::chunk_count() const { return chunks.size(); }
+
+WriteResult OutputQueue::write_memory_chunks(int socket_fd) {
+  // Gather the memory chunks up to the next file region
+  iovec iovecs[MAX_IOVECS];
+  size_t next = 0;
+  size_t iovec_count = gather(next, iovecs, MAX_IOVECS);
+
+  // If a file region follows, MSG_MORE lets the kernel put the headers and
+  // the start of the file in the same segment
+  bool more_follows = next < chunks.size();
+
+  msghdr message{};
+  message.msg_iov = iovecs;
+  message.msg_iovlen = iovec_count;
+
+  while (true) {
+    ssize_t written = sendmsg(socket_fd, &message,
+                              MSG_NOSIGNAL | (more_follows ? MSG_MORE : 0));
+    if (written == -1 && errno == ENOTSOCK) {
+      written = writev(socket_fd, iovecs, iovec_count);
+    }
+
+    if (written >= 0) {
+      consume(written);
+      return WriteResult::DONE;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return WriteResult::AGAIN;
+    }
+    return WriteResult::ERROR;
+  }
+}
+
+WriteResult OutputQueue::write_file_chunk(int socket_fd) {
+  int fd = -1;
+  off_t offset = 0;
+  size_t length = 0;
+  // Only called with a file region at the front of the queue
+  if (!file_at(0, fd, offset, length)) {
+    return WriteResult::ERROR;
+  }
+  length = std::min(length, MAX_SENDFILE_LENGTH);
+
+  while (true) {
+    ssize_t written = sendfile(socket_fd, fd, &offset, length);
+    if (written > 0) {
+      consume(written);
+      return WriteResult::DONE;
+    }
+    if (written == 0) {
+      // The file got shorter than the Content-Length we promised, the only
+      // way out is to drop the connection
+      return WriteResult::ERROR;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return WriteResult::AGAIN;
+    }
+    return WriteResult::ERROR;
+  }
+}
+
+void OutputQueue::consume(size_t written) {
+  bytes_written += written;
+  if (!records.empty()) {
+    log_written_records(false);
+  }
+
+  while (written > 0 && !chunks.empty()) {
+    size_t remaining = chunks.front().size() - front_offset;
+    if (written < remaining) {
+      front_offset += written;
+      return;
+    }
+    written -= remaining;
+    chunks.pop_front();
+    front_offset = 0;
+  }
+
+  // Empty chunks, e.g. of an empty body, never go out on their own
+  while (!chunks.empty() && chunks.front().size() == 0) {
+    chunks.pop_front();
+  }
+
+  // Everything is out, the buffer of heads starts over with its capacity
+  // kept for the next responses
+  if (chunks.empty()) {
+    Metrics::record(MetricStage::WRITE, write_started,
+                    std::chrono::steady_clock::now());
+    staged.clear();
+  }
+}
+
+void OutputQueue::log_written_records(bool all) {
+  auto now = std::chrono::steady_clock::now();
+  while (!records.empty() && (all || records.front().end <= bytes_written)) {
+    AccessRecord &record = *records.front().record;
+    record.write_us = elapsed_us(records.front().queued, now);
+    AccessLog::instance().write(record);
+    records.pop_front();
+  }
+}
@@ -1,106 +1,338 @@
 #include <http_response_builder.h>
 #include <http_parser.h>
+#include <access_log.h>
+#include <content_encoding.h>
+#include <error_responses.h>
+#include <file_cache.h>
 #include <util.h>
+#include <chrono>
+#include <iterator>
 #include <string>
 #include <logging/Logging.h>
 
+namespace {
+
+struct StatusEntry {
+  HTTPStatus status;
+  uint16_t code;
+  std::string_view line;
+};
+
+// Indexed by HTTPStatus
+constexpr StatusEntry STATUS_TABLE[] = {
+    {HTTPStatus::BAD_REQUEST, 400, "400 Bad Request"},
+    {HTTPStatus::UNSUPPORTED_METHOD, 405, "405 Method Not Allowed"},
+    {HTTPStatus::OK, 200, "200 OK"},
+    {HTTPStatus::NOT_FOUND, 404, "404 Not Found"},
+    {HTTPStatus::FORBIDDEN, 403, "403 Forbidden"},
+    {HTTPStatus::UNSUPPORTED_MEDIA_TYPE, 415, "415 Unsupported Media Type"},
+    {HTTPStatus::INTERNAL_SERVER_ERROR, 500, "500 Internal Server Error"},
+    {HTTPStatus::CREATED, 201, "201 Created"},
+    {HTTPStatus::PARTIAL_CONTENT, 206, "206 Partial Content"},
+    {HTTPStatus::RANGE_NOT_SATISFIABLE, 416, "416 Range Not Satisfiable"},
+    {HTTPStatus::NOT_MODIFIED, 304, "304 Not Modified"},
+    {HTTPStatus::REQUEST_HEADER_FIELDS_TOO_LARGE, 431,
+     "431 Request Header Fields Too Large"},
+    {HTTPStatus::PAYLOAD_TOO_LARGE, 413, "413 Content Too Large"},
+    {HTTPStatus::REQUEST_TIMEOUT, 408, "408 Request Timeout"},
+    {HTTPStatus::NOT_IMPLEMENTED, 501, "501 Not Implemented"},
+};
+
+struct ContentTypeEntry {
+  HTTPContentType content_type;
+  std::string_view name;
+};
+
+// Indexed by HTTPContentType
+constexpr ContentTypeEntry CONTENT_TYPE_TABLE[] = {
+    {HTTPContentType::HTML, "text/html"},
+    {HTTPContentType::PNG, "image/png"},
+    {HTTPContentType::JPG, "image/jpg"},
+    {HTTPContentType::JPEG, "image/jpeg"},
+    {HTTPContentType::GIF, "image/gif"},
+    {HTTPContentType::ICO, "image/x-icon"},
+    {HTTPContentType::TEXT, "text/plain"},
+    {HTTPContentType::JSON, "application/json"},
+    {HTTPContentType::OCTET_STREAM, "application/octet-stream"},
+    {HTTPContentType::JS, "application/javascript"},
+    {HTTPContentType::CSS, "text/css"},
+};
+
+constexpr bool tables_are_indexed() {
+  for (size_t i = 0; i < std::size(STATUS_TABLE); i++) {
+    if (STATUS_TABLE[i].status != static_cast<HTTPStatus>(i)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < std::size(CONTENT_TYPE_TABLE); i++) {
+    if (CONTENT_TYPE_TABLE[i].content_type != static_cast<HTTPContentType>(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(tables_are_indexed(),
+              "the tables must list every enum value in declaration order");
+static_assert(std::size(STATUS_TABLE) == HTTPStatus::NOT_IMPLEMENTED + 1);
+static_assert(std::size(CONTENT_TYPE_TABLE) == HTTPContentType::CSS + 1);
+
+const StatusEntry &status_entry(HTTPStatus status) {
+  if (static_cast<size_t>(status) >= std::size(STATUS_TABLE)) {
+    return STATUS_TABLE[HTTPStatus::INTERNAL_SERVER_ERROR];
+  }
+  return STATUS_TABLE[status];
+}
+
+} // namespace
+
+uint16_t http_status_code(HTTPStatus status) {
+  return status_entry(status).code;
+}
+
+std::string_view http_status_line(HTTPStatus status) {
+  return status_entry(status).line;
+}
+
+std::string_view content_type_name(HTTPContentType content_type) {
+  if (static_cast<size_t>(content_type) >= std::size(CONTENT_TYPE_TABLE)) {
+    return CONTENT_TYPE_TABLE[HTTPContentType::OCTET_STREAM].name;
+  }
+  return CONTENT_TYPE_TABLE[content_type].name;
+}
+
 HTTPResponseBuilder::HTTPResponseBuilder(
-    const std::string &version, HTTPStatus status,
+    std::string_view version, HTTPStatus status,
     const std::string &response_body, HTTPContentType content_type,
-    std::unordered_map<std::string, std::string> &http_headers,
-    std::optional<std::string> &http_requested_filename)
+    const HTTPRequest &http_request,
+    const std::optional<std::string> &http_requested_filename,
+    std::shared_ptr<const CachedFile> cached_file,
+    std::pmr::memory_resource *memory)
     : version(version), status(status), response_body(response_body),
-      content_type(content_type), http_headers(http_headers),
-      http_requested_filename(http_requested_filename) {
-  httpcode_string_map[HTTPStatus::OK] = "200 OK";
-  httpcode_string_map[HTTPStatus::NOT_FOUND] = "404 Not Found";
-  httpcode_string_map[HTTPStatus::BAD_REQUEST] = "400 Bad Request";
-  httpcode_string_map[HTTPStatus::FORBIDDEN] = "403 Forbidden";
-  httpcode_string_map[HTTPStatus::UNSUPPORTED_METHOD] =
-      "405 Method Not Allowed";
-  httpcode_string_map[HTTPStatus::CREATED] = "201 Created";
-
-  contenttype_string_map[HTTPContentType::HTML] = "text/html";
-  contenttype_string_map[HTTPContentType::PNG] = "image/png";
-  contenttype_string_map[HTTPContentType::JPG] = "image/jpg";
-  contenttype_string_map[HTTPContentType::JPEG] = "image/jpeg";
-  contenttype_string_map[HTTPContentType::GIF] = "image/gif";
-  contenttype_string_map[HTTPContentType::ICO] = "image/x-icon";
-  contenttype_string_map[HTTPContentType::TEXT] = "text/plain";
-  contenttype_string_map[HTTPContentType::JSON] = "application/json";
-  contenttype_string_map[HTTPContentType::OCTET_STREAM] =
-      "application/octet-stream";
-      contenttype_string_map[HTTPContentType::JS] = "application/javascript";
-      contenttype_string_map[HTTPContentType::CSS] = "text/css";
+      cached_file(std::move(cached_file)), content_type(content_type),
+      http_request(http_request),
+      http_requested_filename(http_requested_filename), memory(memory) {}
+
+void HTTPResponseBuilder::setByteRanges(std::span<const ByteRange> ranges) {
+  byte_ranges = ranges;
 }
 
-std::string HTTPResponseBuilder::build() {
-  Logging logger;
-  logger.setClassName("HTTPResponseBuilder::build");
+void HTTPResponseBuilder::setConnectionClose() { force_close = true; }
 
-  if (status == HTTPStatus::FORBIDDEN) {
-    response_body = forbidden_body;
-    content_type = HTTPContentType::HTML;
-  } else if (status == HTTPStatus::NOT_FOUND) {
-    response_body = not_found_body;
-    content_type = HTTPContentType::HTML;
-  } else if (status == HTTPStatus::BAD_REQUEST) {
-    response_body = bad_request_body;
-    content_type = HTTPContentType::HTML;
-  } else if (status == HTTPStatus::UNSUPPORTED_METHOD) {
-    response_body = method_not_allowed_body;
+std::string HTTPResponseBuilder::build() { return build_response().to_string(); }
+
+HTTPResponse HTTPResponseBuilder::build_response() {
+  const StatusEntry &entry = status_entry(status);
+  keep_alive = decide_keep_alive();
+
+  // Errors are copied from their prebuilt responses, unless they describe a
+  // file (a 416 carries its size)
+  HTTPResponse response;
+  std::string_view error_page = ErrorResponses::instance().page(status);
+  if (!error_page.empty()) {
+    if (cached_file == nullptr &&
+        ErrorResponses::instance().build(status, version, keep_alive,
+                                         response)) {
+      finish(response);
+      return response;
+    }
+    response_body = error_page;
     content_type = HTTPContentType::HTML;
   }
 
-  std::string ct = contenttype_string_map[content_type];
+  std::string_view ct = content_type_name(content_type);
 
-  int content_length = response_body.size();
+  // A file from the cache carries its body and length precomputed
+  // Large files have no body in memory, they are sent from their descriptor
+  bool serve_file = status == HTTPStatus::OK && cached_file != nullptr;
+  bool serve_ranges = status == HTTPStatus::PARTIAL_CONTENT &&
+                      cached_file != nullptr && !byte_ranges.empty();
+  size_t content_length = response_body.size();
+  if (serve_file) {
+    content_length = cached_file->size;
+  } else if (serve_ranges) {
+    content_length = byte_ranges.front().length();
+  }
 
-  // Decide whether the connection should be keep-alive or Close
-  // First we check if we got a Connection header from the client
-  std::string connection_status = "close";
-  if (version == "HTTP/1.1")
-    connection_status = "keep-alive";
-  if (version == "HTTP/1.0")
-    connection_status = "close";
-  if (http_headers.count("Connection") == 1) {
-    if (http_headers["Connection"] == "keep-alive") {
-      connection_status = "keep-alive";
-    } else {
-      connection_status = "close";
+  // Several ranges are sent as a multipart/byteranges body. Each part gets
+  // its own small header, the data in between comes straight from the file
+  //      --<boundary>
+  //      Content-Type: <type of the file>
+  //      Content-Range: bytes <first>-<last>/<size>
+  //
+  //      <data>
+  // and the body ends with --<boundary>--
+  // The part headers become body chunks, only the list of them is temporary
+  std::pmr::vector<std::string> part_headers(memory);
+  std::string closing_boundary;
+  std::string multipart_type;
+  if (serve_ranges && byte_ranges.size() > 1) {
+    std::string boundary = generate_random_id(24);
+    std::string file_size = std::to_string(cached_file->size);
+    part_headers.reserve(byte_ranges.size());
+    content_length = 0;
+    for (const auto &range : byte_ranges) {
+      std::string part = "\r\n--" + boundary + "\r\nContent-Type: " +
+                         std::string(ct) + "\r\nContent-Range: bytes " +
+                         std::to_string(range.first) + "-" +
+                         std::to_string(range.last) + "/" + file_size +
+                         "\r\n\r\n";
+      content_length += part.size() + range.length();
+      part_headers.push_back(std::move(part));
     }
+    closing_boundary = "\r\n--" + boundary + "--\r\n";
+    content_length += closing_boundary.size();
+
+    multipart_type = "multipart/byteranges; boundary=" + boundary;
+    ct = multipart_type;
   }
 
-  auto current_date = get_rfc7231_date();
+  // Serialize the headers straight into the head of the response, sorted by
+  // name. Every value is either a constant, a view into the cached file or a
+  // number, so nothing here allocates
+  response.keep_alive = keep_alive;
+  ResponseHead &head = response.head;
+  auto header = [&head](std::string_view name, std::string_view value) {
+    head.append(name);
+    head.append(": ");
+    head.append(value);
+    head.append("\r\n");
+  };
+
+  head.append(version);
+  head.append(" ");
+  head.append(entry.line);
+  head.append("\r\n");
 
-  std::map<std::string, std::string> response_headers;
-  response_headers["Content-Type"] = ct;
-  response_headers["Content-Length"] = std::to_string(content_length);
-  response_headers["Connection"] = connection_status;
-  response_headers["Server"] = "gigachad-cpp-server by Ojas Maheshwari";
-  response_headers["Date"] = current_date;
+  // Files can be fetched in parts and revalidated, tell the client so
+  if (cached_file != nullptr) {
+    header("Accept-Ranges", "bytes");
+  }
+  header("Connection", keep_alive ? "keep-alive" : "close");
 
   // If binary data is to be served then include additional content-disposition
-  // header
-  if (content_type == HTTPContentType::OCTET_STREAM &&
+  // header. A 304 only carries the validators, it has no body and so no
+  // Content-Type or Content-Length
+  bool not_modified = status == HTTPStatus::NOT_MODIFIED;
+  if (!not_modified && content_type == HTTPContentType::OCTET_STREAM &&
       http_requested_filename.has_value()) {
-    response_headers["Content-Disposition"] =
-        std::string("attachment; filename=") + http_requested_filename.value();
+    head.append("Content-Disposition: attachment; filename=");
+    head.append(*http_requested_filename);
+    head.append("\r\n");
   }
 
-  // Convert response headers into string form
-  // This should have been a separate function but nvm
-
-  std::string response = version + " " + httpcode_string_map[status] + "\r\n";
-  for (const auto &[key, value] : response_headers) {
-    response += key + ": " + value + "\r\n";
+  // Text files may be sent compressed depending on Accept-Encoding, so
+  // caches must key them on it
+  if (cached_file != nullptr &&
+      cached_file->encoding != ContentEncoding::IDENTITY) {
+    header("Content-Encoding", content_encoding_name(cached_file->encoding));
+  }
+  if (!not_modified) {
+    head.append("Content-Length: ");
+    head.append_number(content_length);
+    head.append("\r\n");
+  }
+  if (serve_ranges && byte_ranges.size() == 1) {
+    head.append("Content-Range: bytes ");
+    head.append_number(byte_ranges.front().first);
+    head.append("-");
+    head.append_number(byte_ranges.front().last);
+    head.append("/");
+    head.append_number(cached_file->size);
+    head.append("\r\n");
+  } else if (status == HTTPStatus::RANGE_NOT_SATISFIABLE &&
+             cached_file != nullptr) {
+    head.append("Content-Range: bytes */");
+    head.append_number(cached_file->size);
+    head.append("\r\n");
+  }
+  if (!not_modified) {
+    header("Content-Type", ct);
   }
 
-  response += "\r\n" + response_body;
+  char date[HTTP_DATE_LENGTH];
+  current_http_date(date);
+  header("Date", std::string_view(date, HTTP_DATE_LENGTH));
 
-  // Add logging
-  logger.info("Response: " + version + " " + httpcode_string_map[status]);
-  logger.info("Connection: " + connection_status);
+  if (cached_file != nullptr) {
+    header("ETag", cached_file->etag);
+    header("Last-Modified", cached_file->last_modified);
+  }
+  header("Server", SERVER_NAME);
+  if (cached_file != nullptr &&
+      (cached_file->encoding != ContentEncoding::IDENTITY ||
+       is_compressible(cached_file->content_type))) {
+    header("Vary", "Accept-Encoding");
+  }
+  head.append("\r\n");
 
+  // The body is never copied behind the headers. A cached body is borrowed
+  // from the cache entry and a large file is sent with sendfile()
+  if (serve_file) {
+    append_file_region(response, 0, cached_file->size);
+  } else if (serve_ranges && byte_ranges.size() == 1) {
+    append_file_region(response, byte_ranges.front().first,
+                       byte_ranges.front().length());
+  } else if (not_modified) {
+    // No body
+  } else if (serve_ranges) {
+    for (size_t i = 0; i < byte_ranges.size(); i++) {
+      response.append(std::move(part_headers[i]));
+      append_file_region(response, byte_ranges[i].first,
+                         byte_ranges[i].length());
+    }
+    response.append(std::move(closing_boundary));
+  } else if (!response_body.empty()) {
+    response.append(std::string(response_body));
+  }
+
+  finish(response);
   return response;
-}
\ No newline at end of file
+}
+
+bool HTTPResponseBuilder::decide_keep_alive() const {
+  // Decide whether the connection should be keep-alive or Close
+  // First we check if we got a Connection header from the client
+  bool keep = version == "HTTP/1.1";
+  auto connection_header = http_request.header("Connection");
+  if (connection_header) {
+    keep = iequals(*connection_header, "keep-alive");
+  }
+  return keep && !force_close;
+}
+
+void HTTPResponseBuilder::finish(HTTPResponse &response) const {
+  // The caller fills in the timings, the write time once it has been sent
+  if (AccessLog::instance().enabled()) {
+    response.access = std::make_unique<AccessRecord>();
+    response.access->timestamp_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    response.access->method = http_request.method;
+    response.access->route = http_request.route;
+    response.access->status = http_status_code(status);
+  }
+
+  // Add logging. The logger is only set up if the lines are kept
+  if (Logging::isEnabled(LoggingLevel::LogLevelInfo)) {
+    Logging logger;
+    logger.setClassName("HTTPResponseBuilder::build");
+    logger.info("Response: {} {}", version, http_status_line(status));
+    logger.info("Connection: {}", keep_alive ? "keep-alive" : "close");
+  }
+}
+
+// Ranges are sent from the file offset: a region of the open descriptor for
+// large files and a view into the cached or mapped content for the others,
+// so the rest of the file is never read or copied
+void HTTPResponseBuilder::append_file_region(HTTPResponse &response,
+                                             size_t offset,
+                                             size_t length) const {
+  if (cached_file->file) {
+    response.append_file(cached_file->file, offset, length);
+  } else {
+    response.append(cached_file->data().substr(offset, length), cached_file);
+  }
+}
+
+bool HTTPResponseBuilder::isKeepAlive() const { return keep_alive; }
@@ -0,0 +1,215 @@
+#include <http_scanner.h>
+#include <array>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+static constexpr size_t NPOS = std::string_view::npos;
+
+// Control characters are invalid in request and header lines, HTAB is the
+// only exception. Bytes >= 0x80 are obs-text and allowed in values
+static inline bool is_invalid_char(unsigned char c) {
+  return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+// Lookup table of tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" /
+// "-" / "." / "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+static constexpr std::array<bool, 256> TOKEN_CHARS = [] {
+  std::array<bool, 256> table{};
+  for (int c = '0'; c <= '9'; c++) {
+    table[c] = true;
+  }
+  for (int c = 'a'; c <= 'z'; c++) {
+    table[c] = true;
+    table[c - 'a' + 'A'] = true;
+  }
+  for (char c : std::string_view("!#$%&'*+-.^_`|~")) {
+    table[static_cast<unsigned char>(c)] = true;
+  }
+  return table;
+}();
+
+bool is_token(std::string_view text) {
+  if (text.empty()) {
+    return false;
+  }
+  for (char c : text) {
+    if (!TOKEN_CHARS[static_cast<unsigned char>(c)]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Scalar scan of data[start, length), continuing a scan whose colon and
+// invalid offsets so far are given. Also finishes the tail of the SIMD scans
+static LineScan scan_line_from(const char *data, size_t length, size_t start,
+                               size_t colon, size_t invalid) {
+  for (size_t i = start; i < length; i++) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    if (c == '\n') {
+      return {i, colon, invalid};
+    }
+    if (c == ':' && colon == NPOS) {
+      colon = i;
+    }
+    if (invalid == NPOS && is_invalid_char(c)) {
+      invalid = i;
+    }
+  }
+  return {length, colon, invalid};
+}
+
+LineScan scan_line_scalar(const char *data, size_t length) {
+  return scan_line_from(data, length, 0, NPOS, NPOS);
+}
+
+#ifdef HTTP_SCANNER_X86
+
+// Folds the bit masks of one block into the running result
+// Returns true once the block contained the newline
+static inline bool consume_block(size_t offset, unsigned newline_mask,
+                                 unsigned colon_mask, unsigned invalid_mask,
+                                 LineScan &scan) {
+  if (newline_mask != 0) {
+    // Only bytes before the newline belong to this line
+    unsigned newline_bit = __builtin_ctz(newline_mask);
+    unsigned before_newline = (1u << newline_bit) - 1;
+    colon_mask &= before_newline;
+    invalid_mask &= before_newline;
+    scan.newline = offset + newline_bit;
+  }
+  if (scan.colon == NPOS && colon_mask != 0) {
+    scan.colon = offset + __builtin_ctz(colon_mask);
+  }
+  if (scan.invalid == NPOS && invalid_mask != 0) {
+    scan.invalid = offset + __builtin_ctz(invalid_mask);
+  }
+  return newline_mask != 0;
+}
+
+__attribute__((target("sse2"))) LineScan scan_line_sse2(const char *data,
+                                                        size_t length) {
+  LineScan scan{length, NPOS, NPOS};
+
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+
+    // The comparisons are signed, so "below 0x20" also matches bytes
+    // >= 0x80 which are allowed; those are the negative ones and get masked
+    __m128i below_space = _mm_andnot_si128(_mm_cmpgt_epi8(zero, block),
+                                           _mm_cmpgt_epi8(space, block));
+    __m128i invalid =
+        _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(block, tab), below_space),
+                     _mm_cmpeq_epi8(block, del));
+
+    unsigned newline_mask =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    unsigned colon_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, colon));
+    unsigned invalid_mask = _mm_movemask_epi8(invalid);
+
+    if (consume_block(i, newline_mask, colon_mask, invalid_mask, scan)) {
+      return scan;
+    }
+  }
+
+  return scan_line_from(data, length, i, scan.colon, scan.invalid);
+}
+
+__attribute__((target("avx2"))) LineScan scan_line_avx2(const char *data,
+                                                        size_t length) {
+  LineScan scan{length, NPOS, NPOS};
+
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i zero = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+
+    __m256i below_space = _mm256_andnot_si256(
+        _mm256_cmpgt_epi8(zero, block), _mm256_cmpgt_epi8(space, block));
+    __m256i invalid = _mm256_or_si256(
+        _mm256_andnot_si256(_mm256_cmpeq_epi8(block, tab), below_space),
+        _mm256_cmpeq_epi8(block, del));
+
+    unsigned newline_mask =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+    unsigned colon_mask =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, colon));
+    unsigned invalid_mask = _mm256_movemask_epi8(invalid);
+
+    if (consume_block(i, newline_mask, colon_mask, invalid_mask, scan)) {
+      return scan;
+    }
+  }
+
+  return scan_line_from(data, length, i, scan.colon, scan.invalid);
+}
+
+// __builtin_cpu_init() has to run first when this is called during static
+// initialization, which is where the implementation gets selected
+bool cpu_supports_sse2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+bool cpu_supports_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+LineScan scan_line_sse2(const char *data, size_t length) {
+  return scan_line_scalar(data, length);
+}
+LineScan scan_line_avx2(const char *data, size_t length) {
+  return scan_line_scalar(data, length);
+}
+
+bool cpu_supports_sse2() { return false; }
+bool cpu_supports_avx2() { return false; }
+
+#endif
+
+using ScanLineFunction = LineScan (*)(const char *, size_t);
+
+struct ScannerImplementation {
+  ScanLineFunction function;
+  const char *name;
+};
+
+static ScannerImplementation select_implementation() {
+  if (cpu_supports_avx2()) {
+    return {scan_line_avx2, "avx2"};
+  }
+  if (cpu_supports_sse2()) {
+    return {scan_line_sse2, "sse2"};
+  }
+  return {scan_line_scalar, "scalar"};
+}
+
+static const ScannerImplementation implementation = select_implementation();
+
+LineScan scan_line(const char *data, size_t length) {
+  return implementation.function(data, length);
+}
+
+const char *scanner_implementation() { return implementation.name; }
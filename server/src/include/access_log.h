@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// One answered request as recorded in the access log
+struct AccessRecord {
+  uint64_t timestamp_us = 0; // Wall clock time the request was processed
+  std::string method;        // Empty for requests that could not be framed
+  std::string route;
+  uint16_t status = 0;
+  uint64_t bytes = 0;        // Size of the response, headers included
+  uint32_t parse_us = 0;     // Parsing and validating the request
+  uint32_t process_us = 0;   // Processing it and building the response
+  uint32_t write_us = 0;     // From queueing the response to its last byte
+                             // being written
+};
+
+// Binary access log format, all integers little-endian
+//      File header:  "HTAL" u32 version
+//      Record:       u16 length of the rest of the record
+//                    u64 timestamp_us, u16 status, u64 bytes,
+//                    u32 parse_us, u32 process_us, u32 write_us,
+//                    u8 method length, method, u16 route length, route
+// Readers skip record bytes past the fields they know, so fields can be
+// appended in later versions.
+inline constexpr std::string_view ACCESS_LOG_MAGIC = "HTAL";
+inline constexpr uint32_t ACCESS_LOG_VERSION = 1;
+inline constexpr size_t ACCESS_LOG_HEADER_SIZE = 8;
+
+// Routes longer than this are cut off in the log
+inline constexpr size_t ACCESS_LOG_MAX_ROUTE = 2048;
+
+void encode_access_log_header(std::string &out);
+void encode_access_record(const AccessRecord &record, std::string &out);
+
+// Checks the file header at the start of data
+bool decode_access_log_header(std::string_view data);
+
+// Decodes the record at the start of data and sets consumed to its size
+// Returns false if data doesn't hold a complete record
+bool decode_access_record(std::string_view data, AccessRecord &record,
+                          size_t &consumed);
+
+// Microseconds between two points of the steady clock, saturated to 32 bits
+uint32_t elapsed_us(std::chrono::steady_clock::time_point from,
+                    std::chrono::steady_clock::time_point to);
+
+// Sets the parse and process times of a record: from started to parsed, and
+// from parsed to now
+void record_timings(AccessRecord &record,
+                    std::chrono::steady_clock::time_point started,
+                    std::chrono::steady_clock::time_point parsed);
+
+// Buffered writer of the access log, shared by all threads
+// Records are encoded into one in-memory buffer. It is written out when it is
+// full, by the first record arriving more than a second after the last write,
+// and at exit. Once the file reaches its size limit it is rotated:
+// log -> log.1 -> log.2 ..., keeping the configured number of old files.
+class AccessLog {
+public:
+  static AccessLog &instance();
+
+  // Starts logging to path. Returns false if the file can't be opened
+  bool open(const std::string &path, size_t max_file_bytes, int max_files);
+
+  // Whether records should be collected at all
+  bool enabled() const;
+
+  void write(const AccessRecord &record);
+  void flush();
+
+private:
+  AccessLog() = default;
+
+  bool open_file();
+  void rotate();
+  void write_buffer();
+
+  std::atomic<bool> is_enabled{false};
+
+  std::mutex mutex;
+  std::string path;
+  size_t max_file_bytes = 0;
+  int max_files = 0;
+  int fd = -1;
+  size_t file_bytes = 0;
+  std::string buffer;
+  std::chrono::steady_clock::time_point last_write;
+};
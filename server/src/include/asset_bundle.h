@@ -0,0 +1,83 @@
+#pragma once
+
+#include <content_encoding.h>
+#include <file_cache.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bundle format, all integers little-endian
+//      Header:  "HSAB" u32 version, u32 asset count, u64 index offset
+//      Data:    contents of every variant of every file, each starting at a
+//               multiple of ASSET_BUNDLE_ALIGNMENT
+//      Index:   from the index offset to the end, one record per file,
+//               sorted by path
+//                   u16 path length, path (relative to the root, e.g.
+//                   "css/site.css"), u8 content type, u8 variant count,
+//                   then per variant
+//                       u8 encoding, u64 offset, u64 length,
+//                       i64 mtime seconds, u32 mtime nanoseconds,
+//                       u8 Last-Modified length, Last-Modified,
+//                       u8 ETag length, ETag
+inline constexpr std::string_view ASSET_BUNDLE_MAGIC = "HSAB";
+inline constexpr uint32_t ASSET_BUNDLE_VERSION = 1;
+inline constexpr size_t ASSET_BUNDLE_HEADER_SIZE = 20;
+inline constexpr size_t ASSET_BUNDLE_ALIGNMENT = 64;
+
+// Read-only set of files served from one memory-mapped bundle
+// For immutable deployments all of res/ is packed ahead of time with every
+// encoded variant of each file and the metadata its responses need.
+// Opening the bundle is one mmap() and a walk over its index, no file is
+// read, and the contents are sent straight out of the mapping. The mapping
+// is shared, so the page cache holding it is shared by every server process
+// on the host serving the same bundle.
+class AssetBundle {
+public:
+  // Opens and maps the bundle at path. Returns nullptr and sets error if it
+  // can't be read or is not a valid bundle
+  static std::shared_ptr<const AssetBundle>
+  open(const std::filesystem::path &path, std::string &error);
+
+  // The file at path (relative to the root, e.g. "index.html") with the
+  // given encoding, nullptr if the bundle has no such file or variant
+  std::shared_ptr<const CachedFile> find(std::string_view path,
+                                         ContentEncoding encoding) const;
+
+  size_t asset_count() const;
+  size_t size() const;
+
+  // Bundle GET requests are served from instead of the filesystem, nullptr
+  // if none. Not thread safe, meant to be set once at startup
+  static const AssetBundle *served();
+  static void serve(std::shared_ptr<const AssetBundle> bundle);
+
+private:
+  static constexpr size_t ENCODING_COUNT =
+      static_cast<size_t>(ContentEncoding::GZIP) + 1;
+
+  struct Mapping;
+
+  struct Asset {
+    std::string_view path;
+    std::array<std::shared_ptr<const CachedFile>, ENCODING_COUNT> variants;
+  };
+
+  std::shared_ptr<const Mapping> mapping;
+  std::vector<Asset> assets; // Sorted by path
+};
+
+// Packs every regular file under directory into a bundle at bundle_path,
+// with the precompressed siblings of each file (app.js.br next to app.js)
+// as its variants, or the variants this build can compress if there are
+// none. Files under the uploads directory are left out.
+// Returns the number of files packed, std::nullopt (and sets error) if the
+// directory can't be read or the bundle can't be written
+std::optional<size_t> pack_asset_bundle(const std::filesystem::path &directory,
+                                        const std::filesystem::path &bundle_path,
+                                        std::string &error);
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <frame_pool.h>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Coroutine returning a T to the coroutine that co_awaits it
+// An AsyncTask starts suspended and runs when it is awaited. When it finishes,
+// the awaiting coroutine is resumed right away on the same thread (symmetric
+// transfer), so a chain of awaited tasks costs no trip through the scheduler
+// and no stack depth. One that is never awaited is destroyed unrun, and one
+// handed to Scheduler::spawn() runs detached and frees itself at the end.
+// Frames come from FramePool. An exception is rethrown to the awaiting
+// coroutine, one escaping a detached task ends the process like one escaping
+// a thread.
+template <typename T = void> class AsyncTask;
+
+class AsyncTaskPromiseBase {
+public:
+  static void *operator new(size_t size) { return FramePool::allocate(size); }
+  static void operator delete(void *frame, size_t size) {
+    FramePool::deallocate(frame, size);
+  }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      AsyncTaskPromiseBase &promise = handle.promise();
+      if (!promise.detached) {
+        return promise.continuation;
+      }
+      if (promise.exception) {
+        std::terminate();
+      }
+      handle.destroy();
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { exception = std::current_exception(); }
+
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr exception;
+  bool detached = false;
+};
+
+template <typename T> class AsyncTaskPromise : public AsyncTaskPromiseBase {
+public:
+  AsyncTask<T> get_return_object();
+
+  template <typename Value> void return_value(Value &&value) {
+    result.emplace(std::forward<Value>(value));
+  }
+
+  T take() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+    return std::move(*result);
+  }
+
+private:
+  std::optional<T> result;
+};
+
+template <> class AsyncTaskPromise<void> : public AsyncTaskPromiseBase {
+public:
+  AsyncTask<void> get_return_object();
+
+  void return_void() {}
+
+  void take() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+};
+
+template <typename T> class [[nodiscard]] AsyncTask {
+public:
+  using promise_type = AsyncTaskPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  AsyncTask(AsyncTask &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+  AsyncTask &operator=(AsyncTask &&other) noexcept {
+    if (this != &other) {
+      if (handle) {
+        handle.destroy();
+      }
+      handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+  ~AsyncTask() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() { return handle.promise().take(); }
+
+  // Gives up the coroutine, which destroys itself once it has run to the end
+  std::coroutine_handle<> detach() {
+    handle.promise().detached = true;
+    return std::exchange(handle, {});
+  }
+
+private:
+  friend promise_type;
+  explicit AsyncTask(Handle handle) : handle(handle) {}
+
+  Handle handle;
+};
+
+template <typename T> AsyncTask<T> AsyncTaskPromise<T>::get_return_object() {
+  return AsyncTask<T>(AsyncTask<T>::Handle::from_promise(*this));
+}
+
+inline AsyncTask<void> AsyncTaskPromise<void>::get_return_object() {
+  return AsyncTask<void>(AsyncTask<void>::Handle::from_promise(*this));
+}
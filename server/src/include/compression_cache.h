@@ -0,0 +1,90 @@
+#pragma once
+
+#include <content_encoding.h>
+#include <file_cache.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct CompressionCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t compressions = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+// Sharded LRU cache of the encoded variants of files, bounded by a byte
+// budget. A variant comes from a precompressed sibling file (app.js.br next
+// to app.js) if there is one, otherwise it is compressed on the fly, once
+// per version of the file. Entries are keyed by the sibling's path and
+// remember the ETag of the file they were made from, so a changed file gets
+// a fresh variant. Knowing that a file has no variant is cached as well, so
+// the lookup for a missing sibling is repeated at most once per TTL.
+class CompressionCache {
+public:
+  CompressionCache(size_t byte_budget, std::chrono::milliseconds ttl,
+                   size_t shard_count = 16);
+
+  // Returns `file` (found at path) encoded with `encoding`, or nullptr if
+  // there is no precompressed sibling and it can't or shouldn't be
+  // compressed on the fly
+  std::shared_ptr<const CachedFile>
+  get(std::string_view path, const std::shared_ptr<const CachedFile> &file,
+      ContentEncoding encoding);
+
+  CompressionCacheStats stats() const;
+
+  // Cache shared by all threads, configured by COMPRESSION_CACHE_BYTES and
+  // FILE_CACHE_TTL_MS
+  static CompressionCache &instance();
+
+private:
+  struct Entry {
+    std::string key;
+    std::string source_etag;
+    std::shared_ptr<const CachedFile> variant; // nullptr: no variant
+
+    // State of the precompressed sibling when the entry was made
+    bool has_sibling = false;
+    off_t sibling_size = 0;
+    timespec sibling_mtime{};
+
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point validated_at;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+  };
+
+  size_t shard_budget;
+  size_t max_entry_size;
+  std::chrono::milliseconds ttl;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> compressions{0};
+  std::atomic<uint64_t> evictions{0};
+
+  Shard &shard_for(const std::string &key);
+  Entry make_entry(const std::string &key,
+                   const std::shared_ptr<const CachedFile> &file,
+                   ContentEncoding encoding);
+  void insert(Shard &shard, Entry entry);
+  void erase(Shard &shard, std::list<Entry>::iterator entry);
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+
+// How accepted connections are served
+//      THREAD_POOL - every connection is handed to a pool thread which blocks
+//                    on it for the lifetime of the keep-alive connection
+//      EPOLL       - one edge-triggered epoll reactor owns all the sockets and
+//                    only hands complete requests to the pool threads
+//      REUSEPORT   - one SO_REUSEPORT listener and event loop per core, each
+//                    loop accepts and processes its own connections
+//      COROUTINE   - one SO_REUSEPORT listener and Scheduler per core, every
+//                    connection is a coroutine that suspends where a pool
+//                    thread would block, see serve_connection()
+enum class ServerMode {
+  THREAD_POOL = 0,
+  EPOLL,
+  REUSEPORT,
+  COROUTINE
+};
+
+extern ServerMode SERVER_MODE;
+
+// Length of the kernel accept queue passed to listen()
+extern int LISTEN_BACKLOG;
+
+// Number of listeners / event loops in REUSEPORT mode, and of schedulers in
+// COROUTINE mode
+extern int EVENT_LOOP_COUNT;
+
+// Pin every pool thread to one CPU
+extern bool PIN_POOL_THREADS;
+
+// Run the event loops of the EPOLL and REUSEPORT modes on io_uring where the
+// kernel supports it, see IoUringLoop
+extern bool USE_IO_URING;
+
+// Total size of the in-memory static file cache, 0 disables it
+extern size_t FILE_CACHE_BYTES;
+
+// How long a cached file is served before checking it for changes
+extern int FILE_CACHE_TTL_MS;
+
+// Most descriptors of large files kept open by the file cache, and most
+// missing paths it remembers
+extern size_t FILE_CACHE_MAX_FDS;
+extern size_t FILE_CACHE_MAX_MISSING;
+
+// Files bigger than this are sent with sendfile() instead of being read into
+// memory
+extern size_t SENDFILE_THRESHOLD;
+
+// Total size of the cache of compressed file variants, 0 disables on the fly
+// compression (precompressed .br/.zst/.gz files are still served)
+extern size_t COMPRESSION_CACHE_BYTES;
+
+// Largest request line + header block accepted, bigger ones get a 431
+extern size_t MAX_HEADER_SIZE;
+
+// Largest request body accepted, bigger ones get a 413
+extern size_t MAX_BODY_SIZE;
+
+// Bodies up to this size are buffered whole, bigger and chunked ones are
+// streamed in pieces of about this size, e.g. straight into an upload file
+extern size_t BODY_CHUNK_SIZE;
+
+// How long a client may take to send the request line and headers of a
+// request (and a body small enough to be buffered along with them), counted
+// from its first byte. It then gets a 408 and is closed. 0 disables it
+extern int HEADER_TIMEOUT_MS;
+
+// How long a streamed request body may go without a byte arriving
+extern int BODY_TIMEOUT_MS;
+
+// How long a keep-alive connection is kept open without a request
+extern int IDLE_TIMEOUT_MS;
+
+// How long a response may wait for the client to read any of it
+extern int WRITE_TIMEOUT_MS;
+
+// Most connections open at once. At the limit the server stops accepting,
+// and new connections wait in the kernel accept queue. 0 means no limit
+extern size_t MAX_CONNECTIONS;
+
+// Most connections open at once from one client address, connections above
+// it are closed right after being accepted. 0 means no limit
+extern size_t MAX_CONNECTIONS_PER_IP;
+
+// Requests served on one keep-alive connection before it is closed, the last
+// response carries Connection: close. 0 means no limit
+extern size_t MAX_REQUESTS_PER_CONNECTION;
+
+// Reserved route the metrics are served on in the Prometheus text format,
+// see Metrics. Empty disables it
+extern std::string METRICS_PATH;
+
+// Binary access log, see AccessLog. An empty path disables it
+extern std::string ACCESS_LOG_PATH;
+
+// Size at which the access log is rotated, and how many old files are kept
+extern size_t ACCESS_LOG_MAX_BYTES;
+extern int ACCESS_LOG_FILES;
+
+// Directory files are served from and uploads are written to, res in the
+// working directory. Resolved once when the server starts
+extern const std::filesystem::path SERVER_ROOT;
+
+// Directory with custom error pages named <code>.html, e.g. 404.html
+// Empty means SERVER_ROOT/errors
+extern std::string ERROR_PAGES_DIR;
+
+// Asset bundle GET requests are served from instead of SERVER_ROOT, see
+// AssetBundle. Empty serves the files on disk
+extern std::string ASSET_BUNDLE_PATH;
+
+// When set, the server packs SERVER_ROOT into a bundle at this path and exits
+extern std::string PACK_ASSET_BUNDLE_PATH;
+
+// Parses a single "--key=value" command line option into the globals above
+// Returns false if the option is unknown or its value is invalid
+bool parse_server_option(const std::string &option);
+
+const char *server_mode_name(ServerMode mode);
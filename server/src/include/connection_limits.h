@@ -0,0 +1,47 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// Counts the open client connections of the whole server, in total and per
+// client address, against MAX_CONNECTIONS and MAX_CONNECTIONS_PER_IP
+// Every accept loop asks full() before it accepts: at the limit it stops
+// accepting, the kernel queues new connections in the listen backlog and
+// refuses them once that is full, which pushes back on the clients instead
+// of taking on more than the server can serve. A connection from an address
+// that is at its own limit is accepted and closed at once, so one client
+// can't use up the connections of all the others.
+class ConnectionLimits {
+public:
+  static ConnectionLimits &instance();
+
+  // Counts a connection accepted from address. Returns false, without
+  // counting it, if the address has MAX_CONNECTIONS_PER_IP open already
+  bool admit(const in_addr &address);
+
+  // Uncounts a connection admitted before, once it is closed
+  void release(const in_addr &address);
+
+  // Whether MAX_CONNECTIONS are open
+  bool full() const;
+
+  // Blocks until fewer than MAX_CONNECTIONS are open, for the blocking
+  // accept loop of the THREAD_POOL mode
+  void wait_until_not_full();
+
+  size_t open() const;
+
+private:
+  ConnectionLimits() = default;
+
+  std::atomic<size_t> total{0};
+
+  std::mutex mutex;
+  std::condition_variable released;
+  std::unordered_map<uint32_t, size_t> per_address;
+};
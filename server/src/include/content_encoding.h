@@ -0,0 +1,42 @@
+#pragma once
+
+#include <http_parser.h>
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content codings the server can send, in the order it prefers them when the
+// client accepts several equally
+enum class ContentEncoding { IDENTITY = 0, BROTLI, ZSTD, GZIP };
+
+// Token used in Accept-Encoding and Content-Encoding, e.g. "br"
+const char *content_encoding_name(ContentEncoding encoding);
+
+// Extension of a precompressed sibling file, e.g. ".br" for app.js.br
+const char *content_encoding_extension(ContentEncoding encoding);
+
+// ETag of a representation encoded from the file with the given ETag, e.g.
+// "\"5f3a-1c\"" becomes "\"5f3a-1c-br\"". Each representation needs its own
+std::string encoded_etag(std::string_view etag, ContentEncoding encoding);
+
+// Whether this build can compress with the encoding on the fly. Precompressed
+// siblings are served regardless
+bool can_compress(ContentEncoding encoding);
+
+// Text types worth compressing. Images are already compressed
+bool is_compressible(HTTPContentType content_type);
+
+// Parses an Accept-Encoding header into the codings the client accepts, most
+// preferred first. Codings with q=0 are left out and "*" stands for all the
+// codings the client did not list. identity is implied and never returned
+std::pmr::vector<ContentEncoding> parse_accept_encoding(
+    std::string_view value,
+    std::pmr::memory_resource *memory = std::pmr::get_default_resource());
+
+// Compresses data, returns std::nullopt if the encoder failed or the
+// encoding is not compiled in
+std::optional<std::string> compress(std::string_view data,
+                                    ContentEncoding encoding);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <async_task.h>
+#include <netinet/in.h>
+#include <chrono>
+
+// Connection handling of --mode=coroutine
+// Each connection is one coroutine that reads, processes and answers its
+// requests in order, written top to bottom like handle_client() and around
+// the same HTTPConnection. Where handle_client() blocks its thread in read()
+// or write(), the coroutine suspends and its Scheduler runs other
+// connections meanwhile. Requests are processed on the scheduler thread, one
+// scheduler per core.
+
+// Accepts connections on listen_fd for as long as the scheduler of the
+// calling thread runs, and serves each in a coroutine of its own
+AsyncTask<void> accept_connections(int listen_fd);
+
+// Serves a connection until it is closed, then closes client_socket_fd.
+// accepted is when it was accepted
+AsyncTask<void>
+serve_connection(sockaddr_in client_address, int client_socket_fd,
+                 std::chrono::steady_clock::time_point accepted);
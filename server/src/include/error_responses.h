@@ -0,0 +1,54 @@
+#pragma once
+
+#include <http_parser.h>
+#include <http_response.h>
+#include <array>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Complete responses to the error statuses, serialized once
+// Scanners and bots make errors a large share of the traffic, so answering
+// one should cost no more than copying bytes. For every error status, HTTP
+// version and connection mode the status line, headers and page are built
+// up front, and a response is a copy of them with the current Date patched
+// in. Small pages are copied along with the head, big ones are borrowed.
+// The pages are built in, each can be replaced by a <code>.html file (e.g.
+// 404.html) in the error page directory.
+class ErrorResponses {
+public:
+  static ErrorResponses &instance();
+
+  // Replaces the built-in pages by the <code>.html files found in directory
+  // and rebuilds the responses. Returns the number of pages loaded
+  // Not thread safe, meant to be called once at startup
+  int load_pages(const std::filesystem::path &directory);
+
+  // Page sent as the body of an error status, empty for other statuses
+  std::string_view page(HTTPStatus status) const;
+
+  // Fills response with the prebuilt response to status. Returns false if
+  // there is none for the status or the version isn't HTTP/1.0 or HTTP/1.1
+  bool build(HTTPStatus status, std::string_view version, bool keep_alive,
+             HTTPResponse &response) const;
+
+private:
+  static constexpr size_t STATUS_COUNT = HTTPStatus::NOT_IMPLEMENTED + 1;
+
+  struct Prebuilt {
+    std::shared_ptr<const std::string> bytes; // Whole response
+    size_t date_offset = 0;                   // Where the Date value goes
+    size_t head_length = 0;                   // Bytes before the page
+  };
+
+  ErrorResponses();
+
+  void rebuild();
+
+  std::array<std::string, STATUS_COUNT> pages;
+
+  // Indexed by status, HTTP/1.1 and keep-alive
+  std::array<std::array<std::array<Prebuilt, 2>, 2>, STATUS_COUNT> prebuilt;
+};
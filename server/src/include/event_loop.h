@@ -0,0 +1,138 @@
+#pragma once
+
+#include <http_response.h>
+#include <timer_wheel.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class StreamedRequest;
+class ThreadPool;
+
+// Edge-triggered epoll reactor
+// The loop thread owns every client socket: it accepts, reads and writes
+// without blocking, and only hands a connection to the thread pool once a
+// complete request has been buffered for it. Idle keep-alive connections
+// therefore cost a buffer and an epoll registration, not a pool thread.
+// Every connection has one deadline at a time on the loop's TimerWheel: for
+// the headers of a request, the next piece of a streamed body, the next
+// request while it is idle or the client reading a response, so a slow or
+// stalled client only ever holds its own socket and buffer. Accepting stops
+// while the server is at MAX_CONNECTIONS, see ConnectionLimits.
+// Without a pool the requests are processed on the loop thread itself, which
+// is how the per-core loops of the SO_REUSEPORT mode run.
+// How bytes get in and out of the sockets is left to a few virtual functions,
+// so that IoUringLoop can replace epoll and read()/sendmsg() with io_uring
+// while framing, processing and the deadlines stay the same.
+class EventLoop {
+public:
+  // listen_fd must be a bound and listening socket, pool may be nullptr
+  EventLoop(int listen_fd, ThreadPool *pool);
+  virtual ~EventLoop();
+
+  // An IoUringLoop with USE_IO_URING if this kernel supports it, otherwise
+  // an epoll EventLoop
+  static std::unique_ptr<EventLoop> create(int listen_fd, ThreadPool *pool);
+
+  // Runs the loop forever
+  virtual void run();
+
+protected:
+  // What a connection is waiting for, and so which timeout applies
+  enum class Deadline {
+    NONE = 0, // A pool thread has its request, or it is about to be closed
+    HEADER,   // The rest of a request's headers
+    BODY,     // More of a streamed request body
+    IDLE,     // The next request on a keep-alive connection
+    WRITE     // The client to read the queued responses
+  };
+
+  // The connection is its own timer
+  struct Connection : TimerWheel::Timer {
+    int fd;
+    sockaddr_in address;
+    std::string client;            // "ip:port", for logging
+    std::string read_buffer;       // Bytes received but not yet processed
+    OutputQueue output;            // Responses not yet written
+    bool busy = false;             // A pool thread is processing a request
+    bool keep_alive = true;        // False once a response asked to close
+    bool peer_closed = false;      // Read side hit EOF or an error
+    bool read_paused = false;      // Stopped reading on a full read_buffer
+    Deadline deadline = Deadline::NONE;
+    bool progressed = false;       // Bytes moved since the deadline was set
+    size_t requests = 0;           // Requests dispatched so far
+    std::chrono::steady_clock::time_point accepted;
+    bool first_byte_written = false;
+
+    // Request whose body is still arriving, see StreamedRequest
+    std::unique_ptr<StreamedRequest> streamed;
+
+    virtual ~Connection();
+  };
+
+  // Responses to a batch of pipelined requests built by a pool thread,
+  // handed back to the loop thread
+  struct Completion {
+    Connection *connection;
+    std::vector<HTTPResponse> responses;
+  };
+
+  int listen_fd_;
+  int epoll_fd_ = -1;
+  int wakeup_fd_;
+  ThreadPool *pool_;
+  bool accept_paused_ = false; // The listener is off epoll while at the limit
+  TimerWheel timers_;
+
+  std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+
+  std::mutex completions_mutex_;
+  std::vector<Completion> completions_;
+
+  // Takes over a socket accepted from address. Returns nullptr, with the
+  // socket closed, if the address is at MAX_CONNECTIONS_PER_IP
+  Connection *add_connection(int fd, const sockaddr_in &address);
+
+  // Handles whatever arrived in the read_buffer or was written since the
+  // connection was last looked at
+  void process_connection(Connection &connection);
+  void drain_completions();
+  void handle_timeout(Connection &connection);
+  void close_connection(Connection &connection);
+  void record_first_byte(Connection &connection);
+
+  // The I/O of the loop
+  //      new_connection  - the state kept for a connection
+  //      flush           - starts writing connection.output, returns false
+  //                        once the connection is broken
+  //      resume_reading  - reads again after read_paused was set on a full
+  //                        read_buffer
+  //      retire          - releases the socket of a closed connection
+  virtual std::unique_ptr<Connection> new_connection();
+  virtual bool flush(Connection &connection);
+  virtual void resume_reading(Connection &connection);
+  virtual void retire(std::unique_ptr<Connection> connection);
+
+private:
+  void accept_connections();
+  void pause_accepting();
+  void resume_accepting();
+  void handle_event(Connection &connection, uint32_t events);
+  void read_available(Connection &connection);
+  void dispatch_requests(Connection &connection);
+  bool feed_streamed_request(Connection &connection);
+  static std::vector<HTTPResponse>
+  process_batch(std::string_view batch, const std::vector<size_t> &lengths,
+                bool close_after);
+  void apply_responses(Connection &connection,
+                       std::vector<HTTPResponse> &&responses);
+  void update_deadline(Connection &connection);
+  // Cancels the timer, so the next update_deadline() starts a fresh one
+  void clear_deadline(Connection &connection);
+  void maybe_close(Connection &connection);
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <content_encoding.h>
+#include <http_parser.h>
+#include <http_response.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A file's contents together with everything a response needs to serve it,
+// computed once when the file is loaded. Files larger than SENDFILE_THRESHOLD
+// are not read at all: content stays empty and the open descriptor in `file`
+// is used to send them with sendfile(). Files of an AssetBundle borrow their
+// contents from its mapping, kept alive by `mapping`
+struct CachedFile {
+  std::string content;
+  std::shared_ptr<const FileHandle> file;
+  std::string_view mapped;
+  std::shared_ptr<const void> mapping;
+  HTTPContentType content_type = HTTPContentType::OCTET_STREAM;
+  ContentEncoding encoding = ContentEncoding::IDENTITY;
+  std::string content_length;
+  std::string etag;
+  std::string last_modified;
+
+  // Identity of the file version the content was read from
+  off_t size = 0;
+  timespec mtime{};
+  dev_t device = 0;
+  ino_t inode = 0;
+
+  // The contents, wherever they are held. Empty for files sent with
+  // sendfile()
+  std::string_view data() const { return mapping ? mapped : content; }
+};
+
+// Hash of the string keys of the caches that also takes string_views, so a
+// lookup doesn't have to build a std::string
+struct PathHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view path) const {
+    return std::hash<std::string_view>{}(path);
+  }
+};
+
+struct FileCacheStats {
+  uint64_t hits = 0;
+  uint64_t missing_hits = 0; // Lookups answered by a cached "not found"
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t invalidations = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+  size_t open_files = 0;     // Descriptors of large files held open
+  size_t missing = 0;        // Paths remembered as not found
+};
+
+// Sharded LRU cache of files, the filesystem lookup of every GET
+// Three kinds of entries share one index keyed by the full path, each kind
+// with its own LRU list and bound:
+//      i) small files with their contents, bounded by a total byte budget
+//      ii) large files with their open descriptor for sendfile(), bounded
+//          by a number of descriptors
+//      iii) paths that don't exist or aren't regular files, bounded by a
+//           number of entries, so that floods of 404s don't open() anything
+// A cached entry is trusted for `ttl` after it was last checked. After that
+// the next lookup compares the file's inode, size and mtime with the cached
+// ones and reloads it if it changed, and a missing path is looked up again,
+// so within the TTL a lookup costs no syscall at all. Entries are handed out
+// as shared_ptrs, so an evicted or invalidated file (and its descriptor)
+// stays alive until the responses using it are written.
+class FileCache {
+public:
+  FileCache(size_t byte_budget, size_t max_open_files, size_t max_missing,
+            std::chrono::milliseconds ttl, size_t shard_count = 16);
+
+  // Returns the file at path, or nullptr if it doesn't exist or is not a
+  // regular file. Files too big for the cache are loaded but not cached
+  std::shared_ptr<const CachedFile> get(std::string_view path);
+
+  FileCacheStats stats() const;
+
+  // Cache shared by all threads, configured by FILE_CACHE_BYTES,
+  // FILE_CACHE_MAX_FDS, FILE_CACHE_MAX_MISSING and FILE_CACHE_TTL_MS
+  static FileCache &instance();
+
+private:
+  // A null file marks a missing path
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const CachedFile> file;
+    std::chrono::steady_clock::time_point validated_at;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> contents;    // Most recently used first
+    std::list<Entry> descriptors; // Most recently used first
+    std::list<Entry> missing;     // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator, PathHash,
+                       std::equal_to<>>
+        index;
+    size_t bytes = 0;
+  };
+
+  size_t shard_budget;
+  size_t shard_open_files;
+  size_t shard_missing;
+  size_t max_file_size;
+  std::chrono::milliseconds ttl;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> missing_hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> evictions{0};
+  std::atomic<uint64_t> invalidations{0};
+
+  Shard &shard_for(std::string_view key);
+  std::list<Entry> &list_for(Shard &shard, const CachedFile *file);
+  bool over_budget(const Shard &shard, const std::list<Entry> &list) const;
+  void insert(Shard &shard, const std::string &key,
+              std::shared_ptr<const CachedFile> file);
+  void erase(Shard &shard, std::list<Entry>::iterator entry);
+};
+
+// Reads the file at path and precomputes its response metadata. Files bigger
+// than max_content_size are kept open instead of being read
+// Returns nullptr if it can't be opened or is not a regular file
+std::shared_ptr<CachedFile> load_file(const std::filesystem::path &path,
+                                      size_t max_content_size);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+// Memory for coroutine frames (see AsyncTask)
+// Frames are rounded up to a size class and recycled through free lists of
+// the calling thread. The coroutines of a connection are created, resumed and
+// destroyed on the thread of its Scheduler, so after the first few requests
+// awaiting a read or a write no longer touches the heap. A frame freed on
+// another thread joins the lists of that thread. Frames larger than the
+// biggest class, and frames beyond what a thread keeps cached, go to the heap.
+class FramePool {
+public:
+  static constexpr size_t GRANULE = 64;
+  static constexpr size_t CLASS_COUNT = 64; // Frames up to 4 KiB are pooled
+  static constexpr size_t MAX_CACHED_BYTES = 1024 * 1024; // Per thread
+
+  static void *allocate(size_t size);
+  static void deallocate(void *frame, size_t size);
+
+  // Bytes of frames sitting in the free lists of the calling thread
+  static size_t cached_bytes();
+};
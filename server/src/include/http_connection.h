@@ -0,0 +1,78 @@
+#pragma once
+
+#include <http_response.h>
+#include <streamed_request.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <memory>
+#include <string>
+
+// What serving a connection one request after the other takes, apart from
+// moving the bytes: framing the requests in the read buffer, answering them
+// in order, the header and idle timeouts and the 408 for a client that
+// stalls. handle_client() drives it with blocking reads and writes and
+// serve_connection() with a coroutine's, so both answer the same way.
+//
+// The caller loops over
+//      process()       - answers every complete request buffered, queuing
+//                        the responses in output()
+//      streaming()     - set if process() stopped at a request whose body
+//                        must be read as it arrives. output() is sent first,
+//                        then start_body(), receive_body() until
+//                        body_complete() or the body stalls, finish_body()
+//      output()        - sent, then record_first_byte(). The connection ends
+//                        if that failed or keep_alive() is no longer set
+//      read_timeout_ms() and received() - the next bytes of the connection,
+//                        or timed_out() if none came in time
+class HTTPConnection {
+public:
+  HTTPConnection(const sockaddr_in &address,
+                 std::chrono::steady_clock::time_point accepted);
+
+  // "ip:port" of the client, for logging
+  const std::string &client() const;
+
+  void process();
+
+  OutputQueue &output();
+  bool keep_alive() const;
+
+  bool streaming() const;
+
+  // Feeds the buffered part of the body. Returns true if a 100 Continue was
+  // queued in output(), which must then be sent before reading the body
+  bool start_body();
+  // Feeds body bytes read from the socket, bytes past the end of the body
+  // are kept for the next request
+  void receive_body(const char *data, size_t size);
+  bool body_complete() const;
+  // Queues the response of the streamed request, complete or not: a body
+  // that stopped arriving is answered as one that wasn't read to its end
+  void finish_body();
+
+  void record_first_byte();
+
+  // How long to wait for the next bytes: the idle timeout for a new request,
+  // what is left of the header timeout for the rest of one, 0 for ever. -1
+  // if the header timeout passed already, however slowly bytes trickle in
+  int read_timeout_ms() const;
+  void received(const char *data, size_t size);
+
+  // No bytes came within read_timeout_ms(). Returns true if a 408 was queued
+  // in output() for a client that started a request, it must be sent before
+  // closing
+  bool timed_out();
+
+private:
+  std::string client_;
+  std::chrono::steady_clock::time_point accepted_;
+  std::string read_buffer_;
+  OutputQueue output_;
+  bool keep_alive_ = true;
+  size_t requests_ = 0;
+  bool first_byte_recorded_ = false;
+  std::chrono::steady_clock::time_point request_started_;
+  std::unique_ptr<StreamedRequest> streamed_;
+
+  void respond(HTTPResponse response);
+};
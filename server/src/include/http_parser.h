@@ -1,9 +1,17 @@
 #pragma once
 
+#include <http_range.h>
+#include <http_request_parser.h>
+#include <http_response.h>
+#include <router.h>
+#include <chrono>
 #include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <filesystem>
+#include <memory>
+#include <memory_resource>
+#include <vector>
 
 enum HTTPLineType {
     REQUEST = 0,
@@ -19,7 +27,14 @@ enum HTTPStatus {
     FORBIDDEN,
     UNSUPPORTED_MEDIA_TYPE,
     INTERNAL_SERVER_ERROR,
-    CREATED
+    CREATED,
+    PARTIAL_CONTENT,
+    RANGE_NOT_SATISFIABLE,
+    NOT_MODIFIED,
+    REQUEST_HEADER_FIELDS_TOO_LARGE,
+    PAYLOAD_TOO_LARGE,
+    REQUEST_TIMEOUT,
+    NOT_IMPLEMENTED
 };
 
 enum HTTPContentType {
@@ -36,31 +51,64 @@ enum HTTPContentType {
     CSS
 };
 
+struct CachedFile;
+
+// Content type to serve a file with, guessed from its extension
+HTTPContentType content_type_for_path(const std::filesystem::path &path);
+
 class HTTPParser
 {
 private:
-    std::string request;
+    std::string_view request;
+    std::pmr::memory_resource *memory;
     HTTPStatus status = HTTPStatus::OK;
-    std::filesystem::path SERVER_ROOT;
     std::string response;
 
     // Request information variables
-    std::string http_method;
-    std::string http_route;
-    std::string http_version;
-    std::unordered_map<std::string, std::string> http_headers;
-    std::string http_body;
+    // These are views into the request buffer, nothing is copied out of it
+    HTTPRequestParser request_parser;
+    HTTPRequest http_request;
+    HTTPMethod http_method = HTTPMethod::UNKNOWN;
+    std::string_view http_route;
+    std::string_view http_version;
+    std::string_view http_body;
     std::optional<std::string> http_requested_filename;
 
+    // The route when it had to be normalized, http_route then views it
+    std::pmr::string normalized_route;
+
     // Response information variables
+    // A GET is answered from cached_file, other responses use response_body
     std::string response_body;
+    std::shared_ptr<const CachedFile> cached_file;
+
+    // Parts of cached_file to send when the request had a Range header
+    std::pmr::vector<ByteRange> byte_ranges;
 
     // Content type for response
     HTTPContentType content_type = HTTPContentType::TEXT;
-    
+
+    // Whether the connection stays open after the response, set by
+    // buildResponse()
+    bool keep_alive = false;
+    bool force_close = false;
+
+    // Set once a POST to /upload passed the checks that come before its body
+    bool upload_accepted = false;
+
+    // When parsing and validation ended and processing began
+    std::chrono::steady_clock::time_point parsed_at;
+
+    bool parse_request(bool head_only);
+    bool match_route(RouteMatch &match);
 
 public:
-    HTTPParser(const std::string &request);
+    // The request buffer is not copied and must outlive the parser
+    // Whatever only lives as long as the request (paths, ranges, parsed
+    // headers) is allocated from memory, e.g. a RequestArena
+    HTTPParser(std::string_view request,
+               std::pmr::memory_resource *memory =
+                   std::pmr::get_default_resource());
 
     // Replaces all newlines with \r\n
     void reformat_newlines();
@@ -69,11 +117,56 @@ public:
     bool parse();
     bool validate_fields();
 
+    // Parses and processes only the request line and headers, for requests
+    // whose body is streamed. A request to a route that takes a streamed body
+    // (see Route::accept_body) is only accepted here, its body is written by
+    // the caller and the outcome reported with finishUpload(). Returns false
+    // if the request was rejected
+    bool parse_head();
+    bool acceptsBody() const;
+    void finishUpload(HTTPStatus upload_status, const std::string &filename);
+
+    // Closes the connection after the response whatever the request asked
+    // for, needed when the rest of the request body was not read
+    void setConnectionClose();
+
+    // The parsed request, valid once parse() or parse_head() got past the
+    // request line and headers
+    const HTTPRequest &httpRequest() const;
+
+    HTTPMethod httpMethod() const;
+
+    // When parsing ended, for the access log timings
+    std::chrono::steady_clock::time_point parsedAt() const;
+
+    // Status of the response, once the request has been processed
+    HTTPStatus httpStatus() const;
+
+    // Directory uploads are written to
+    std::filesystem::path uploadsPath() const;
+
     // Function to process the request
-    bool process_request();
-    bool process_GET_request();
+    // process_request() normalizes the route and hands the request to the
+    // handler of its Route, the others are the handlers of the built-in
+    // routes and what they are made of
+    bool process_request(bool head_only = false);
+    bool process_GET_request(std::string_view relative_path);
+    bool is_not_modified();
+    void process_range_request();
     bool process_POST_request();
+    bool accept_upload();
+
+    // Sets the response of a handler that doesn't serve a file
+    void setResponse(HTTPStatus response_status, std::string body,
+                     HTTPContentType response_content_type);
 
     // Response functions
     const std::string getResponse();
-};
\ No newline at end of file
+    HTTPResponse buildResponse();
+    bool keepAlive() const;
+};
+
+// Adds the endpoints the server has built in to router: the metrics on
+// METRICS_PATH, JSON uploads to POST /upload and static files for every
+// other GET
+void add_builtin_routes(Router &router);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+// An inclusive range of byte offsets, as in "bytes=first-last"
+struct ByteRange {
+  size_t first;
+  size_t last;
+
+  size_t length() const { return last - first + 1; }
+};
+
+enum class RangeResult {
+  IGNORE = 0,     // No usable Range header, serve the whole file
+  SATISFIABLE,    // At least one range lies within the file
+  UNSATISFIABLE   // Valid syntax but no range lies within the file (416)
+};
+
+// Maximum number of ranges served for one request, requests with more are
+// answered with the whole file so that tiny overlapping ranges can't be used
+// to amplify the response
+static constexpr size_t MAX_BYTE_RANGES = 16;
+
+// Parses a Range header value (RFC 9110 section 14.2) against a file size
+// Supports "a-b", "a-" and suffix "-n" ranges, ranges past the end of the
+// file are clamped and ranges starting past it are dropped. A syntax error
+// makes the whole header ignored, as the RFC requires
+RangeResult parse_range_header(std::string_view value, size_t file_size,
+                               std::pmr::vector<ByteRange> &ranges);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+struct HTTPHeader {
+  std::string_view name;
+  std::string_view value;
+};
+
+// A parsed request. Every field is a view into the buffer that was parsed,
+// so the buffer must outlive the request and must not be modified
+struct HTTPRequest {
+  static constexpr size_t MAX_HEADERS = 64;
+
+  std::string_view method;
+  std::string_view route;
+  std::string_view version;
+  HTTPHeader headers[MAX_HEADERS];
+  size_t header_count = 0;
+  std::string_view body;
+
+  // Header names are case insensitive
+  std::optional<std::string_view> header(std::string_view name) const;
+};
+
+enum class ParseResult {
+  NEED_MORE = 0,
+  COMPLETE,
+  ERROR
+};
+
+enum class ParseError {
+  NONE = 0,
+  MALFORMED_REQUEST_LINE,
+  MALFORMED_HEADER,
+  TOO_MANY_HEADERS,
+  INVALID_CONTENT_LENGTH
+};
+
+// Resumable HTTP/1.x request parser
+// parse() is called with the whole receive buffer every time more bytes have
+// arrived and continues where the previous call stopped, so no byte is
+// scanned twice. Lines are scanned with the SIMD kernel of http_scanner.h,
+// which also rejects control characters. It never allocates: positions are
+// kept as offsets, which also keeps them valid when the buffer is reallocated
+// between calls, and the views are only handed out once the request is
+// complete.
+class HTTPRequestParser {
+public:
+  ParseResult parse(std::string_view buffer, HTTPRequest &request);
+
+  // Like parse() but completes at the end of the header block, leaving the
+  // body empty. Used for requests whose body is streamed instead of buffered
+  ParseResult parse_head(std::string_view buffer, HTTPRequest &request);
+
+  // Prepares the parser for the next request on the same connection
+  void reset();
+
+  // Number of buffer bytes taken by the request once parse() returned COMPLETE
+  size_t consumed() const;
+
+  ParseError error() const;
+
+private:
+  enum class State {
+    REQUEST_LINE = 0,
+    HEADERS,
+    BODY,
+    DONE,
+    FAILED
+  };
+
+  struct Span {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+  };
+
+  State state = State::REQUEST_LINE;
+  ParseError parse_error = ParseError::NONE;
+  size_t position = 0;       // Start of the first unparsed line
+  size_t scan_position = 0;  // End of the bytes already scanned
+  size_t line_colon = std::string_view::npos;   // First ':' of the current line
+  size_t line_invalid = std::string_view::npos; // First control character
+  size_t content_length = 0;
+  size_t body_offset = 0;
+  bool head_only = false;
+
+  Span method;
+  Span route;
+  Span version;
+  Span header_names[HTTPRequest::MAX_HEADERS];
+  Span header_values[HTTPRequest::MAX_HEADERS];
+  size_t header_count = 0;
+
+  ParseResult fail(ParseError error);
+  bool parse_request_line(std::string_view line, size_t line_offset);
+  bool parse_header_line(std::string_view line, size_t line_offset,
+                         size_t colon);
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <access_log.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An open file descriptor, closed when the last response using it is gone
+struct FileHandle {
+  int fd;
+
+  explicit FileHandle(int fd) : fd(fd) {}
+  ~FileHandle();
+  FileHandle(const FileHandle &) = delete;
+  FileHandle &operator=(const FileHandle &) = delete;
+};
+
+// One piece of a response on the wire. It is either
+//      i) bytes owned by the chunk (headers, generated bodies)
+//      ii) bytes borrowed from an object kept alive by `owner` (cached files)
+//      iii) a region of an open file, sent with sendfile() so that the file
+//           contents never pass through user space
+//      iv) a response head copied into the output buffer of the OutputQueue
+//          holding the chunk, at [staged_offset, staged_offset + size())
+struct ResponseChunk {
+  std::string owned;
+  std::string_view borrowed;
+  std::shared_ptr<const void> owner;
+  std::shared_ptr<const FileHandle> file;
+  off_t file_offset = 0;
+  size_t file_length = 0;
+  bool staged = false;
+  size_t staged_offset = 0;
+  size_t staged_length = 0;
+
+  bool is_file() const { return file != nullptr; }
+  std::string_view bytes() const;
+  size_t size() const;
+};
+
+// Status line and headers of a response, serialized in place
+// They nearly always fit the inline buffer, so building them doesn't allocate.
+// Bigger ones (e.g. a long Content-Disposition filename) move to the heap
+class ResponseHead {
+public:
+  static constexpr size_t INLINE_CAPACITY = 512;
+
+  // Only the bytes in use are copied, the rest of the buffer is left
+  // uninitialized
+  ResponseHead() {}
+  ResponseHead(const ResponseHead &other);
+  ResponseHead &operator=(const ResponseHead &other);
+  ResponseHead(ResponseHead &&other) noexcept;
+  ResponseHead &operator=(ResponseHead &&other) noexcept;
+
+  void append(std::string_view bytes);
+  void append_number(uint64_t value);
+
+  std::string_view bytes() const;
+  size_t size() const;
+  bool empty() const;
+
+private:
+  std::array<char, INLINE_CAPACITY> inline_bytes;
+  size_t inline_size = 0;
+  std::string overflow; // Holds everything once the inline buffer is full
+};
+
+// A complete response: the head and the body as a list of chunks
+// The head is kept apart so that it can be copied into the connection's
+// output buffer and sent as the first iovec, the body is never copied
+struct HTTPResponse {
+  ResponseHead head;
+  std::vector<ResponseChunk> chunks;
+  bool keep_alive = false;
+
+  // Set while the access log is enabled, logged once the response is written
+  std::unique_ptr<AccessRecord> access;
+
+  void append(std::string bytes);
+  void append(std::string_view bytes, std::shared_ptr<const void> owner);
+  void append_file(std::shared_ptr<const FileHandle> file, off_t offset,
+                   size_t length);
+
+  size_t size() const;
+
+  // Flattens the response into one string, reading file regions from disk
+  // Only meant for tests and benchmarks, the server sends the chunks
+  std::string to_string() const;
+};
+
+enum class WriteResult {
+  DONE = 0,   // Everything queued has been written
+  AGAIN,      // The socket would block, retry once it is writable
+  ERROR       // The connection is broken
+};
+
+// Responses waiting to be written to one socket
+// Response heads are copied into one buffer that is reused once everything
+// queued has been written, so a long-lived connection stops allocating for
+// them. Consecutive memory chunks go out with a single sendmsg() (gathered like
+// writev()), file regions with sendfile(). Partial writes are remembered, so
+// on a non-blocking socket write_to() is simply called again when the
+// socket becomes writable. On a blocking socket it returns once all is sent.
+// The access record of a response goes to the access log once its last byte
+// has been written, and the time the queue took to drain to the metrics.
+// A writer that issues the writes itself, such as IoUringLoop, walks the
+// queue with gather() and file_at() and reports what went out with consume().
+class OutputQueue {
+public:
+  void push(HTTPResponse &&response);
+  WriteResult write_to(int socket_fd);
+
+  bool empty() const;
+  void clear();
+
+  // Bytes written over the lifetime of the queue
+  uint64_t written() const;
+
+  // Fills iovecs with at most max memory chunks from chunk index on, up to
+  // the next file region, and moves index past them. Returns the number of
+  // iovecs filled
+  size_t gather(size_t &index, iovec *iovecs, size_t max) const;
+
+  // The descriptor, offset and length of chunk index if it is a file region
+  bool file_at(size_t index, int &fd, off_t &offset, size_t &length) const;
+
+  size_t chunk_count() const;
+
+  // Marks bytes at the front as written, in order
+  void consume(size_t written);
+
+private:
+  std::deque<ResponseChunk> chunks;
+  size_t front_offset = 0; // Bytes of chunks.front() already written
+  std::string staged;      // Heads of the queued responses
+
+  std::string_view bytes_of(const ResponseChunk &chunk) const;
+
+  // Access records of queued responses, with the total number of bytes
+  // pushed when each response was complete
+  struct PendingRecord {
+    uint64_t end;
+    std::chrono::steady_clock::time_point queued;
+    std::unique_ptr<AccessRecord> record;
+  };
+  std::deque<PendingRecord> records;
+  uint64_t bytes_pushed = 0;
+  uint64_t bytes_written = 0;
+
+  // When responses were queued while the queue was empty, for the WRITE
+  // latency of the responses written together
+  std::chrono::steady_clock::time_point write_started;
+
+  WriteResult write_memory_chunks(int socket_fd);
+  WriteResult write_file_chunk(int socket_fd);
+  void log_written_records(bool all);
+};
@@ -1,44 +1,79 @@
 #pragma once
 
 #include "http_parser.h"
-#include <map>
+#include <http_range.h>
+#include <http_response.h>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
+
+// Sent in the Server header
+inline constexpr std::string_view SERVER_NAME =
+    "gigachad-cpp-server by Ojas Maheshwari";
+
+// Numeric code of a status, e.g. 404 for NOT_FOUND
+uint16_t http_status_code(HTTPStatus status);
+
+// Code and reason phrase of a status line, e.g. "404 Not Found"
+std::string_view http_status_line(HTTPStatus status);
+
+// MIME type sent in Content-Type, e.g. "text/html" for HTML
+std::string_view content_type_name(HTTPContentType content_type);
 
 class HTTPResponseBuilder {
 private:
-  std::string version;
+  std::string_view version;
   HTTPStatus status;
-  std::string response_body;
+  std::string_view response_body;
+  std::shared_ptr<const CachedFile> cached_file;
   HTTPContentType content_type = HTTPContentType::TEXT;
-  std::map<HTTPStatus, std::string> httpcode_string_map;
-  std::map<HTTPContentType, std::string> contenttype_string_map;
-  std::unordered_map<std::string, std::string> http_headers;
-  std::optional<std::string> http_requested_filename;
-
-  // Default body content for error status codes
-  std::string forbidden_body =
-      "<!DOCTYPE html><html><head><title>403 "
-      "Forbidden</title></head><body><h1>403 Forbidden</h1><p>You don't have "
-      "permission to access this resource.</p></body></html>";
-  std::string not_found_body =
-      "<!DOCTYPE html><html><head><title>404 Not "
-      "Found</title></head><body><h1>404 Not Found</h1><p>The requested "
-      "resource could not be found on this server.</p></body></html>";
-  std::string bad_request_body =
-      "<!DOCTYPE html><html><head><title>400 Bad "
-      "Request</title></head><body><h1>400 Bad Request</h1><p>Your browser "
-      "sent a request that this server could not understand.</p></body></html>";
-  std::string method_not_allowed_body =
-      "<!DOCTYPE html><html><head><title>405 Method Not "
-      "Allowed</title></head><body><h1>405 Method Not Allowed</h1><p>The "
-      "request method is not supported for this resource.</p></body></html>";
+  const HTTPRequest &http_request;
+  const std::optional<std::string> &http_requested_filename;
+  std::span<const ByteRange> byte_ranges;
+  std::pmr::memory_resource *memory;
+  bool force_close = false;
+  bool keep_alive = false;
+
+  // Whether the connection stays open after this response
+  bool decide_keep_alive() const;
+
+  // Attaches the access record and logs the response
+  void finish(HTTPResponse &response) const;
+
+  // Appends the bytes [offset, offset + length) of cached_file to the body
+  void append_file_region(HTTPResponse &response, size_t offset,
+                          size_t length) const;
 
 public:
   HTTPResponseBuilder(
-      const std::string &version, HTTPStatus status,
+      std::string_view version, HTTPStatus status,
       const std::string &response_body, HTTPContentType content_type,
-      std::unordered_map<std::string, std::string> &http_headers,
-      std::optional<std::string> &http_requested_filename);
+      const HTTPRequest &http_request,
+      const std::optional<std::string> &http_requested_filename,
+      std::shared_ptr<const CachedFile> cached_file = nullptr,
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource());
+
+  // Ranges of cached_file to send for a 206 Partial Content response
+  // One range is sent as the body, several as multipart/byteranges. They are
+  // not copied and must outlive the builder
+  void setByteRanges(std::span<const ByteRange> ranges);
+
+  // Sends "Connection: close" whatever the request asked for, used when the
+  // rest of the connection's bytes can't be trusted to frame a request
+  void setConnectionClose();
+
+  // Builds the response: the headers serialized into its head, without
+  // allocating, followed by the body chunks
+  HTTPResponse build_response();
+
+  // Builds the whole response as one string
   std::string build();
+
+  // Whether the built response keeps the connection open
+  bool isKeepAlive() const;
 };
\ No newline at end of file
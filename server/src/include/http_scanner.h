@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// Result of scanning the bytes of one request line or header line
+struct LineScan {
+  size_t newline; // Offset of the first '\n', or the scanned length if none
+  size_t colon;   // Offset of the first ':' before newline, or npos
+  size_t invalid; // Offset of the first control character before newline
+                  // (anything below 0x20 except HTAB, and DEL), or npos.
+                  // The CR of the CRLF line ending shows up here as well
+};
+
+// Finds the end of the line, the header colon and any invalid character in
+// a single pass over data. Uses AVX2 or SSE2 when the CPU supports them and
+// falls back to a scalar loop otherwise, the choice is made once at startup
+LineScan scan_line(const char *data, size_t length);
+
+// Whether every byte is a tchar (RFC 9110 token character), used to validate
+// header names and the request method
+bool is_token(std::string_view text);
+
+// Name of the scan_line() implementation picked for this CPU
+const char *scanner_implementation();
+
+// The individual implementations, exposed for benchmarks
+// Calling a SIMD variant on a CPU without the instruction set is undefined
+LineScan scan_line_scalar(const char *data, size_t length);
+LineScan scan_line_sse2(const char *data, size_t length);
+LineScan scan_line_avx2(const char *data, size_t length);
+bool cpu_supports_sse2();
+bool cpu_supports_avx2();
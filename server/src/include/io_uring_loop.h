@@ -0,0 +1,129 @@
+#pragma once
+
+#include <event_loop.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// EventLoop on io_uring: the same connections, framing, processing and
+// deadlines, with epoll_wait(), accept(), read() and sendmsg() replaced by
+// operations queued on a submission ring. Each turn of the loop submits what
+// every connection queued and reaps every completion with one
+// io_uring_enter(), so at high concurrency a request costs close to no system
+// call of its own.
+//      - one multishot accept on the listener delivers every connection
+//      - one multishot recv per connection fills buffers the kernel picks from
+//        a provided buffer ring, an idle connection holds no buffer. Where
+//        buffer rings don't work the buffers are provided by operations
+//        queued with the rest
+//      - the queued responses of a connection go out as one chain of linked
+//        operations: sendmsg() of memory chunks, and for a file region a read
+//        into a registered buffer linked to the send of that buffer
+//      - client sockets are registered files, so the kernel doesn't look up
+//        their descriptor for every operation
+// Accepting, installing a registered file and closing a refused connection
+// still cost a system call each, once per connection.
+class IoUringLoop : public EventLoop {
+public:
+  IoUringLoop(int listen_fd, ThreadPool *pool);
+  ~IoUringLoop() override;
+
+  // Whether this kernel has everything the loop uses, checked once
+  static bool supported();
+
+  void run() override;
+
+private:
+  class Ring;
+
+  // Whether a recv actually gets a buffer from a registered buffer ring,
+  // checked once
+  static bool buffer_rings_work();
+
+  // A run of a connection's output written by one or two linked operations:
+  // a sendmsg() of up to SEGMENT_IOVECS memory chunks, or the read of a file
+  // region into a registered buffer and the send of that buffer
+  static constexpr size_t SEGMENT_IOVECS = 16;
+  struct Segment {
+    msghdr message;
+    iovec iovecs[SEGMENT_IOVECS];
+    size_t length;
+    int buffer; // Registered buffer of a file region, -1 for memory
+  };
+
+  // The chain of segments in flight on a connection, taken from a pool while
+  // the connection has output
+  static constexpr size_t CHAIN_SEGMENTS = 8;
+  struct Chain {
+    Segment segments[CHAIN_SEGMENTS];
+    size_t count = 0;
+    size_t completed = 0; // Segments whose send completed
+    bool failed = false;
+  };
+
+  struct RingConnection : Connection {
+    int slot = -1;           // Index among the registered files, -1 if none
+    bool receiving = false;  // The multishot recv is armed
+    int in_flight = 0;       // Operations the kernel still holds
+    bool retired = false;    // Closed, freed once in_flight reaches 0
+    std::unique_ptr<Chain> chain;
+  };
+
+  std::unique_ptr<Ring> ring_;
+  bool accept_armed_ = false;
+  std::chrono::steady_clock::time_point accept_retry_; // After a failed accept
+  uint64_t wakeup_value_ = 0;
+
+  // Accepted while at the connection limit, installed as connections close
+  std::deque<int> waiting_sockets_;
+
+  // Provided buffers for recv, owned by the kernel until a completion names
+  // one, given back as soon as its bytes are copied out. recv_ring_ is null
+  // when they are provided by IORING_OP_PROVIDE_BUFFERS instead
+  char *recv_buffers_ = nullptr;
+  void *recv_ring_ = nullptr;
+  size_t recv_ring_size_ = 0;
+  uint16_t recv_ring_tail_ = 0;
+
+  // Registered buffers that file regions are read into, and the connections
+  // waiting for one to be free
+  char *file_buffers_ = nullptr;
+  bool file_buffers_registered_ = false;
+  std::vector<int> free_file_buffers_;
+  std::deque<RingConnection *> file_buffer_waiters_;
+
+  std::vector<int> free_slots_;
+  std::vector<std::unique_ptr<Chain>> free_chains_;
+
+  // Closed connections whose operations haven't all completed yet
+  std::unordered_map<RingConnection *, std::unique_ptr<Connection>> retired_;
+
+  void setup();
+  void arm_accept();
+  void install(int fd);
+  void arm_wakeup();
+  void arm_recv(RingConnection &connection);
+  void cancel(uint64_t user_data);
+  void return_recv_buffer(uint16_t id);
+  void start_chain(RingConnection &connection);
+
+  void handle_completion(uint64_t user_data, int32_t result, uint32_t flags);
+  void handle_accept(int32_t result, uint32_t flags);
+  void handle_recv(RingConnection &connection, int32_t result, uint32_t flags);
+  void handle_read(RingConnection &connection, int32_t result);
+  void handle_send(RingConnection &connection, int32_t result);
+  void finish_chain(RingConnection &connection);
+  void release_file_buffer(int buffer);
+  void free_retired(RingConnection &connection);
+
+  std::unique_ptr<Connection> new_connection() override;
+  bool flush(Connection &connection) override;
+  void resume_reading(Connection &connection) override;
+  void retire(std::unique_ptr<Connection> connection) override;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Push style JSON syntax checker (RFC 8259)
+// The document is fed in pieces as they arrive and validated as it goes,
+// nothing of it is kept: memory is one byte per open object or array, up to
+// MAX_DEPTH. nlohmann::json can only pull its input, so it can't be handed
+// a body that is still arriving on a non-blocking socket.
+class JsonStreamValidator {
+public:
+  static constexpr size_t MAX_DEPTH = 512;
+
+  // Validates the next piece of the document. Returns false as soon as the
+  // document can no longer be valid, every later call returns false too
+  bool feed(std::string_view data);
+
+  // Whether everything fed so far is one complete JSON value
+  bool finish();
+
+private:
+  enum class State : uint8_t {
+    VALUE = 0,            // A value must follow
+    FIRST_VALUE_OR_END,   // Just after '['
+    FIRST_KEY_OR_END,     // Just after '{'
+    KEY,                  // A key must follow (after ',' in an object)
+    COLON,                // After a key
+    AFTER_VALUE,          // ',' or the closing bracket must follow
+    STRING,
+    STRING_UTF8,          // Continuation bytes of a multibyte character
+    STRING_ESCAPE,
+    STRING_UNICODE,
+    NUMBER_MINUS,         // "-"
+    NUMBER_ZERO,          // "0" or "-0"
+    NUMBER_INTEGER,       // Integer digits
+    NUMBER_POINT,         // "."
+    NUMBER_FRACTION,      // Fraction digits
+    NUMBER_EXPONENT,      // "e"
+    NUMBER_EXPONENT_SIGN, // "e+"
+    NUMBER_EXPONENT_DIGITS,
+    LITERAL,              // Inside true, false or null
+    DONE,                 // The top level value is complete
+    FAILED
+  };
+
+  State state = State::VALUE;
+  bool string_is_key = false;
+  uint8_t unicode_digits = 0;
+  // Continuation bytes the character in a string still needs, and the range
+  // the next one must be in, which rules out overlong forms, surrogates and
+  // code points past U+10FFFF
+  uint8_t utf8_remaining = 0;
+  uint8_t utf8_lower = 0x80;
+  uint8_t utf8_upper = 0xBF;
+  const char *literal = nullptr;
+  uint8_t literal_position = 0;
+  std::vector<char> stack; // '{' or '[' for every open container
+
+  bool step(char c);
+  bool begin_value(char c);
+  bool begin_utf8(unsigned char lead);
+  void end_value();
+  bool is_number_state() const;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bucket layout of a LatencyHistogram, in the style of an HDR histogram
+// Values below 2^SUB_BUCKET_BITS have a bucket each. Above that every power
+// of two is split into 2^SUB_BUCKET_BITS linear buckets, so a bucket is never
+// wider than about 3% of the values in it, from nanoseconds to a minute,
+// with a fixed number of buckets. Finding the bucket of a value is a count
+// of leading zeros and two shifts.
+struct LatencyBuckets {
+  static constexpr int SUB_BUCKET_BITS = 5;
+  static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+
+  // Values above this (about 68 seconds in nanoseconds) share the last bucket
+  static constexpr int MAX_VALUE_BITS = 36;
+  static constexpr uint64_t MAX_VALUE = (uint64_t(1) << MAX_VALUE_BITS) - 1;
+
+  static constexpr size_t COUNT =
+      SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+  static size_t index_of(uint64_t value) {
+    if (value > MAX_VALUE) {
+      value = MAX_VALUE;
+    }
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return SUB_BUCKETS + shift * SUB_BUCKETS +
+           ((value >> shift) - SUB_BUCKETS);
+  }
+
+  // Largest value counted in a bucket
+  static uint64_t upper_bound(size_t index) {
+    if (index < SUB_BUCKETS) {
+      return index;
+    }
+    size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t sub_bucket = SUB_BUCKETS + (index - SUB_BUCKETS) % SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+};
+
+// The counts of one or more LatencyHistograms added up, for reading
+struct LatencySnapshot {
+  std::array<uint64_t, LatencyBuckets::COUNT> counts{};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+
+  void record(uint64_t value);
+  void merge(const LatencySnapshot &other);
+
+  // Smallest recorded value at or below which a fraction q of the values
+  // lie, e.g. q = 0.99 for the p99. Accurate to the width of its bucket
+  uint64_t percentile(double q) const;
+
+  // Number of values whose bucket lies at or below value
+  uint64_t count_at_most(uint64_t value) const;
+
+  uint64_t max() const;
+};
+
+// Histogram of latencies written by one thread and read by any
+// Recording is a relaxed load and store of two counters, no locked
+// instruction, since only the owning thread writes. Readers may see a
+// recording half done, which is off by one value at most.
+class LatencyHistogram {
+public:
+  void record(uint64_t value) {
+    auto &bucket = counts[LatencyBuckets::index_of(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value,
+              std::memory_order_relaxed);
+  }
+
+  // Adds the counts to snapshot
+  void add_to(LatencySnapshot &snapshot) const;
+
+private:
+  std::array<std::atomic<uint64_t>, LatencyBuckets::COUNT> counts{};
+  std::atomic<uint64_t> sum{0};
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <latency_histogram.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class ThreadPool;
+
+// Events counted by the server
+enum class MetricCounter {
+  CONNECTIONS_ACCEPTED = 0,
+  CONNECTIONS_REFUSED,      // Over MAX_CONNECTIONS_PER_IP
+  TIMEOUTS,                 // Connections closed by one of the timeouts
+  REQUESTS_GET,
+  REQUESTS_POST,
+  REQUESTS_OTHER,           // Other methods and unparseable requests
+  RESPONSES_2XX,
+  RESPONSES_3XX,
+  RESPONSES_4XX,
+  RESPONSES_5XX,
+  COUNT
+};
+
+// Stages of a request whose latency is recorded
+//      FIRST_BYTE   - from accepting a connection to the first byte of its
+//                     first response being written
+//      PARSE        - parsing and validating a request
+//      PROCESS_GET  - looking up the file of a GET, or the body of a POST
+//      PROCESS_POST   being validated and written (streamed bodies include
+//                     receiving them)
+//      BUILD        - serializing the response head
+//      WRITE        - from queueing responses on an idle connection to their
+//                     last byte being written
+enum class MetricStage {
+  FIRST_BYTE = 0,
+  PARSE,
+  PROCESS_GET,
+  PROCESS_POST,
+  BUILD,
+  WRITE,
+  COUNT
+};
+
+// Always-on counters and latency histograms, exposed in the Prometheus text
+// format on METRICS_PATH
+// Every thread records into a shard of its own, aligned to cache lines so
+// that no two threads ever write the same line. Recording is a thread local
+// lookup plus a relaxed load and store, a few nanoseconds and no locked
+// instruction. The shards are only added up when the metrics are read.
+// Gauges (open connections, pool queue depth, cache statistics) are read
+// from their owners at that point as well.
+class Metrics {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static void count(MetricCounter counter, uint64_t amount = 1);
+  static void record(MetricStage stage, Clock::duration duration);
+  static void record(MetricStage stage, Clock::time_point from,
+                     Clock::time_point to) {
+    record(stage, to - from);
+  }
+
+  // Counts a response by the class of its status code, e.g. 404 as 4xx
+  static void count_response(uint16_t status_code);
+
+  // Pool whose queue depth is reported, nullptr if requests are processed
+  // on the event loops
+  static void watch_pool(const ThreadPool *pool);
+
+  // The sums of all shards, for reading
+  static uint64_t total(MetricCounter counter);
+  static LatencySnapshot snapshot(MetricStage stage);
+
+  // Everything in the Prometheus text exposition format
+  static std::string render_prometheus();
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+// Memory for the short-lived allocations made while one request is processed:
+// paths, the parsed Accept-Encoding list, byte ranges and the like
+// Allocating is a pointer bump in a block owned by the worker thread, nothing
+// is freed one by one, and reset() hands the whole block back once the
+// response is built. Only a request that needs more than the block goes to
+// the heap, and that memory is released on reset() as well.
+// Nothing allocated from the arena may outlive the request, the response
+// itself is built on the heap since it is written after the reset.
+class RequestArena {
+public:
+  static constexpr size_t BLOCK_SIZE = 16 * 1024;
+
+  RequestArena();
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  std::pmr::memory_resource *resource();
+
+  // Releases everything allocated since the last reset
+  void reset();
+
+  // Arena of the calling thread
+  static RequestArena &for_this_thread();
+
+private:
+  std::unique_ptr<std::byte[]> block;
+  std::pmr::monotonic_buffer_resource memory;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class HTTPParser;
+
+enum class HTTPMethod {
+  GET = 0,
+  HEAD,
+  POST,
+  PUT,
+  DELETE,
+  PATCH,
+  OPTIONS,
+  UNKNOWN
+};
+
+inline constexpr size_t HTTP_METHOD_COUNT =
+    static_cast<size_t>(HTTPMethod::UNKNOWN);
+
+// The method of a request line, UNKNOWN for anything else. Methods are case
+// sensitive
+HTTPMethod parse_http_method(std::string_view method);
+
+struct RouteParam {
+  std::string_view name;
+  std::string_view value;
+};
+
+struct Route;
+
+// What a lookup found: the route, and the parameters of its pattern as views
+// into the route's pattern and into the path that was looked up
+struct RouteMatch {
+  static constexpr size_t MAX_PARAMS = 8;
+
+  const Route *route = nullptr;
+  RouteParam params[MAX_PARAMS];
+  size_t param_count = 0;
+
+  // Value of the parameter, empty if the pattern has none of that name
+  std::string_view param(std::string_view name) const;
+};
+
+// Processes a request whose route matched. It answers through the parser and
+// returns false if the request failed
+using RouteHandler = std::function<bool(HTTPParser &, const RouteMatch &)>;
+
+struct Route {
+  std::string pattern;
+  RouteHandler handler;
+
+  // For routes that take a streamed body (see StreamedRequest): checks the
+  // head in place of handler before any of the body arrives, and has the body
+  // written out as an upload with HTTPParser::accept_upload(). A route
+  // without one is handled as soon as the head is parsed, and its body dropped
+  RouteHandler accept_body;
+};
+
+// Maps a method and a path to a Route
+// Patterns are paths in which a segment starting with ':' matches any
+// non-empty segment and one starting with '*', which must be the last,
+// matches the rest of the path, even nothing. Their values are kept under
+// the names that follow. Static bytes are kept in a radix tree whose edges
+// are picked by the next byte of the path, so a lookup is one pass over the
+// path, hands out views and never allocates. Where a static route and a
+// parameter overlap, e.g. /users/new and /users/:id, the static branch is
+// tried first and the parameter only if the rest of the path doesn't match
+// below it; a '*' route is the last resort.
+//
+// Routes are added at startup, before any lookup, and never removed.
+class Router {
+public:
+  Router();
+  ~Router();
+
+  // The routes the server answers. Built with the built-in endpoints (see
+  // add_builtin_routes()) the first time it is used, which must be after the
+  // configuration was read
+  static Router &instance();
+
+  // Adds a route. Returns false, adding nothing, if the pattern doesn't start
+  // with '/', has a '*' segment that isn't last, a parameter without a name
+  // or named differently from one in the same place of another route, more
+  // than MAX_PARAMS parameters, or the method and pattern are routed already
+  bool add(HTTPMethod method, std::string_view pattern, RouteHandler handler,
+           RouteHandler accept_body = nullptr);
+
+  // Finds the route of method and path, false if there is none
+  bool find(HTTPMethod method, std::string_view path, RouteMatch &match) const;
+
+  // Whether any route takes method
+  bool handles(HTTPMethod method) const;
+
+  size_t size() const;
+
+private:
+  struct Node;
+
+  std::unique_ptr<Node> root;
+  size_t route_count = 0;
+  bool methods[HTTP_METHOD_COUNT] = {};
+};
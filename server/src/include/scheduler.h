@@ -0,0 +1,132 @@
+#pragma once
+
+#include <async_task.h>
+#include <http_response.h>
+#include <timer_wheel.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Runs coroutines on the thread that calls run(), one scheduler per core
+// A coroutine runs until it waits for a socket that isn't ready or for a
+// deadline, then the next ready one runs. When none is ready the scheduler
+// sleeps in epoll_wait() until a socket some coroutine waits on becomes ready
+// or the next tick of its timer wheel. Sockets are registered edge-triggered
+// once for their lifetime (see AsyncSocket), so waiting and waking costs no
+// epoll_ctl(), and an idle connection is a few coroutine frames instead of a
+// thread parked in read().
+class Scheduler {
+public:
+  Scheduler();
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+  ~Scheduler();
+
+  // The scheduler running on the calling thread, null outside of run()
+  static Scheduler *current();
+
+  // Runs task detached on this scheduler, starting with its next turn. Safe
+  // to call from any thread
+  void spawn(AsyncTask<void> task);
+
+  // Runs coroutines until stop() is called
+  void run();
+
+  // Makes run() return after the current turn. Safe to call from any thread
+  void stop();
+
+  // A coroutine waiting for a socket, a deadline or both
+  struct Waiter : TimerWheel::Timer {
+    std::coroutine_handle<> handle;
+    Waiter **slot = nullptr; // The socket's pointer to this waiter, if any
+    bool timed_out = false;
+  };
+
+  // co_await-ed to wait, true unless the deadline passed first
+  class Wait {
+  public:
+    Wait(Scheduler &scheduler, Waiter **slot, int timeout_ms)
+        : scheduler(scheduler), slot(slot), timeout_ms(timeout_ms) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() const noexcept { return !waiter.timed_out; }
+
+  private:
+    Scheduler &scheduler;
+    Waiter **slot;
+    int timeout_ms;
+    Waiter waiter;
+  };
+
+  // Suspends the calling coroutine for delay, to the tick of the timer wheel
+  Wait sleep(std::chrono::milliseconds delay);
+
+private:
+  friend class AsyncSocket;
+
+  int epoll_fd_;
+  int wakeup_fd_; // Written by spawn() and stop() from other threads
+  TimerWheel timers_;
+  std::deque<std::coroutine_handle<>> ready_;
+  std::atomic<bool> stopping_{false};
+
+  std::mutex spawned_mutex_;
+  std::vector<std::coroutine_handle<>> spawned_;
+
+  // Puts the waiting coroutine on the ready queue
+  void wake(Waiter &waiter, bool timed_out);
+  void take_spawned();
+};
+
+// A non-blocking socket whose operations suspend the calling coroutine until
+// they can make progress instead of blocking its thread
+// It is registered with the scheduler of the calling thread for as long as
+// it lives, and isn't closed with it. One coroutine may wait to read and one
+// to write at a time. Operations return what the system call did, or -errno,
+// -ETIMEDOUT if the socket didn't become ready within timeout_ms (0 waits as
+// long as it takes).
+class AsyncSocket {
+public:
+  explicit AsyncSocket(int fd);
+  AsyncSocket(const AsyncSocket &) = delete;
+  AsyncSocket &operator=(const AsyncSocket &) = delete;
+  ~AsyncSocket();
+
+  int fd() const { return fd_; }
+
+  // Bytes read, 0 at the end of the stream
+  AsyncTask<ssize_t> read(char *buffer, size_t size, int timeout_ms);
+
+  // Bytes of iovecs sent, with a single sendmsg() once the socket has room
+  AsyncTask<ssize_t> write(const iovec *iovecs, size_t count, int timeout_ms);
+
+  // Bytes of the file region sent, with a single sendfile()
+  AsyncTask<ssize_t> sendfile(int file_fd, off_t offset, size_t length,
+                              int timeout_ms);
+
+  // Writes everything queued in output: memory chunks with write(), file
+  // regions with sendfile(). False if the connection broke, or the client
+  // read nothing for timeout_ms
+  AsyncTask<bool> send(OutputQueue &output, int timeout_ms);
+
+  // A connection of a listening socket, made non-blocking
+  AsyncTask<int> accept(sockaddr_in &address);
+
+private:
+  Scheduler &scheduler_;
+  int fd_;
+  Scheduler::Waiter *reader_ = nullptr;
+  Scheduler::Waiter *writer_ = nullptr;
+
+  friend class Scheduler;
+  void notify(uint32_t events);
+};
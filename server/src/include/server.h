@@ -4,7 +4,37 @@
 
 #pragma once
 
+#include <http_parser.h>
+#include <http_response.h>
+#include <util.h>
 #include <netinet/in.h>
+#include <chrono>
+#include <string_view>
 
+// Serves a connection on the calling thread until it is closed, accepted is
+// when it was accepted
+void handle_client(sockaddr_in client_address, int client_socket_fd,
+                   std::chrono::steady_clock::time_point accepted);
 
-void handle_client(sockaddr_in client_address, int client_socket_fd);
\ No newline at end of file
+// Parses a complete HTTP request and builds the response for it
+// The response doesn't reference the request buffer. With close_connection
+// set it closes the connection whatever the request asked for
+HTTPResponse process_http_request(std::string_view request,
+                                  bool close_connection = false);
+
+// Counts a request processed by parser and its response in the metrics, and
+// records the latency of its stages. Processing ended at processed, the
+// response was built at built
+void record_request_metrics(const HTTPParser &parser,
+                            std::chrono::steady_clock::time_point started,
+                            std::chrono::steady_clock::time_point processed,
+                            std::chrono::steady_clock::time_point built);
+
+// Response for a request that could not be framed: 431 if its headers are too
+// large, 413 if its body is, 400 or 501 for a Transfer-Encoding other than
+// chunked. It always closes the connection
+HTTPResponse frame_error_response(FrameResult result);
+
+// 408 for a request that did not arrive within HEADER_TIMEOUT_MS, it closes
+// the connection as well
+HTTPResponse timeout_response();
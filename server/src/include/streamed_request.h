@@ -0,0 +1,104 @@
+#pragma once
+
+#include <http_parser.h>
+#include <http_response.h>
+#include <upload.h>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Incremental decoder for Transfer-Encoding: chunked bodies (RFC 9112 7.1)
+//      <size in hex>[;extensions]\r\n
+//      <size bytes of data>\r\n
+//      ... repeated until a chunk of size 0, then optional trailer lines and
+//      an empty line
+// Chunk data is handed out as views into the input, nothing is copied.
+class ChunkedDecoder {
+public:
+  // Decodes from the start of input until it has some chunk data or needs
+  // more bytes. Returns the number of bytes consumed and points data at the
+  // chunk data among them, which may be empty. Call again with the rest
+  size_t decode(std::string_view input, std::string_view &data);
+
+  bool done() const;
+  bool failed() const;
+
+private:
+  enum class State {
+    SIZE = 0,
+    EXTENSION,
+    SIZE_LF,
+    DATA,
+    DATA_CR,
+    DATA_LF,
+    TRAILER_START,
+    TRAILER,
+    TRAILER_LF,
+    FINAL_LF,
+    DONE,
+    FAILED
+  };
+
+  State state = State::SIZE;
+  size_t chunk_size = 0;
+  size_t size_digits = 0;
+  size_t metadata_bytes = 0; // Extensions and trailers, which we ignore
+};
+
+// Interim response telling a client that sent Expect: 100-continue to go on
+inline constexpr std::string_view CONTINUE_RESPONSE =
+    "HTTP/1.1 100 Continue\r\n\r\n";
+
+// A request whose body is read as a stream instead of being buffered whole:
+// chunked bodies, bodies larger than BODY_CHUNK_SIZE and requests that sent
+// Expect: 100-continue
+// The head is parsed and validated first. An accepted upload then gets its
+// body written to an UploadWriter piece by piece as it arrives. The body of a
+// rejected request is read and dropped so the connection can be reused,
+// unless the client is still waiting for a 100 Continue, in which case it is
+// answered right away and the connection closed.
+class StreamedRequest {
+public:
+  // head is the request line and headers as framed by frame_http_request()
+  explicit StreamedRequest(std::string head);
+  StreamedRequest(const StreamedRequest &) = delete;
+  StreamedRequest &operator=(const StreamedRequest &) = delete;
+
+  // Whether "100 Continue" has to be sent before the client sends the body
+  bool expectsContinue() const;
+
+  // Consumes body bytes from the start of input and returns how many were
+  // used. Bytes after the end of the body belong to the next request
+  size_t feed(std::string_view input);
+
+  // Whether the final response can be built: the body is complete, or it
+  // won't be read any further
+  bool complete() const;
+
+  // Closes the connection after the final response whatever the request
+  // asked for, e.g. on the last request a connection is allowed to make
+  void setConnectionClose();
+
+  // Finishes the upload and builds the final response. If the body was not
+  // read to its end the response closes the connection
+  HTTPResponse respond();
+
+private:
+  std::string head; // The parser keeps views into it
+  std::chrono::steady_clock::time_point started;
+  HTTPParser parser;
+  std::unique_ptr<UploadWriter> upload;
+
+  bool accepted = false;
+  bool expect_continue = false;
+  bool chunked = false;
+  ChunkedDecoder decoder;
+  size_t remaining = 0;   // Body bytes still to come without chunked
+  size_t body_bytes = 0;
+  bool body_done = false;
+  HTTPStatus failure = HTTPStatus::OK;
+
+  void fail(HTTPStatus status);
+};
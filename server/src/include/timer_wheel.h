@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Hashed timing wheel of coarse deadlines
+// Every connection of an event loop has one deadline at a time (the header,
+// body, idle or write timeout), and nearly all of them are pushed back or
+// cancelled before they expire. Timers are intrusive list nodes hashed into
+// one slot per tick, so scheduling, moving and cancelling one is O(1) and
+// the loop only visits the slots of the ticks that passed. Deadlines further
+// out than one turn of the wheel stay in their slot until their turn comes.
+// Not thread safe, a wheel belongs to one loop thread.
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Resolution of the deadlines
+  static constexpr std::chrono::milliseconds TICK{100};
+  static constexpr size_t SLOT_COUNT = 512;
+
+  // Embedded in whatever times out, e.g. a connection
+  class Timer {
+  public:
+    Timer() = default;
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+    ~Timer();
+
+    bool scheduled() const { return wheel != nullptr; }
+
+  private:
+    friend class TimerWheel;
+
+    TimerWheel *wheel = nullptr;
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    uint64_t expires = 0; // Tick the timer fires at
+  };
+
+  TimerWheel();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+  ~TimerWheel();
+
+  // (Re)schedules timer to fire once delay has passed, within a tick after
+  void schedule(Timer &timer, std::chrono::milliseconds delay);
+  void cancel(Timer &timer);
+
+  // Unschedules every timer due by now and calls on_expired with it. A
+  // callback may schedule or cancel any timer, including the one it got
+  template <typename Callback> void expire(Callback &&on_expired);
+
+  bool empty() const { return count == 0; }
+
+  // Milliseconds until the next tick starts, for the epoll_wait() timeout
+  int until_next_tick() const;
+
+private:
+  uint64_t now_tick() const;
+  void link(Timer &timer);
+  void unlink(Timer &timer);
+
+  Clock::time_point start;
+  uint64_t current = 0; // Last tick whose slot has been expired
+  size_t count = 0;
+
+  // Heads of the circular lists, a slot is empty when its head points at
+  // itself
+  std::array<Timer, SLOT_COUNT> slots;
+};
+
+template <typename Callback> void TimerWheel::expire(Callback &&on_expired) {
+  uint64_t now = now_tick();
+  uint64_t ticks = now - current;
+  if (ticks > SLOT_COUNT) {
+    ticks = SLOT_COUNT;
+  }
+
+  for (uint64_t tick = current + 1; tick <= current + ticks && count > 0;
+       tick++) {
+    // The slot is moved to a list of its own first. Timers the callbacks
+    // schedule into it wait for its next turn, and ones they cancel are
+    // simply unlinked from the moved list
+    Timer &head = slots[tick % SLOT_COUNT];
+    if (head.next == &head) {
+      continue;
+    }
+    Timer pending;
+    pending.next = head.next;
+    pending.prev = head.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head.next = head.prev = &head;
+
+    while (pending.next != &pending) {
+      Timer &timer = *pending.next;
+      unlink(timer);
+      if (timer.expires > now) {
+        link(timer);
+      } else {
+        timer.wheel = nullptr;
+        on_expired(timer);
+      }
+    }
+  }
+  current = now;
+}
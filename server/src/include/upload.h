@@ -0,0 +1,46 @@
+#pragma once
+
+#include <http_parser.h>
+#include <json_validator.h>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+// Writes one uploaded JSON document into the uploads directory
+// The body is appended to a hidden temp file as it arrives and validated on
+// the way, so only the piece being written is ever in memory. commit()
+// renames the temp file to its final upload_<time>_<id>.json name, which is
+// atomic: readers never see a partial upload. A writer that is destroyed
+// without a successful commit() removes its temp file.
+class UploadWriter {
+public:
+  explicit UploadWriter(const std::filesystem::path &directory);
+  ~UploadWriter();
+  UploadWriter(const UploadWriter &) = delete;
+  UploadWriter &operator=(const UploadWriter &) = delete;
+
+  // Validates and appends the next piece of the body
+  // Returns false once the upload has failed, see status()
+  bool write(std::string_view data);
+
+  // Checks that the body was one complete JSON document and moves the file
+  // into place. Returns false if it wasn't or the file couldn't be written
+  bool commit();
+
+  // CREATED after a successful commit(), BAD_REQUEST for invalid JSON,
+  // INTERNAL_SERVER_ERROR if the file couldn't be written, OK until then
+  HTTPStatus status() const;
+
+  // Name of the file in the uploads directory, set by commit()
+  const std::string &filename() const;
+
+private:
+  std::filesystem::path directory;
+  std::filesystem::path temp_path;
+  std::string final_filename;
+  int fd = -1;
+  HTTPStatus upload_status = HTTPStatus::OK;
+  JsonStreamValidator validator;
+
+  void fail(HTTPStatus status);
+};
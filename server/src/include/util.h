@@ -1,7 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 extern int PORT;
@@ -9,13 +14,50 @@ extern const char *SERVER_ADDRESS;
 extern int THREAD_POOL_SIZE;
 
 const std::string receive_line(int socket_fd, int MAX_SIZE = 1024);
-const std::string receive_http_req(int socket_fd, int MAX_SIZE = 2048);
+
+enum class FrameResult {
+  INCOMPLETE = 0,     // More bytes are needed
+  COMPLETE,           // length is set to the size of the first request
+  HEADERS_TOO_LARGE,  // No header terminator within max_header_size (431)
+  BODY_TOO_LARGE,     // Content-Length exceeds max_body_size (413)
+  BODY_FOLLOWS,       // length is set to the size of the headers, the body
+                      // must be streamed: it is chunked, bigger than
+                      // max_buffered_body or awaits a 100 Continue
+  BAD_TRANSFER_ENCODING,        // Transfer-Encoding doesn't end in chunked,
+                                // so the body has no framing (400)
+  UNSUPPORTED_TRANSFER_ENCODING // A transfer coding before chunked, which
+                                // the server can't decode (501)
+};
+
+// Finds where the first request in buffer ends: after the header block and
+// as many body bytes as its Content-Length says. Pipelined requests after it
+// are left alone, so calling this again past `length` frames the next one
+FrameResult frame_http_request(std::string_view buffer, size_t max_header_size,
+                               size_t max_body_size, size_t max_buffered_body,
+                               size_t &length);
+// Switches a file descriptor to non-blocking mode
+bool set_nonblocking(int fd);
+// Case insensitive ASCII comparison, used for header names and tokens
+bool iequals(std::string_view a, std::string_view b);
 void replaceAll(std::string &str, const std::string &from,
                 const std::string &to);
 std::vector<std::string> split(const std::string &str,
                                const std::string &delimiter);
 const std::optional<std::string> sanitize_path(const std::string &path);
+// Like sanitize_path() for the route of a request: route is replaced with a
+// view of its normal form in normalized, unless it is normal already, which
+// is checked without allocating. False if the route tries to escape the root
+bool sanitize_route(std::string_view &route, std::pmr::string &normalized);
 const std::optional<std::string> read_file(const std::string &path);
 bool write_file(const std::string &content, const std::string &path);
 std::string generate_random_id(size_t length);
+// Length of an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"
+inline constexpr size_t HTTP_DATE_LENGTH = 29;
+// Writes the current date as an IMF-fixdate to out, which must have room for
+// HTTP_DATE_LENGTH characters. It is formatted once per second and shared by
+// all threads
+void current_http_date(char *out);
 std::string get_rfc7231_date();
+std::string format_rfc7231_date(std::time_t time);
+// Parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"
+std::optional<std::time_t> parse_rfc7231_date(std::string_view date);
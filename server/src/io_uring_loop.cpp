@@ -0,0 +1,946 @@
+#ifdef HAVE_IO_URING
+
+#include <io_uring_loop.h>
+#include <config.h>
+#include <connection_limits.h>
+#include <streamed_request.h>
+#include <logging/Logging.h>
+#include <linux/io_uring.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Entries of the submission ring. Multishot operations complete many times
+// per submission, so the completion ring is a good deal larger
+static const unsigned RING_ENTRIES = 1024;
+static const unsigned COMPLETION_ENTRIES = 8 * RING_ENTRIES;
+
+// Provided buffers recv picks from, the count must be a power of two
+static const unsigned RECV_BUFFER_COUNT = 512;
+static const size_t RECV_BUFFER_SIZE = 4096;
+static const uint16_t RECV_BUFFER_GROUP = 0;
+
+// Registered buffers file regions are read into before they are sent
+static const int FILE_BUFFER_COUNT = 32;
+static const size_t FILE_BUFFER_SIZE = 64 * 1024;
+
+// Sockets registered as files at once, capped by RLIMIT_NOFILE. Connections
+// past that use their descriptor
+static const int MAX_REGISTERED_SOCKETS = 4096;
+
+// Written into a registered file slot to empty it
+static const int NO_FILE = -1;
+
+// What a completion is for, in the low bits of its user_data. The other
+// bits are the connection, or the slot of an UNREGISTER
+enum Operation : uint64_t {
+  IGNORED = 0,
+  ACCEPT,
+  WAKEUP,
+  RECV,
+  READ,
+  SEND,
+  UNREGISTER
+};
+static const uint64_t OPERATION_BITS = 3;
+static const uint64_t OPERATION_MASK = (1 << OPERATION_BITS) - 1;
+
+static int ring_setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags, const void *arg, size_t arg_size) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, arg, arg_size));
+}
+
+static int ring_register(int fd, unsigned opcode, const void *arg,
+                         unsigned count) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// The submission and completion rings shared with the kernel, without
+// liburing. Submissions are only handed to the kernel by submit_and_wait(),
+// or by next_sqe() when the submission ring is full
+class IoUringLoop::Ring {
+public:
+  static std::unique_ptr<Ring> create() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = COMPLETION_ENTRIES;
+    int fd = ring_setup(RING_ENTRIES, &params);
+    if (fd == -1 && errno == EINVAL) {
+      // The task running flags are optimizations of newer kernels
+      params = io_uring_params{};
+      params.flags = IORING_SETUP_CQSIZE;
+      params.cq_entries = COMPLETION_ENTRIES;
+      fd = ring_setup(RING_ENTRIES, &params);
+    }
+    if (fd == -1) {
+      return nullptr;
+    }
+
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                              IORING_FEAT_EXT_ARG | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+      close(fd);
+      return nullptr;
+    }
+
+    std::unique_ptr<Ring> ring(new Ring());
+    ring->fd_ = fd;
+    ring->map_size_ =
+        std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                 params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring->map_ = mmap(nullptr, ring->map_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->map_ == MAP_FAILED || sqes == MAP_FAILED) {
+      if (sqes != MAP_FAILED) {
+        munmap(sqes, ring->sqes_size_);
+      }
+      return nullptr;
+    }
+
+    char *map = static_cast<char *>(ring->map_);
+    ring->sq_head_ = reinterpret_cast<unsigned *>(map + params.sq_off.head);
+    ring->sq_tail_ = reinterpret_cast<unsigned *>(map + params.sq_off.tail);
+    ring->sq_mask_ = *reinterpret_cast<unsigned *>(map + params.sq_off.ring_mask);
+    ring->sq_entries_ = params.sq_entries;
+    ring->sqes_ = static_cast<io_uring_sqe *>(sqes);
+    ring->cq_head_ = reinterpret_cast<unsigned *>(map + params.cq_off.head);
+    ring->cq_tail_ = reinterpret_cast<unsigned *>(map + params.cq_off.tail);
+    ring->cq_mask_ = *reinterpret_cast<unsigned *>(map + params.cq_off.ring_mask);
+    ring->cqes_ = reinterpret_cast<io_uring_cqe *>(map + params.cq_off.cqes);
+    ring->tail_ = *ring->sq_tail_;
+
+    // Submission entries are always used in order, so the indirection
+    // array maps every index to itself once and for all
+    unsigned *array = reinterpret_cast<unsigned *>(map + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+      array[i] = i;
+    }
+    return ring;
+  }
+
+  ~Ring() {
+    if (map_ != nullptr && map_ != MAP_FAILED) {
+      munmap(map_, map_size_);
+    }
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    close(fd_);
+  }
+
+  int fd() const { return fd_; }
+
+  // A cleared submission entry, queued with the next submission
+  io_uring_sqe *next_sqe() {
+    if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+      submit();
+    }
+    io_uring_sqe *sqe = &sqes_[tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    tail_++;
+    return sqe;
+  }
+
+  // Makes room for count entries, so that a chain of linked operations is
+  // never split over two submissions
+  void reserve(unsigned count) {
+    if (sq_entries_ - (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) <
+        count) {
+      submit();
+    }
+  }
+
+  // Submits everything queued and waits for a completion, at most
+  // timeout_ms unless it is -1. Returns false on an unexpected error
+  bool submit_and_wait(int timeout_ms) {
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    __kernel_timespec timeout{};
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0) {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+      arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    }
+    int ret = ring_enter(fd_, to_submit, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg));
+    return ret >= 0 || errno == EINTR || errno == ETIME || errno == EBUSY ||
+           errno == EAGAIN;
+  }
+
+  // Calls handler(user_data, result, flags) for every completion posted
+  template <typename Handler> void reap(Handler &&handler) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      uint64_t user_data = cqe.user_data;
+      int32_t result = cqe.res;
+      uint32_t flags = cqe.flags;
+
+      // The entry is handed back before the handler queues new work
+      head++;
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      handler(user_data, result, flags);
+    }
+  }
+
+private:
+  Ring() = default;
+
+  int fd_ = -1;
+  void *map_ = nullptr;
+  size_t map_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned tail_ = 0; // Entries queued, published to the kernel on submit
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+
+  void submit() {
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    while (ring_enter(fd_, to_submit, 0, 0, nullptr, 0) == -1 &&
+           errno == EINTR) {
+    }
+  }
+};
+
+IoUringLoop::IoUringLoop(int listen_fd, ThreadPool *pool)
+    : EventLoop(listen_fd, pool) {}
+
+IoUringLoop::~IoUringLoop() {
+  for (int fd : waiting_sockets_) {
+    close(fd);
+  }
+  for (auto &[connection, owned] : retired_) {
+    close(connection->fd);
+  }
+  ring_.reset();
+  if (recv_buffers_ != nullptr) {
+    munmap(recv_buffers_, RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+  }
+  if (recv_ring_ != nullptr) {
+    munmap(recv_ring_, recv_ring_size_);
+  }
+  if (file_buffers_ != nullptr) {
+    munmap(file_buffers_, FILE_BUFFER_COUNT * FILE_BUFFER_SIZE);
+  }
+}
+
+bool IoUringLoop::supported() {
+  static const bool result = [] {
+    // Multishot recv, the youngest operation used, came with Linux 6.0
+    utsname name;
+    int major = 0;
+    int minor = 0;
+    if (uname(&name) != 0 ||
+        std::sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+      return false;
+    }
+
+    // Fails where io_uring is disabled, e.g. by a seccomp filter
+    std::unique_ptr<Ring> ring = Ring::create();
+    if (!ring) {
+      return false;
+    }
+
+    const int probe_ops = 256;
+    std::vector<char> probe_memory(sizeof(io_uring_probe) +
+                                   probe_ops * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(probe_memory.data());
+    if (ring_register(ring->fd(), IORING_REGISTER_PROBE, probe, probe_ops) ==
+        -1) {
+      return false;
+    }
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                   IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_READ_FIXED,
+                   IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL,
+                   IORING_OP_FILES_UPDATE, IORING_OP_CLOSE}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+
+    return true;
+  }();
+  return result;
+}
+
+bool IoUringLoop::buffer_rings_work() {
+  // Some kernels register a buffer ring without error and then never hand
+  // out its buffers, so a byte is received through one
+  static const bool result = [] {
+    std::unique_ptr<Ring> ring = Ring::create();
+    int sockets[2];
+    if (!ring ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1) {
+      return false;
+    }
+    size_t size = sysconf(_SC_PAGESIZE);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io_uring_buf_reg registration{};
+    registration.ring_addr = reinterpret_cast<uint64_t>(memory);
+    registration.ring_entries = 1;
+
+    bool works = false;
+    char byte = 0;
+    if (memory != MAP_FAILED &&
+        ring_register(ring->fd(), IORING_REGISTER_PBUF_RING, &registration,
+                      1) == 0 &&
+        write(sockets[0], "x", 1) == 1) {
+      auto *buffers = static_cast<io_uring_buf_ring *>(memory);
+      buffers->bufs[0].addr = reinterpret_cast<uint64_t>(&byte);
+      buffers->bufs[0].len = 1;
+      buffers->bufs[0].bid = 0;
+      __atomic_store_n(&buffers->tail, 1, __ATOMIC_RELEASE);
+
+      io_uring_sqe *sqe = ring->next_sqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = sockets[1];
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      if (ring->submit_and_wait(1000)) {
+        ring->reap([&works](uint64_t, int32_t result, uint32_t flags) {
+          works = result == 1 && (flags & IORING_CQE_F_BUFFER);
+        });
+      }
+    }
+
+    ring.reset();
+    if (memory != MAP_FAILED) {
+      munmap(memory, size);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+    return works;
+  }();
+  return result;
+}
+
+void IoUringLoop::setup() {
+  // The ring is created on the thread that runs the loop, the only one that
+  // ever submits to it
+  ring_ = Ring::create();
+  if (!ring_) {
+    perror("io_uring_setup() failed");
+    exit(EXIT_FAILURE);
+  }
+
+  void *recv_buffers =
+      mmap(nullptr, RECV_BUFFER_COUNT * RECV_BUFFER_SIZE,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (recv_buffers == MAP_FAILED) {
+    perror("Failed to allocate the recv buffers");
+    exit(EXIT_FAILURE);
+  }
+  recv_buffers_ = static_cast<char *>(recv_buffers);
+  if (buffer_rings_work()) {
+    recv_ring_size_ = RECV_BUFFER_COUNT * sizeof(io_uring_buf);
+    recv_ring_ = mmap(nullptr, recv_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io_uring_buf_reg registration{};
+    registration.ring_addr = reinterpret_cast<uint64_t>(recv_ring_);
+    registration.ring_entries = RECV_BUFFER_COUNT;
+    registration.bgid = RECV_BUFFER_GROUP;
+    if (recv_ring_ == MAP_FAILED ||
+        ring_register(ring_->fd(), IORING_REGISTER_PBUF_RING, &registration,
+                      1) == -1) {
+      perror("Failed to register the recv buffer ring");
+      exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < RECV_BUFFER_COUNT; i++) {
+      return_recv_buffer(i);
+    }
+  } else {
+    io_uring_sqe *sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = RECV_BUFFER_COUNT;
+    sqe->addr = reinterpret_cast<uint64_t>(recv_buffers_);
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = IGNORED;
+  }
+
+  // Registered buffers pin memory, which RLIMIT_MEMLOCK may not allow.
+  // File regions are then read into the same buffers unregistered
+  void *file_buffers =
+      mmap(nullptr, FILE_BUFFER_COUNT * FILE_BUFFER_SIZE,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (file_buffers == MAP_FAILED) {
+    perror("Failed to allocate the file buffers");
+    exit(EXIT_FAILURE);
+  }
+  file_buffers_ = static_cast<char *>(file_buffers);
+  std::vector<iovec> iovecs(FILE_BUFFER_COUNT);
+  for (int i = 0; i < FILE_BUFFER_COUNT; i++) {
+    iovecs[i].iov_base = file_buffers_ + i * FILE_BUFFER_SIZE;
+    iovecs[i].iov_len = FILE_BUFFER_SIZE;
+    free_file_buffers_.push_back(i);
+  }
+  file_buffers_registered_ =
+      ring_register(ring_->fd(), IORING_REGISTER_BUFFERS, iovecs.data(),
+                    FILE_BUFFER_COUNT) == 0;
+
+  // An empty table of registered files, filled as connections come in
+  rlimit files{};
+  getrlimit(RLIMIT_NOFILE, &files);
+  int slots = static_cast<int>(
+      std::min<rlim_t>(MAX_REGISTERED_SOCKETS, files.rlim_cur));
+  std::vector<int> empty(slots, NO_FILE);
+  if (ring_register(ring_->fd(), IORING_REGISTER_FILES, empty.data(), slots) ==
+      0) {
+    for (int slot = slots - 1; slot >= 0; slot--) {
+      free_slots_.push_back(slot);
+    }
+  }
+
+  // Completions from the pool are read off the eventfd by the ring, which
+  // needs it blocking to wait for a write instead of failing with EAGAIN
+  int flags = fcntl(wakeup_fd_, F_GETFL, 0);
+  fcntl(wakeup_fd_, F_SETFL, flags & ~O_NONBLOCK);
+
+  Logging logger;
+  logger.setClassName("IoUringLoop");
+  logger.info("Event loop running on io_uring, {} registered sockets, recv "
+              "buffers {}, file buffers {}registered",
+              free_slots_.size(),
+              recv_ring_ != nullptr ? "in a ring" : "provided by operations",
+              file_buffers_registered_ ? "" : "not ");
+}
+
+void IoUringLoop::run() {
+  setup();
+  arm_accept();
+  arm_wakeup();
+
+  while (true) {
+    // Deadlines and a stopped accept need the loop to wake up without a
+    // completion, once per tick of the timer wheel
+    int timeout = timers_.empty() && accept_armed_
+                      ? -1
+                      : timers_.until_next_tick();
+    if (!ring_->submit_and_wait(timeout)) {
+      perror("io_uring_enter() failed");
+      exit(EXIT_FAILURE);
+    }
+
+    ring_->reap([this](uint64_t user_data, int32_t result, uint32_t flags) {
+      handle_completion(user_data, result, flags);
+    });
+
+    timers_.expire([this](TimerWheel::Timer &timer) {
+      handle_timeout(static_cast<Connection &>(timer));
+    });
+
+    // Connections closed since, here or by another loop, make room for the
+    // ones waiting to be installed, then for the accept queue
+    ConnectionLimits &limits = ConnectionLimits::instance();
+    while (!waiting_sockets_.empty() && !limits.full()) {
+      install(waiting_sockets_.front());
+      waiting_sockets_.pop_front();
+    }
+    if (!accept_armed_ && waiting_sockets_.empty() && !limits.full() &&
+        std::chrono::steady_clock::now() >= accept_retry_) {
+      accept_paused_ = false;
+      arm_accept();
+    }
+  }
+}
+
+void IoUringLoop::arm_accept() {
+  io_uring_sqe *sqe = ring_->next_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd_;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = ACCEPT;
+  accept_armed_ = true;
+}
+
+void IoUringLoop::arm_wakeup() {
+  io_uring_sqe *sqe = ring_->next_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wakeup_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&wakeup_value_);
+  sqe->len = sizeof(wakeup_value_);
+  sqe->off = static_cast<uint64_t>(-1);
+  sqe->user_data = WAKEUP;
+}
+
+void IoUringLoop::arm_recv(RingConnection &connection) {
+  io_uring_sqe *sqe = ring_->next_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  if (connection.slot >= 0) {
+    sqe->fd = connection.slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = connection.fd;
+  }
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_BUFFER_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = reinterpret_cast<uint64_t>(&connection) | RECV;
+  connection.receiving = true;
+  connection.in_flight++;
+}
+
+void IoUringLoop::cancel(uint64_t user_data) {
+  io_uring_sqe *sqe = ring_->next_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+  sqe->user_data = IGNORED;
+}
+
+void IoUringLoop::return_recv_buffer(uint16_t id) {
+  if (recv_ring_ == nullptr) {
+    io_uring_sqe *sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr =
+        reinterpret_cast<uint64_t>(recv_buffers_ + id * RECV_BUFFER_SIZE);
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->off = id;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = IGNORED;
+    return;
+  }
+
+  auto *ring = static_cast<io_uring_buf_ring *>(recv_ring_);
+  io_uring_buf &buffer = ring->bufs[recv_ring_tail_ & (RECV_BUFFER_COUNT - 1)];
+  buffer.addr = reinterpret_cast<uint64_t>(recv_buffers_ + id * RECV_BUFFER_SIZE);
+  buffer.len = RECV_BUFFER_SIZE;
+  buffer.bid = id;
+  recv_ring_tail_++;
+  __atomic_store_n(&ring->tail, recv_ring_tail_, __ATOMIC_RELEASE);
+}
+
+void IoUringLoop::handle_completion(uint64_t user_data, int32_t result,
+                                    uint32_t flags) {
+  Operation operation = static_cast<Operation>(user_data & OPERATION_MASK);
+  auto &connection =
+      *reinterpret_cast<RingConnection *>(user_data & ~OPERATION_MASK);
+  switch (operation) {
+  case IGNORED:
+    break;
+  case ACCEPT:
+    handle_accept(result, flags);
+    break;
+  case WAKEUP:
+    drain_completions();
+    arm_wakeup();
+    break;
+  case RECV:
+    handle_recv(connection, result, flags);
+    break;
+  case READ:
+    handle_read(connection, result);
+    break;
+  case SEND:
+    handle_send(connection, result);
+    break;
+  case UNREGISTER:
+    // A slot that couldn't be emptied still holds its socket, it isn't
+    // used again
+    if (result >= 0) {
+      free_slots_.push_back(static_cast<int>(user_data >> OPERATION_BITS));
+    }
+    break;
+  }
+}
+
+void IoUringLoop::handle_accept(int32_t result, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    accept_armed_ = false;
+  }
+  if (result < 0) {
+    if (result != -ECANCELED) {
+      // Running out of file descriptors must not take the server down, or
+      // spin. Accepting is retried a tick later
+      Logging logger;
+      logger.setClassName("IoUringLoop::handle_accept");
+      logger.warn(std::string("accept() failed: ") + strerror(-result));
+      accept_retry_ = std::chrono::steady_clock::now() + TimerWheel::TICK;
+    }
+    return;
+  }
+
+  // Sockets the kernel accepted before the cancel arrived wait here for
+  // their turn, as they would have in the accept queue
+  if (ConnectionLimits::instance().full()) {
+    waiting_sockets_.push_back(result);
+  } else {
+    install(result);
+  }
+
+  // At the limit the rest waits in the accept queue
+  if (accept_armed_ && ConnectionLimits::instance().full()) {
+    cancel(ACCEPT);
+    accept_paused_ = true;
+    Logging logger;
+    logger.setClassName("IoUringLoop::handle_accept");
+    logger.warn("Connection limit reached, accepting paused");
+  }
+}
+
+void IoUringLoop::install(int fd) {
+  // A multishot accept has nowhere to put the address of each connection
+  sockaddr_in address{};
+  socklen_t address_length = sizeof(address);
+  getpeername(fd, reinterpret_cast<sockaddr *>(&address), &address_length);
+
+  auto *connection =
+      static_cast<RingConnection *>(add_connection(fd, address));
+  if (connection == nullptr) {
+    return;
+  }
+  if (!free_slots_.empty()) {
+    io_uring_files_update update{};
+    update.offset = free_slots_.back();
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    if (ring_register(ring_->fd(), IORING_REGISTER_FILES_UPDATE, &update, 1) ==
+        1) {
+      connection->slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+  }
+  arm_recv(*connection);
+}
+
+void IoUringLoop::handle_recv(RingConnection &connection, int32_t result,
+                              uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    connection.receiving = false;
+    connection.in_flight--;
+  }
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+    // Once the connection is going to close, whatever else the client
+    // sends is never processed, so it isn't kept either
+    if (result > 0 && !connection.retired && connection.keep_alive) {
+      connection.read_buffer.append(recv_buffers_ + id * RECV_BUFFER_SIZE,
+                                    result);
+    }
+    return_recv_buffer(id);
+  }
+
+  if (connection.retired) {
+    free_retired(connection);
+    return;
+  }
+
+  if (result > 0) {
+    connection.progressed = true;
+    // Past the size of the largest buffered request we stop receiving,
+    // process_connection() resumes once the buffer has been drained
+    if (connection.keep_alive && connection.read_buffer.size() >=
+                                     MAX_HEADER_SIZE + BODY_CHUNK_SIZE) {
+      connection.read_paused = true;
+      if (connection.receiving) {
+        cancel(reinterpret_cast<uint64_t>(&connection) | RECV);
+      }
+    }
+  } else if (result == 0) {
+    connection.peer_closed = true;
+  } else if (result != -ENOBUFS && result != -ECANCELED) {
+    connection.peer_closed = true;
+    connection.keep_alive = false;
+  }
+
+  // A multishot recv also ends when the buffer ring ran dry
+  if (!connection.receiving && !connection.peer_closed &&
+      !connection.read_paused) {
+    arm_recv(connection);
+  }
+
+  process_connection(connection);
+}
+
+void IoUringLoop::resume_reading(Connection &connection) {
+  auto &ring_connection = static_cast<RingConnection &>(connection);
+  // A recv still being cancelled is armed again when it ends
+  if (!ring_connection.receiving && !ring_connection.peer_closed) {
+    arm_recv(ring_connection);
+  }
+}
+
+std::unique_ptr<EventLoop::Connection> IoUringLoop::new_connection() {
+  return std::make_unique<RingConnection>();
+}
+
+bool IoUringLoop::flush(Connection &connection) {
+  auto &ring_connection = static_cast<RingConnection &>(connection);
+  if (!ring_connection.chain) {
+    start_chain(ring_connection);
+  }
+  return !connection.peer_closed || connection.keep_alive;
+}
+
+void IoUringLoop::start_chain(RingConnection &connection) {
+  if (connection.chain || connection.retired || connection.output.empty()) {
+    return;
+  }
+
+  std::unique_ptr<Chain> chain;
+  if (free_chains_.empty()) {
+    chain = std::make_unique<Chain>();
+  } else {
+    chain = std::move(free_chains_.back());
+    free_chains_.pop_back();
+  }
+  chain->count = 0;
+  chain->completed = 0;
+  chain->failed = false;
+
+  // Every segment takes up to two entries, and the chain goes out whole
+  ring_->reserve(2 * CHAIN_SEGMENTS);
+  uint64_t user_data = reinterpret_cast<uint64_t>(&connection);
+  int socket = connection.slot >= 0 ? connection.slot : connection.fd;
+  uint8_t socket_flags = connection.slot >= 0 ? IOSQE_FIXED_FILE : 0;
+  io_uring_sqe *last = nullptr;
+
+  const OutputQueue &output = connection.output;
+  size_t index = 0;
+  while (index < output.chunk_count() && chain->count < CHAIN_SEGMENTS) {
+    int file_fd;
+    off_t offset;
+    size_t length;
+    if (!output.file_at(index, file_fd, offset, length)) {
+      Segment &segment = chain->segments[chain->count++];
+      size_t iovec_count =
+          output.gather(index, segment.iovecs, SEGMENT_IOVECS);
+      segment.message = msghdr{};
+      segment.message.msg_iov = segment.iovecs;
+      segment.message.msg_iovlen = iovec_count;
+      segment.length = 0;
+      for (size_t i = 0; i < iovec_count; i++) {
+        segment.length += segment.iovecs[i].iov_len;
+      }
+      segment.buffer = -1;
+
+      io_uring_sqe *send = ring_->next_sqe();
+      send->opcode = IORING_OP_SENDMSG;
+      send->fd = socket;
+      send->flags = socket_flags | IOSQE_IO_LINK;
+      send->addr = reinterpret_cast<uint64_t>(&segment.message);
+      send->len = 1;
+      send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      send->user_data = user_data | SEND;
+      connection.in_flight++;
+      last = send;
+      continue;
+    }
+
+    // A file region is read a buffer at a time, each read linked to the
+    // send of its buffer. What doesn't fit this chain goes in the next
+    while (length > 0 && chain->count < CHAIN_SEGMENTS &&
+           !free_file_buffers_.empty()) {
+      int buffer = free_file_buffers_.back();
+      free_file_buffers_.pop_back();
+      char *bytes = file_buffers_ + buffer * FILE_BUFFER_SIZE;
+      size_t part = std::min(length, FILE_BUFFER_SIZE);
+
+      Segment &segment = chain->segments[chain->count++];
+      segment.length = part;
+      segment.buffer = buffer;
+
+      io_uring_sqe *read = ring_->next_sqe();
+      read->opcode =
+          file_buffers_registered_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      read->fd = file_fd;
+      read->flags = IOSQE_IO_LINK;
+      read->addr = reinterpret_cast<uint64_t>(bytes);
+      read->len = part;
+      read->off = offset;
+      read->buf_index = file_buffers_registered_ ? buffer : 0;
+      read->user_data = user_data | READ;
+      connection.in_flight++;
+
+      io_uring_sqe *send = ring_->next_sqe();
+      send->opcode = IORING_OP_SEND;
+      send->fd = socket;
+      send->flags = socket_flags | IOSQE_IO_LINK;
+      send->addr = reinterpret_cast<uint64_t>(bytes);
+      send->len = part;
+      send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      send->user_data = user_data | SEND;
+      connection.in_flight++;
+      last = send;
+
+      offset += part;
+      length -= part;
+    }
+    if (length > 0) {
+      break;
+    }
+    index++;
+  }
+
+  if (last == nullptr) {
+    // A file region is first and every buffer is taken, the connection
+    // waits for one to be released
+    free_chains_.push_back(std::move(chain));
+    file_buffer_waiters_.push_back(&connection);
+    return;
+  }
+  last->flags &= ~IOSQE_IO_LINK;
+  connection.chain = std::move(chain);
+}
+
+void IoUringLoop::handle_read(RingConnection &connection, int32_t result) {
+  connection.in_flight--;
+
+  // A read short of its region means the file got shorter than the
+  // Content-Length we promised, the only way out is to drop the connection.
+  // The read is cancelled if a send before it in the chain came up short
+  Chain &chain = *connection.chain;
+  const Segment &segment = chain.segments[chain.completed];
+  if (result != -ECANCELED && result != static_cast<int32_t>(segment.length)) {
+    chain.failed = true;
+  }
+}
+
+void IoUringLoop::handle_send(RingConnection &connection, int32_t result) {
+  connection.in_flight--;
+
+  Chain &chain = *connection.chain;
+  const Segment &segment = chain.segments[chain.completed++];
+  if (segment.buffer >= 0) {
+    release_file_buffer(segment.buffer);
+  }
+
+  // A short send breaks the chain, the rest is cancelled and sent again by
+  // the next chain
+  if (!connection.retired && !chain.failed) {
+    if (result > 0) {
+      connection.output.consume(result);
+      connection.progressed = true;
+      record_first_byte(connection);
+    } else if (result != -ECANCELED && (result < 0 || segment.length > 0)) {
+      chain.failed = true;
+    }
+  }
+
+  if (chain.completed == chain.count) {
+    finish_chain(connection);
+  } else if (!connection.retired && result > 0) {
+    process_connection(connection);
+  }
+}
+
+void IoUringLoop::finish_chain(RingConnection &connection) {
+  bool failed = connection.chain->failed;
+  free_chains_.push_back(std::move(connection.chain));
+
+  if (connection.retired) {
+    free_retired(connection);
+    return;
+  }
+
+  if (failed) {
+    connection.peer_closed = true;
+    connection.keep_alive = false;
+    connection.output.clear();
+  } else {
+    start_chain(connection);
+  }
+  process_connection(connection);
+}
+
+void IoUringLoop::release_file_buffer(int buffer) {
+  free_file_buffers_.push_back(buffer);
+  if (!file_buffer_waiters_.empty()) {
+    RingConnection *waiter = file_buffer_waiters_.front();
+    file_buffer_waiters_.pop_front();
+    start_chain(*waiter);
+  }
+}
+
+void IoUringLoop::retire(std::unique_ptr<Connection> connection) {
+  auto *ring_connection = static_cast<RingConnection *>(connection.get());
+  ring_connection->retired = true;
+  file_buffer_waiters_.erase(std::remove(file_buffer_waiters_.begin(),
+                                         file_buffer_waiters_.end(),
+                                         ring_connection),
+                             file_buffer_waiters_.end());
+
+  // Operations still held by the kernel point at the connection, it lives
+  // until the last of them completes
+  retired_[ring_connection] = std::move(connection);
+  if (ring_connection->in_flight > 0) {
+    io_uring_sqe *sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD;
+    if (ring_connection->slot >= 0) {
+      sqe->fd = ring_connection->slot;
+      sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+    } else {
+      sqe->fd = ring_connection->fd;
+    }
+    sqe->user_data = IGNORED;
+  }
+  free_retired(*ring_connection);
+}
+
+void IoUringLoop::free_retired(RingConnection &connection) {
+  if (connection.in_flight > 0) {
+    return;
+  }
+
+  // The slot is reused once it has been emptied
+  if (connection.slot >= 0) {
+    io_uring_sqe *sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&NO_FILE);
+    sqe->len = 1;
+    sqe->off = connection.slot;
+    sqe->user_data =
+        (static_cast<uint64_t>(connection.slot) << OPERATION_BITS) | UNREGISTER;
+  }
+  io_uring_sqe *sqe = ring_->next_sqe();
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = connection.fd;
+  sqe->user_data = IGNORED;
+
+  // Destroys the connection
+  retired_.erase(&connection);
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include <json_validator.h>
+
+static bool is_whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool is_hex_digit(char c) {
+  return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+bool JsonStreamValidator::feed(std::string_view data) {
+  if (state == State::FAILED) {
+    return false;
+  }
+
+  for (char c : data) {
+    if (!step(c)) {
+      state = State::FAILED;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool JsonStreamValidator::finish() {
+  // A number at the top level only ends with the document
+  if (stack.empty() && is_number_state()) {
+    state = State::DONE;
+  }
+  return state == State::DONE;
+}
+
+bool JsonStreamValidator::step(char c) {
+  switch (state) {
+  case State::VALUE:
+    return is_whitespace(c) || begin_value(c);
+
+  case State::FIRST_VALUE_OR_END:
+    if (c == ']') {
+      stack.pop_back();
+      end_value();
+      return true;
+    }
+    return is_whitespace(c) || begin_value(c);
+
+  case State::FIRST_KEY_OR_END:
+  case State::KEY:
+    if (is_whitespace(c)) {
+      return true;
+    }
+    if (c == '}' && state == State::FIRST_KEY_OR_END) {
+      stack.pop_back();
+      end_value();
+      return true;
+    }
+    if (c == '"') {
+      state = State::STRING;
+      string_is_key = true;
+      return true;
+    }
+    return false;
+
+  case State::COLON:
+    if (c == ':') {
+      state = State::VALUE;
+      return true;
+    }
+    return is_whitespace(c);
+
+  case State::AFTER_VALUE:
+    if (is_whitespace(c)) {
+      return true;
+    }
+    if (c == ',') {
+      state = stack.back() == '{' ? State::KEY : State::VALUE;
+      return true;
+    }
+    if ((c == '}' && stack.back() == '{') || (c == ']' && stack.back() == '[')) {
+      stack.pop_back();
+      end_value();
+      return true;
+    }
+    return false;
+
+  case State::STRING:
+    if (c == '"') {
+      if (string_is_key) {
+        state = State::COLON;
+      } else {
+        end_value();
+      }
+      return true;
+    }
+    if (c == '\\') {
+      state = State::STRING_ESCAPE;
+      return true;
+    }
+    // Control characters have to be escaped inside strings, and anything
+    // else must be valid UTF-8
+    if (static_cast<unsigned char>(c) >= 0x80) {
+      return begin_utf8(static_cast<unsigned char>(c));
+    }
+    return static_cast<unsigned char>(c) >= 0x20;
+
+  case State::STRING_UTF8: {
+    auto byte = static_cast<unsigned char>(c);
+    if (byte < utf8_lower || byte > utf8_upper) {
+      return false;
+    }
+    utf8_lower = 0x80;
+    utf8_upper = 0xBF;
+    if (--utf8_remaining == 0) {
+      state = State::STRING;
+    }
+    return true;
+  }
+
+  case State::STRING_ESCAPE:
+    if (c == 'u') {
+      state = State::STRING_UNICODE;
+      unicode_digits = 0;
+      return true;
+    }
+    if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' ||
+        c == 'n' || c == 'r' || c == 't') {
+      state = State::STRING;
+      return true;
+    }
+    return false;
+
+  case State::STRING_UNICODE:
+    if (!is_hex_digit(c)) {
+      return false;
+    }
+    if (++unicode_digits == 4) {
+      state = State::STRING;
+    }
+    return true;
+
+  // Numbers: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  // A number has no terminator, the first character that can't continue it
+  // ends it and is then processed on its own
+  case State::NUMBER_MINUS:
+    if (c == '0') {
+      state = State::NUMBER_ZERO;
+      return true;
+    }
+    if (is_digit(c)) {
+      state = State::NUMBER_INTEGER;
+      return true;
+    }
+    return false;
+
+  case State::NUMBER_ZERO:
+  case State::NUMBER_INTEGER:
+    if (is_digit(c) && state == State::NUMBER_INTEGER) {
+      return true;
+    }
+    if (c == '.') {
+      state = State::NUMBER_POINT;
+      return true;
+    }
+    if (c == 'e' || c == 'E') {
+      state = State::NUMBER_EXPONENT;
+      return true;
+    }
+    end_value();
+    return step(c);
+
+  case State::NUMBER_POINT:
+    if (is_digit(c)) {
+      state = State::NUMBER_FRACTION;
+      return true;
+    }
+    return false;
+
+  case State::NUMBER_FRACTION:
+    if (is_digit(c)) {
+      return true;
+    }
+    if (c == 'e' || c == 'E') {
+      state = State::NUMBER_EXPONENT;
+      return true;
+    }
+    end_value();
+    return step(c);
+
+  case State::NUMBER_EXPONENT:
+    if (c == '+' || c == '-') {
+      state = State::NUMBER_EXPONENT_SIGN;
+      return true;
+    }
+    if (is_digit(c)) {
+      state = State::NUMBER_EXPONENT_DIGITS;
+      return true;
+    }
+    return false;
+
+  case State::NUMBER_EXPONENT_SIGN:
+    if (is_digit(c)) {
+      state = State::NUMBER_EXPONENT_DIGITS;
+      return true;
+    }
+    return false;
+
+  case State::NUMBER_EXPONENT_DIGITS:
+    if (is_digit(c)) {
+      return true;
+    }
+    end_value();
+    return step(c);
+
+  case State::LITERAL:
+    if (c != literal[literal_position]) {
+      return false;
+    }
+    if (literal[++literal_position] == '\0') {
+      end_value();
+    }
+    return true;
+
+  case State::DONE:
+    return is_whitespace(c);
+
+  case State::FAILED:
+    return false;
+  }
+
+  return false;
+}
+
+bool JsonStreamValidator::begin_value(char c) {
+  switch (c) {
+  case '{':
+  case '[':
+    if (stack.size() == MAX_DEPTH) {
+      return false;
+    }
+    stack.push_back(c);
+    state = c == '{' ? State::FIRST_KEY_OR_END : State::FIRST_VALUE_OR_END;
+    return true;
+  case '"':
+    state = State::STRING;
+    string_is_key = false;
+    return true;
+  case '-':
+    state = State::NUMBER_MINUS;
+    return true;
+  case '0':
+    state = State::NUMBER_ZERO;
+    return true;
+  case 't':
+    literal = "true";
+    break;
+  case 'f':
+    literal = "false";
+    break;
+  case 'n':
+    literal = "null";
+    break;
+  default:
+    if (is_digit(c)) {
+      state = State::NUMBER_INTEGER;
+      return true;
+    }
+    return false;
+  }
+
+  state = State::LITERAL;
+  literal_position = 1;
+  return true;
+}
+
+// Lead bytes and the continuation bytes they allow (RFC 3629 section 4)
+//      C2..DF 80..BF
+//      E0     A0..BF 80..BF    E1..EC, EE..EF 80..BF 80..BF
+//      ED     80..9F 80..BF    (D800..DFFF are surrogates)
+//      F0     90..BF 80..BF 80..BF    F1..F3 80..BF 80..BF 80..BF
+//      F4     80..8F 80..BF 80..BF    (nothing past U+10FFFF)
+// Continuation bytes on their own, C0, C1 and F5..FF never start one
+bool JsonStreamValidator::begin_utf8(unsigned char lead) {
+  utf8_lower = 0x80;
+  utf8_upper = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    utf8_remaining = 1;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    utf8_remaining = 2;
+    if (lead == 0xE0) {
+      utf8_lower = 0xA0;
+    } else if (lead == 0xED) {
+      utf8_upper = 0x9F;
+    }
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    utf8_remaining = 3;
+    if (lead == 0xF0) {
+      utf8_lower = 0x90;
+    } else if (lead == 0xF4) {
+      utf8_upper = 0x8F;
+    }
+  } else {
+    return false;
+  }
+  state = State::STRING_UTF8;
+  return true;
+}
+
+void JsonStreamValidator::end_value() {
+  state = stack.empty() ? State::DONE : State::AFTER_VALUE;
+}
+
+bool JsonStreamValidator::is_number_state() const {
+  return state == State::NUMBER_ZERO || state == State::NUMBER_INTEGER ||
+         state == State::NUMBER_FRACTION ||
+         state == State::NUMBER_EXPONENT_DIGITS;
+}
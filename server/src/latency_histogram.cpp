@@ -0,0 +1,65 @@
+#include <latency_histogram.h>
+#include <cmath>
+
+void LatencySnapshot::record(uint64_t value) {
+  counts[LatencyBuckets::index_of(value)]++;
+  count++;
+  sum += value;
+}
+
+void LatencySnapshot::merge(const LatencySnapshot &other) {
+  for (size_t i = 0; i < LatencyBuckets::COUNT; i++) {
+    counts[i] += other.counts[i];
+  }
+  count += other.count;
+  sum += other.sum;
+}
+
+uint64_t LatencySnapshot::percentile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(q * count));
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LatencyBuckets::COUNT; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return LatencyBuckets::upper_bound(i);
+    }
+  }
+  return max();
+}
+
+uint64_t LatencySnapshot::count_at_most(uint64_t value) const {
+  uint64_t total = 0;
+  for (size_t i = 0; i < LatencyBuckets::COUNT; i++) {
+    if (LatencyBuckets::upper_bound(i) > value) {
+      break;
+    }
+    total += counts[i];
+  }
+  return total;
+}
+
+uint64_t LatencySnapshot::max() const {
+  for (size_t i = LatencyBuckets::COUNT; i > 0; i--) {
+    if (counts[i - 1] > 0) {
+      return LatencyBuckets::upper_bound(i - 1);
+    }
+  }
+  return 0;
+}
+
+void LatencyHistogram::add_to(LatencySnapshot &snapshot) const {
+  uint64_t total = 0;
+  for (size_t i = 0; i < LatencyBuckets::COUNT; i++) {
+    uint64_t bucket = counts[i].load(std::memory_order_relaxed);
+    snapshot.counts[i] += bucket;
+    total += bucket;
+  }
+  snapshot.count += total;
+  snapshot.sum += sum.load(std::memory_order_relaxed);
+}
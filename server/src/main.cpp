@@ -1,38 +1,40 @@
 #include <util.h>
+#include <config.h>
+#include <event_loop.h>
+#include <router.h>
+#include <coroutine_server.h>
+#include <scheduler.h>
 #include <logging/Logging.h>
 #include <arpa/inet.h>
 #include <iostream>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <string>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 #include <server.h>
 #include <thread_pool.h>
+#include <access_log.h>
+#include <error_responses.h>
+#include <asset_bundle.h>
+#include <connection_limits.h>
+#include <metrics.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 
 int PORT = 8080;
 const char* SERVER_ADDRESS = "127.0.0.1";
 int THREAD_POOL_SIZE = 20;
 
-int main(int argc, char *argv[]) {
-  // Check if user provides port, ip address, thread pool size
-  if (argc == 4) {
-    PORT = std::stoi(argv[1]);
-    SERVER_ADDRESS = argv[2];
-    THREAD_POOL_SIZE = std::stoi(argv[3]);
-  }
-
-  // If the browser closes the connection then we write to a broken pipe
-  // In that case SIGPIPE will be thrown
-  // We ignore that and just log that the server closed connection and then
-  // accept new connections
-  signal(SIGPIPE, SIG_IGN);
-
-  Logging logger;
-  logger.setClassName("main");
-
-  ThreadPool pool(THREAD_POOL_SIZE);
-
+// Creates, binds and starts listening on a TCP socket for the given address
+// With reuse_port set, several sockets can be bound to the same address and
+// the kernel load balances new connections between them
+static int create_listening_socket(const sockaddr_in &address, bool reuse_port) {
   // Integer return value used for validation of errors
   int ret_val;
 
@@ -54,6 +56,123 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  if (reuse_port) {
+    ret_val = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &op_val,
+                         sizeof(op_val));
+    if (ret_val == -1) {
+      perror("setsockopt(SO_REUSEPORT) failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Bind the socket
+  // Note that we also need to explicitly pass the length of address struct here
+  // as the second argument is a generic pointer
+  ret_val = bind(socket_fd, (sockaddr *)(&address), sizeof(address));
+  if (ret_val == -1) {
+    perror("Binding the socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Listen for connections
+  // The backlog bounds the number of connections the kernel queues for us
+  // before we accept() them, it is capped by net.core.somaxconn
+  ret_val = listen(socket_fd, LISTEN_BACKLOG);
+  if (ret_val == -1) {
+    std::cerr << "Failed to call listen() on sockets\n";
+    exit(EXIT_FAILURE);
+  }
+
+  return socket_fd;
+}
+
+// Pins a thread to a single CPU so that its event loop, socket buffers and
+// caches stay on one core. Failing to pin is not fatal
+static void pin_thread_to_cpu(std::thread &thread, int index) {
+  int cpu_count = std::thread::hardware_concurrency();
+  if (cpu_count <= 0) {
+    return;
+  }
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(index % cpu_count, &cpu_set);
+  int ret_val = pthread_setaffinity_np(thread.native_handle(),
+                                       sizeof(cpu_set), &cpu_set);
+  if (ret_val != 0) {
+    Logging logger;
+    logger.setClassName("pin_thread_to_cpu");
+    logger.warn("Failed to pin event loop " + std::to_string(index) +
+                " to a CPU");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // Options of the form --key=value may appear anywhere on the command line
+  std::vector<char *> positional_args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) == 0) {
+      if (!parse_server_option(arg)) {
+        std::cerr << "Unknown or invalid option: " << arg << "\n";
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      positional_args.push_back(argv[i]);
+    }
+  }
+
+  // Check if user provides port, ip address, thread pool size
+  if (positional_args.size() == 3) {
+    PORT = std::stoi(positional_args[0]);
+    SERVER_ADDRESS = positional_args[1];
+    THREAD_POOL_SIZE = std::stoi(positional_args[2]);
+  }
+
+  // Packing a bundle is a build step, no server is started
+  if (!PACK_ASSET_BUNDLE_PATH.empty()) {
+    std::string error;
+    auto packed =
+        pack_asset_bundle(SERVER_ROOT, PACK_ASSET_BUNDLE_PATH, error);
+    if (!packed) {
+      std::cerr << "Unable to pack the asset bundle: " << error << "\n";
+      exit(EXIT_FAILURE);
+    }
+    std::cout << "Packed " << *packed << " files from " << SERVER_ROOT.string()
+              << " into " << PACK_ASSET_BUNDLE_PATH << "\n";
+    return 0;
+  }
+
+  // If the browser closes the connection then we write to a broken pipe
+  // In that case SIGPIPE will be thrown
+  // We ignore that and just log that the server closed connection and then
+  // accept new connections
+  signal(SIGPIPE, SIG_IGN);
+
+  // Ctrl+C and SIGTERM are handled by a thread of their own. Blocking them
+  // here, before any other thread exists, keeps them off all other threads.
+  // The process then ends with quick_exit(), which runs the handlers that
+  // flush the logs but not the destructors of objects other threads still use
+  sigset_t shutdown_signals;
+  sigemptyset(&shutdown_signals);
+  sigaddset(&shutdown_signals, SIGINT);
+  sigaddset(&shutdown_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+  std::thread([shutdown_signals] {
+    int signal_number;
+    sigwait(&shutdown_signals, &signal_number);
+    Logging logger;
+    logger.setClassName("main");
+    logger.log("Shutting down");
+    std::quick_exit(EXIT_SUCCESS);
+  }).detach();
+
+  Logging logger;
+  logger.setClassName("main");
+
+  // Integer return value used for validation of errors
+  int ret_val;
+
   // Create address struct and populate it
   // It's called sockaddr_in because it's an address struct for IPv4. For IPv6,
   // you would have to use 'sockaddr_in6' It's also important to note that
@@ -81,29 +200,113 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  // Bind the socket
-  // Note that we also need to explicitly pass the length of address struct here
-  // as the second argument is a generic pointer
-  ret_val = bind(socket_fd, (sockaddr *)(&address), sizeof(address));
-  if (ret_val == -1) {
-    perror("Binding the socket failed");
-    exit(EXIT_FAILURE);
+  logger.log("HTTP Server started on http://" + std::string(SERVER_ADDRESS) +
+             ":" + std::to_string(PORT));
+  if (!ASSET_BUNDLE_PATH.empty()) {
+    std::string error;
+    auto bundle = AssetBundle::open(ASSET_BUNDLE_PATH, error);
+    if (!bundle) {
+      std::cerr << "Unable to open the asset bundle " << ASSET_BUNDLE_PATH
+                << ": " << error << "\n";
+      exit(EXIT_FAILURE);
+    }
+    logger.log("Serving " + std::to_string(bundle->asset_count()) +
+               " files from the asset bundle " + ASSET_BUNDLE_PATH);
+    AssetBundle::serve(std::move(bundle));
+  } else {
+    logger.log("Serving files from " + SERVER_ROOT.string());
   }
 
-  // Listen for connections
-  ret_val = listen(socket_fd, 20);
-  ;
-  if (ret_val == -1) {
-    std::cerr << "Failed to call listen() on sockets\n";
-    exit(EXIT_FAILURE);
+  // Uploads go to SERVER_ROOT/uploads, which a fresh checkout doesn't have.
+  // Without it every upload would be answered with 500
+  std::error_code uploads_error;
+  std::filesystem::create_directories(SERVER_ROOT / "uploads", uploads_error);
+  if (uploads_error) {
+    logger.warn("Unable to create " + (SERVER_ROOT / "uploads").string() +
+                ": " + uploads_error.message());
   }
-
-  logger.log("HTTP Server started on http://" + std::string(SERVER_ADDRESS) +
-             ":" + std::to_string(PORT));
-  logger.log("Serving files from 'res' directory");
   logger.log("Press Ctrl+C to stop the server");
+  logger.log(std::string("Connection handling mode: ") +
+             server_mode_name(SERVER_MODE));
+
+  if (!ACCESS_LOG_PATH.empty()) {
+    if (!AccessLog::instance().open(ACCESS_LOG_PATH, ACCESS_LOG_MAX_BYTES,
+                                    ACCESS_LOG_FILES)) {
+      std::cerr << "Unable to open the access log " << ACCESS_LOG_PATH << "\n";
+      exit(EXIT_FAILURE);
+    }
+    logger.log("Writing the access log to " + ACCESS_LOG_PATH);
+  }
+
+  // The routes are built now that the configuration is known, endpoints of
+  // our own are added to Router::instance() here, before any request
+  logger.log("Serving " + std::to_string(Router::instance().size()) +
+             " routes");
+
+  // Error responses are prebuilt before any request comes in
+  std::filesystem::path error_pages =
+      ERROR_PAGES_DIR.empty() ? SERVER_ROOT / "errors"
+                              : std::filesystem::path(ERROR_PAGES_DIR);
+  int custom_pages = ErrorResponses::instance().load_pages(error_pages);
+  if (custom_pages > 0) {
+    logger.log("Loaded " + std::to_string(custom_pages) +
+               " custom error pages from " + error_pages.string());
+  }
+
+  if (SERVER_MODE == ServerMode::REUSEPORT ||
+      SERVER_MODE == ServerMode::COROUTINE) {
+    // Every loop gets its own SO_REUSEPORT listener, so the kernel spreads
+    // incoming connections across them and the loops share nothing.
+    // All listeners are bound up front so that a bind error stops startup
+    int loop_count = EVENT_LOOP_COUNT;
+    std::vector<int> listen_fds;
+    for (int i = 0; i < loop_count; i++) {
+      listen_fds.push_back(create_listening_socket(address, true));
+    }
+
+    bool coroutines = SERVER_MODE == ServerMode::COROUTINE;
+    logger.log("Running " + std::to_string(loop_count) +
+               (coroutines ? " coroutine schedulers" : " event loops") +
+               " with SO_REUSEPORT listeners");
 
+    std::vector<std::thread> loop_threads;
+    for (int i = 0; i < loop_count; i++) {
+      loop_threads.emplace_back([listen_fd = listen_fds[i], coroutines]() {
+        // Requests are processed on the loop thread itself, there is no
+        // queue shared with other loops
+        if (coroutines) {
+          Scheduler scheduler;
+          scheduler.spawn(accept_connections(listen_fd));
+          scheduler.run();
+        } else {
+          EventLoop::create(listen_fd, nullptr)->run();
+        }
+      });
+      pin_thread_to_cpu(loop_threads.back(), i);
+    }
+
+    for (auto &thread : loop_threads) {
+      thread.join();
+    }
+    return 0;
+  }
+
+  int socket_fd = create_listening_socket(address, false);
+  ThreadPool pool(THREAD_POOL_SIZE, PIN_POOL_THREADS);
+  Metrics::watch_pool(&pool);
+
+  if (SERVER_MODE == ServerMode::EPOLL) {
+    // The event loop owns all client sockets, the pool threads only ever see
+    // complete requests
+    EventLoop::create(socket_fd, &pool)->run();
+  }
+
+  ConnectionLimits &limits = ConnectionLimits::instance();
   while (true) {
+    // At the connection limit we stop accepting until one is closed, new
+    // connections wait in the kernel accept queue meanwhile
+    limits.wait_until_not_full();
+
     // Since accept returns a socket file descriptor attached to the client
     // We also need to provide it with pointers to new sockaddr and socklen_t
     // structs to have information about the client
@@ -112,14 +315,29 @@ int main(int argc, char *argv[]) {
     int client_socket_fd = accept(socket_fd, (sockaddr *)(&client_address),
                                   (socklen_t *)&client_address_len);
     if (client_socket_fd == -1) {
-      perror("accept() call failed. Connection with client failed\n");
-      exit(EXIT_FAILURE);
+      // A failed accept only concerns that connection. Running out of file
+      // descriptors is retried after a pause instead of spinning
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        logger.warn(std::string("accept() failed: ") + strerror(errno));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      continue;
+    }
+
+    if (!limits.admit(client_address.sin_addr)) {
+      Metrics::count(MetricCounter::CONNECTIONS_REFUSED);
+      close(client_socket_fd);
+      continue;
     }
+    Metrics::count(MetricCounter::CONNECTIONS_ACCEPTED);
 
-    pool.enqueue([client_address, client_socket_fd]() {
-      handle_client(client_address, client_socket_fd);
+    auto accepted = std::chrono::steady_clock::now();
+    pool.enqueue([client_address, client_socket_fd, accepted]() {
+      handle_client(client_address, client_socket_fd, accepted);
+      ConnectionLimits::instance().release(client_address.sin_addr);
     });
   }
 
   close(socket_fd);
-}
\ No newline at end of file
+}
@@ -0,0 +1,246 @@
+#include <metrics.h>
+#include <compression_cache.h>
+#include <connection_limits.h>
+#include <file_cache.h>
+#include <thread_pool.h>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Counters and histograms written by one thread
+struct alignas(64) MetricsShard {
+  std::array<std::atomic<uint64_t>, static_cast<size_t>(MetricCounter::COUNT)>
+      counters{};
+  std::array<LatencyHistogram, static_cast<size_t>(MetricStage::COUNT)>
+      histograms;
+};
+
+// Shards are never freed: those of threads that exited still hold counts
+static std::mutex shards_mutex;
+static std::vector<std::unique_ptr<MetricsShard>> shards;
+
+static std::atomic<const ThreadPool *> watched_pool{nullptr};
+
+static thread_local MetricsShard *this_thread_shard = nullptr;
+
+static MetricsShard &shard() {
+  if (this_thread_shard == nullptr) {
+    auto created = std::make_unique<MetricsShard>();
+    this_thread_shard = created.get();
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    shards.push_back(std::move(created));
+  }
+  return *this_thread_shard;
+}
+
+void Metrics::count(MetricCounter counter, uint64_t amount) {
+  auto &value = shard().counters[static_cast<size_t>(counter)];
+  value.store(value.load(std::memory_order_relaxed) + amount,
+              std::memory_order_relaxed);
+}
+
+void Metrics::record(MetricStage stage, Clock::duration duration) {
+  auto nanoseconds =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  shard().histograms[static_cast<size_t>(stage)].record(
+      nanoseconds > 0 ? nanoseconds : 0);
+}
+
+void Metrics::count_response(uint16_t status_code) {
+  if (status_code >= 200 && status_code < 600) {
+    count(static_cast<MetricCounter>(
+        static_cast<size_t>(MetricCounter::RESPONSES_2XX) + status_code / 100 -
+        2));
+  }
+}
+
+void Metrics::watch_pool(const ThreadPool *pool) { watched_pool = pool; }
+
+uint64_t Metrics::total(MetricCounter counter) {
+  uint64_t sum = 0;
+  std::lock_guard<std::mutex> lock(shards_mutex);
+  for (const auto &shard : shards) {
+    sum += shard->counters[static_cast<size_t>(counter)].load(
+        std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+LatencySnapshot Metrics::snapshot(MetricStage stage) {
+  LatencySnapshot snapshot;
+  std::lock_guard<std::mutex> lock(shards_mutex);
+  for (const auto &shard : shards) {
+    shard->histograms[static_cast<size_t>(stage)].add_to(snapshot);
+  }
+  return snapshot;
+}
+
+// Upper bounds of the histogram buckets in the exposition, in seconds
+static const double EXPOSED_BUCKETS[] = {
+    1e-6,   2.5e-6, 5e-6,   1e-5,   2.5e-5, 5e-5, 1e-4, 2.5e-4,
+    5e-4,   1e-3,   2.5e-3, 5e-3,   1e-2,   2.5e-2, 5e-2, 0.1,
+    0.25,   0.5,    1,      2.5,    5,      10};
+
+static const double EXPOSED_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static const char *stage_name(MetricStage stage) {
+  switch (stage) {
+  case MetricStage::FIRST_BYTE:
+    return "first_byte";
+  case MetricStage::PARSE:
+    return "parse";
+  case MetricStage::PROCESS_GET:
+    return "process_get";
+  case MetricStage::PROCESS_POST:
+    return "process_post";
+  case MetricStage::BUILD:
+    return "build";
+  case MetricStage::WRITE:
+    return "write";
+  case MetricStage::COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+// Appends "<name>{<labels>} <value>\n"
+static void sample(std::string &out, const char *name, const char *labels,
+                   double value) {
+  char line[256];
+  int length = std::snprintf(line, sizeof(line), "%s%s%s%s %.9g\n", name,
+                             labels[0] ? "{" : "", labels,
+                             labels[0] ? "}" : "", value);
+  if (length > 0) {
+    out.append(line, std::min<size_t>(length, sizeof(line) - 1));
+  }
+}
+
+static void family(std::string &out, const char *name, const char *type,
+                   const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+std::string Metrics::render_prometheus() {
+  std::string out;
+  out.reserve(16 * 1024);
+  char labels[128];
+
+  family(out, "http_connections_accepted_total", "counter",
+         "Client connections accepted.");
+  sample(out, "http_connections_accepted_total", "",
+         total(MetricCounter::CONNECTIONS_ACCEPTED));
+  family(out, "http_connections_refused_total", "counter",
+         "Connections closed for exceeding the per address limit.");
+  sample(out, "http_connections_refused_total", "",
+         total(MetricCounter::CONNECTIONS_REFUSED));
+  family(out, "http_timeouts_total", "counter",
+         "Connections closed by a header, body, idle or write timeout.");
+  sample(out, "http_timeouts_total", "", total(MetricCounter::TIMEOUTS));
+  family(out, "http_connections_open", "gauge", "Client connections open.");
+  sample(out, "http_connections_open", "", ConnectionLimits::instance().open());
+
+  family(out, "http_requests_total", "counter", "Requests by method.");
+  sample(out, "http_requests_total", "method=\"GET\"",
+         total(MetricCounter::REQUESTS_GET));
+  sample(out, "http_requests_total", "method=\"POST\"",
+         total(MetricCounter::REQUESTS_POST));
+  sample(out, "http_requests_total", "method=\"other\"",
+         total(MetricCounter::REQUESTS_OTHER));
+  family(out, "http_responses_total", "counter",
+         "Responses by class of status code.");
+  const char *classes[] = {"2xx", "3xx", "4xx", "5xx"};
+  for (size_t i = 0; i < 4; i++) {
+    std::snprintf(labels, sizeof(labels), "code=\"%s\"", classes[i]);
+    sample(out, "http_responses_total", labels,
+           total(static_cast<MetricCounter>(
+               static_cast<size_t>(MetricCounter::RESPONSES_2XX) + i)));
+  }
+
+  if (const ThreadPool *pool = watched_pool.load()) {
+    family(out, "http_pool_queue_depth", "gauge",
+           "Tasks waiting for a thread pool worker.");
+    sample(out, "http_pool_queue_depth", "", pool->pending());
+  }
+
+  // Hit ratios are left to the queries, from the counters
+  FileCacheStats files = FileCache::instance().stats();
+  family(out, "http_file_cache_lookups_total", "counter",
+         "File cache lookups by outcome.");
+  sample(out, "http_file_cache_lookups_total", "result=\"hit\"", files.hits);
+  sample(out, "http_file_cache_lookups_total", "result=\"missing_hit\"",
+         files.missing_hits);
+  sample(out, "http_file_cache_lookups_total", "result=\"miss\"",
+         files.misses);
+  family(out, "http_file_cache_bytes", "gauge",
+         "Bytes of file contents held by the file cache.");
+  sample(out, "http_file_cache_bytes", "", files.bytes);
+  family(out, "http_file_cache_entries", "gauge",
+         "Entries of the file cache by kind.");
+  sample(out, "http_file_cache_entries", "kind=\"file\"", files.entries);
+  sample(out, "http_file_cache_entries", "kind=\"open_file\"",
+         files.open_files);
+  sample(out, "http_file_cache_entries", "kind=\"missing\"", files.missing);
+
+  CompressionCacheStats variants = CompressionCache::instance().stats();
+  family(out, "http_compression_cache_lookups_total", "counter",
+         "Compression cache lookups by outcome.");
+  sample(out, "http_compression_cache_lookups_total", "result=\"hit\"",
+         variants.hits);
+  sample(out, "http_compression_cache_lookups_total", "result=\"miss\"",
+         variants.misses);
+  family(out, "http_compression_cache_bytes", "gauge",
+         "Bytes of encoded variants held by the compression cache.");
+  sample(out, "http_compression_cache_bytes", "", variants.bytes);
+
+  // Histograms with Prometheus' cumulative buckets. A bucket of ours that
+  // straddles an exposed bound counts toward the next bound up
+  LatencySnapshot stages[static_cast<size_t>(MetricStage::COUNT)];
+  for (size_t i = 0; i < std::size(stages); i++) {
+    stages[i] = snapshot(static_cast<MetricStage>(i));
+  }
+
+  family(out, "http_stage_duration_seconds", "histogram",
+         "Latency of the stages of a request.");
+  for (size_t i = 0; i < std::size(stages); i++) {
+    const char *stage = stage_name(static_cast<MetricStage>(i));
+    for (double bound : EXPOSED_BUCKETS) {
+      std::snprintf(labels, sizeof(labels), "stage=\"%s\",le=\"%g\"", stage,
+                    bound);
+      sample(out, "http_stage_duration_seconds_bucket", labels,
+             stages[i].count_at_most(static_cast<uint64_t>(bound * 1e9)));
+    }
+    std::snprintf(labels, sizeof(labels), "stage=\"%s\",le=\"+Inf\"", stage);
+    sample(out, "http_stage_duration_seconds_bucket", labels, stages[i].count);
+    std::snprintf(labels, sizeof(labels), "stage=\"%s\"", stage);
+    sample(out, "http_stage_duration_seconds_sum", labels,
+           stages[i].sum / 1e9);
+    sample(out, "http_stage_duration_seconds_count", labels, stages[i].count);
+  }
+
+  // The percentiles at full resolution, which the buckets above can only
+  // approximate
+  family(out, "http_stage_duration_quantile_seconds", "gauge",
+         "Percentiles of the latency of the stages of a request.");
+  for (size_t i = 0; i < std::size(stages); i++) {
+    const char *stage = stage_name(static_cast<MetricStage>(i));
+    for (double quantile : EXPOSED_QUANTILES) {
+      std::snprintf(labels, sizeof(labels), "stage=\"%s\",quantile=\"%g\"",
+                    stage, quantile);
+      sample(out, "http_stage_duration_quantile_seconds", labels,
+             stages[i].percentile(quantile) / 1e9);
+    }
+  }
+
+  return out;
+}
@@ -0,0 +1,14 @@
+#include <request_arena.h>
+
+RequestArena::RequestArena()
+    : block(new std::byte[BLOCK_SIZE]),
+      memory(block.get(), BLOCK_SIZE, std::pmr::new_delete_resource()) {}
+
+std::pmr::memory_resource *RequestArena::resource() { return &memory; }
+
+void RequestArena::reset() { memory.release(); }
+
+RequestArena &RequestArena::for_this_thread() {
+  thread_local RequestArena arena;
+  return arena;
+}
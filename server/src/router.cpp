@@ -0,0 +1,280 @@
+#include <router.h>
+#include <http_parser.h>
+
+// A node matches the static bytes of prefix, or one parameter named prefix,
+// and then one of its children. Static children are told apart by their
+// first byte, which is kept in indices
+struct Router::Node {
+  enum class Kind { STATIC = 0, PARAM, WILDCARD };
+
+  Kind kind = Kind::STATIC;
+  std::string prefix;
+  std::string indices;
+  std::vector<std::unique_ptr<Node>> children;
+  std::unique_ptr<Node> param;
+  std::unique_ptr<Node> wildcard;
+  std::unique_ptr<Route> routes[HTTP_METHOD_COUNT];
+
+  // The node below this one that matches the static bytes s, split off or
+  // created as needed
+  Node *insert_static(std::string_view s);
+
+  // The parameter or wildcard child named name, created if there is none.
+  // Null if it exists under another name
+  Node *insert_param(std::unique_ptr<Node> &child, Kind kind,
+                     std::string_view name);
+
+  // Matches path from where this node starts, recording the parameters
+  const Route *find(std::string_view path, size_t method,
+                    RouteMatch &match) const;
+};
+
+Router::Node *Router::Node::insert_static(std::string_view s) {
+  Node *node = this;
+  while (!s.empty()) {
+    size_t index = node->indices.find(s.front());
+    if (index == std::string::npos) {
+      auto child = std::make_unique<Node>();
+      child->prefix = std::string(s);
+      node->indices.push_back(s.front());
+      node->children.push_back(std::move(child));
+      return node->children.back().get();
+    }
+
+    Node *child = node->children[index].get();
+    size_t common = 0;
+    while (common < child->prefix.size() && common < s.size() &&
+           child->prefix[common] == s[common]) {
+      common++;
+    }
+
+    // The child shares only part of its prefix with s: the shared part
+    // becomes a node of its own with the child, shortened, below it
+    if (common < child->prefix.size()) {
+      auto split = std::make_unique<Node>();
+      split->prefix = child->prefix.substr(0, common);
+      child->prefix.erase(0, common);
+      split->indices.push_back(child->prefix.front());
+      split->children.push_back(std::move(node->children[index]));
+      node->children[index] = std::move(split);
+      child = node->children[index].get();
+    }
+
+    node = child;
+    s.remove_prefix(common);
+  }
+  return node;
+}
+
+Router::Node *Router::Node::insert_param(std::unique_ptr<Node> &child,
+                                         Kind kind, std::string_view name) {
+  if (!child) {
+    child = std::make_unique<Node>();
+    child->kind = kind;
+    child->prefix = std::string(name);
+  }
+  return child->prefix == name ? child.get() : nullptr;
+}
+
+const Route *Router::Node::find(std::string_view path, size_t method,
+                                RouteMatch &match) const {
+  size_t param_count = match.param_count;
+  switch (kind) {
+  case Kind::STATIC:
+    if (path.substr(0, prefix.size()) != prefix) {
+      return nullptr;
+    }
+    path.remove_prefix(prefix.size());
+    break;
+  case Kind::PARAM: {
+    size_t end = path.find('/');
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    if (end == 0) {
+      return nullptr;
+    }
+    match.params[match.param_count++] = {prefix, path.substr(0, end)};
+    path.remove_prefix(end);
+    break;
+  }
+  case Kind::WILDCARD:
+    match.params[match.param_count++] = {prefix, path};
+    path = std::string_view();
+    break;
+  }
+
+  if (path.empty()) {
+    if (routes[method]) {
+      return routes[method].get();
+    }
+  } else {
+    size_t index = indices.find(path.front());
+    if (index != std::string::npos) {
+      if (const Route *route = children[index]->find(path, method, match)) {
+        return route;
+      }
+    }
+    if (param) {
+      if (const Route *route = param->find(path, method, match)) {
+        return route;
+      }
+    }
+  }
+  if (wildcard) {
+    if (const Route *route = wildcard->find(path, method, match)) {
+      return route;
+    }
+  }
+
+  match.param_count = param_count;
+  return nullptr;
+}
+
+HTTPMethod parse_http_method(std::string_view method) {
+  switch (method.size()) {
+  case 3:
+    if (method == "GET") {
+      return HTTPMethod::GET;
+    }
+    if (method == "PUT") {
+      return HTTPMethod::PUT;
+    }
+    break;
+  case 4:
+    if (method == "POST") {
+      return HTTPMethod::POST;
+    }
+    if (method == "HEAD") {
+      return HTTPMethod::HEAD;
+    }
+    break;
+  case 5:
+    if (method == "PATCH") {
+      return HTTPMethod::PATCH;
+    }
+    break;
+  case 6:
+    if (method == "DELETE") {
+      return HTTPMethod::DELETE;
+    }
+    break;
+  case 7:
+    if (method == "OPTIONS") {
+      return HTTPMethod::OPTIONS;
+    }
+    break;
+  }
+  return HTTPMethod::UNKNOWN;
+}
+
+std::string_view RouteMatch::param(std::string_view name) const {
+  for (size_t i = 0; i < param_count; i++) {
+    if (params[i].name == name) {
+      return params[i].value;
+    }
+  }
+  return std::string_view();
+}
+
+Router::Router() : root(std::make_unique<Node>()) {}
+
+Router::~Router() = default;
+
+Router &Router::instance() {
+  static Router router;
+  static bool built = (add_builtin_routes(router), true);
+  (void)built;
+  return router;
+}
+
+// Whether pattern is one add() can take: it starts with '/', every parameter
+// has a name, a '*' segment is the last and there are at most MAX_PARAMS
+static bool valid_pattern(std::string_view pattern) {
+  if (pattern.empty() || pattern.front() != '/') {
+    return false;
+  }
+  size_t params = 0;
+  size_t start = 1;
+  while (start <= pattern.size()) {
+    size_t end = pattern.find('/', start);
+    if (end == std::string_view::npos) {
+      end = pattern.size();
+    }
+    std::string_view segment = pattern.substr(start, end - start);
+    if (!segment.empty() && (segment.front() == ':' || segment.front() == '*')) {
+      if (segment.size() == 1 || ++params > RouteMatch::MAX_PARAMS ||
+          (segment.front() == '*' && end != pattern.size())) {
+        return false;
+      }
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+bool Router::add(HTTPMethod method, std::string_view pattern,
+                 RouteHandler handler, RouteHandler accept_body) {
+  if (method == HTTPMethod::UNKNOWN || !handler || !valid_pattern(pattern)) {
+    return false;
+  }
+
+  // Static bytes up to each parameter, then the parameter. A pattern can only
+  // conflict with a route that has the same static bytes up to the conflict,
+  // so no node is created before add() gives up
+  Node *node = root.get();
+  std::string_view rest = pattern;
+  while (node != nullptr && !rest.empty()) {
+    size_t special = 1;
+    while (special < rest.size() &&
+           !(rest[special - 1] == '/' &&
+             (rest[special] == ':' || rest[special] == '*'))) {
+      special++;
+    }
+    node = node->insert_static(rest.substr(0, special));
+    rest.remove_prefix(special);
+    if (rest.empty()) {
+      break;
+    }
+
+    size_t end = rest.find('/');
+    if (end == std::string_view::npos) {
+      end = rest.size();
+    }
+    std::string_view name = rest.substr(1, end - 1);
+    if (rest.front() == '*') {
+      node = node->insert_param(node->wildcard, Node::Kind::WILDCARD, name);
+    } else {
+      node = node->insert_param(node->param, Node::Kind::PARAM, name);
+    }
+    rest.remove_prefix(end);
+  }
+
+  size_t index = static_cast<size_t>(method);
+  if (node == nullptr || node->routes[index]) {
+    return false;
+  }
+  node->routes[index] = std::make_unique<Route>(
+      Route{std::string(pattern), std::move(handler), std::move(accept_body)});
+  methods[index] = true;
+  route_count++;
+  return true;
+}
+
+bool Router::find(HTTPMethod method, std::string_view path,
+                  RouteMatch &match) const {
+  match.param_count = 0;
+  if (method == HTTPMethod::UNKNOWN) {
+    match.route = nullptr;
+    return false;
+  }
+  match.route = root->find(path, static_cast<size_t>(method), match);
+  return match.route != nullptr;
+}
+
+bool Router::handles(HTTPMethod method) const {
+  return method != HTTPMethod::UNKNOWN &&
+         methods[static_cast<size_t>(method)];
+}
+
+size_t Router::size() const { return route_count; }
@@ -0,0 +1,271 @@
+#include <scheduler.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Maximum number of events handled per epoll_wait() call
+static const int MAX_EVENTS = 1024;
+
+// Memory chunks sent by one write() of AsyncSocket::send()
+static const size_t MAX_IOVECS = 64;
+
+static thread_local Scheduler *current_scheduler = nullptr;
+
+Scheduler::Scheduler() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ == -1 || wakeup_fd_ == -1) {
+    perror("Failed to create the scheduler");
+    exit(EXIT_FAILURE);
+  }
+
+  // The eventfd is the one registration without an AsyncSocket
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event) == -1) {
+    perror("epoll_ctl() failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+Scheduler::~Scheduler() {
+  close(wakeup_fd_);
+  close(epoll_fd_);
+}
+
+Scheduler *Scheduler::current() { return current_scheduler; }
+
+void Scheduler::spawn(AsyncTask<void> task) {
+  std::coroutine_handle<> handle = task.detach();
+  if (current_scheduler == this) {
+    ready_.push_back(handle);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(spawned_mutex_);
+    spawned_.push_back(handle);
+  }
+  uint64_t one = 1;
+  if (write(wakeup_fd_, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("write() to the scheduler eventfd failed");
+  }
+}
+
+void Scheduler::stop() {
+  stopping_.store(true);
+  uint64_t one = 1;
+  if (write(wakeup_fd_, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("write() to the scheduler eventfd failed");
+  }
+}
+
+void Scheduler::take_spawned() {
+  uint64_t value;
+  while (read(wakeup_fd_, &value, sizeof(value)) > 0) {
+  }
+  std::lock_guard<std::mutex> lock(spawned_mutex_);
+  ready_.insert(ready_.end(), spawned_.begin(), spawned_.end());
+  spawned_.clear();
+}
+
+void Scheduler::run() {
+  current_scheduler = this;
+  take_spawned();
+
+  epoll_event events[MAX_EVENTS];
+  while (!stopping_.load(std::memory_order_relaxed)) {
+    // Coroutines woken while others ran are run in the same turn, before
+    // the scheduler looks for more work
+    while (!ready_.empty()) {
+      std::coroutine_handle<> handle = ready_.front();
+      ready_.pop_front();
+      handle.resume();
+    }
+
+    int timeout = timers_.empty() ? -1 : timers_.until_next_tick();
+    int count = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait() failed");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == nullptr) {
+        take_spawned();
+      } else {
+        static_cast<AsyncSocket *>(events[i].data.ptr)
+            ->notify(events[i].events);
+      }
+    }
+
+    timers_.expire([this](TimerWheel::Timer &timer) {
+      wake(static_cast<Waiter &>(timer), true);
+    });
+  }
+  current_scheduler = nullptr;
+}
+
+void Scheduler::wake(Waiter &waiter, bool timed_out) {
+  if (waiter.slot != nullptr) {
+    *waiter.slot = nullptr;
+    waiter.slot = nullptr;
+  }
+  if (waiter.scheduled()) {
+    timers_.cancel(waiter);
+  }
+  waiter.timed_out = timed_out;
+  ready_.push_back(waiter.handle);
+}
+
+void Scheduler::Wait::await_suspend(std::coroutine_handle<> handle) {
+  waiter.handle = handle;
+  if (slot != nullptr) {
+    waiter.slot = slot;
+    *slot = &waiter;
+  }
+  if (timeout_ms > 0) {
+    scheduler.timers_.schedule(waiter, std::chrono::milliseconds(timeout_ms));
+  }
+}
+
+Scheduler::Wait Scheduler::sleep(std::chrono::milliseconds delay) {
+  return Wait(*this, nullptr, std::max<int>(1, delay.count()));
+}
+
+AsyncSocket::AsyncSocket(int fd) : scheduler_(*Scheduler::current()), fd_(fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  // Edge-triggered for both directions, for as long as the socket lives. An
+  // edge nobody waits for is dropped, every operation tries its system call
+  // before it waits
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = this;
+  if (epoll_ctl(scheduler_.epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl() failed");
+  }
+}
+
+AsyncSocket::~AsyncSocket() {
+  epoll_ctl(scheduler_.epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+}
+
+void AsyncSocket::notify(uint32_t events) {
+  if (reader_ != nullptr &&
+      (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+    scheduler_.wake(*reader_, false);
+  }
+  if (writer_ != nullptr && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+    scheduler_.wake(*writer_, false);
+  }
+}
+
+AsyncTask<ssize_t> AsyncSocket::read(char *buffer, size_t size,
+                                     int timeout_ms) {
+  while (true) {
+    ssize_t bytes_read = ::read(fd_, buffer, size);
+    if (bytes_read >= 0) {
+      co_return bytes_read;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      co_return -errno;
+    }
+    if (errno != EINTR &&
+        !co_await Scheduler::Wait(scheduler_, &reader_, timeout_ms)) {
+      co_return -ETIMEDOUT;
+    }
+  }
+}
+
+AsyncTask<ssize_t> AsyncSocket::write(const iovec *iovecs, size_t count,
+                                      int timeout_ms) {
+  msghdr message{};
+  message.msg_iov = const_cast<iovec *>(iovecs);
+  message.msg_iovlen = count;
+  while (true) {
+    ssize_t written = sendmsg(fd_, &message, MSG_NOSIGNAL);
+    if (written >= 0) {
+      co_return written;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      co_return -errno;
+    }
+    if (errno != EINTR &&
+        !co_await Scheduler::Wait(scheduler_, &writer_, timeout_ms)) {
+      co_return -ETIMEDOUT;
+    }
+  }
+}
+
+AsyncTask<ssize_t> AsyncSocket::sendfile(int file_fd, off_t offset,
+                                         size_t length, int timeout_ms) {
+  while (true) {
+    ssize_t written = ::sendfile(fd_, file_fd, &offset, length);
+    if (written >= 0) {
+      co_return written;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      co_return -errno;
+    }
+    if (errno != EINTR &&
+        !co_await Scheduler::Wait(scheduler_, &writer_, timeout_ms)) {
+      co_return -ETIMEDOUT;
+    }
+  }
+}
+
+AsyncTask<bool> AsyncSocket::send(OutputQueue &output, int timeout_ms) {
+  iovec iovecs[MAX_IOVECS];
+  while (!output.empty()) {
+    int file_fd;
+    off_t offset;
+    size_t length;
+    ssize_t written;
+    if (output.file_at(0, file_fd, offset, length)) {
+      written = co_await sendfile(file_fd, offset, length, timeout_ms);
+      // The file got shorter than the Content-Length that was sent
+      if (written == 0 && length > 0) {
+        co_return false;
+      }
+    } else {
+      size_t index = 0;
+      size_t count = output.gather(index, iovecs, MAX_IOVECS);
+      written = co_await write(iovecs, count, timeout_ms);
+    }
+    if (written < 0) {
+      co_return false;
+    }
+    output.consume(written);
+  }
+  co_return true;
+}
+
+AsyncTask<int> AsyncSocket::accept(sockaddr_in &address) {
+  while (true) {
+    socklen_t address_length = sizeof(address);
+    int fd = accept4(fd_, reinterpret_cast<sockaddr *>(&address),
+                     &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0) {
+      co_return fd;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      co_return -errno;
+    }
+    if (errno != EINTR) {
+      co_await Scheduler::Wait(scheduler_, &reader_, 0);
+    }
+  }
+}
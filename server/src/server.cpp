@@ -3,55 +3,213 @@
 //
 
 #include <server.h>
+#include <config.h>
 #include <logging/Logging.h>
 #include <http_parser.h>
-#include <arpa/inet.h>
+#include <http_response.h>
+#include <http_response_builder.h>
+#include <http_connection.h>
+#include <request_arena.h>
+#include <metrics.h>
+#include <chrono>
+#include <cerrno>
 #include <iostream>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <util.h>
 #include <unistd.h>
 
-void handle_client(sockaddr_in client_address, int client_socket_fd) {
+// Size of the stack buffer each read() of a client socket goes into
+static const size_t READ_CHUNK_SIZE = 16 * 1024;
+
+// Sets SO_RCVTIMEO or SO_SNDTIMEO of a blocking socket, 0 waits forever
+static void set_socket_timeout(int socket_fd, int option, int timeout_ms) {
+    timeval timeout{};
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(socket_fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+void handle_client(sockaddr_in client_address, int client_socket_fd,
+                   std::chrono::steady_clock::time_point accepted) {
     Logging logger;
     logger.setClassName("handle_client");
 
-    // Print the client's IP address by converting the address from binary
-    // format to a char*
-    char client_ip_addr[100];
-    const char *ret_ntop =
-        inet_ntop(AF_INET, &client_address.sin_addr, client_ip_addr, 100);
-    if (ret_ntop == NULL) {
-        perror("inet_ntop() failed, unable to get client address");
-        exit(EXIT_FAILURE);
-    }
-
-    int client_port = ntohs(client_address.sin_port);
+    HTTPConnection connection(client_address, accepted);
+    logger.info("Connection from: {}", connection.client());
 
-    logger.info(std::string("Connection from: ") + client_ip_addr + ":" +
-                std::to_string(client_port));
+    char chunk[READ_CHUNK_SIZE];
 
-    // Read incoming data
-    // Note: read() does not null terminate the array
-    // We have to do it ourselves, so always read 1 less byte than the size of
-    // your buffer
+    // The timeouts of this mode are the kernel's timers on the blocking
+    // socket. A write gives up once the client read nothing for the write
+    // timeout, and each read waits as long as HTTPConnection allows. The read
+    // timeout is only changed when it has to be
+    set_socket_timeout(client_socket_fd, SO_SNDTIMEO, WRITE_TIMEOUT_MS);
+    int read_timeout_ms = -1;
     while (true) {
-        std::string request = receive_http_req(client_socket_fd);
+        // STEP 1
+        // Answer every complete request already buffered, in order. Their
+        // responses are queued and written together, so a pipelined batch
+        // goes out in as few writes as possible
+        connection.process();
 
-        HTTPParser parser(request);
-        if (!parser.parse()) {
-            std::cout << "[!] FAILED TO PARSE REQUEST\n";
+        // A body that has to be streamed is read right here, one chunk at a
+        // time. One that stops arriving ends the request, it is then
+        // answered as one that wasn't read to its end
+        if (connection.streaming()) {
+            if (connection.output().write_to(client_socket_fd) !=
+                WriteResult::DONE) {
+                break;
+            }
+            if (connection.start_body() &&
+                connection.output().write_to(client_socket_fd) !=
+                    WriteResult::DONE) {
+                break;
+            }
+            if (read_timeout_ms != BODY_TIMEOUT_MS) {
+                set_socket_timeout(client_socket_fd, SO_RCVTIMEO,
+                                   BODY_TIMEOUT_MS);
+                read_timeout_ms = BODY_TIMEOUT_MS;
+            }
+            while (!connection.body_complete()) {
+                ssize_t bytes_read =
+                    read(client_socket_fd, chunk, sizeof(chunk));
+                if (bytes_read == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes_read <= 0) {
+                    break;
+                }
+                connection.receive_body(chunk, bytes_read);
+            }
+            connection.finish_body();
+            continue;
         }
 
-        std::string response = parser.getResponse();
-        const char *response_buffer = response.c_str();
+        // The socket is blocking, so write_to() only returns once the whole
+        // batch is out or the client went away
+        WriteResult written = connection.output().write_to(client_socket_fd);
+        connection.record_first_byte();
+        if (written != WriteResult::DONE || !connection.keep_alive()) {
+            break;
+        }
 
-        int data_written =
-            write(client_socket_fd, response_buffer, response.size());
-        if (data_written == -1) {
-            logger.log(std::string("Client ") + client_ip_addr + ":" +
-                       std::to_string(client_port) + " closed connection");
+        // STEP 2
+        // Wait for more bytes: the next request for as long as the idle
+        // timeout, the rest of a partial one for what is left of the header
+        // timeout
+        int timeout_ms = connection.read_timeout_ms();
+        ssize_t bytes_read = -1;
+        if (timeout_ms >= 0) {
+            if (timeout_ms != read_timeout_ms) {
+                set_socket_timeout(client_socket_fd, SO_RCVTIMEO, timeout_ms);
+                read_timeout_ms = timeout_ms;
+            }
+            bytes_read = read(client_socket_fd, chunk, sizeof(chunk));
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+        }
+        if (timeout_ms < 0 ||
+            (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            if (connection.timed_out()) {
+                connection.output().write_to(client_socket_fd);
+            }
+            break;
+        }
+        if (bytes_read <= 0) {
             break;
         }
+        connection.received(chunk, bytes_read);
     }
 
+    // Closing a socket with unread bytes makes the kernel reset the
+    // connection, which can destroy a 431/413 the client hasn't read yet.
+    // Discard whatever already arrived first
+    while (recv(client_socket_fd, chunk, sizeof(chunk), MSG_DONTWAIT) > 0) {
+    }
+
+    logger.info("Client {} closed connection", connection.client());
     close(client_socket_fd);
-}
\ No newline at end of file
+}
+
+HTTPResponse process_http_request(std::string_view request,
+                                  bool close_connection) {
+    auto started = std::chrono::steady_clock::now();
+
+    // Everything the parser allocates for the request comes from the arena
+    // of this thread, and is dropped at once when the parser is gone
+    RequestArena &arena = RequestArena::for_this_thread();
+    HTTPResponse response;
+    {
+        HTTPParser parser(request, arena.resource());
+        if (!parser.parse()) {
+            std::cout << "[!] FAILED TO PARSE REQUEST\n";
+        }
+        if (close_connection) {
+            parser.setConnectionClose();
+        }
+
+        auto processed = std::chrono::steady_clock::now();
+        response = parser.buildResponse();
+        record_request_metrics(parser, started, processed,
+                               std::chrono::steady_clock::now());
+        if (response.access) {
+            record_timings(*response.access, started, parser.parsedAt());
+        }
+    }
+    arena.reset();
+    return response;
+}
+
+void record_request_metrics(const HTTPParser &parser,
+                            std::chrono::steady_clock::time_point started,
+                            std::chrono::steady_clock::time_point processed,
+                            std::chrono::steady_clock::time_point built) {
+    bool is_get = parser.httpMethod() == HTTPMethod::GET;
+    bool is_post = parser.httpMethod() == HTTPMethod::POST;
+    Metrics::count(is_get    ? MetricCounter::REQUESTS_GET
+                   : is_post ? MetricCounter::REQUESTS_POST
+                             : MetricCounter::REQUESTS_OTHER);
+    Metrics::count_response(http_status_code(parser.httpStatus()));
+
+    Metrics::record(MetricStage::PARSE, started, parser.parsedAt());
+    if (is_get || is_post) {
+        Metrics::record(is_get ? MetricStage::PROCESS_GET
+                               : MetricStage::PROCESS_POST,
+                        parser.parsedAt(), processed);
+    }
+    Metrics::record(MetricStage::BUILD, processed, built);
+}
+
+// Response to a request that was never parsed. Whatever follows on the
+// connection can't be framed, so it always closes the connection
+static HTTPResponse closing_error_response(HTTPStatus status) {
+    HTTPRequest request;
+    std::string body;
+    std::optional<std::string> filename;
+    HTTPResponseBuilder builder("HTTP/1.1", status, body, HTTPContentType::HTML,
+                                request, filename);
+    builder.setConnectionClose();
+    Metrics::count(MetricCounter::REQUESTS_OTHER);
+    Metrics::count_response(http_status_code(status));
+    return builder.build_response();
+}
+
+HTTPResponse frame_error_response(FrameResult result) {
+    switch (result) {
+    case FrameResult::HEADERS_TOO_LARGE:
+        return closing_error_response(
+            HTTPStatus::REQUEST_HEADER_FIELDS_TOO_LARGE);
+    case FrameResult::BAD_TRANSFER_ENCODING:
+        return closing_error_response(HTTPStatus::BAD_REQUEST);
+    case FrameResult::UNSUPPORTED_TRANSFER_ENCODING:
+        return closing_error_response(HTTPStatus::NOT_IMPLEMENTED);
+    default:
+        return closing_error_response(HTTPStatus::PAYLOAD_TOO_LARGE);
+    }
+}
+
+HTTPResponse timeout_response() {
+    return closing_error_response(HTTPStatus::REQUEST_TIMEOUT);
+}
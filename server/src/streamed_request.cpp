@@ -0,0 +1,244 @@
+#include <streamed_request.h>
+#include <config.h>
+#include <server.h>
+#include <util.h>
+#include <logging/Logging.h>
+#include <algorithm>
+
+// Limit on the bytes of chunk extensions and trailers, which are skipped
+static const size_t MAX_CHUNK_METADATA = 8 * 1024;
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+size_t ChunkedDecoder::decode(std::string_view input, std::string_view &data) {
+  data = std::string_view();
+
+  size_t position = 0;
+  while (position < input.size() && state != State::DONE &&
+         state != State::FAILED) {
+    // Chunk data is handed out in one piece, as much of it as is here
+    if (state == State::DATA) {
+      size_t length = std::min(chunk_size, input.size() - position);
+      data = input.substr(position, length);
+      position += length;
+      chunk_size -= length;
+      if (chunk_size == 0) {
+        state = State::DATA_CR;
+      }
+      return position;
+    }
+
+    char c = input[position++];
+    switch (state) {
+    case State::SIZE: {
+      int digit = hex_value(c);
+      if (digit >= 0 && size_digits < 15) {
+        chunk_size = chunk_size * 16 + digit;
+        size_digits++;
+      } else if (size_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+        state = State::EXTENSION;
+      } else if (size_digits > 0 && c == '\r') {
+        state = State::SIZE_LF;
+      } else {
+        state = State::FAILED;
+      }
+      break;
+    }
+    case State::EXTENSION:
+      if (c == '\r') {
+        state = State::SIZE_LF;
+      } else if (++metadata_bytes > MAX_CHUNK_METADATA) {
+        state = State::FAILED;
+      }
+      break;
+    case State::SIZE_LF:
+      if (c != '\n') {
+        state = State::FAILED;
+      } else {
+        // The last chunk has size 0 and is followed by the trailers
+        state = chunk_size == 0 ? State::TRAILER_START : State::DATA;
+      }
+      break;
+    case State::DATA_CR:
+      state = c == '\r' ? State::DATA_LF : State::FAILED;
+      break;
+    case State::DATA_LF:
+      if (c != '\n') {
+        state = State::FAILED;
+      } else {
+        state = State::SIZE;
+        chunk_size = 0;
+        size_digits = 0;
+      }
+      break;
+    case State::TRAILER_START:
+      if (c == '\r') {
+        state = State::FINAL_LF;
+      } else {
+        state = State::TRAILER;
+        metadata_bytes++;
+      }
+      break;
+    case State::TRAILER:
+      if (c == '\r') {
+        state = State::TRAILER_LF;
+      } else if (++metadata_bytes > MAX_CHUNK_METADATA) {
+        state = State::FAILED;
+      }
+      break;
+    case State::TRAILER_LF:
+      state = c == '\n' ? State::TRAILER_START : State::FAILED;
+      break;
+    case State::FINAL_LF:
+      state = c == '\n' ? State::DONE : State::FAILED;
+      break;
+    default:
+      break;
+    }
+  }
+
+  return position;
+}
+
+bool ChunkedDecoder::done() const { return state == State::DONE; }
+
+bool ChunkedDecoder::failed() const { return state == State::FAILED; }
+
+StreamedRequest::StreamedRequest(std::string head)
+    : head(std::move(head)), started(std::chrono::steady_clock::now()),
+      parser(this->head) {
+  Logging logger;
+  logger.setClassName("StreamedRequest");
+
+  // STEP 1
+  // Parse and validate the head. A request that can't even be parsed gives
+  // us no trustworthy framing for its body
+  bool valid = parser.parse_head();
+  accepted = valid && parser.acceptsBody();
+  const HTTPRequest &request = parser.httpRequest();
+  if (request.method.empty()) {
+    fail(HTTPStatus::BAD_REQUEST);
+    return;
+  }
+
+  auto expect = request.header("Expect");
+  expect_continue = expect && iequals(*expect, "100-continue");
+
+  // STEP 2
+  // Work out how the body is framed. chunked is the only transfer coding we
+  // decode, and it takes precedence over Content-Length. Requests with any
+  // other are answered by frame_http_request() and don't get here
+  auto transfer_encoding = request.header("Transfer-Encoding");
+  if (transfer_encoding) {
+    if (!iequals(*transfer_encoding, "chunked")) {
+      logger.warn("Unsupported Transfer-Encoding - " +
+                  std::string(*transfer_encoding));
+      fail(HTTPStatus::BAD_REQUEST);
+      return;
+    }
+    chunked = true;
+  } else {
+    auto content_length = request.header("Content-Length");
+    if (content_length) {
+      for (char c : *content_length) {
+        remaining = remaining * 10 + (c - '0');
+      }
+    }
+    body_done = remaining == 0;
+  }
+
+  // STEP 3
+  // An accepted upload gets its temp file now, before any body byte
+  if (accepted) {
+    upload = std::make_unique<UploadWriter>(parser.uploadsPath());
+    if (upload->status() != HTTPStatus::OK) {
+      fail(upload->status());
+    }
+  }
+}
+
+bool StreamedRequest::expectsContinue() const {
+  return expect_continue && accepted && failure == HTTPStatus::OK;
+}
+
+size_t StreamedRequest::feed(std::string_view input) {
+  size_t consumed = 0;
+  while (!complete() && consumed < input.size()) {
+    std::string_view data;
+    if (chunked) {
+      consumed += decoder.decode(input.substr(consumed), data);
+      if (decoder.failed()) {
+        fail(HTTPStatus::BAD_REQUEST);
+        break;
+      }
+      body_done = decoder.done();
+    } else {
+      data = input.substr(consumed, remaining);
+      consumed += data.size();
+      remaining -= data.size();
+      body_done = remaining == 0;
+    }
+
+    // Content-Length was checked when the request was framed, a chunked body
+    // can only be checked as it arrives
+    body_bytes += data.size();
+    if (body_bytes > MAX_BODY_SIZE) {
+      fail(HTTPStatus::PAYLOAD_TOO_LARGE);
+      break;
+    }
+
+    // The body of a rejected request is dropped
+    if (accepted && !data.empty() && !upload->write(data)) {
+      fail(upload->status());
+      break;
+    }
+  }
+
+  return consumed;
+}
+
+bool StreamedRequest::complete() const {
+  // Without an accepted upload the body is only read to keep the connection
+  // usable, which is pointless if the client waits for a 100 Continue
+  bool read_body = accepted || !expect_continue;
+  return body_done || failure != HTTPStatus::OK || !read_body;
+}
+
+void StreamedRequest::setConnectionClose() { parser.setConnectionClose(); }
+
+HTTPResponse StreamedRequest::respond() {
+  if (failure != HTTPStatus::OK) {
+    parser.finishUpload(failure, "");
+  } else if (accepted) {
+    upload->commit();
+    parser.finishUpload(upload->status(), upload->filename());
+  }
+
+  // The rest of an unread body would be taken for the next request
+  if (!body_done) {
+    parser.setConnectionClose();
+  }
+
+  // Processing includes receiving the body
+  auto processed = std::chrono::steady_clock::now();
+  HTTPResponse response = parser.buildResponse();
+  record_request_metrics(parser, started, processed,
+                         std::chrono::steady_clock::now());
+  if (response.access) {
+    record_timings(*response.access, started, parser.parsedAt());
+  }
+  return response;
+}
+
+void StreamedRequest::fail(HTTPStatus status) { failure = status; }
@@ -1,34 +1,114 @@
 #include <thread_pool.h>
+#include <algorithm>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
 
-ThreadPool::ThreadPool(size_t num_threads) {
-    for (size_t i = 0; i < num_threads; ++i) {
-        threads_.emplace_back([this] {
-            while (true) {
-                std::function<void()> task;
+// Slots per worker queue. Submissions beyond that go to the overflow queue
+static const size_t QUEUE_CAPACITY = 1024;
 
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex_);
-                    cv_.wait(lock, [this] {
-                        return !tasks_.empty() || stop_;
-                    });
+// Number of times an idle worker checks for new tasks before it parks. On a
+// single CPU spinning only delays the thread that would enqueue
+static const int SPIN_ITERATIONS = 1024;
 
-                    if (stop_ && tasks_.empty()) {
-                        return;
-                    }
+// The pool and queue index of the calling thread, if it is a pool worker
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
 
-                    task = std::move(tasks_.front());
-                    tasks_.pop();
-                }
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
 
-                task();
+TaskQueue::TaskQueue(size_t capacity)
+    : cells_(new Cell[capacity]), mask_(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool TaskQueue::try_push(Task& task) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &cells_[pos & mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) -
+                        static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            // The slot is free in this lap, claim it
+            if (enqueue_pos_.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) {
+                break;
             }
-        });
+        } else if (diff < 0) {
+            // The slot still holds a task from the previous lap: full
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->task = std::move(task);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool TaskQueue::try_pop(Task& task) {
+    Cell* cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &cells_[pos & mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) -
+                        static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos_.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Nothing has been pushed to this slot yet: empty
+            return false;
+        } else {
+            pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    task = std::move(cell->task);
+    // Free the slot for the producers of the next lap
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+}
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_threads) {
+    num_threads = std::max<size_t>(num_threads, 1);
+    for (size_t i = 0; i < num_threads; ++i) {
+        queues_.push_back(std::make_unique<TaskQueue>(QUEUE_CAPACITY));
+    }
+
+    unsigned cpu_count = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < num_threads; ++i) {
+        threads_.emplace_back([this, i] { worker_loop(i); });
+
+        if (pin_threads) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cpu_count, &cpus);
+            pthread_setaffinity_np(threads_.back().native_handle(),
+                                   sizeof(cpus), &cpus);
+        }
     }
 }
 
 ThreadPool::~ThreadPool() {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex_);
+        std::unique_lock<std::mutex> lock(park_mutex_);
         stop_ = true;
     }
 
@@ -41,10 +121,93 @@ ThreadPool::~ThreadPool() {
     }
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex_);
-        tasks_.emplace(std::move(task));
+void ThreadPool::enqueue(Task task) {
+    // Counted first so that a worker about to park can't miss the task
+    pending_.fetch_add(1, std::memory_order_seq_cst);
+
+    size_t count = queues_.size();
+    size_t start = current_pool == this
+                       ? current_index
+                       : next_queue_.fetch_add(1, std::memory_order_relaxed);
+    bool queued = false;
+    for (size_t i = 0; i < count && !queued; ++i) {
+        queued = queues_[(start + i) % count]->try_push(task);
+    }
+    if (!queued) {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        overflow_.push_back(std::move(task));
+        overflow_size_.fetch_add(1, std::memory_order_release);
+    }
+
+    // Taking the mutex orders the notify after a parking worker has checked
+    // pending_ and started waiting
+    if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        cv_.notify_one();
+    }
+}
+
+bool ThreadPool::find_task(size_t index, Task& task) {
+    // STEP 1
+    // Own queue first, then steal from the others starting at the next one
+    size_t count = queues_.size();
+    bool found = false;
+    for (size_t i = 0; i < count && !found; ++i) {
+        found = queues_[(index + i) % count]->try_pop(task);
+    }
+
+    // STEP 2
+    // Tasks that didn't fit any queue
+    if (!found && overflow_size_.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        if (!overflow_.empty()) {
+            task = std::move(overflow_.front());
+            overflow_.pop_front();
+            overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+            found = true;
+        }
+    }
+
+    if (found) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return found;
+}
+
+void ThreadPool::worker_loop(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    const int spin_iterations =
+        std::thread::hardware_concurrency() > 1 ? SPIN_ITERATIONS : 0;
+
+    Task task;
+    while (true) {
+        bool found = find_task(index, task);
+
+        // Spin on the pending count, which is cheaper to poll than the
+        // queues, before giving up the CPU
+        for (int i = 0; i < spin_iterations && !found; ++i) {
+            cpu_relax();
+            if (pending_.load(std::memory_order_relaxed) > 0) {
+                found = find_task(index, task);
+            }
+        }
+
+        if (found) {
+            task();
+            task = Task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        if (stop_ && pending_.load() == 0) {
+            return;
+        }
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        cv_.wait(lock, [this] {
+            return pending_.load(std::memory_order_seq_cst) > 0 || stop_;
+        });
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
     }
-    cv_.notify_one();
 }
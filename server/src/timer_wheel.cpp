@@ -0,0 +1,71 @@
+#include <timer_wheel.h>
+
+TimerWheel::Timer::~Timer() {
+  if (wheel != nullptr) {
+    wheel->cancel(*this);
+  }
+}
+
+TimerWheel::TimerWheel() : start(Clock::now()) {
+  for (auto &head : slots) {
+    head.next = head.prev = &head;
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  // Timers still scheduled may outlive the wheel, they must not point at it
+  for (auto &head : slots) {
+    while (head.next != &head) {
+      Timer &timer = *head.next;
+      unlink(timer);
+      timer.wheel = nullptr;
+    }
+  }
+}
+
+void TimerWheel::schedule(Timer &timer, std::chrono::milliseconds delay) {
+  if (timer.wheel != nullptr) {
+    timer.wheel->unlink(timer);
+  }
+
+  // The current tick is partly over, so the timer goes one tick further
+  // than the delay rounded up: it never fires early, and at most a tick late
+  uint64_t ticks = (delay.count() + TICK.count() - 1) / TICK.count();
+  timer.expires = now_tick() + ticks + 1;
+  timer.wheel = this;
+  link(timer);
+}
+
+void TimerWheel::cancel(Timer &timer) {
+  if (timer.wheel == nullptr) {
+    return;
+  }
+  timer.wheel->unlink(timer);
+  timer.wheel = nullptr;
+}
+
+int TimerWheel::until_next_tick() const {
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - start);
+  return static_cast<int>(TICK.count() - elapsed.count() % TICK.count());
+}
+
+uint64_t TimerWheel::now_tick() const {
+  return (Clock::now() - start) / TICK;
+}
+
+void TimerWheel::link(Timer &timer) {
+  Timer &head = slots[timer.expires % SLOT_COUNT];
+  timer.prev = head.prev;
+  timer.next = &head;
+  head.prev->next = &timer;
+  head.prev = &timer;
+  count++;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+  timer.prev->next = timer.next;
+  timer.next->prev = timer.prev;
+  timer.prev = timer.next = nullptr;
+  count--;
+}
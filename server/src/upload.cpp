@@ -0,0 +1,112 @@
+#include <upload.h>
+#include <util.h>
+#include <logging/Logging.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+
+UploadWriter::UploadWriter(const std::filesystem::path &directory)
+    : directory(directory) {
+  // mkstemp() creates the file with a unique name in the same directory as
+  // the final file, so that the rename in commit() never crosses filesystems
+  std::string temp_template = (directory / ".upload_XXXXXX").string();
+  fd = mkstemp(temp_template.data());
+  if (fd == -1) {
+    Logging logger;
+    logger.setClassName("UploadWriter");
+    logger.warn("Failed to create a temp file in " + directory.string());
+    upload_status = HTTPStatus::INTERNAL_SERVER_ERROR;
+    return;
+  }
+  temp_path = temp_template;
+
+  // mkstemp() makes the file private to us, uploads are served like any
+  // other file
+  fchmod(fd, 0644);
+}
+
+UploadWriter::~UploadWriter() {
+  if (fd != -1) {
+    close(fd);
+  }
+  if (upload_status != HTTPStatus::CREATED && !temp_path.empty()) {
+    unlink(temp_path.c_str());
+  }
+}
+
+bool UploadWriter::write(std::string_view data) {
+  if (upload_status != HTTPStatus::OK) {
+    return false;
+  }
+
+  // Stop at the first byte that makes the document invalid, there is no
+  // point writing the rest
+  if (!validator.feed(data)) {
+    fail(HTTPStatus::BAD_REQUEST);
+    return false;
+  }
+
+  while (!data.empty()) {
+    ssize_t written = ::write(fd, data.data(), data.size());
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      fail(HTTPStatus::INTERNAL_SERVER_ERROR);
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+
+  return true;
+}
+
+bool UploadWriter::commit() {
+  if (upload_status != HTTPStatus::OK) {
+    return false;
+  }
+  if (!validator.finish()) {
+    fail(HTTPStatus::BAD_REQUEST);
+    return false;
+  }
+
+  int result = close(fd);
+  fd = -1;
+  if (result == -1) {
+    fail(HTTPStatus::INTERNAL_SERVER_ERROR);
+    return false;
+  }
+
+  auto current_ts =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  auto uid = generate_random_id(10);
+  std::string filename =
+      "upload_" + std::to_string(current_ts) + "_" + uid + ".json";
+  if (rename(temp_path.c_str(), (directory / filename).c_str()) == -1) {
+    fail(HTTPStatus::INTERNAL_SERVER_ERROR);
+    return false;
+  }
+
+  // The temp file has its final name now, the destructor must not remove it
+  final_filename = filename;
+  upload_status = HTTPStatus::CREATED;
+  return true;
+}
+
+HTTPStatus UploadWriter::status() const { return upload_status; }
+
+const std::string &UploadWriter::filename() const { return final_filename; }
+
+void UploadWriter::fail(HTTPStatus status) {
+  Logging logger;
+  logger.setClassName("UploadWriter");
+  if (status == HTTPStatus::BAD_REQUEST) {
+    logger.warn("POST request contains invalid JSON");
+  } else {
+    logger.warn("Failed to write to file in POST request");
+  }
+  upload_status = status;
+}
@@ -1,5 +1,10 @@
 #include <util.h>
+#include <atomic>
+#include <cctype>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -12,9 +17,11 @@ const std::string receive_line(int socket_fd, int MAX_SIZE) {
   char buffer[MAX_SIZE + 1];
   int bytes_read = read(socket_fd, &buffer, MAX_SIZE);
 
+  // A failed read only concerns this socket, the caller sees it as an empty
+  // line and closes it
   if (bytes_read == -1) {
     perror("util.h - read() failed");
-    exit(EXIT_FAILURE);
+    return "";
   }
 
   buffer[bytes_read] = '\0';
@@ -22,18 +29,137 @@ const std::string receive_line(int socket_fd, int MAX_SIZE) {
   return buffer;
 }
 
-const std::string receive_http_req(int socket_fd, int MAX_SIZE) {
-  char buffer[MAX_SIZE + 1];
-  int bytes_read = read(socket_fd, &buffer, MAX_SIZE);
+// Whether a header line starts with the given lowercase "name:"
+static bool header_is(std::string_view line, std::string_view name) {
+  return line.size() >= name.size() && iequals(line.substr(0, name.size()), name);
+}
 
-  if (bytes_read == -1) {
-    perror("util.h - receive_http_req() failed");
-    exit(EXIT_FAILURE);
+static std::string_view header_value(std::string_view line, size_t name_size) {
+  std::string_view value = line.substr(name_size);
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
   }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  return value;
+}
 
-  buffer[bytes_read] = '\0';
+FrameResult frame_http_request(std::string_view buffer, size_t max_header_size,
+                               size_t max_body_size, size_t max_buffered_body,
+                               size_t &length) {
+  // STEP 1
+  // The header block ends at the first empty line. Only the first
+  // max_header_size bytes are searched, a terminator further out means the
+  // headers are too large anyway
+  std::string_view searched = buffer.substr(0, max_header_size);
+  size_t headers_end = searched.find("\r\n\r\n");
+  if (headers_end == std::string_view::npos) {
+    if (buffer.size() >= max_header_size) {
+      return FrameResult::HEADERS_TOO_LARGE;
+    }
+    return FrameResult::INCOMPLETE;
+  }
+  headers_end += 4;
+
+  // STEP 2
+  // Look for the headers (case insensitive) that say how the body is framed
+  // and how many of its bytes belong to this request. A malformed value is
+  // left for the request parser to reject
+  size_t content_length = 0;
+  bool chunked = false;
+  bool expect_continue = false;
+  size_t line_start = buffer.find("\r\n") + 2;
+  while (line_start < headers_end - 2) {
+    size_t line_end = buffer.find("\r\n", line_start);
+    std::string_view line = buffer.substr(line_start, line_end - line_start);
+    static constexpr std::string_view content_length_name = "content-length:";
+    static constexpr std::string_view transfer_encoding_name =
+        "transfer-encoding:";
+    static constexpr std::string_view expect_name = "expect:";
+    if (header_is(line, content_length_name)) {
+      std::string_view value = header_value(line, content_length_name.size());
+      size_t digits = 0;
+      size_t parsed = 0;
+      while (digits < value.size() && value[digits] >= '0' &&
+             value[digits] <= '9') {
+        if (digits == 18) {
+          return FrameResult::BODY_TOO_LARGE;
+        }
+        parsed = parsed * 10 + (value[digits] - '0');
+        digits++;
+      }
+      content_length = parsed;
+    } else if (header_is(line, transfer_encoding_name)) {
+      // chunked must be the final coding, and the only one as no other is
+      // decoded. The request is answered here, its body never streamed
+      std::string_view codings =
+          header_value(line, transfer_encoding_name.size());
+      size_t last_comma = codings.rfind(',');
+      std::string_view final_coding = codings;
+      if (last_comma != std::string_view::npos) {
+        final_coding = header_value(codings, last_comma + 1);
+      }
+      if (!iequals(final_coding, "chunked")) {
+        return FrameResult::BAD_TRANSFER_ENCODING;
+      }
+      if (last_comma != std::string_view::npos) {
+        return FrameResult::UNSUPPORTED_TRANSFER_ENCODING;
+      }
+      chunked = true;
+    } else if (header_is(line, expect_name)) {
+      // Like StreamedRequest, only 100-continue is waited on
+      expect_continue =
+          iequals(header_value(line, expect_name.size()), "100-continue");
+    }
+    line_start = line_end + 2;
+  }
 
-  return buffer;
+  // STEP 3
+  // Chunked bodies have no length up front, and a client that asked for
+  // 100 Continue waits for it before sending the body. Both, like bodies too
+  // big to buffer, are read by the caller as a stream after the headers
+  length = headers_end;
+  if (chunked) {
+    return FrameResult::BODY_FOLLOWS;
+  }
+  if (content_length > max_body_size) {
+    return FrameResult::BODY_TOO_LARGE;
+  }
+  if (content_length > max_buffered_body ||
+      (expect_continue && content_length > 0)) {
+    return FrameResult::BODY_FOLLOWS;
+  }
+  if (buffer.size() - headers_end < content_length) {
+    return FrameResult::INCOMPLETE;
+  }
+
+  length = headers_end + content_length;
+  return FrameResult::COMPLETE;
+}
+
+bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return false;
+  }
+
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+
+  return true;
 }
 
 void replaceAll(std::string &str, const std::string &from,
@@ -64,7 +190,38 @@ std::vector<std::string> split(const std::string &str,
   return result;
 }
 
+// Whether lexically_normal() would return path as it is: it starts with a
+// '/' and no segment is empty (but the last), "." or ".."
+static bool is_normal_path(std::string_view path) {
+  if (path.empty() || path.front() != '/') {
+    return false;
+  }
+  size_t start = 1;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    std::string_view segment = path.substr(start, end - start);
+    if ((segment.empty() && end != path.size()) || segment == "." ||
+        segment == "..") {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
 const std::optional<std::string> sanitize_path(const std::string &path) {
+  // Nearly every route is already normal, which is checked without building
+  // a std::filesystem::path
+  if (is_normal_path(path)) {
+    if (path.find("..") != std::string::npos) {
+      return std::nullopt;
+    }
+    return path;
+  }
+
   std::filesystem::path requested(path);
 
   requested = requested.lexically_normal();
@@ -76,6 +233,20 @@ const std::optional<std::string> sanitize_path(const std::string &path) {
   return requested.string();
 }
 
+bool sanitize_route(std::string_view &route, std::pmr::string &normalized) {
+  if (is_normal_path(route)) {
+    return route.find("..") == std::string_view::npos;
+  }
+
+  auto sanitized = sanitize_path(std::string(route));
+  if (!sanitized) {
+    return false;
+  }
+  normalized.assign(*sanitized);
+  route = normalized;
+  return true;
+}
+
 const std::optional<std::string> read_file(const std::string &path) {
   std::ifstream file(path);
 
@@ -124,10 +295,81 @@ std::string generate_random_id(size_t length) {
     return id;
 }
 
+// The current date, formatted at most once per second for all threads
+// Readers copy it under a sequence lock: the sequence is odd while a writer
+// replaces it, and a copy is only used if the sequence didn't change during
+// it. The text lives in atomic words so that a torn copy is not a data race
+namespace {
+struct SharedDate {
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<std::time_t> second{-1};
+    std::atomic<uint64_t> words[4] = {};
+};
+}
+static SharedDate shared_date;
+static_assert(sizeof(shared_date.words) >= HTTP_DATE_LENGTH);
+
+void current_http_date(char *out) {
+    std::time_t now = std::time(nullptr);
+
+    uint32_t sequence = shared_date.sequence.load(std::memory_order_acquire);
+    if (sequence % 2 == 0 &&
+        shared_date.second.load(std::memory_order_relaxed) == now) {
+        uint64_t words[4];
+        for (size_t i = 0; i < 4; i++) {
+            words[i] = shared_date.words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shared_date.sequence.load(std::memory_order_relaxed) == sequence) {
+            std::memcpy(out, words, HTTP_DATE_LENGTH);
+            return;
+        }
+    }
+
+    // A new second, or a writer got in the way: format the date here and
+    // publish it unless another thread is already doing so
+    char text[sizeof(shared_date.words)] = {};
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    std::strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    std::memcpy(out, text, HTTP_DATE_LENGTH);
+
+    if (sequence % 2 == 0 &&
+        shared_date.sequence.compare_exchange_strong(
+            sequence, sequence + 1, std::memory_order_relaxed)) {
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t words[4];
+        std::memcpy(words, text, sizeof(words));
+        for (size_t i = 0; i < 4; i++) {
+            shared_date.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        shared_date.second.store(now, std::memory_order_relaxed);
+        shared_date.sequence.store(sequence + 2, std::memory_order_release);
+    }
+}
+
 std::string get_rfc7231_date() {
-    std::time_t t = std::time(nullptr);
-    std::tm tm = *std::gmtime(&t); // GMT time
+    char date[HTTP_DATE_LENGTH];
+    current_http_date(date);
+    return std::string(date, HTTP_DATE_LENGTH);
+}
+
+std::string format_rfc7231_date(std::time_t time) {
+    std::tm tm;
+    gmtime_r(&time, &tm); // GMT time
     char buf[30];
     std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
     return std::string(buf);
-}
\ No newline at end of file
+}
+
+std::optional<std::time_t> parse_rfc7231_date(std::string_view date) {
+    // The obsolete RFC 850 and asctime() formats are not accepted, a date we
+    // can't parse simply makes the condition be ignored
+    std::string text(date);
+    std::tm tm{};
+    const char *end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') {
+        return std::nullopt;
+    }
+    return timegm(&tm);
+}
@@ -0,0 +1,107 @@
+//
+// Regression test: a request whose headers arrived in two pieces is handed
+// to the pool with its header timer started. The pool is kept busy past the
+// header timeout, and the connection must still be open to get its response
+// once the pool gets to it
+//
+
+#include <config.h>
+#include <event_loop.h>
+#include <logging/Logging.h>
+#include <thread_pool.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <string>
+#include <thread>
+
+int PORT = 0;
+const char *SERVER_ADDRESS = "127.0.0.1";
+int THREAD_POOL_SIZE = 1;
+
+static int listen_on_loopback(sockaddr_in &address) {
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (fd == -1 || bind(fd, (sockaddr *)&address, sizeof(address)) == -1 ||
+      listen(fd, 16) == -1 ||
+      getsockname(fd, (sockaddr *)&address, &length) == -1) {
+    perror("listen_on_loopback");
+    std::exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+static bool send_all(int fd, const std::string &data) {
+  return send(fd, data.data(), data.size(), MSG_NOSIGNAL) ==
+         static_cast<ssize_t>(data.size());
+}
+
+// Whether a loop, run with a single pool thread, answers the request after
+// the pool held it past the header timeout
+static bool answers_after_busy_pool(bool io_uring) {
+  USE_IO_URING = io_uring;
+  sockaddr_in address;
+  int listen_fd = listen_on_loopback(address);
+
+  // Never destroyed: the loop runs until the process exits
+  ThreadPool *pool = new ThreadPool(1);
+  std::thread([listen_fd, pool] {
+    EventLoop::create(listen_fd, pool)->run();
+  }).detach();
+
+  // The only pool thread waits until released, so the request below stays
+  // queued while its connection is busy
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  pool->enqueue([released] { released.wait(); });
+
+  int client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  timeval receive_timeout{5, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout,
+             sizeof(receive_timeout));
+  if (connect(client, (sockaddr *)&address, sizeof(address)) == -1) {
+    perror("connect");
+    return false;
+  }
+
+  // The first piece starts the header timer, the second completes the
+  // request and hands it to the pool
+  auto pause = std::chrono::milliseconds(HEADER_TIMEOUT_MS / 4);
+  send_all(client, "GET /missing.html HTTP/1.1\r\nHost: 127.0.0.1\r\n");
+  std::this_thread::sleep_for(pause);
+  send_all(client, "\r\n");
+
+  // Well past the header timeout of the first piece
+  std::this_thread::sleep_for(std::chrono::milliseconds(HEADER_TIMEOUT_MS * 3));
+  release.set_value();
+
+  char buffer[64] = {};
+  ssize_t received = recv(client, buffer, sizeof(buffer) - 1, 0);
+  close(client);
+  return received > 0 && std::string(buffer).rfind("HTTP/1.1 ", 0) == 0;
+}
+
+int main() {
+  Logging::setMinimumLevel(LoggingLevel::LogLevelNone);
+  HEADER_TIMEOUT_MS = 200;
+
+  int failures = 0;
+  for (bool io_uring : {false, true}) {
+    bool passed = answers_after_busy_pool(io_uring);
+    std::printf("%s: busy connection outlives its header timeout%s\n",
+                passed ? "PASS" : "FAIL", io_uring ? " (io_uring)" : "");
+    failures += passed ? 0 : 1;
+  }
+
+  // The loops never return, so the process ends without unwinding them
+  std::fflush(stdout);
+  std::_Exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
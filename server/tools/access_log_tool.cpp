@@ -0,0 +1,406 @@
+//
+// Reads the binary access log written with --access-log
+//      access_log_tool csv <log>...     - one CSV line per request
+//      access_log_tool json <log>...    - one JSON object per line
+//      access_log_tool replay <log> <host> <port> [--connections=N]
+//                                       [--speed=X]
+//          Sends the recorded GET requests to a server, over N keep-alive
+//          connections (default 8). With --speed the original arrival times
+//          are kept, scaled by X; without it requests go out back to back.
+//          Prints throughput, latencies and the status codes received.
+//
+
+#include <access_log.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <netdb.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static bool read_log(const std::string &path,
+                     std::vector<AccessRecord> &records) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Unable to open " << path << "\n";
+    return false;
+  }
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  if (!decode_access_log_header(data)) {
+    std::cerr << path << " is not an access log\n";
+    return false;
+  }
+
+  std::string_view rest = std::string_view(data).substr(ACCESS_LOG_HEADER_SIZE);
+  AccessRecord record;
+  size_t consumed = 0;
+  while (decode_access_record(rest, record, consumed)) {
+    records.push_back(record);
+    rest.remove_prefix(consumed);
+  }
+  if (!rest.empty()) {
+    std::cerr << path << ": ignoring " << rest.size()
+              << " bytes of a truncated record\n";
+  }
+  return true;
+}
+
+static std::string csv_field(const std::string &value) {
+  if (value.find_first_of(",\"\r\n") == std::string::npos) {
+    return value;
+  }
+  std::string quoted = "\"";
+  for (char c : value) {
+    quoted += c;
+    if (c == '"') {
+      quoted += '"';
+    }
+  }
+  return quoted + "\"";
+}
+
+static std::string json_string(const std::string &value) {
+  std::string escaped = "\"";
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c < 0x20) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      escaped += buffer;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped + "\"";
+}
+
+static void print_csv(const std::vector<AccessRecord> &records) {
+  std::cout << "timestamp_us,method,route,status,bytes,parse_us,process_us,"
+               "write_us\n";
+  for (const auto &record : records) {
+    std::cout << record.timestamp_us << ',' << csv_field(record.method) << ','
+              << csv_field(record.route) << ',' << record.status << ','
+              << record.bytes << ',' << record.parse_us << ','
+              << record.process_us << ',' << record.write_us << '\n';
+  }
+}
+
+static void print_json(const std::vector<AccessRecord> &records) {
+  for (const auto &record : records) {
+    std::cout << "{\"timestamp_us\":" << record.timestamp_us
+              << ",\"method\":" << json_string(record.method)
+              << ",\"route\":" << json_string(record.route)
+              << ",\"status\":" << record.status
+              << ",\"bytes\":" << record.bytes
+              << ",\"parse_us\":" << record.parse_us
+              << ",\"process_us\":" << record.process_us
+              << ",\"write_us\":" << record.write_us << "}\n";
+  }
+}
+
+// One keep-alive connection of the replay
+class ReplayConnection {
+public:
+  ReplayConnection(const addrinfo *address, std::string host_header)
+      : address(address), host_header(std::move(host_header)) {}
+  ~ReplayConnection() { disconnect(); }
+
+  // Sends a GET for route and reads the response. Returns its status code,
+  // or 0 if the request failed
+  int get(const std::string &route) {
+    if (fd == -1 && !connect()) {
+      return 0;
+    }
+    std::string request = "GET " + route + " HTTP/1.1\r\nHost: " +
+                          host_header + "\r\n\r\n";
+    if (!send_all(request)) {
+      // The server may have closed an idle connection, retry once
+      disconnect();
+      if (!connect() || !send_all(request)) {
+        return 0;
+      }
+    }
+
+    int status = read_response();
+    if (status == 0 || close_after) {
+      disconnect();
+    }
+    return status;
+  }
+
+private:
+  const addrinfo *address;
+  std::string host_header;
+  int fd = -1;
+  std::string buffer;
+  bool close_after = false;
+
+  bool connect() {
+    fd = socket(address->ai_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return false;
+    }
+    if (::connect(fd, address->ai_addr, address->ai_addrlen) == -1) {
+      disconnect();
+      return false;
+    }
+    buffer.clear();
+    return true;
+  }
+
+  void disconnect() {
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  bool send_all(std::string_view data) {
+    while (!data.empty()) {
+      ssize_t sent = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+      if (sent == -1 && errno == EINTR) {
+        continue;
+      }
+      if (sent <= 0) {
+        return false;
+      }
+      data.remove_prefix(sent);
+    }
+    return true;
+  }
+
+  bool fill() {
+    char chunk[16 * 1024];
+    while (true) {
+      ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+      if (received == -1 && errno == EINTR) {
+        continue;
+      }
+      if (received <= 0) {
+        return false;
+      }
+      buffer.append(chunk, received);
+      return true;
+    }
+  }
+
+  // Case-insensitive value of a header in the head, empty if missing
+  static std::string header(const std::string &head, const std::string &name) {
+    size_t position = 0;
+    while ((position = head.find("\r\n", position)) != std::string::npos) {
+      position += 2;
+      if (head.size() - position > name.size() &&
+          strncasecmp(head.data() + position, name.c_str(), name.size()) == 0 &&
+          head[position + name.size()] == ':') {
+        size_t start = head.find_first_not_of(' ', position + name.size() + 1);
+        size_t end = head.find("\r\n", start);
+        return head.substr(start, end - start);
+      }
+    }
+    return "";
+  }
+
+  int read_response() {
+    size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if (!fill()) {
+        return 0;
+      }
+    }
+    std::string head = buffer.substr(0, head_end + 2);
+    buffer.erase(0, head_end + 4);
+
+    int status = 0;
+    if (head.size() > 12) {
+      status = std::atoi(head.c_str() + 9);
+    }
+    close_after = strcasecmp(header(head, "Connection").c_str(), "close") == 0;
+
+    // A 304 has no body whatever its headers say
+    size_t length = 0;
+    std::string content_length = header(head, "Content-Length");
+    if (status != 304 && !content_length.empty()) {
+      length = std::stoull(content_length);
+    }
+    while (buffer.size() < length) {
+      if (!fill()) {
+        return 0;
+      }
+    }
+    buffer.erase(0, length);
+    return status;
+  }
+};
+
+static int replay(const std::vector<AccessRecord> &all_records,
+                  const std::string &host, const std::string &port,
+                  int connection_count, double speed) {
+  using Clock = std::chrono::steady_clock;
+
+  // Only GETs can be replayed faithfully, request bodies are not logged
+  std::vector<AccessRecord> records;
+  for (const auto &record : all_records) {
+    if (record.method == "GET") {
+      records.push_back(record);
+    }
+  }
+  std::sort(records.begin(), records.end(),
+            [](const AccessRecord &a, const AccessRecord &b) {
+              return a.timestamp_us < b.timestamp_us;
+            });
+  size_t skipped = all_records.size() - records.size();
+  if (records.empty()) {
+    std::cerr << "No GET requests to replay\n";
+    return 1;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *address = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &address) != 0) {
+    std::cerr << "Unable to resolve " << host << ":" << port << "\n";
+    return 1;
+  }
+
+  std::atomic<size_t> next{0};
+  std::mutex results_mutex;
+  std::map<int, size_t> status_counts;
+  size_t status_mismatches = 0;
+  std::vector<double> latencies;
+
+  const uint64_t first_timestamp = records.front().timestamp_us;
+  const Clock::time_point start = Clock::now();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < connection_count; i++) {
+    threads.emplace_back([&] {
+      ReplayConnection connection(address, host + ":" + port);
+      std::map<int, size_t> local_counts;
+      std::vector<double> local_latencies;
+      size_t local_mismatches = 0;
+
+      size_t index;
+      while ((index = next.fetch_add(1)) < records.size()) {
+        const AccessRecord &record = records[index];
+        if (speed > 0) {
+          auto offset = std::chrono::microseconds(static_cast<int64_t>(
+              (record.timestamp_us - first_timestamp) / speed));
+          std::this_thread::sleep_until(start + offset);
+        }
+
+        Clock::time_point sent = Clock::now();
+        int status = connection.get(record.route);
+        local_latencies.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - sent)
+                .count());
+        local_counts[status]++;
+        if (status != record.status) {
+          local_mismatches++;
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(results_mutex);
+      for (auto [status, count] : local_counts) {
+        status_counts[status] += count;
+      }
+      latencies.insert(latencies.end(), local_latencies.begin(),
+                       local_latencies.end());
+      status_mismatches += local_mismatches;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  freeaddrinfo(address);
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+
+  std::printf("Replayed %zu requests over %d connections in %.3f s, %.0f "
+              "req/s (%zu non-GET requests skipped)\n",
+              records.size(), connection_count, elapsed,
+              records.size() / elapsed, skipped);
+  std::printf("Latency us: p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+              percentile(0.50), percentile(0.90), percentile(0.99),
+              latencies.back());
+  for (auto [status, count] : status_counts) {
+    std::printf("Status %s: %zu\n",
+                status == 0 ? "failed" : std::to_string(status).c_str(),
+                count);
+  }
+  std::printf("Status differs from the log: %zu\n", status_mismatches);
+  return status_counts.count(0) > 0 ? 1 : 0;
+}
+
+static int usage() {
+  std::cerr << "Usage: access_log_tool csv <log>...\n"
+               "       access_log_tool json <log>...\n"
+               "       access_log_tool replay <log> <host> <port> "
+               "[--connections=N] [--speed=X]\n";
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    return usage();
+  }
+  std::string command = argv[1];
+
+  if (command == "csv" || command == "json") {
+    std::vector<AccessRecord> records;
+    for (int i = 2; i < argc; i++) {
+      if (!read_log(argv[i], records)) {
+        return 1;
+      }
+    }
+    if (command == "csv") {
+      print_csv(records);
+    } else {
+      print_json(records);
+    }
+    return 0;
+  }
+
+  if (command == "replay" && argc >= 5) {
+    int connection_count = 8;
+    double speed = 0;
+    for (int i = 5; i < argc; i++) {
+      std::string option = argv[i];
+      if (option.rfind("--connections=", 0) == 0) {
+        connection_count = std::max(1, std::atoi(option.c_str() + 14));
+      } else if (option.rfind("--speed=", 0) == 0) {
+        speed = std::atof(option.c_str() + 8);
+      } else {
+        return usage();
+      }
+    }
+
+    std::vector<AccessRecord> records;
+    if (!read_log(argv[2], records)) {
+      return 1;
+    }
+    return replay(records, argv[3], argv[4], connection_count, speed);
+  }
+
+  return usage();
+}